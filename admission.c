@@ -0,0 +1,144 @@
+/*
+    Custom Web Server - admission control
+    By: Ricard Grace
+*/
+
+#include "admission.h"
+#include "logger.h"
+#include "metrics.h"
+
+#include <poll.h>
+#include <sys/resource.h>
+
+/*
+    Keeps the server working when more clients arrive than it can serve, instead of letting
+    threads, descriptors and queues grow until everything slows down.
+        - open connections and requests being answered are counted across every thread, anything
+          over the limit is turned away straight away
+        - the worker pool turns away connections that waited in its queue for too long, their
+          clients have most likely given up already
+        - one descriptor is held in reserve, so when accept runs out of descriptors it can be
+          freed to take the waiting connection off the queue and turn it away rather than leave
+          it (and everything behind it) hanging
+    Turned away clients get a 503 with Retry-After that is built once at startup, so shedding
+    never touches the filesystem or allocates, and the connection is closed after it.
+*/
+
+static atomic_int openConnections = 0;
+static atomic_int activeRequests = 0;
+static int connectionLimit = 0;
+static int requestLimit = 0;
+static long long queueLimit = 0;
+
+static char overloadResponse[OVERLOAD_SIZE];
+static int overloadLen = 0;
+
+static int reserveFd = ERROR;
+static pthread_mutex_t reserveLock = PTHREAD_MUTEX_INITIALIZER;
+
+void InitAdmission (int maxConnections, int maxRequests, int maxQueueMs) {
+    connectionLimit = maxConnections;
+    requestLimit = maxRequests;
+    queueLimit = (long long)maxQueueMs * 1000000;
+
+    char* body = "<html><head><title>503 Service Unavailable</title></head><body><h1>503 Service Unavailable</h1><p>The server is busy, please try again shortly.</p></body></html>\n";
+    overloadLen = snprintf(overloadResponse,OVERLOAD_SIZE,"%s %s\r\nRetry-After: %d\r\nContent-Type: text/html; charset=utf-8\r\nContent-Length: %d\r\nConnection: close\r\n\r\n%s",HTTPVER_11,RESPONSE_503,RETRY_AFTER,(int)strlen(body),body);
+
+    //every connection needs a descriptor (two or more while a file is sent), take all we may have
+    struct rlimit files;
+    if (getrlimit(RLIMIT_NOFILE,&files) == NOERR && files.rlim_cur < files.rlim_max) {
+        files.rlim_cur = files.rlim_max;
+        setrlimit(RLIMIT_NOFILE,&files);
+    }
+    if (getrlimit(RLIMIT_NOFILE,&files) == NOERR && (connectionLimit == 0 || (rlim_t)connectionLimit >= files.rlim_cur)) {
+        printf("Descriptor limit is %lu, connections beyond it are turned away at accept\n",(unsigned long)files.rlim_cur);
+    }
+
+    reserveFd = open("/dev/null",O_RDONLY | O_CLOEXEC);
+    if (reserveFd == ERROR) LogWarn("** reserve descriptor error ** %s",strerror(errno));
+}
+
+//count a new connection, returns FALSE (and counts it as shed) if there are too many open already
+int AdmitConnection () {
+    int open = atomic_fetch_add_explicit(&openConnections,1,memory_order_relaxed);
+    if (connectionLimit > 0 && open >= connectionLimit) {
+        atomic_fetch_sub_explicit(&openConnections,1,memory_order_relaxed);
+        CountShed(SHED_CONNECTIONS);
+        return FALSE;
+    }
+    return TRUE;
+}
+
+void ReleaseConnection () {
+    atomic_fetch_sub_explicit(&openConnections,1,memory_order_relaxed);
+}
+
+//count a request about to be answered, returns FALSE (and counts it as shed) if too many are in progress
+int AdmitRequest () {
+    int active = atomic_fetch_add_explicit(&activeRequests,1,memory_order_relaxed);
+    if (requestLimit > 0 && active >= requestLimit) {
+        atomic_fetch_sub_explicit(&activeRequests,1,memory_order_relaxed);
+        CountShed(SHED_REQUESTS);
+        return FALSE;
+    }
+    return TRUE;
+}
+
+void ReleaseRequest () {
+    atomic_fetch_sub_explicit(&activeRequests,1,memory_order_relaxed);
+}
+
+//returns FALSE (and counts it as shed) if a connection queued at queuedAt has waited too long
+int AdmitQueued (long long queuedAt) {
+    if (queueLimit > 0 && NanoTime() - queuedAt > queueLimit) {
+        CountShed(SHED_QUEUE);
+        return FALSE;
+    }
+    return TRUE;
+}
+
+//the prebuilt 503, it asks for the connection to be closed
+char* OverloadResponse (int* len) {
+    *len = overloadLen;
+    return overloadResponse;
+}
+
+//turn the client away with a 503 and close the connection, never blocks
+void ShedConnection (int connID) {
+    int sent = send(connID,overloadResponse,overloadLen,MSG_DONTWAIT | MSG_NOSIGNAL);
+    CountResponse(503, sent == ERROR ? 0 : sent);
+    //unread request bytes would turn the close into a reset that can wipe out the 503 on the way
+    shutdown(connID,SHUT_WR);
+    char discard[PACK_SIZE];
+    while (recv(connID,discard,PACK_SIZE,MSG_DONTWAIT) > 0);
+    close(connID);
+}
+
+//accept failed for want of a descriptor: free the reserve one, take the waiting connection with it
+//and turn it away, then put the reserve back
+//returns TRUE if a connection was turned away, FALSE if none was waiting and ERROR without a reserve
+int ShedWithReserve (int listenSoc) {
+    //accept fails for want of a descriptor before it looks for a connection, there may be none
+    //and a blocking accept would then hold on to the reserve until the next one arrives
+    struct pollfd waiting;
+    waiting.fd = listenSoc;
+    waiting.events = POLLIN;
+    if (poll(&waiting,1,0) != 1) return FALSE;
+
+    pthread_mutex_lock(&reserveLock);
+    //the last time it could not be opened again, there may be a descriptor free by now
+    if (reserveFd == ERROR) reserveFd = open("/dev/null",O_RDONLY | O_CLOEXEC);
+    if (reserveFd == ERROR) {
+        pthread_mutex_unlock(&reserveLock);
+        return ERROR;
+    }
+    close(reserveFd);
+    int connID = accept4(listenSoc,NULL,NULL,SOCK_CLOEXEC);
+    if (connID != ERROR) {
+        CountShed(SHED_FILES);
+        ShedConnection(connID);
+    }
+    reserveFd = open("/dev/null",O_RDONLY | O_CLOEXEC);
+    pthread_mutex_unlock(&reserveLock);
+    return connID == ERROR ? FALSE : TRUE;
+}
@@ -0,0 +1,40 @@
+/*
+    Custom Web Server - admission control
+    By: Ricard Grace
+*/
+
+#ifndef ADMISSION_H
+#define ADMISSION_H
+
+#include "webServer.h"
+
+#include <stdatomic.h>
+
+//limits the server starts with, changed with -M, -R and -Q or in the config file (0 turns one off)
+#define DEFAULT_MAX_CONNECTIONS 10000
+#define DEFAULT_MAX_REQUESTS 0
+#define DEFAULT_MAX_QUEUE_MS 1000
+//seconds turned away clients are told to wait before trying again
+#define RETRY_AFTER 1
+//how long accepting stops for when no descriptor can be found for a new connection
+#define ACCEPT_BACKOFF_MS 100
+#define OVERLOAD_SIZE 512
+
+//why a client was turned away
+#define SHED_CONNECTIONS 0
+#define SHED_REQUESTS    1
+#define SHED_QUEUE       2
+#define SHED_FILES       3
+#define NUM_SHED_REASONS 4
+
+void InitAdmission (int maxConnections, int maxRequests, int maxQueueMs);
+int AdmitConnection ();
+void ReleaseConnection ();
+int AdmitRequest ();
+void ReleaseRequest ();
+int AdmitQueued (long long queuedAt);
+char* OverloadResponse (int* len);
+void ShedConnection (int connID);
+int ShedWithReserve (int listenSoc);
+
+#endif
@@ -0,0 +1,145 @@
+/*
+    Custom Web Server - packed asset archive
+    By: Ricard Grace
+*/
+
+#include "assetPack.h"
+#include "conditional.h"
+#include "hash.h"
+
+/*
+    The data directory can be packed ahead of time (make pack) into one archive that the server
+    maps at startup (-P), so the files in it are served without touching the filesystem, even on
+    the first request after a deploy when the page cache is cold.
+        - every body starts on a page boundary, bodies over INLINE_FILE_SIZE are sent straight
+          from the archive with sendfile, smaller ones from the mapping along with the header
+        - the entity headers and ETag of every file were worked out by the packer, the server
+          only adds the Cache-Control rules it was started with
+        - paths are found with a minimal perfect hash (hash and displace): the hash of a path
+          picks a bucket, and the bucket's displacement moves the path to a slot of its own among
+          exactly as many slots as there are files, so a lookup is one hash and one record, with
+          the path compared to turn away paths that are not in the archive
+    Every file in the archive is wrapped in a cache entry that is never released, so it is served
+    (ranges, compression, conditionals and all) the same way as a file from the cache. Paths that
+    are not in the archive are served from the data directory as before. The archive is a
+    snapshot: a file changed after packing is served as it was until the archive is rebuilt.
+*/
+
+static int CheckPack (char* map, long long size);
+static int CheckString (char* map, long long size, uint64_t offset, uint32_t len);
+static uint64_t Mix (uint64_t hash, uint32_t displacement);
+
+static char* packMap = NULL;
+static long long packSize = 0;
+static int packFd = ERROR;
+static PackHeader* packHeader = NULL;
+static uint32_t* displacements = NULL;
+static CacheEntry* packEntries = NULL;
+
+//map the archive and wrap each of its files in an entry, returns ERROR if it cannot be used
+int LoadAssetPack (char* fileName) {
+    struct stat st;
+    packFd = open(fileName,O_RDONLY | O_CLOEXEC);
+    if (packFd == ERROR || fstat(packFd,&st) == ERROR) {
+        fprintf(stderr,"** asset pack error ** %s: %s\n",fileName,strerror(errno));
+        return ERROR;
+    }
+    packSize = (long long)st.st_size;
+    if (packSize < sizeof(PackHeader) || (packMap = mmap(NULL,packSize,PROT_READ,MAP_SHARED,packFd,0)) == MAP_FAILED) {
+        fprintf(stderr,"** asset pack error ** %s: %s\n",fileName,packSize < sizeof(PackHeader) ? "too short" : strerror(errno));
+        return ERROR;
+    }
+    if (CheckPack(packMap, packSize) == ERROR) {
+        fprintf(stderr,"** asset pack error ** %s: not a valid archive (rebuild it with make pack)\n",fileName);
+        return ERROR;
+    }
+    packHeader = (PackHeader*)packMap;
+    displacements = (uint32_t*)&packMap[packHeader->displacementOffset];
+    PackRecord* records = (PackRecord*)&packMap[packHeader->recordOffset];
+    //the index is read on every lookup, have it read in now rather than on the first requests
+    madvise(packMap,packHeader->recordOffset + packHeader->numEntries * sizeof(PackRecord),MADV_WILLNEED);
+
+    packEntries = calloc(packHeader->numEntries > 0 ? packHeader->numEntries : 1,sizeof(CacheEntry));
+    uint32_t i;
+    for (i = 0; i < packHeader->numEntries; i++) {
+        PackRecord* record = &records[i];
+        CacheEntry* entry = &packEntries[i];
+        entry->path = &packMap[record->pathOffset];
+        entry->hash = HashPath(entry->path);
+        entry->data = &packMap[record->bodyOffset];
+        entry->size = (long long)record->bodySize;
+        entry->mtime = (time_t)record->mtime;
+        memcpy(entry->etag,record->etag,ETAG_SIZE);
+        entry->header = &packMap[record->headerOffset];
+        entry->headerLen = record->headerLen;
+        char* cacheControl = CacheControlFor(entry->path);
+        if (cacheControl != NULL) {
+            //Cache-Control comes from the rules the server runs with, not those of the packer
+            int size = entry->headerLen + strlen(cacheControl) + sizeof("Cache-Control: \r\n");
+            entry->header = malloc(size);
+            entry->headerLen = snprintf(entry->header,size,"%s""Cache-Control: %s\r\n",&packMap[record->headerOffset],cacheControl);
+        }
+        entry->packFd = packFd;
+        entry->packOffset = (off_t)record->bodyOffset;
+        //the archive holds the reference, so the entry is never freed
+        atomic_init(&entry->refs,1);
+        atomic_init(&entry->referenced,FALSE);
+        atomic_init(&entry->next,NULL);
+        entry->clockPrev = NULL;
+        entry->clockNext = NULL;
+    }
+    printf("Serving %u files from %s\n",packHeader->numEntries,fileName);
+    return NOERR;
+}
+
+//returns the entry for the decoded path with a reference held for the caller, or NULL if it is not in the archive
+CacheEntry* PackLookup (char* path) {
+    if (packEntries == NULL || packHeader->numEntries == 0) return NULL;
+    uint64_t hash = HashPath64(path, packHeader->seed);
+    uint32_t slot = PackSlot(hash, displacements[PackBucket(hash, packHeader->numBuckets)], packHeader->numEntries);
+    CacheEntry* entry = &packEntries[slot];
+    if (strcmp(entry->path,path) != STREQU) return NULL;
+    atomic_fetch_add(&entry->refs,1);
+    return entry;
+}
+
+uint32_t PackBucket (uint64_t hash, uint32_t numBuckets) {
+    return Mix(hash, 0) % numBuckets;
+}
+
+uint32_t PackSlot (uint64_t hash, uint32_t displacement, uint32_t numEntries) {
+    return Mix(hash, displacement + 1) % numEntries;
+}
+
+//everything the server reads from the archive has to lie inside it, and every path has to be in the slot it hashes to
+static int CheckPack (char* map, long long size) {
+    PackHeader* header = (PackHeader*)map;
+    if (memcmp(header->magic,PACK_MAGIC,PACK_MAGIC_SIZE) != STREQU || header->version != PACK_VERSION || header->size != size || header->numBuckets == 0) return ERROR;
+    if (header->displacementOffset % sizeof(uint32_t) != 0 || header->displacementOffset + (uint64_t)header->numBuckets * sizeof(uint32_t) > size) return ERROR;
+    if (header->recordOffset % sizeof(uint64_t) != 0 || header->recordOffset + (uint64_t)header->numEntries * sizeof(PackRecord) > size) return ERROR;
+    uint32_t* displacement = (uint32_t*)&map[header->displacementOffset];
+    PackRecord* records = (PackRecord*)&map[header->recordOffset];
+    uint32_t i;
+    for (i = 0; i < header->numEntries; i++) {
+        PackRecord* record = &records[i];
+        if (CheckString(map, size, record->pathOffset, record->pathLen) == ERROR || CheckString(map, size, record->headerOffset, record->headerLen) == ERROR) return ERROR;
+        if (record->bodyOffset > size || record->bodySize > size - record->bodyOffset || memchr(record->etag,'\0',ETAG_SIZE) == NULL) return ERROR;
+        uint64_t hash = HashPath64(&map[record->pathOffset], header->seed);
+        if (PackSlot(hash, displacement[PackBucket(hash, header->numBuckets)], header->numEntries) != i) return ERROR;
+    }
+    return NOERR;
+}
+
+//a string of len bytes at offset, followed by its NUL
+static int CheckString (char* map, long long size, uint64_t offset, uint32_t len) {
+    if (offset >= size || len >= size - offset || map[offset+len] != '\0' || strlen(&map[offset]) != len) return ERROR;
+    return NOERR;
+}
+
+//splitmix64's finaliser over the hash moved along by the displacement
+static uint64_t Mix (uint64_t hash, uint32_t displacement) {
+    uint64_t x = hash + displacement * 0x9e3779b97f4a7c15ULL;
+    x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    x = (x ^ (x >> 27)) * 0x94d049bb133111ebULL;
+    return x ^ (x >> 31);
+}
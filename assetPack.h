@@ -0,0 +1,58 @@
+/*
+    Custom Web Server - packed asset archive
+    By: Ricard Grace
+*/
+
+#ifndef ASSETPACK_H
+#define ASSETPACK_H
+
+#include "webServer.h"
+#include "fileCache.h"
+
+#include <stdint.h>
+#include <sys/mman.h>
+
+#define PACK_MAGIC "WSPACK01"
+#define PACK_MAGIC_SIZE 8
+#define PACK_VERSION 1
+//bodies start on a page boundary, so the kernel can send them straight from the page cache
+#define PACK_ALIGN 4096
+//paths per bucket of the perfect hash, on average
+#define PACK_BUCKET_LOAD 4
+//displacements tried for one bucket before the packer starts again with another seed
+#define PACK_MAX_DISPLACEMENT 1048576
+#define PACK_MAX_SEEDS 16
+
+//the start of the archive, everything else is found from here
+//all offsets are from the start of the archive
+typedef struct _packHeader {
+    char magic[PACK_MAGIC_SIZE];
+    uint32_t version;
+    uint32_t numEntries;
+    uint32_t numBuckets;
+    uint32_t seed;
+    //one uint32_t per bucket, and the records in slot order
+    uint64_t displacementOffset;
+    uint64_t recordOffset;
+    uint64_t size;
+} PackHeader;
+
+//one file, in the slot the perfect hash gives its path
+typedef struct _packRecord {
+    uint64_t pathOffset;
+    uint64_t headerOffset;
+    uint64_t bodyOffset;
+    uint64_t bodySize;
+    int64_t mtime;
+    //the path and the entity headers are NUL terminated
+    uint32_t pathLen;
+    uint32_t headerLen;
+    char etag[ETAG_SIZE];
+} PackRecord;
+
+int LoadAssetPack (char* fileName);
+CacheEntry* PackLookup (char* path);
+uint32_t PackBucket (uint64_t hash, uint32_t numBuckets);
+uint32_t PackSlot (uint64_t hash, uint32_t displacement, uint32_t numEntries);
+
+#endif
@@ -0,0 +1,123 @@
+/*
+    Custom Web Server - conditional requests
+    By: Ricard Grace
+*/
+
+#include "conditional.h"
+#include "encoding.h"
+
+/*
+    Every file is sent with a strong ETag made from its inode, size and modification time (to the
+    nanosecond) and a Last-Modified date, both taken from the fstat of the file being served, so
+    no file content is ever hashed. A client that already has the current version gets a 304
+    with no body: If-None-Match is checked first (weak comparison, as RFC 9110 asks for GET) and
+    If-Modified-Since only when there is no If-None-Match.
+    Cache-Control is decided by the longest matching path prefix given with -C.
+*/
+
+static int TagMatches (char* list, char* etag);
+
+static CacheRule cacheRules[MAX_CACHE_RULES];
+static int numCacheRules = 0;
+
+//add a rule in the form prefix:value (e.g. "/images/:max-age=86400"), returns ERROR if it is malformed
+int AddCacheRule (char* spec) {
+    char* colon = strchr(spec,':');
+    if (colon == NULL || colon == spec || numCacheRules >= MAX_CACHE_RULES) return ERROR;
+    CacheRule* rule = &cacheRules[numCacheRules++];
+    rule->prefixLen = colon - spec;
+    rule->prefix = strndup(spec,rule->prefixLen);
+    rule->value = strdup(colon+1);
+    return NOERR;
+}
+
+//the Cache-Control value for path, or NULL if no rule covers it
+char* CacheControlFor (char* path) {
+    CacheRule* best = NULL;
+    int i;
+    for (i = 0; i < numCacheRules; i++) {
+        if (strncmp(path,cacheRules[i].prefix,cacheRules[i].prefixLen) == STREQU && (best == NULL || cacheRules[i].prefixLen > best->prefixLen)) {
+            best = &cacheRules[i];
+        }
+    }
+    return best == NULL ? NULL : best->value;
+}
+
+//a strong validator, it changes whenever the file is replaced or written to
+void FormatETag (char* etag, struct stat* st) {
+    snprintf(etag,ETAG_SIZE,"\"%lx-%llx-%lx.%lx\"",(unsigned long)st->st_ino,(long long)st->st_size,(unsigned long)st->st_mtim.tv_sec,(unsigned long)st->st_mtim.tv_nsec);
+}
+
+//IMF-fixdate, e.g. Sun, 06 Nov 1994 08:49:37 GMT
+void FormatHttpDate (char* buffer, time_t time) {
+    struct tm gmt;
+    gmtime_r(&time,&gmt);
+    strftime(buffer,HTTP_DATE_SIZE,"%a, %d %b %Y %H:%M:%S GMT",&gmt);
+}
+
+//write the headers describing the file (type, size, encoding, validators and caching) into buffer, returns their length
+//an empty etag means the body is generated and has no validators, a NULL encoding means it is sent as is
+//and a NULL contentType leaves the type to be given elsewhere
+int EntityHeaders (char* buffer, int size, char* contentType, long long length, char* etag, time_t mtime, char* path, char* encoding) {
+    int len = 0;
+    if (contentType != NULL) len = snprintf(buffer,size,"Content-Type: %s\r\n",contentType);
+    if (len < size) len += snprintf(&buffer[len],size-len,"Content-Length: %lld\r\n",length);
+    if (encoding != NULL && len < size) {
+        len += snprintf(&buffer[len],size-len,"Content-Encoding: %s\r\n",encoding);
+    }
+    //anything that might be compressed tells caches the body depends on Accept-Encoding
+    if ((encoding != NULL || (path != NULL && Compressible(path))) && len < size) {
+        len += snprintf(&buffer[len],size-len,"Vary: Accept-Encoding\r\n");
+    }
+    if (etag != NULL && etag[0] != '\0' && len < size) {
+        char date[HTTP_DATE_SIZE];
+        FormatHttpDate(date, mtime);
+        len += snprintf(&buffer[len],size-len,"ETag: %s\r\nLast-Modified: %s\r\nAccept-Ranges: bytes\r\n",etag,date);
+    }
+    char* cacheControl = path != NULL ? CacheControlFor(path) : NULL;
+    if (cacheControl != NULL && len < size) {
+        len += snprintf(&buffer[len],size-len,"Cache-Control: %s\r\n",cacheControl);
+    }
+    if (len >= size) len = size-1;
+    return len;
+}
+
+//returns TRUE if the client's copy (described by its If-None-Match/If-Modified-Since) is still current
+int NotModified (HttpParser* parser, char* request, char* etag, time_t mtime) {
+    if (etag == NULL || etag[0] == '\0') return FALSE;
+    char value[VALUE_SIZE];
+    if (CopyHeader(parser, request, HDR_IF_NONE_MATCH, value, VALUE_SIZE) != ERROR) {
+        return TagMatches(value, etag);
+    }
+    if (CopyHeader(parser, request, HDR_IF_MODIFIED_SINCE, value, VALUE_SIZE) != ERROR) {
+        struct tm since;
+        memset(&since,0,sizeof(since));
+        char* end = strptime(value,"%a, %d %b %Y %H:%M:%S GMT",&since);
+        //a date we cannot read is ignored, as the standard asks
+        if (end == NULL || *end != '\0') return FALSE;
+        return mtime <= timegm(&since);
+    }
+    return FALSE;
+}
+
+//does the comma separated list of entity tags contain etag (ignoring weakness), or is it "*"
+static int TagMatches (char* list, char* etag) {
+    int etagLen = strlen(etag);
+    char* pos = list;
+    while (*pos != '\0') {
+        while (*pos == ' ' || *pos == '\t' || *pos == ',') pos++;
+        if (*pos == '*') return TRUE;
+        if (strncmp(pos,"W/",2) == STREQU) pos += 2;
+        char* start = pos;
+        if (*pos == '"') {
+            //a quoted tag may contain commas
+            pos = strchr(pos+1,'"');
+            if (pos == NULL) return FALSE;
+            pos++;
+        } else {
+            while (*pos != '\0' && *pos != ',' && *pos != ' ') pos++;
+        }
+        if (pos - start == etagLen && strncmp(start,etag,etagLen) == STREQU) return TRUE;
+    }
+    return FALSE;
+}
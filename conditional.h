@@ -0,0 +1,32 @@
+/*
+    Custom Web Server - conditional requests
+    By: Ricard Grace
+*/
+
+#ifndef CONDITIONAL_H
+#define CONDITIONAL_H
+
+#include "webServer.h"
+#include "httpParser.h"
+
+#include <time.h>
+
+#define HTTP_DATE_SIZE 32
+//Cache-Control rules given with -C
+#define MAX_CACHE_RULES 32
+
+//the Cache-Control value sent for every path starting with prefix
+typedef struct _cacheRule {
+    char* prefix;
+    int prefixLen;
+    char* value;
+} CacheRule;
+
+int AddCacheRule (char* spec);
+char* CacheControlFor (char* path);
+void FormatETag (char* etag, struct stat* st);
+void FormatHttpDate (char* buffer, time_t time);
+int EntityHeaders (char* buffer, int size, char* contentType, long long length, char* etag, time_t mtime, char* path, char* encoding);
+int NotModified (HttpParser* parser, char* request, char* etag, time_t mtime);
+
+#endif
@@ -0,0 +1,218 @@
+/*
+    Custom Web Server - configuration
+    By: Ricard Grace
+*/
+
+#include "config.h"
+#include "listener.h"
+#include "eventLoop.h"
+#include "sendFile.h"
+#include "fileCache.h"
+#include "threadPool.h"
+#include "logger.h"
+#include "conditional.h"
+#include "admission.h"
+#include "requestBody.h"
+
+/*
+    Everything that used to need a rebuild (port, listen backlog, document root) can be given on
+    the command line or in a config file passed with -f. The file holds one "key value" (or
+    "key = value") per line, # starts a comment, and every key is the long name of a command line
+    option so both go through ApplyOption. The file is read first wherever -f appears, so options
+    on the command line always win over it.
+*/
+
+typedef struct _configKey {
+    char* name;
+    int opt;
+} ConfigKey;
+
+static ConfigKey configKeys[] = {
+    {"mode", 'm'},
+    {"loops", 'l'},
+    {"workers", 'w'},
+    {"send", 's'},
+    {"cache", 'c'},
+    {"log_level", 'd'},
+    {"access_log", 'a'},
+    {"cache_control", 'C'},
+    {"port", 'p'},
+    {"backlog", 'b'},
+    {"shards", 'S'},
+    {"pin_shards", 'A'},
+    {"docroot", 'r'},
+    {"max_connections", 'M'},
+    {"max_requests", 'R'},
+    {"max_queue_ms", 'Q'},
+    {"max_body", 'B'},
+    {"spool_dir", 'T'},
+    {"pack", 'P'},
+    {"rewrites", 'W'},
+    {NULL, 0}
+};
+
+#define CONFIG_OPTIONS "m:l:w:s:c:d:a:C:p:b:S:Ar:M:R:Q:B:T:P:W:f:"
+
+static void DefaultConfig (ServerConfig* config);
+static void Usage (char* program);
+static char* Trim (char* text);
+
+//fill config from the defaults, the config file (if any) and then the command line
+int ReadConfig (ServerConfig* config, int argc, char* argv[]) {
+    DefaultConfig(config);
+
+    //first pass only looks for the config file, bad options are reported by the second
+    int opt;
+    opterr = 0;
+    while ((opt = getopt(argc, argv, CONFIG_OPTIONS)) != ERROR) {
+        if (opt == 'f' && LoadConfigFile(config, optarg) == ERROR) return ERROR;
+    }
+
+    opterr = 1;
+    optind = 1;
+    while ((opt = getopt(argc, argv, CONFIG_OPTIONS)) != ERROR) {
+        if (opt == 'f') continue;
+        if (opt == '?' || ApplyOption(config, opt, optarg) == ERROR) {
+            Usage(argv[0]);
+            return ERROR;
+        }
+    }
+    if (optind < argc) {
+        Usage(argv[0]);
+        return ERROR;
+    }
+    return NOERR;
+}
+
+int LoadConfigFile (ServerConfig* config, char* fileName) {
+    FILE* file = fopen(fileName,"r");
+    if (file == NULL) {
+        fprintf(stderr,"** config error ** %s: %s\n",fileName,strerror(errno));
+        return ERROR;
+    }
+
+    char line[CONFIG_LINE_SIZE];
+    int lineNum = 0;
+    while (fgets(line,CONFIG_LINE_SIZE,file) != NULL) {
+        lineNum++;
+        char* comment = strchr(line,'#');
+        if (comment != NULL) *comment = '\0';
+        char* key = Trim(line);
+        if (*key == '\0') continue;
+
+        //the key ends at the first space or '='
+        char* value = key;
+        while (*value != '\0' && !isspace((unsigned char)*value) && *value != '=') value++;
+        if (*value != '\0') *value++ = '\0';
+        value = Trim(value);
+        if (*value == '=') value = Trim(value+1);
+
+        ConfigKey* entry;
+        for (entry = configKeys; entry->name != NULL; entry++) {
+            if (strcmp(entry->name,key) == STREQU) break;
+        }
+        if (entry->name == NULL || *value == '\0' || ApplyOption(config, entry->opt, value) == ERROR) {
+            fprintf(stderr,"** config error ** %s:%d: bad setting '%s'\n",fileName,lineNum,key);
+            fclose(file);
+            return ERROR;
+        }
+    }
+
+    fclose(file);
+    return NOERR;
+}
+
+//apply one option, opt is its command line letter
+int ApplyOption (ServerConfig* config, int opt, char* value) {
+    if (opt == 'm' && strcmp(value,"thread") == STREQU) {
+        config->serverMode = MODE_THREAD;
+    } else if (opt == 'm' && strcmp(value,"epoll") == STREQU) {
+        config->serverMode = MODE_EPOLL;
+    } else if (opt == 'm' && strcmp(value,"pool") == STREQU) {
+        config->serverMode = MODE_POOL;
+    } else if (opt == 'm' && strcmp(value,"uring") == STREQU) {
+        config->serverMode = MODE_URING;
+    } else if (opt == 'l' && atoi(value) > 0) {
+        config->numLoops = atoi(value);
+    } else if (opt == 'w' && atoi(value) > 0) {
+        config->numWorkers = atoi(value);
+    } else if (opt == 's' && strcmp(value,"sendfile") == STREQU) {
+        SetSendMethod(SEND_SENDFILE);
+    } else if (opt == 's' && strcmp(value,"splice") == STREQU) {
+        SetSendMethod(SEND_SPLICE);
+    } else if (opt == 's' && strcmp(value,"stdio") == STREQU) {
+        SetSendMethod(SEND_STDIO);
+    } else if (opt == 'c' && atoll(value) >= 0) {
+        config->cacheMB = atoll(value);
+    } else if (opt == 'd' && LogLevelFromName(value) != ERROR) {
+        config->logLevel = LogLevelFromName(value);
+    } else if (opt == 'a') {
+        config->accessLog = strdup(value);
+    } else if (opt == 'C' && AddCacheRule(value) != ERROR) {
+        //Cache-Control by path prefix, e.g. -C /images/:max-age=86400
+    } else if (opt == 'p' && *value != '\0' && strlen(value) < PORT_SIZE) {
+        //a port number or a service name such as "http"
+        snprintf(config->port,PORT_SIZE,"%s",value);
+    } else if (opt == 'b' && atoi(value) > 0) {
+        config->backlog = atoi(value);
+    } else if (opt == 'S' && atoi(value) > 0 && atoi(value) <= MAX_SHARDS) {
+        config->numShards = atoi(value);
+    } else if (opt == 'A' && (value == NULL || strcmp(value,"yes") == STREQU)) {
+        config->pinShards = TRUE;
+    } else if (opt == 'A' && strcmp(value,"no") == STREQU) {
+        config->pinShards = FALSE;
+    } else if (opt == 'r' && *value != '\0') {
+        config->docRoot = strdup(value);
+    } else if (opt == 'M' && atoi(value) >= 0) {
+        config->maxConnections = atoi(value);
+    } else if (opt == 'R' && atoi(value) >= 0) {
+        config->maxRequests = atoi(value);
+    } else if (opt == 'Q' && atoi(value) >= 0) {
+        config->maxQueueMs = atoi(value);
+    } else if (opt == 'B' && atoll(value) >= 0) {
+        config->maxBody = atoll(value);
+    } else if (opt == 'T' && *value != '\0') {
+        config->spoolDir = strdup(value);
+    } else if (opt == 'P' && *value != '\0') {
+        config->packFile = strdup(value);
+    } else if (opt == 'W' && *value != '\0') {
+        config->rewriteFile = strdup(value);
+    } else {
+        return ERROR;
+    }
+    return NOERR;
+}
+
+static void DefaultConfig (ServerConfig* config) {
+    memset(config,0,sizeof(ServerConfig));
+    config->serverMode = MODE_THREAD;
+    config->numLoops = DEFAULT_LOOPS;
+    config->numWorkers = DefaultWorkerCount();
+    config->cacheMB = CACHE_DEFAULT_SIZE;
+    config->logLevel = LOG_DEFAULT_LEVEL;
+    config->accessLog = NULL;
+    snprintf(config->port,PORT_SIZE,"%s",DEFAULT_PORT);
+    config->backlog = DEFAULT_BACKLOG;
+    config->numShards = DEFAULT_SHARDS;
+    config->pinShards = FALSE;
+    config->docRoot = NULL;
+    config->maxConnections = DEFAULT_MAX_CONNECTIONS;
+    config->maxRequests = DEFAULT_MAX_REQUESTS;
+    config->maxQueueMs = DEFAULT_MAX_QUEUE_MS;
+    config->maxBody = DEFAULT_MAX_BODY;
+    config->spoolDir = DEFAULT_SPOOL_DIR;
+    config->packFile = NULL;
+    config->rewriteFile = NULL;
+}
+
+static void Usage (char* program) {
+    fprintf(stderr,"Usage: %s [-f config file] [-m thread|epoll|pool|uring] [-l event loops] [-w pool workers] [-s sendfile|splice|stdio] [-c cache MB] [-d error|warn|info|debug] [-a access log file] [-C path prefix:cache-control]... [-p port] [-b listen backlog] [-S listening sockets] [-A (pin each to a CPU)] [-r document root] [-M max connections] [-R max requests in progress] [-Q max pool queue ms] [-B max request body bytes] [-T body spool directory] [-P asset pack] [-W rewrite rules]\n",program);
+}
+
+//skip leading and cut trailing whitespace
+static char* Trim (char* text) {
+    while (isspace((unsigned char)*text)) text++;
+    int len = strlen(text);
+    while (len > 0 && isspace((unsigned char)text[len-1])) text[--len] = '\0';
+    return text;
+}
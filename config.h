@@ -0,0 +1,49 @@
+/*
+    Custom Web Server - configuration
+    By: Ricard Grace
+*/
+
+#ifndef CONFIG_H
+#define CONFIG_H
+
+#include "webServer.h"
+
+#include <ctype.h>
+
+#define CONFIG_LINE_SIZE 1024
+#define PORT_SIZE 32
+//most listening sockets opened with -S
+#define MAX_SHARDS 256
+
+//the options every part of the server is started with
+typedef struct _serverConfig {
+    int serverMode;
+    int numLoops;
+    int numWorkers;
+    long long cacheMB;
+    int logLevel;
+    char* accessLog;
+    char port[PORT_SIZE];
+    int backlog;
+    int numShards;
+    int pinShards;
+    //NULL serves webServerData in the working directory
+    char* docRoot;
+    //admission limits, 0 means no limit
+    int maxConnections;
+    int maxRequests;
+    int maxQueueMs;
+    //largest request body accepted and where bodies are spooled as they arrive
+    long long maxBody;
+    char* spoolDir;
+    //archive made with make pack, NULL serves everything from the data directory
+    char* packFile;
+    //redirect and rewrite rules, NULL for none
+    char* rewriteFile;
+} ServerConfig;
+
+int ReadConfig (ServerConfig* config, int argc, char* argv[]);
+int LoadConfigFile (ServerConfig* config, char* fileName);
+int ApplyOption (ServerConfig* config, int opt, char* value);
+
+#endif
@@ -0,0 +1,190 @@
+/*
+    Custom Web Server - document root
+    By: Ricard Grace
+*/
+
+#include "docRoot.h"
+#include "hash.h"
+
+#include <time.h>
+
+/*
+    The data directory is opened once at startup and every requested file is opened relative to
+    it, so no request ever builds an absolute path or calls getcwd. Paths are first canonicalised
+    ("." and empty segments dropped, ".." removes the segment before it and can never climb above
+    the root), then opened with openat2(RESOLVE_BENEATH) which also stops symlinks from leading
+    out of the directory. Kernels without openat2 get openat on the canonical path instead.
+    The descriptor that was opened is the one the body is later sent from.
+    Paths that did not resolve to a regular file are remembered for a couple of seconds in a small
+    direct mapped table, so scanners requesting the same missing files over and over are answered
+    without a system call. The file cache's inotify thread forgets a miss as soon as it is created.
+*/
+
+typedef struct _missEntry {
+    unsigned int hash;
+    time_t expires;
+    char path[MISS_PATH_SIZE];
+} MissEntry;
+
+static int IsMiss (char* path);
+static void RememberMiss (char* path);
+static int OpenRelative (char* relPath);
+static time_t Now ();
+
+static int rootFd = ERROR;
+//openat2 is not available before linux 5.6, RESOLVE_CACHED not before 5.12
+static int useOpenat2 = TRUE;
+static int useResolveCached = TRUE;
+
+static MissEntry misses[MISS_CACHE_SLOTS];
+static pthread_mutex_t missLocks[MISS_CACHE_LOCKS];
+
+//open the data directory that every request is resolved against
+int OpenDocRoot (char* dataDir) {
+    rootFd = open(dataDir,O_PATH | O_DIRECTORY | O_CLOEXEC);
+    if (rootFd == ERROR) {
+        fprintf(stderr,"** open error ** %s: %s\n",dataDir,strerror(errno));
+        return ERROR;
+    }
+    int i;
+    for (i = 0; i < MISS_CACHE_LOCKS; i++) {
+        pthread_mutex_init(&missLocks[i],NULL);
+    }
+
+    //see if the kernel can resolve beneath a directory for us
+    struct open_how how;
+    memset(&how,0,sizeof(how));
+    how.flags = O_PATH | O_DIRECTORY | O_CLOEXEC;
+    how.resolve = RESOLVE_BENEATH;
+    int probeFd = syscall(SYS_openat2,rootFd,".",&how,sizeof(how));
+    if (probeFd == ERROR) {
+        printf("openat2 is not available (%s), canonicalised paths will be used\n",strerror(errno));
+        useOpenat2 = FALSE;
+    } else {
+        close(probeFd);
+    }
+    return NOERR;
+}
+
+//canonicalise a decoded path (at most PATH_SIZE characters) in place
+//the result starts with '/' and has no empty, "." or ".." segments
+void NormalizePath (char* path) {
+    //segments are copied into result, a ".." moves back over the last one
+    char result[PATH_SIZE+2];
+    int readPos = 0;
+    int writePos = 0;
+    while (path[readPos] != '\0') {
+        while (path[readPos] == '/') readPos++;
+        int segStart = readPos;
+        while (path[readPos] != '/' && path[readPos] != '\0') readPos++;
+        int segLen = readPos - segStart;
+
+        if (segLen == 0 || (segLen == 1 && path[segStart] == '.')) continue;
+        if (segLen == 2 && path[segStart] == '.' && path[segStart+1] == '.') {
+            //go up a directory, the root is as far as it goes
+            while (writePos > 0 && result[writePos-1] != '/') writePos--;
+            if (writePos > 0) writePos--;
+            continue;
+        }
+        if (writePos + 1 + segLen > PATH_SIZE) break;
+        result[writePos++] = '/';
+        memcpy(&result[writePos],&path[segStart],segLen);
+        writePos += segLen;
+    }
+    if (writePos == 0) result[writePos++] = '/';
+    result[writePos] = '\0';
+    memcpy(path,result,writePos+1);
+}
+
+//open the regular file at path (canonical, relative to the data directory) and fill in st
+//returns the descriptor, or ERROR if there is no such file
+int OpenBeneath (char* path, struct stat* st) {
+    if (IsMiss(path)) {
+        errno = ENOENT;
+        return ERROR;
+    }
+
+    int fileFd = OpenRelative(&path[1]);
+    if (fileFd != ERROR && (fstat(fileFd,st) == ERROR || !S_ISREG(st->st_mode))) {
+        //directories, FIFOs and devices are not served
+        close(fileFd);
+        fileFd = ERROR;
+        errno = ENOENT;
+    }
+    if (fileFd == ERROR && (errno == ENOENT || errno == ENOTDIR || errno == EXDEV || errno == ELOOP || errno == ENAMETOOLONG)) {
+        //only remember answers that will not change until the directory does
+        RememberMiss(path);
+    }
+    return fileFd;
+}
+
+//path has appeared in the data directory
+void ForgetMiss (char* path) {
+    unsigned int hash = HashPath(path);
+    int slot = hash % MISS_CACHE_SLOTS;
+    pthread_mutex_lock(&missLocks[slot % MISS_CACHE_LOCKS]);
+    if (misses[slot].hash == hash && strcmp(misses[slot].path,path) == STREQU) misses[slot].expires = 0;
+    pthread_mutex_unlock(&missLocks[slot % MISS_CACHE_LOCKS]);
+}
+
+//a whole directory appeared, anything remembered may now exist
+void ForgetAllMisses () {
+    int i;
+    for (i = 0; i < MISS_CACHE_SLOTS; i++) {
+        pthread_mutex_lock(&missLocks[i % MISS_CACHE_LOCKS]);
+        misses[i].expires = 0;
+        pthread_mutex_unlock(&missLocks[i % MISS_CACHE_LOCKS]);
+    }
+}
+
+static int IsMiss (char* path) {
+    unsigned int hash = HashPath(path);
+    int slot = hash % MISS_CACHE_SLOTS;
+    pthread_mutex_lock(&missLocks[slot % MISS_CACHE_LOCKS]);
+    int found = misses[slot].hash == hash && misses[slot].expires > Now() && strcmp(misses[slot].path,path) == STREQU;
+    pthread_mutex_unlock(&missLocks[slot % MISS_CACHE_LOCKS]);
+    return found;
+}
+
+static void RememberMiss (char* path) {
+    if (strlen(path) >= MISS_PATH_SIZE) return;
+    unsigned int hash = HashPath(path);
+    int slot = hash % MISS_CACHE_SLOTS;
+    pthread_mutex_lock(&missLocks[slot % MISS_CACHE_LOCKS]);
+    misses[slot].hash = hash;
+    misses[slot].expires = Now() + MISS_CACHE_TTL;
+    snprintf(misses[slot].path,MISS_PATH_SIZE,"%s",path);
+    pthread_mutex_unlock(&missLocks[slot % MISS_CACHE_LOCKS]);
+}
+
+static int OpenRelative (char* relPath) {
+    if (useOpenat2 == FALSE) {
+        //the path is canonical so it cannot climb out, but a symlink inside the directory still could
+        return openat(rootFd,relPath,DOCROOT_OPEN_FLAGS);
+    }
+
+    struct open_how how;
+    memset(&how,0,sizeof(how));
+    how.flags = DOCROOT_OPEN_FLAGS;
+    how.resolve = RESOLVE_BENEATH | RESOLVE_NO_MAGICLINKS;
+    int fileFd;
+    if (useResolveCached) {
+        //try to resolve from the dentry cache alone first, which takes no locks
+        how.resolve |= RESOLVE_CACHED;
+        fileFd = syscall(SYS_openat2,rootFd,relPath,&how,sizeof(how));
+        if (fileFd != ERROR || (errno != EAGAIN && errno != EINVAL)) return fileFd;
+        if (errno == EINVAL) useResolveCached = FALSE;
+        how.resolve &= ~RESOLVE_CACHED;
+    }
+    do {
+        //EAGAIN means a rename raced with the lookup
+        fileFd = syscall(SYS_openat2,rootFd,relPath,&how,sizeof(how));
+    } while (fileFd == ERROR && errno == EAGAIN);
+    return fileFd;
+}
+
+static time_t Now () {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC_COARSE,&now);
+    return now.tv_sec;
+}
@@ -0,0 +1,29 @@
+/*
+    Custom Web Server - document root
+    By: Ricard Grace
+*/
+
+#ifndef DOCROOT_H
+#define DOCROOT_H
+
+#include "webServer.h"
+
+#include <sys/syscall.h>
+#include <linux/openat2.h>
+
+//recent misses are remembered so repeated 404s do not touch the filesystem
+#define MISS_CACHE_SLOTS 1024
+#define MISS_CACHE_LOCKS 64
+#define MISS_CACHE_TTL 2
+//longer paths are never remembered
+#define MISS_PATH_SIZE 256
+//non-blocking, so opening a FIFO (or a device) never waits for the other end
+#define DOCROOT_OPEN_FLAGS (O_RDONLY | O_CLOEXEC | O_NOCTTY | O_NONBLOCK)
+
+int OpenDocRoot (char* dataDir);
+void NormalizePath (char* path);
+int OpenBeneath (char* path, struct stat* st);
+void ForgetMiss (char* path);
+void ForgetAllMisses ();
+
+#endif
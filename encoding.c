@@ -0,0 +1,296 @@
+/*
+    Custom Web Server - compressed responses
+    By: Ricard Grace
+*/
+
+#include "encoding.h"
+#include "conditional.h"
+#include "docRoot.h"
+#include "logger.h"
+#include "hash.h"
+#include "assetPack.h"
+
+/*
+    Clients that accept gzip get a compressed body whenever there is one to give:
+        - a sibling file with .gz appended (e.g. index.html.gz) is sent as it is, so anything
+          compressed ahead of time (at any level) costs nothing to serve; probing for a sibling
+          that does not exist is answered by the document root's miss cache, and a sibling in the
+          asset pack is found there without touching the filesystem
+        - otherwise text files are compressed with zlib the first time they are asked for and the
+          result is kept in memory, keyed by path and the file's ETag, so a file is compressed
+          once per version no matter how many requests arrive for it at the same time (the first
+          compresses, the rest wait for it)
+    Compressed copies are held as file cache entries, so they are sent the same way as any other
+    cached file. The variant table takes its lock only long enough to find an entry and take a
+    reference, never while compressing. The least recently used copies are dropped when the
+    table is over VARIANT_CACHE_SIZE.
+*/
+
+static Variant* FindVariant (char* path, unsigned int hash);
+static CacheEntry* CompressedEntry (ReqInfo* reqInfo);
+static CacheEntry* CompressFile (ReqInfo* reqInfo);
+static char* ReadSource (ReqInfo* reqInfo, char** toFree);
+static void TouchVariant (Variant* variant);
+static void DropVariant (Variant* variant);
+
+//extensions worth compressing, everything else (images, audio, archives) is already compressed
+static char* textTypes[] = {
+    ".html", ".htm", ".css", ".js", ".mjs", ".json", ".txt", ".xml", ".svg", ".csv", ".md", NULL
+};
+
+static Variant* variants[VARIANT_BUCKETS];
+static Variant* lruHead = NULL;
+static Variant* lruTail = NULL;
+static long long variantBytes = 0;
+static pthread_mutex_t variantLock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t variantReady = PTHREAD_COND_INITIALIZER;
+
+//returns TRUE if the file at path is text that compresses well
+int Compressible (char* path) {
+    char* extension = strrchr(path,'.');
+    if (extension == NULL || strchr(extension,'/') != NULL) return FALSE;
+    int i;
+    for (i = 0; textTypes[i] != NULL; i++) {
+        if (strcasecmp(extension,textTypes[i]) == STREQU) return TRUE;
+    }
+    return FALSE;
+}
+
+//returns TRUE if the Accept-Encoding header allows gzip (listed, or covered by *, without q=0)
+int AcceptsGzip (HttpParser* parser, char* request) {
+    char value[VALUE_SIZE];
+    if (CopyHeader(parser, request, HDR_ACCEPT_ENCODING, value, VALUE_SIZE) == ERROR) return FALSE;
+    int gzip = ERROR;
+    int any = ERROR;
+    char* save;
+    char* coding;
+    for (coding = strtok_r(value,",",&save); coding != NULL; coding = strtok_r(NULL,",",&save)) {
+        while (*coding == ' ' || *coding == '\t') coding++;
+        int len = strcspn(coding," \t;");
+        //a q value of 0 (0, 0.0, 0.00...) means not acceptable
+        int accepted = TRUE;
+        char* q = strstr(coding,"q=");
+        if (q != NULL && q[2] == '0' && strspn(&q[3],".0") == strlen(&q[3])) accepted = FALSE;
+        if (len == 4 && strncasecmp(coding,ENCODING_GZIP,4) == STREQU) gzip = accepted;
+        if (len == 1 && coding[0] == '*') any = accepted;
+    }
+    if (gzip != ERROR) return gzip;
+    return any == TRUE;
+}
+
+//swap the file chosen for reqInfo (a 200 for a file) for a gzip version of it when there is one
+void NegotiateEncoding (ReqInfo* reqInfo) {
+    //a precompressed sibling wins, looked for in the asset pack first
+    char gzPath[PATH_SIZE+sizeof(GZIP_SUFFIX)];
+    snprintf(gzPath,sizeof(gzPath),"%s%s",reqInfo->fileName,GZIP_SUFFIX);
+    CacheEntry* packed = PackLookup(gzPath);
+    if (packed != NULL) {
+        if (reqInfo->cached != NULL) ReleaseCacheEntry(reqInfo->cached);
+        if (reqInfo->fileFd != ERROR) close(reqInfo->fileFd);
+        reqInfo->cached = packed;
+        reqInfo->fileFd = ERROR;
+        reqInfo->fileSize = packed->size;
+        memcpy(reqInfo->etag,packed->etag,ETAG_SIZE);
+        reqInfo->mtime = packed->mtime;
+        reqInfo->encoding = ENCODING_GZIP;
+        return;
+    }
+    //the pack is a snapshot, a packed file has no sibling outside it
+    struct stat st;
+    int gzFd = reqInfo->cached != NULL && reqInfo->cached->packFd != ERROR ? ERROR : OpenBeneath(gzPath, &st);
+    if (gzFd != ERROR) {
+        if (reqInfo->cached != NULL) ReleaseCacheEntry(reqInfo->cached);
+        if (reqInfo->fileFd != ERROR) close(reqInfo->fileFd);
+        reqInfo->cached = NULL;
+        reqInfo->fileFd = gzFd;
+        reqInfo->fileSize = (long long)st.st_size;
+        FormatETag(reqInfo->etag, &st);
+        reqInfo->mtime = st.st_mtime;
+        reqInfo->encoding = ENCODING_GZIP;
+        return;
+    }
+
+    if (!Compressible(reqInfo->fileName) || reqInfo->fileSize < COMPRESS_MIN_FILE || reqInfo->fileSize > COMPRESS_MAX_FILE) return;
+    CacheEntry* entry = CompressedEntry(reqInfo);
+    if (entry == NULL) return;
+    if (reqInfo->cached != NULL) ReleaseCacheEntry(reqInfo->cached);
+    if (reqInfo->fileFd != ERROR) close(reqInfo->fileFd);
+    reqInfo->cached = entry;
+    reqInfo->fileFd = ERROR;
+    reqInfo->fileSize = entry->size;
+    memcpy(reqInfo->etag,entry->etag,ETAG_SIZE);
+    reqInfo->encoding = ENCODING_GZIP;
+}
+
+//returns the compressed copy of the file with a reference held for the caller
+//or NULL if it does not compress (or compressing failed)
+static CacheEntry* CompressedEntry (ReqInfo* reqInfo) {
+    unsigned int hash = HashPath(reqInfo->fileName);
+    pthread_mutex_lock(&variantLock);
+    Variant* variant;
+    while ((variant = FindVariant(reqInfo->fileName, hash)) != NULL) {
+        //being made by another request, it can be dropped while the lock is let go so it is looked up again
+        if (variant->state == VARIANT_PENDING) {
+            pthread_cond_wait(&variantReady,&variantLock);
+            continue;
+        }
+        if (strcmp(variant->sourceTag,reqInfo->etag) == STREQU) break;
+        //another version of the file, replace it
+        DropVariant(variant);
+    }
+    if (variant != NULL) {
+        CacheEntry* entry = variant->entry;
+        if (entry != NULL) atomic_fetch_add(&entry->refs,1);
+        TouchVariant(variant);
+        pthread_mutex_unlock(&variantLock);
+        return entry;
+    }
+
+    //this request makes it, everyone else waits on the placeholder
+    variant = malloc(sizeof(Variant));
+    char* path = strdup(reqInfo->fileName);
+    if (variant == NULL || path == NULL) {
+        //the file is sent as it is
+        pthread_mutex_unlock(&variantLock);
+        free(variant);
+        free(path);
+        return NULL;
+    }
+    variant->path = path;
+    variant->hash = hash;
+    memcpy(variant->sourceTag,reqInfo->etag,ETAG_SIZE);
+    variant->state = VARIANT_PENDING;
+    variant->entry = NULL;
+    variant->bytes = 0;
+    variant->next = variants[hash % VARIANT_BUCKETS];
+    variants[hash % VARIANT_BUCKETS] = variant;
+    variant->lruPrev = NULL;
+    variant->lruNext = NULL;
+    pthread_mutex_unlock(&variantLock);
+
+    CacheEntry* entry = CompressFile(reqInfo);
+
+    pthread_mutex_lock(&variantLock);
+    variant->state = VARIANT_READY;
+    variant->entry = entry;
+    if (entry != NULL) {
+        variant->bytes = entry->size + entry->headerLen;
+        atomic_fetch_add(&entry->refs,1);
+    }
+    variantBytes += variant->bytes;
+    TouchVariant(variant);
+    //make room, but never drop what was just made
+    while (variantBytes > VARIANT_CACHE_SIZE && lruTail != variant) DropVariant(lruTail);
+    pthread_cond_broadcast(&variantReady);
+    pthread_mutex_unlock(&variantLock);
+    return entry;
+}
+
+//gzip the file into a new entry, returns NULL if it is no smaller than the original
+static CacheEntry* CompressFile (ReqInfo* reqInfo) {
+    char* toFree = NULL;
+    char* source = ReadSource(reqInfo, &toFree);
+    if (source == NULL) return NULL;
+
+    z_stream stream;
+    memset(&stream,0,sizeof(stream));
+    //15 window bits plus 16 asks zlib for a gzip wrapper
+    if (deflateInit2(&stream,COMPRESS_LEVEL,Z_DEFLATED,15+16,8,Z_DEFAULT_STRATEGY) != Z_OK) {
+        LogError("** deflate error ** %s",stream.msg != NULL ? stream.msg : "init failed");
+        free(toFree);
+        return NULL;
+    }
+    uLong bound = deflateBound(&stream,reqInfo->fileSize);
+    char* data = malloc(bound);
+    if (data == NULL) {
+        LogError("** out of memory **");
+        deflateEnd(&stream);
+        free(toFree);
+        return NULL;
+    }
+    stream.next_in = (Bytef*)source;
+    stream.avail_in = reqInfo->fileSize;
+    stream.next_out = (Bytef*)data;
+    stream.avail_out = bound;
+    int result = deflate(&stream,Z_FINISH);
+    long long size = stream.total_out;
+    deflateEnd(&stream);
+    free(toFree);
+
+    if (result != Z_STREAM_END || size >= reqInfo->fileSize) {
+        if (result != Z_STREAM_END) LogError("** deflate error ** %s: %d",reqInfo->fileName,result);
+        free(data);
+        return NULL;
+    }
+    LogDebug("Compressed %s: %lld -> %lld bytes",reqInfo->fileName,reqInfo->fileSize,size);
+
+    //a distinct strong validator for the compressed representation
+    char etag[ETAG_SIZE];
+    snprintf(etag,ETAG_SIZE,"%.*s-gz\"",(int)strlen(reqInfo->etag)-1,reqInfo->etag);
+    return CreateMemoryEntry(reqInfo->fileName, data, size, etag, reqInfo->mtime, ENCODING_GZIP);
+}
+
+//the bytes of the file being served, from the cache or read from the open file
+//toFree is set to anything that must be freed once the bytes are no longer needed
+static char* ReadSource (ReqInfo* reqInfo, char** toFree) {
+    if (reqInfo->cached != NULL) return reqInfo->cached->data;
+    if (reqInfo->fileFd == ERROR) return NULL;
+
+    char* data = malloc(reqInfo->fileSize);
+    if (data == NULL) {
+        LogError("** out of memory **");
+        return NULL;
+    }
+    long long totalRead = 0;
+    while (totalRead < reqInfo->fileSize) {
+        ssize_t elemRead = pread(reqInfo->fileFd,&data[totalRead],reqInfo->fileSize-totalRead,totalRead);
+        if (elemRead == ERROR && errno == EINTR) continue;
+        if (elemRead <= 0) {
+            //the file changed under us
+            free(data);
+            return NULL;
+        }
+        totalRead += elemRead;
+    }
+    *toFree = data;
+    return data;
+}
+
+//called under variantLock
+static Variant* FindVariant (char* path, unsigned int hash) {
+    Variant* variant = variants[hash % VARIANT_BUCKETS];
+    while (variant != NULL && (variant->hash != hash || strcmp(variant->path,path) != STREQU)) {
+        variant = variant->next;
+    }
+    return variant;
+}
+
+//move a ready variant to the front of the LRU list (called under variantLock)
+static void TouchVariant (Variant* variant) {
+    if (lruHead == variant) return;
+    if (variant->lruPrev != NULL) variant->lruPrev->lruNext = variant->lruNext;
+    if (variant->lruNext != NULL) variant->lruNext->lruPrev = variant->lruPrev;
+    if (lruTail == variant) lruTail = variant->lruPrev;
+    variant->lruPrev = NULL;
+    variant->lruNext = lruHead;
+    if (lruHead != NULL) lruHead->lruPrev = variant;
+    lruHead = variant;
+    if (lruTail == NULL) lruTail = variant;
+}
+
+//remove a ready variant, requests still sending it keep their reference (called under variantLock)
+static void DropVariant (Variant* variant) {
+    Variant** link = &variants[variant->hash % VARIANT_BUCKETS];
+    while (*link != variant) link = &(*link)->next;
+    *link = variant->next;
+
+    if (variant->lruPrev != NULL) variant->lruPrev->lruNext = variant->lruNext;
+    if (variant->lruNext != NULL) variant->lruNext->lruPrev = variant->lruPrev;
+    if (lruHead == variant) lruHead = variant->lruNext;
+    if (lruTail == variant) lruTail = variant->lruPrev;
+
+    variantBytes -= variant->bytes;
+    if (variant->entry != NULL) ReleaseCacheEntry(variant->entry);
+    free(variant->path);
+    free(variant);
+}
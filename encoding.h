@@ -0,0 +1,51 @@
+/*
+    Custom Web Server - compressed responses
+    By: Ricard Grace
+*/
+
+#ifndef ENCODING_H
+#define ENCODING_H
+
+#include "webServer.h"
+#include "httpParser.h"
+#include "fileCache.h"
+
+#include <zlib.h>
+
+#define ENCODING_GZIP "gzip"
+#define GZIP_SUFFIX ".gz"
+
+//files outside these sizes are always sent as they are
+#define COMPRESS_MIN_FILE 256
+#define COMPRESS_MAX_FILE 8388608
+#define COMPRESS_LEVEL 6
+//compressed copies kept in memory
+#define VARIANT_BUCKETS 1024
+#define VARIANT_CACHE_SIZE 16777216
+
+//variant states
+#define VARIANT_PENDING 0
+#define VARIANT_READY   1
+
+//the gzip version of one version of a file
+typedef struct _variant {
+    char* path;
+    unsigned int hash;
+    //etag of the file that was compressed, a different one means the variant is stale
+    char sourceTag[ETAG_SIZE];
+    int state;
+    //NULL when compressing did not make the file smaller
+    CacheEntry* entry;
+    long long bytes;
+
+    struct _variant* next;
+    //least recently used order, most recent first
+    struct _variant* lruPrev;
+    struct _variant* lruNext;
+} Variant;
+
+int Compressible (char* path);
+int AcceptsGzip (HttpParser* parser, char* request);
+void NegotiateEncoding (ReqInfo* reqInfo);
+
+#endif
@@ -0,0 +1,41 @@
+/*
+    Custom Web Server - epoch based reclamation
+    By: Ricard Grace
+*/
+
+#include "epoch.h"
+
+#include <sched.h>
+
+/*
+    Shared structures that are read without a lock (the file cache's chains and the rewrite table)
+    are released this way. A reader adds itself to the counter of the current epoch for as long
+    as it holds pointers into the structure. A writer that has unlinked something flips the epoch
+    and waits for the old counter to drain; after that no reader can still see what was unlinked,
+    since any that came later found the new epoch and the new state. Writers must be serialised
+    by the caller.
+*/
+
+//returns the slot to hand back to ExitEpoch
+int EnterEpoch (Epoch* epoch) {
+    while (1) {
+        long current = atomic_load(&epoch->current);
+        int slot = current & 1;
+        atomic_fetch_add(&epoch->activeReaders[slot],1);
+        //if a writer flipped the epoch in between it may not have seen us, announce again
+        if (atomic_load(&epoch->current) == current) return slot;
+        atomic_fetch_sub(&epoch->activeReaders[slot],1);
+    }
+}
+
+void ExitEpoch (Epoch* epoch, int slot) {
+    atomic_fetch_sub(&epoch->activeReaders[slot],1);
+}
+
+//wait until no reader can still be holding a pointer to something unlinked before the call
+void SynchronizeEpoch (Epoch* epoch) {
+    long current = atomic_fetch_add(&epoch->current,1);
+    while (atomic_load(&epoch->activeReaders[current & 1]) != 0) {
+        sched_yield();
+    }
+}
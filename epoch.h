@@ -0,0 +1,23 @@
+/*
+    Custom Web Server - epoch based reclamation
+    By: Ricard Grace
+*/
+
+#ifndef EPOCH_H
+#define EPOCH_H
+
+#include "webServer.h"
+
+#include <stdatomic.h>
+
+//readers announce themselves on the counter of the current epoch (zeroed, as a static is, before use)
+typedef struct _epoch {
+    atomic_long current;
+    atomic_long activeReaders[2];
+} Epoch;
+
+int EnterEpoch (Epoch* epoch);
+void ExitEpoch (Epoch* epoch, int slot);
+void SynchronizeEpoch (Epoch* epoch);
+
+#endif
@@ -0,0 +1,524 @@
+/*
+    Custom Web Server - epoll event loop
+    By: Ricard Grace
+*/
+
+#include "eventLoop.h"
+#include "logger.h"
+#include "metrics.h"
+#include "range.h"
+#include "admission.h"
+
+/*
+    Alternative to the thread per connection model in main().
+    A small number of loops each own an epoll instance and every connection accepted by that loop.
+    Sockets are non-blocking and registered edge-triggered once, so each connection moves through
+    its states (reading request -> reading its body -> sending header -> sending body) whenever
+    the kernel tells us it can make progress, and simply waits in the epoll set when it cannot.
+    Keep-alive connections go back to reading once a response is sent.
+    Every connection waits on one deadline in its loop's timer wheel: the keep-alive timeout while
+    idle, HEADER_TIMEOUT once a request has started arriving, and while a response goes out a
+    window of SEND_WINDOW seconds that is renewed as long as the client keeps up MIN_SEND_RATE
+    (request bodies get the same window while they arrive).
+    The loop wakes up every tick and closes whatever has run out in one batch.
+*/
+
+static void* RunLoop (void* shardPtr);
+static void AcceptConnections (EventLoop* loop);
+static void HandleConnection (EventLoop* loop, Connection* conn);
+static int ReadRequest (Connection* conn);
+static int ReadBody (Connection* conn);
+static int SendHeader (Connection* conn);
+static int SendBody (Connection* conn);
+static void CloseConnection (EventLoop* loop, Connection* conn);
+static void CloseExpiredConnections (EventLoop* loop);
+static long long ResponseSent (Connection* conn);
+static int SetNonBlocking (int fd);
+
+//loops are spread over the listening sockets, there are always at least as many loops as sockets
+int RunEventLoops (int* listenSocs, int numListeners, int numLoops) {
+    //loops sharing a listening socket race for its connections, the losers must not block
+    int i;
+    for (i = 0; i < numListeners; i++) {
+        if (SetNonBlocking(listenSocs[i]) == ERROR) {
+            fprintf(stderr,"** fcntl error ** %s\n",strerror(errno));
+            return ERROR;
+        }
+    }
+    //every socket needs a loop accepting from it
+    if (numLoops < numListeners) numLoops = numListeners;
+    Shard* shards = AssignShards(listenSocs, numListeners, numLoops);
+
+    //the calling thread runs the first loop itself
+    pthread_t* threads = malloc(sizeof(pthread_t) * numLoops);
+    for (i = 1; i < numLoops; i++) {
+        if (pthread_create(&threads[i],NULL,RunLoop,&shards[i]) != NOERR) {
+            fprintf(stderr,"** pthread_create error **\n");
+            numLoops = i;
+            break;
+        }
+    }
+    //sockets left without a loop are closed so the kernel stops giving them connections
+    for (i = numLoops; i < numListeners; i++) {
+        close(listenSocs[i]);
+    }
+    printf("Running %d event loop(s)\n",numLoops);
+    RunLoop(&shards[0]);
+
+    for (i = 1; i < numLoops; i++) {
+        pthread_join(threads[i],NULL);
+    }
+    free(threads);
+    free(shards);
+    return NOERR;
+}
+
+static void* RunLoop (void* shardPtr) {
+    Shard* shard = shardPtr;
+    PinShard(shard);
+    EventLoop loop;
+    loop.listenSoc = shard->listenSoc;
+    InitLoopPools(&loop.pools, sizeof(Connection));
+    InitTimerWheel(&loop.wheel);
+    loop.epollFd = epoll_create1(EPOLL_CLOEXEC);
+    if (loop.epollFd == ERROR) {
+        fprintf(stderr,"** epoll_create error ** %s\n",strerror(errno));
+        return NULL;
+    }
+
+    //EPOLLEXCLUSIVE stops every loop waking up for the same incoming connection
+    //the listening socket is marked with a NULL pointer
+    struct epoll_event event;
+    memset(&event,0,sizeof(event));
+    event.events = EPOLLIN | EPOLLET | EPOLLEXCLUSIVE;
+    event.data.ptr = NULL;
+    if (epoll_ctl(loop.epollFd,EPOLL_CTL_ADD,loop.listenSoc,&event) == ERROR) {
+        LogError("** epoll_ctl error ** %s",strerror(errno));
+        close(loop.epollFd);
+        return NULL;
+    }
+
+    struct epoll_event events[MAX_EVENTS];
+    while (1) {
+        //wake up every tick even when nothing happens so expired connections get closed
+        int numEvents = epoll_wait(loop.epollFd,events,MAX_EVENTS,TIMER_TICK_MS);
+        if (numEvents == ERROR) {
+            if (errno == EINTR) continue;
+            LogError("** epoll_wait error ** %s",strerror(errno));
+            break;
+        }
+
+        int i;
+        for (i = 0; i < numEvents; i++) {
+            Connection* conn = events[i].data.ptr;
+            if (conn == NULL) {
+                AcceptConnections(&loop);
+            } else if (events[i].events & (EPOLLERR | EPOLLHUP)) {
+                //the client has gone away, nothing more can be sent
+                CloseConnection(&loop, conn);
+            } else {
+                HandleConnection(&loop, conn);
+            }
+        }
+        CloseExpiredConnections(&loop);
+    }
+
+    close(loop.epollFd);
+    return NULL;
+}
+
+static void AcceptConnections (EventLoop* loop) {
+    //edge-triggered, so keep accepting until the backlog is empty
+    while (1) {
+        int connID = accept4(loop->listenSoc,NULL,NULL,SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (connID == ERROR) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK) return;
+            if (errno == EINTR || errno == ECONNABORTED) continue;
+            //out of descriptors, turn the waiting clients away so the backlog keeps moving
+            int err = errno;
+            int shed = err == EMFILE || err == ENFILE ? ShedWithReserve(loop->listenSoc) : ERROR;
+            if (shed == TRUE) continue;
+            if (shed == ERROR) LogError("** accept error ** %s",strerror(err));
+            return;
+        }
+        //too many open already, the client is told to come back later
+        if (!AdmitConnection()) {
+            ShedConnection(connID);
+            continue;
+        }
+
+        Connection* conn = SlabAlloc(&loop->pools.connections);
+        if (conn == NULL) {
+            LogError("** out of memory **");
+            ShedConnection(connID);
+            ReleaseConnection();
+            continue;
+        }
+        InitConnection(conn, connID, &loop->pools, &loop->wheel);
+
+        //registered once for both directions, the state decides which one matters
+        struct epoll_event event;
+        memset(&event,0,sizeof(event));
+        event.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+        event.data.ptr = conn;
+        if (epoll_ctl(loop->epollFd,EPOLL_CTL_ADD,connID,&event) == ERROR) {
+            LogError("** epoll_ctl error ** %s",strerror(errno));
+            CloseConnection(loop, conn);
+            continue;
+        }
+
+        //data may already be waiting, the edge for it could have been missed
+        HandleConnection(loop, conn);
+    }
+}
+
+//run the connection's state machine as far as the socket allows
+static void HandleConnection (EventLoop* loop, Connection* conn) {
+    int result = TRUE;
+    while (result == TRUE && conn->state != CONN_DONE) {
+        switch (conn->state) {
+            case CONN_READING:
+                result = ReadRequest(conn);
+                if (result == TRUE) result = StartRequest(conn);
+                break;
+            case CONN_READING_BODY:
+                result = ReadBody(conn);
+                break;
+            case CONN_SEND_HEADER:
+                result = SendHeader(conn);
+                break;
+            case CONN_SEND_BODY:
+                result = SendBody(conn);
+                break;
+            default:
+                result = ERROR;
+                break;
+        }
+        if (result == TRUE && conn->state == CONN_DONE) result = FinishResponse(conn);
+    }
+
+    //FALSE means we are waiting on the socket, finishing or failing ends the connection
+    if (result != FALSE) CloseConnection(loop, conn);
+}
+
+void InitLoopPools (LoopPools* pools, size_t connectionSize) {
+    InitSlabPool(&pools->connections, connectionSize);
+    InitSlabPool(&pools->recvBlocks, RECV_INITIAL_SIZE);
+    InitSlabPool(&pools->arenaBlocks, ARENA_BLOCK_SIZE);
+}
+
+//set up a newly accepted connection, its memory comes from the loop's pools
+void InitConnection (Connection* conn, int connID, LoopPools* pools, TimerWheel* wheel) {
+    conn->connID = connID;
+    conn->acceptTime = NanoTime();
+    conn->parseTime = 0;
+    CountConnection(1);
+    ClientAddress(connID, conn->client, INET6_ADDRSTRLEN);
+    conn->state = CONN_READING;
+    conn->keepAlive = FALSE;
+    conn->numRequests = 0;
+    InitGrowBuffer(&conn->recvBuffer, &pools->recvBlocks);
+    conn->bytesRecv = 0;
+    conn->requestLen = 0;
+    InitArena(&conn->arena, &pools->arenaBlocks);
+    conn->parser = NULL;
+    conn->body = NULL;
+    conn->header = NULL;
+    conn->headerLen = 0;
+    conn->headerSent = 0;
+    conn->admitted = FALSE;
+    InitFileSender(&conn->sender, ERROR, 0, 0);
+    conn->cached = NULL;
+    conn->hasBody = FALSE;
+    conn->ranges = NULL;
+    InitTimer(&conn->timer, conn);
+    conn->wheel = wheel;
+    SetDeadline(conn, TIMEOUT_IDLE);
+}
+
+//parse what has been received so far, the parser carries on from where it stopped
+//returns TRUE when a full request header is in the buffer, FALSE if more data is needed and ERROR if it cannot fit
+int ParseBuffered (Connection* conn) {
+    //the parser is only set up once there is something to parse
+    if (conn->bytesRecv == 0) return FALSE;
+    if (conn->parser == NULL) {
+        conn->parser = ArenaAlloc(&conn->arena, sizeof(HttpParser));
+        if (conn->parser == NULL) return ERROR;
+        InitParser(conn->parser);
+        //the whole header has to arrive within the timeout from its first bytes
+        SetDeadline(conn, TIMEOUT_HEADER);
+    }
+
+    long long parseStart = NanoTime();
+    int parsed = ParseRequest(conn->parser, conn->recvBuffer.data, conn->bytesRecv);
+    conn->parseTime += NanoTime() - parseStart;
+    if (parsed == TRUE) {
+        conn->requestLen = ParsedLength(conn->parser);
+        RecordPhase(PHASE_PARSE, conn->parseTime);
+        conn->parseTime = 0;
+        return TRUE;
+    }
+    if (conn->bytesRecv >= BUFF_SIZE) {
+        LogError("** request too large **");
+        return ERROR;
+    }
+    return FALSE;
+}
+
+//returns TRUE when a full request header is in the buffer, FALSE if more data is needed
+static int ReadRequest (Connection* conn) {
+    while (1) {
+        //a pipelined request may already be complete
+        int parsed = ParseBuffered(conn);
+        if (parsed != FALSE) return parsed;
+
+        //the buffer grows once it is full
+        int space = ReserveSpace(&conn->recvBuffer, conn->bytesRecv, 1);
+        if (space == ERROR) return ERROR;
+        int recvOut = recv(conn->connID,&conn->recvBuffer.data[conn->bytesRecv],space,0);
+        if (recvOut == ERROR) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                //an idle connection does not hold on to a buffer while it waits
+                if (conn->bytesRecv == 0) ReleaseGrowBuffer(&conn->recvBuffer);
+                return FALSE;
+            }
+            if (errno == EINTR) continue;
+            LogError("** recv error ** %s",strerror(errno));
+            return ERROR;
+        } else if (recvOut == 0) {
+            //the client has terminated the connection
+            return ERROR;
+        }
+        if (conn->numRequests == 0 && conn->bytesRecv == 0) RecordPhase(PHASE_FIRST_BYTE, NanoTime() - conn->acceptTime);
+        conn->bytesRecv += recvOut;
+        conn->recvBuffer.data[conn->bytesRecv] = '\0';
+    }
+}
+
+//the request header is in, go on to its body if it has one or straight to the response
+//returns ERROR if the connection cannot go on
+int StartRequest (Connection* conn) {
+    conn->startTime = MicroTime();
+    conn->numRequests++;
+    conn->admitted = AdmitRequest();
+    if (!conn->admitted) {
+        //too many requests in progress, the prebuilt 503 is sent and the connection closed
+        conn->header = OverloadResponse(&conn->headerLen);
+        conn->headerSent = 0;
+        conn->responseCode = RESPONSE_503;
+        conn->keepAlive = FALSE;
+        conn->hasBody = FALSE;
+        conn->state = CONN_SEND_HEADER;
+        conn->phaseStart = NanoTime();
+        SetDeadline(conn, TIMEOUT_SEND);
+        return TRUE;
+    }
+    if (!RequestHasBody(conn->parser)) return StartResponse(conn);
+
+    //only requests with a body pay for a reader
+    conn->body = ArenaAlloc(&conn->arena, sizeof(BodyReader));
+    if (conn->body == NULL) return ERROR;
+    if (StartBody(conn->body, conn->parser, conn->recvBuffer.data) != TRUE) return StartResponse(conn);
+    //the client only sends the body once it is told to go ahead
+    if (conn->body->expectsContinue && conn->bytesRecv == conn->requestLen && SendContinue(conn->connID) == ERROR) return ERROR;
+    conn->state = CONN_READING_BODY;
+    SetDeadline(conn, TIMEOUT_BODY);
+    return TRUE;
+}
+
+//hand what has been received of the request body to its reader, dropping it from the buffer
+//returns TRUE once the body is complete (or turned away) and the response started, FALSE if more is needed
+int BufferedBody (Connection* conn) {
+    if (ConsumeBuffered(conn->body, conn->recvBuffer.data, &conn->bytesRecv, conn->requestLen) == FALSE) return FALSE;
+    return StartResponse(conn);
+}
+
+//process the request and prepare the response header and body
+//returns ERROR if there is no memory for the response
+int StartResponse (Connection* conn) {
+    conn->header = ArenaAlloc(&conn->arena, HEADER_SIZE);
+    if (conn->header == NULL) return ERROR;
+    ReqInfo reqInfo = ProcessRequest(conn->recvBuffer.data, conn->parser, &conn->arena, conn->body);
+    conn->responseCode = reqInfo.responseCode;
+    if (conn->numRequests >= MAX_KEEPALIVE_REQUESTS) reqInfo.keepAlive = FALSE;
+    conn->keepAlive = reqInfo.keepAlive;
+
+    conn->headerLen = BuildResponseHeader(&reqInfo, conn->header, HEADER_SIZE);
+    conn->headerSent = 0;
+
+    //the connection takes over the request's cache reference until the body is sent
+    conn->cached = reqInfo.cached;
+    conn->hasBody = ResponseHasBody(&reqInfo);
+    if (conn->hasBody) {
+        //the sender takes over the file opened for the request and closes it when done
+        InitResponseSender(&reqInfo, &conn->sender);
+    } else if (reqInfo.fileFd != ERROR) {
+        close(reqInfo.fileFd);
+    }
+    conn->ranges = reqInfo.ranges;
+    conn->fileSize = reqInfo.fileSize;
+    conn->part = 0;
+
+    conn->state = CONN_SEND_HEADER;
+    conn->phaseStart = NanoTime();
+    SetDeadline(conn, TIMEOUT_SEND);
+    return TRUE;
+}
+
+//receive the request body a piece at a time, returns TRUE once it is complete and the response started
+static int ReadBody (Connection* conn) {
+    while (1) {
+        int result = BufferedBody(conn);
+        if (result != FALSE) return result;
+
+        int space = ReserveSpace(&conn->recvBuffer, conn->bytesRecv, 1);
+        if (space == ERROR) return ERROR;
+        int recvOut = recv(conn->connID,&conn->recvBuffer.data[conn->bytesRecv],space < BODY_CHUNK_SIZE ? space : BODY_CHUNK_SIZE,0);
+        if (recvOut == ERROR) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK) return FALSE;
+            if (errno == EINTR) continue;
+            LogError("** recv error ** %s",strerror(errno));
+            return ERROR;
+        } else if (recvOut == 0) {
+            //the client has terminated the connection
+            return ERROR;
+        }
+        conn->bytesRecv += recvOut;
+    }
+}
+
+//the start of the body goes out with the header, a small body all of it
+static int SendHeader (Connection* conn) {
+    int result = SendWithHeader(conn->hasBody ? &conn->sender : NULL, conn->connID, conn->header, conn->headerLen, &conn->headerSent);
+    if (result != TRUE) return result;
+    long long now = NanoTime();
+    RecordPhase(PHASE_HEADER, now - conn->phaseStart);
+    conn->phaseStart = now;
+
+    conn->state = conn->hasBody ? CONN_SEND_BODY : CONN_DONE;
+    return TRUE;
+}
+
+static int SendBody (Connection* conn) {
+    int result;
+    while ((result = SendFileStep(&conn->sender, conn->connID)) == TRUE && NextBodyPart(conn->ranges, conn->part+1, conn->fileSize, &conn->sender)) {
+        conn->part++;
+    }
+    if (result == TRUE) {
+        RecordPhase(PHASE_BODY, NanoTime() - conn->phaseStart);
+        conn->state = CONN_DONE;
+    }
+    return result;
+}
+
+//the response is out, either get ready for the next request (state back to reading) or end the connection
+int FinishResponse (Connection* conn) {
+    LogResponse(conn);
+    CloseFileSender(&conn->sender);
+    if (conn->cached != NULL) ReleaseCacheEntry(conn->cached);
+    conn->cached = NULL;
+    conn->hasBody = FALSE;
+    if (conn->admitted) ReleaseRequest();
+    conn->admitted = FALSE;
+    //the rest of a body that was turned away may still be on its way, the connection closes after the response
+    if (conn->body != NULL && conn->body->status != NULL) DiscardUnread(conn->connID);
+    conn->body = NULL;
+    if (!conn->keepAlive) return TRUE;
+
+    //keep any pipelined requests that arrived after this one
+    conn->bytesRecv -= conn->requestLen;
+    memmove(conn->recvBuffer.data,&conn->recvBuffer.data[conn->requestLen],conn->bytesRecv);
+    conn->recvBuffer.data[conn->bytesRecv] = '\0';
+    conn->requestLen = 0;
+    //the next request starts with an empty arena, an idle connection gives its memory back altogether
+    ResetArena(&conn->arena);
+    if (conn->bytesRecv == 0) {
+        FreeConnectionMemory(conn);
+        SetDeadline(conn, TIMEOUT_IDLE);
+    }
+    conn->parser = NULL;
+    conn->header = NULL;
+    conn->ranges = NULL;
+    conn->state = CONN_READING;
+    return TRUE;
+}
+
+//hand the receive buffer and arena back to the loop's pools
+void FreeConnectionMemory (Connection* conn) {
+    ReleaseGrowBuffer(&conn->recvBuffer);
+    ReleaseArena(&conn->arena);
+}
+
+void LogResponse (Connection* conn) {
+    RecordResponse(conn->client, conn->recvBuffer.data, conn->parser, conn->responseCode, ResponseSent(conn), conn->startTime);
+}
+
+//bytes of the current response sent so far
+static long long ResponseSent (Connection* conn) {
+    return conn->headerSent + (conn->hasBody ? FileSenderSent(&conn->sender) : 0);
+}
+
+//how far the request body (while it is being received) or the response has got
+static long long Progress (Connection* conn) {
+    if (conn->state == CONN_READING_BODY) return conn->body->received;
+    return ResponseSent(conn);
+}
+
+//wait on a new deadline in place of the current one
+void SetDeadline (Connection* conn, int timeout) {
+    conn->timeout = timeout;
+    int seconds = KEEPALIVE_TIMEOUT;
+    if (timeout == TIMEOUT_HEADER) {
+        seconds = HEADER_TIMEOUT;
+    } else if (timeout == TIMEOUT_SEND || timeout == TIMEOUT_BODY) {
+        seconds = SEND_WINDOW;
+        conn->windowBytes = Progress(conn);
+    }
+    SetTimer(conn->wheel, &conn->timer, seconds * 1000);
+}
+
+//the connection's timer has gone off, returns TRUE if the connection should be closed
+//a response still going out at the minimum rate gets another window instead
+int DeadlinePassed (Connection* conn) {
+    if ((conn->timeout == TIMEOUT_SEND || conn->timeout == TIMEOUT_BODY) && Progress(conn) - conn->windowBytes >= (long long)MIN_SEND_RATE * SEND_WINDOW) {
+        SetDeadline(conn, conn->timeout);
+        return FALSE;
+    }
+    CountTimeout(conn->timeout);
+    if (conn->timeout != TIMEOUT_IDLE) LogWarn("** timeout ** %s: %s too slow, closing",conn->client,TimeoutName(conn->timeout));
+    return TRUE;
+}
+
+static void CloseConnection (EventLoop* loop, Connection* conn) {
+    //closing the socket also removes it from the epoll set
+    CancelTimer(&conn->timer);
+    //a response that was cut short is still logged
+    if (conn->state == CONN_SEND_HEADER || conn->state == CONN_SEND_BODY) LogResponse(conn);
+    CloseFileSender(&conn->sender);
+    if (conn->cached != NULL) ReleaseCacheEntry(conn->cached);
+    if (conn->admitted) ReleaseRequest();
+    if (conn->body != NULL) EndBody(conn->body);
+    FreeConnectionMemory(conn);
+    close(conn->connID);
+    CountConnection(-1);
+    ReleaseConnection();
+    SlabFree(&loop->pools.connections, conn);
+}
+
+//close every connection whose deadline has passed
+static void CloseExpiredConnections (EventLoop* loop) {
+    Timer* timer = ExpireTimers(&loop->wheel);
+    while (timer != NULL) {
+        //the timer may be set again, so move on before looking at it
+        Timer* next = timer->next;
+        Connection* conn = timer->owner;
+        if (DeadlinePassed(conn)) CloseConnection(loop, conn);
+        timer = next;
+    }
+}
+
+static int SetNonBlocking (int fd) {
+    int flags = fcntl(fd,F_GETFL,0);
+    if (flags == ERROR) return ERROR;
+    return fcntl(fd,F_SETFL,flags | O_NONBLOCK);
+}
@@ -0,0 +1,109 @@
+/*
+    Custom Web Server - epoll event loop
+    By: Ricard Grace
+*/
+
+#ifndef EVENTLOOP_H
+#define EVENTLOOP_H
+
+#include "webServer.h"
+#include "listener.h"
+#include "sendFile.h"
+#include "fileCache.h"
+#include "httpParser.h"
+#include "memPool.h"
+#include "timerWheel.h"
+#include "requestBody.h"
+
+#include <sys/epoll.h>
+#include <fcntl.h>
+#include <time.h>
+
+#define MAX_EVENTS 256
+#define DEFAULT_LOOPS 4
+
+//connection states
+#define CONN_READING      0
+#define CONN_READING_BODY 1
+#define CONN_SEND_HEADER  2
+#define CONN_SEND_BODY    3
+#define CONN_DONE         4
+
+//slabs one loop's connections and their memory come from
+typedef struct _loopPools {
+    SlabPool connections;
+    SlabPool recvBlocks;
+    SlabPool arenaBlocks;
+} LoopPools;
+
+//state kept for every connection owned by an event loop
+//an idle connection holds nothing else, its buffer and arena are only taken while a request is in progress
+typedef struct _connection {
+    int connID;
+    int state;
+    int keepAlive;
+    int numRequests;
+    char client[INET6_ADDRSTRLEN];
+    //when the connection was accepted, when the current phase started and time spent parsing
+    long long acceptTime;
+    long long phaseStart;
+    long long parseTime;
+
+    //the one deadline the connection is waiting on (idle, header or send), in its loop's wheel
+    Timer timer;
+    TimerWheel* wheel;
+    int timeout;
+    //bytes of the response sent (or of the request body received) when the current window started
+    long long windowBytes;
+
+    //request being read, bytes past requestLen belong to pipelined requests
+    GrowBuffer recvBuffer;
+    int bytesRecv;
+    int requestLen;
+    //the parser and everything else for the current request, set up once its first bytes arrive
+    Arena arena;
+    HttpParser* parser;
+    //the request body being received, NULL when the request has none
+    BodyReader* body;
+
+    //response header, status and start time are kept for the access log
+    char* header;
+    char* responseCode;
+    long long startTime;
+    int headerLen;
+    int headerSent;
+    //set while the request counts towards the in-progress limit
+    int admitted;
+
+    //response body, sent from the cached entry or the file one part (range) at a time
+    FileSender sender;
+    CacheEntry* cached;
+    int hasBody;
+    RangeSet* ranges;
+    long long fileSize;
+    int part;
+} Connection;
+
+//state kept by each event loop thread
+typedef struct _eventLoop {
+    int epollFd;
+    int listenSoc;
+    TimerWheel wheel;
+    LoopPools pools;
+} EventLoop;
+
+int RunEventLoops (int* listenSocs, int numListeners, int numLoops);
+//the connection state machine, shared with the io_uring loops
+void InitLoopPools (LoopPools* pools, size_t connectionSize);
+void InitConnection (Connection* conn, int connID, LoopPools* pools, TimerWheel* wheel);
+void FreeConnectionMemory (Connection* conn);
+int ParseBuffered (Connection* conn);
+int StartRequest (Connection* conn);
+int BufferedBody (Connection* conn);
+int StartResponse (Connection* conn);
+int FinishResponse (Connection* conn);
+void LogResponse (Connection* conn);
+void SetDeadline (Connection* conn, int timeout);
+int DeadlinePassed (Connection* conn);
+
+#endif
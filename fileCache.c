@@ -0,0 +1,415 @@
+/*
+    Custom Web Server - static content cache
+    By: Ricard Grace
+*/
+
+#include "fileCache.h"
+#include "logger.h"
+#include "docRoot.h"
+#include "conditional.h"
+#include "mimeTypes.h"
+#include "hash.h"
+#include "epoch.h"
+
+#include <dirent.h>
+
+/*
+    Hot files from the data directory are kept in memory, keyed by the decoded request path, so a
+    hit answers a request without touching the filesystem at all.
+    Lookups never take a lock: buckets are chains of immutable entries published with atomic
+    stores, and a reader only announces itself on one of two counters while it walks a chain.
+    Writers (inserts, evictions and invalidations) are serialised by one mutex. An entry that is
+    unlinked is only released once every reader that might still be looking at it has left,
+    which is checked by flipping the epoch and waiting for the old counter to drain (epoch.c).
+    When the cache is full, entries are evicted with the clock algorithm (an approximation of LRU
+    that only costs a hit one relaxed store).
+    An inotify thread watches the whole data directory and drops entries as soon as they change.
+*/
+
+static CacheEntry* CreateEntry (char* path, int fileFd);
+static void FreeEntry (CacheEntry* entry);
+static void UnlinkEntry (CacheEntry* entry);
+static CacheEntry* EvictEntries (long long needed);
+static void ReleaseEntries (CacheEntry* list);
+static void* WatchDataDir (void* unused);
+static void AddWatches (char* relPath);
+static char* WatchPath (int wd);
+static void RemoveWatch (int wd);
+
+static CacheEntry* _Atomic buckets[CACHE_BUCKETS];
+static long long maxCacheBytes = 0;
+
+//writer side, only touched under cacheLock
+static pthread_mutex_t cacheLock = PTHREAD_MUTEX_INITIALIZER;
+static CacheEntry* clockHand = NULL;
+static long long cacheBytes = 0;
+
+//readers of the chains
+static Epoch cacheEpoch;
+
+//bumped on every change inotify reports, so a file read during a change is not cached
+static atomic_long changeGeneration = 0;
+
+//inotify state, only touched by the watching thread once it has started
+static char dataRoot[PATH_SIZE+1];
+static int inotifyFd = ERROR;
+static int watchIDs[MAX_WATCHES];
+static char* watchPaths[MAX_WATCHES];
+static int numWatches = 0;
+
+//set up the cache and start watching dataDir, a size of 0 disables caching
+int InitFileCache (char* dataDir, long long maxBytes) {
+    maxCacheBytes = maxBytes;
+    if (maxBytes <= 0) return NOERR;
+
+    snprintf(dataRoot,PATH_SIZE+1,"%s",dataDir);
+    inotifyFd = inotify_init1(IN_CLOEXEC);
+    if (inotifyFd == ERROR) {
+        //without invalidation the cache would serve stale files
+        fprintf(stderr,"** inotify error ** %s, caching disabled\n",strerror(errno));
+        maxCacheBytes = 0;
+        return ERROR;
+    }
+    AddWatches("");
+
+    pthread_t thread;
+    if (pthread_create(&thread,NULL,WatchDataDir,NULL) != NOERR) {
+        fprintf(stderr,"** pthread_create error **, caching disabled\n");
+        maxCacheBytes = 0;
+        return ERROR;
+    }
+    pthread_detach(thread);
+    printf("Caching up to %lldMB of files from %s\n",maxBytes/1048576,dataDir);
+    return NOERR;
+}
+
+//returns the entry for path with a reference held for the caller, or NULL on a miss
+CacheEntry* CacheLookup (char* path) {
+    if (maxCacheBytes <= 0) return NULL;
+
+    unsigned int hash = HashPath(path);
+    int slot = EnterEpoch(&cacheEpoch);
+    CacheEntry* entry = atomic_load_explicit(&buckets[hash % CACHE_BUCKETS],memory_order_acquire);
+    while (entry != NULL && (entry->hash != hash || strcmp(entry->path,path) != STREQU)) {
+        entry = atomic_load_explicit(&entry->next,memory_order_acquire);
+    }
+    if (entry != NULL) {
+        atomic_fetch_add(&entry->refs,1);
+        atomic_store_explicit(&entry->referenced,TRUE,memory_order_relaxed);
+    }
+    ExitEpoch(&cacheEpoch, slot);
+
+    return entry;
+}
+
+//the change generation, taken before a file is opened and handed back to CacheInsert
+long CacheGeneration () {
+    return atomic_load(&changeGeneration);
+}
+
+//read the open file into the cache under path (the caller keeps the descriptor)
+//generation is CacheGeneration from before the file was opened, so a change in between is not missed
+//returns the entry with a reference held for the caller, or NULL if the file cannot be cached
+CacheEntry* CacheInsert (char* path, int fileFd, long generation) {
+    if (maxCacheBytes <= 0) return NULL;
+
+    CacheEntry* entry = CreateEntry(path, fileFd);
+    if (entry == NULL) return NULL;
+    long long entryBytes = entry->size + entry->headerLen;
+
+    pthread_mutex_lock(&cacheLock);
+    //another request may have cached it first
+    CacheEntry* existing = atomic_load(&buckets[entry->hash % CACHE_BUCKETS]);
+    while (existing != NULL && (existing->hash != entry->hash || strcmp(existing->path,path) != STREQU)) {
+        existing = atomic_load(&existing->next);
+    }
+    if (existing != NULL) {
+        atomic_fetch_add(&existing->refs,1);
+        pthread_mutex_unlock(&cacheLock);
+        FreeEntry(entry);
+        return existing;
+    }
+    if (atomic_load(&changeGeneration) != generation || entryBytes > maxCacheBytes) {
+        //the file changed while we read it (or can never fit), serve this copy once without keeping it
+        pthread_mutex_unlock(&cacheLock);
+        return entry;
+    }
+
+    CacheEntry* evicted = EvictEntries(entryBytes);
+
+    //join the clock ring just behind the hand, so it is the last to be considered
+    if (clockHand == NULL) {
+        entry->clockPrev = entry;
+        entry->clockNext = entry;
+        clockHand = entry;
+    } else {
+        entry->clockNext = clockHand;
+        entry->clockPrev = clockHand->clockPrev;
+        clockHand->clockPrev->clockNext = entry;
+        clockHand->clockPrev = entry;
+    }
+    cacheBytes += entryBytes;
+
+    //publish, readers see a fully built entry
+    atomic_fetch_add(&entry->refs,1);
+    atomic_store_explicit(&entry->next,atomic_load(&buckets[entry->hash % CACHE_BUCKETS]),memory_order_relaxed);
+    atomic_store_explicit(&buckets[entry->hash % CACHE_BUCKETS],entry,memory_order_release);
+
+    if (evicted != NULL) SynchronizeEpoch(&cacheEpoch);
+    pthread_mutex_unlock(&cacheLock);
+    ReleaseEntries(evicted);
+
+    return entry;
+}
+
+//drop the cached copy of path, if there is one
+void CacheInvalidate (char* path) {
+    if (maxCacheBytes <= 0) return;
+
+    unsigned int hash = HashPath(path);
+    pthread_mutex_lock(&cacheLock);
+    CacheEntry* entry = atomic_load(&buckets[hash % CACHE_BUCKETS]);
+    while (entry != NULL && (entry->hash != hash || strcmp(entry->path,path) != STREQU)) {
+        entry = atomic_load(&entry->next);
+    }
+    if (entry != NULL) {
+        UnlinkEntry(entry);
+        SynchronizeEpoch(&cacheEpoch);
+    }
+    pthread_mutex_unlock(&cacheLock);
+
+    if (entry != NULL) {
+        entry->clockNext = NULL;
+        ReleaseEntries(entry);
+    }
+}
+
+//drop everything
+void CacheFlush () {
+    if (maxCacheBytes <= 0) return;
+
+    pthread_mutex_lock(&cacheLock);
+    CacheEntry* removed = EvictEntries(maxCacheBytes + 1);
+    if (removed != NULL) SynchronizeEpoch(&cacheEpoch);
+    pthread_mutex_unlock(&cacheLock);
+    ReleaseEntries(removed);
+}
+
+void ReleaseCacheEntry (CacheEntry* entry) {
+    if (atomic_fetch_sub(&entry->refs,1) == 1) FreeEntry(entry);
+}
+
+static CacheEntry* CreateEntry (char* path, int fileFd) {
+    struct stat st;
+    if (fstat(fileFd,&st) == ERROR || !S_ISREG(st.st_mode) || st.st_size > CACHE_MAX_FILE) {
+        return NULL;
+    }
+
+    CacheEntry* entry = malloc(sizeof(CacheEntry));
+    entry->header = NULL;
+    entry->headerLen = 0;
+    entry->packFd = ERROR;
+    entry->packOffset = 0;
+    entry->path = strdup(path);
+    entry->hash = HashPath(path);
+    entry->size = (long long)st.st_size;
+    entry->mtime = st.st_mtime;
+    FormatETag(entry->etag, &st);
+    entry->data = malloc(entry->size > 0 ? entry->size : 1);
+    atomic_init(&entry->refs,1);
+    atomic_init(&entry->referenced,FALSE);
+    atomic_init(&entry->next,NULL);
+    entry->clockPrev = NULL;
+    entry->clockNext = NULL;
+
+    long long totalRead = 0;
+    while (totalRead < entry->size) {
+        ssize_t elemRead = pread(fileFd,&entry->data[totalRead],entry->size-totalRead,totalRead);
+        if (elemRead == ERROR && errno == EINTR) continue;
+        if (elemRead <= 0) {
+            //the file changed under us
+            FreeEntry(entry);
+            return NULL;
+        }
+        totalRead += elemRead;
+    }
+
+    char header[HEADER_SIZE];
+    entry->headerLen = EntityHeaders(header, HEADER_SIZE, ContentType(path), entry->size, entry->etag, entry->mtime, path, NULL);
+    entry->header = strdup(header);
+
+    return entry;
+}
+
+//wrap a body that is already in memory (the entry takes ownership of data) in an entry outside the cache
+//used for generated variants of files, returns it with one reference held for the caller
+CacheEntry* CreateMemoryEntry (char* path, char* data, long long size, char* etag, time_t mtime, char* encoding) {
+    CacheEntry* entry = malloc(sizeof(CacheEntry));
+    entry->path = strdup(path);
+    entry->hash = HashPath(path);
+    entry->data = data;
+    entry->size = size;
+    entry->packFd = ERROR;
+    entry->packOffset = 0;
+    entry->mtime = mtime;
+    snprintf(entry->etag,ETAG_SIZE,"%s",etag);
+    atomic_init(&entry->refs,1);
+    atomic_init(&entry->referenced,FALSE);
+    atomic_init(&entry->next,NULL);
+    entry->clockPrev = NULL;
+    entry->clockNext = NULL;
+
+    char header[HEADER_SIZE];
+    entry->headerLen = EntityHeaders(header, HEADER_SIZE, ContentType(path), size, entry->etag, mtime, path, encoding);
+    entry->header = strdup(header);
+    return entry;
+}
+
+static void FreeEntry (CacheEntry* entry) {
+    free(entry->path);
+    free(entry->data);
+    free(entry->header);
+    free(entry);
+}
+
+//remove the entry from its bucket and the clock ring (called under cacheLock)
+static void UnlinkEntry (CacheEntry* entry) {
+    CacheEntry* _Atomic* link = &buckets[entry->hash % CACHE_BUCKETS];
+    while (atomic_load(link) != entry) {
+        link = &atomic_load(link)->next;
+    }
+    //readers already on this entry can still follow its next pointer
+    atomic_store_explicit(link,atomic_load(&entry->next),memory_order_release);
+
+    if (entry->clockNext == entry) {
+        clockHand = NULL;
+    } else {
+        entry->clockPrev->clockNext = entry->clockNext;
+        entry->clockNext->clockPrev = entry->clockPrev;
+        if (clockHand == entry) clockHand = entry->clockNext;
+    }
+    cacheBytes -= entry->size + entry->headerLen;
+}
+
+//unlink entries until needed more bytes fit, returns them chained through clockNext (called under cacheLock)
+static CacheEntry* EvictEntries (long long needed) {
+    CacheEntry* evicted = NULL;
+    while (clockHand != NULL && cacheBytes + needed > maxCacheBytes) {
+        CacheEntry* entry = clockHand;
+        if (atomic_exchange_explicit(&entry->referenced,FALSE,memory_order_relaxed)) {
+            //used since the hand last passed, give it another lap
+            clockHand = entry->clockNext;
+            continue;
+        }
+        UnlinkEntry(entry);
+        entry->clockNext = evicted;
+        evicted = entry;
+    }
+    return evicted;
+}
+
+//drop the table's reference to unlinked entries (after Synchronize)
+static void ReleaseEntries (CacheEntry* list) {
+    while (list != NULL) {
+        CacheEntry* next = list->clockNext;
+        ReleaseCacheEntry(list);
+        list = next;
+    }
+}
+
+static void* WatchDataDir (void* unused) {
+    //inotify events are variable length, the buffer must be aligned for them
+    char buffer[4096] __attribute__ ((aligned(__alignof__(struct inotify_event))));
+    while (1) {
+        ssize_t len = read(inotifyFd,buffer,sizeof(buffer));
+        if (len == ERROR) {
+            if (errno == EINTR) continue;
+            LogError("** inotify read error ** %s",strerror(errno));
+            break;
+        }
+
+        char* pos;
+        for (pos = buffer; pos < buffer + len; pos += sizeof(struct inotify_event) + ((struct inotify_event*)pos)->len) {
+            struct inotify_event* event = (struct inotify_event*)pos;
+            atomic_fetch_add(&changeGeneration,1);
+
+            if (event->mask & IN_Q_OVERFLOW) {
+                //events were lost, nothing in the cache can be trusted
+                CacheFlush();
+                continue;
+            }
+            if (event->mask & IN_IGNORED) {
+                RemoveWatch(event->wd);
+                continue;
+            }
+
+            char* dir = WatchPath(event->wd);
+            if (dir == NULL || event->len == 0) continue;
+            char path[PATH_SIZE+1];
+            snprintf(path,PATH_SIZE+1,"%s/%s",dir,event->name);
+
+            if (event->mask & IN_ISDIR) {
+                //a new directory needs watching, a removed one takes its files with it
+                if (event->mask & (IN_CREATE | IN_MOVED_TO)) {
+                    AddWatches(path);
+                    ForgetAllMisses();
+                }
+                if (event->mask & (IN_DELETE | IN_MOVED_FROM)) CacheFlush();
+            } else {
+                CacheInvalidate(path);
+                if (event->mask & (IN_CREATE | IN_MOVED_TO)) ForgetMiss(path);
+            }
+        }
+    }
+    return NULL;
+}
+
+//watch relPath (relative to the data directory) and every directory below it
+static void AddWatches (char* relPath) {
+    if (numWatches >= MAX_WATCHES) {
+        LogError("** too many directories to watch, %s will not be invalidated **",relPath);
+        return;
+    }
+    char fullPath[PATH_SIZE+1];
+    snprintf(fullPath,PATH_SIZE+1,"%s%s",dataRoot,relPath);
+    int wd = inotify_add_watch(inotifyFd,fullPath,IN_CLOSE_WRITE | IN_MODIFY | IN_ATTRIB | IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO);
+    if (wd == ERROR) {
+        LogError("** inotify watch error ** %s: %s",fullPath,strerror(errno));
+        return;
+    }
+    watchIDs[numWatches] = wd;
+    watchPaths[numWatches] = strdup(relPath);
+    numWatches++;
+
+    DIR* dir = opendir(fullPath);
+    if (dir == NULL) return;
+    struct dirent* item;
+    while ((item = readdir(dir)) != NULL) {
+        if (item->d_type != DT_DIR || strcmp(item->d_name,".") == STREQU || strcmp(item->d_name,"..") == STREQU) continue;
+        char subPath[PATH_SIZE+1];
+        snprintf(subPath,PATH_SIZE+1,"%s/%s",relPath,item->d_name);
+        AddWatches(subPath);
+    }
+    closedir(dir);
+}
+
+static char* WatchPath (int wd) {
+    int i;
+    for (i = 0; i < numWatches; i++) {
+        if (watchIDs[i] == wd) return watchPaths[i];
+    }
+    return NULL;
+}
+
+static void RemoveWatch (int wd) {
+    int i;
+    for (i = 0; i < numWatches; i++) {
+        if (watchIDs[i] == wd) {
+            free(watchPaths[i]);
+            numWatches--;
+            watchIDs[i] = watchIDs[numWatches];
+            watchPaths[i] = watchPaths[numWatches];
+            return;
+        }
+    }
+}
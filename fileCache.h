@@ -0,0 +1,56 @@
+/*
+    Custom Web Server - static content cache
+    By: Ricard Grace
+*/
+
+#ifndef FILECACHE_H
+#define FILECACHE_H
+
+#include "webServer.h"
+
+#include <stdatomic.h>
+#include <sys/inotify.h>
+
+#define CACHE_BUCKETS 4096
+#define CACHE_DEFAULT_SIZE 64
+#define CACHE_MAX_FILE 1048576
+#define MAX_WATCHES 1024
+
+//a file held in memory, shared read-only by every request that serves it
+typedef struct _cacheEntry {
+    char* path;
+    unsigned int hash;
+    char* data;
+    long long size;
+    time_t mtime;
+    char etag[ETAG_SIZE];
+
+    //entity headers, everything after the status line that does not depend on the request
+    char* header;
+    int headerLen;
+
+    //entries from the asset pack also have their body at packOffset in the archive (ERROR otherwise)
+    int packFd;
+    off_t packOffset;
+
+    //one reference for the table plus one per request using the entry
+    atomic_int refs;
+    //set on every hit, cleared by the eviction clock
+    atomic_int referenced;
+
+    struct _cacheEntry* _Atomic next;
+    //eviction clock ring (only touched under the cache lock)
+    struct _cacheEntry* clockPrev;
+    struct _cacheEntry* clockNext;
+} CacheEntry;
+
+int InitFileCache (char* dataDir, long long maxBytes);
+CacheEntry* CacheLookup (char* path);
+long CacheGeneration ();
+CacheEntry* CacheInsert (char* path, int fileFd, long generation);
+void CacheInvalidate (char* path);
+void CacheFlush ();
+void ReleaseCacheEntry (CacheEntry* entry);
+CacheEntry* CreateMemoryEntry (char* path, char* data, long long size, char* etag, time_t mtime, char* encoding);
+
+#endif
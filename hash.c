@@ -0,0 +1,33 @@
+/*
+    Custom Web Server - path hashing
+    By: Ricard Grace
+*/
+
+#include "hash.h"
+
+/*
+    Every table keyed by a path (the file cache, the miss cache, the compressed variants and the
+    asset pack's index) hashes it with FNV-1a, which is cheap for short strings and spreads paths
+    that differ in one character well. The asset pack needs 64 bits and a seed it can change
+    until its perfect hash is found.
+*/
+
+//32 bit FNV-1a
+unsigned int HashPath (char* path) {
+    unsigned int hash = 2166136261u;
+    while (*path != '\0') {
+        hash ^= (unsigned char)*path++;
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+//64 bit FNV-1a, started from the seed
+uint64_t HashPath64 (char* path, uint32_t seed) {
+    uint64_t hash = 14695981039346656037ULL ^ seed;
+    while (*path != '\0') {
+        hash ^= (unsigned char)*path++;
+        hash *= 1099511628211ULL;
+    }
+    return hash;
+}
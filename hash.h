@@ -0,0 +1,16 @@
+/*
+    Custom Web Server - path hashing
+    By: Ricard Grace
+*/
+
+#ifndef HASH_H
+#define HASH_H
+
+#include "webServer.h"
+
+#include <stdint.h>
+
+unsigned int HashPath (char* path);
+uint64_t HashPath64 (char* path, uint32_t seed);
+
+#endif
@@ -0,0 +1,367 @@
+/*
+    Custom Web Server - HPACK header compression
+    By: Ricard Grace
+*/
+
+#include "hpack.h"
+
+/*
+    HTTP/2 sends header fields compressed (RFC 7541): a field is either the index of one seen
+    before or a literal name and value, either of which may be Huffman coded.
+        - the first 61 indexes are the static table, fixed by the RFC, and are answered straight
+          from the array below without going near the dynamic table
+        - literals the client asks to be indexed go into a dynamic table of at most 4KB that lasts
+          as long as the connection, the oldest entries are dropped to make room
+        - Huffman strings are decoded a bit at a time against the canonical code, so only the
+          number of codes of each length and the symbols in code order are needed, not the codes
+    Responses are encoded without the dynamic table or Huffman coding: the common statuses are a
+    single byte and every other field a literal with a static name where there is one, so encoding
+    keeps no state and a response header costs about what it does in HTTP/1.1.
+*/
+
+#define STATIC_FIELD(name,value) {name, sizeof(name)-1, value, sizeof(value)-1}
+
+static const HpackEntry staticTable[HPACK_STATIC_ENTRIES] = {
+    STATIC_FIELD(":authority", ""),
+    STATIC_FIELD(":method", "GET"),
+    STATIC_FIELD(":method", "POST"),
+    STATIC_FIELD(":path", "/"),
+    STATIC_FIELD(":path", "/index.html"),
+    STATIC_FIELD(":scheme", "http"),
+    STATIC_FIELD(":scheme", "https"),
+    STATIC_FIELD(":status", "200"),
+    STATIC_FIELD(":status", "204"),
+    STATIC_FIELD(":status", "206"),
+    STATIC_FIELD(":status", "304"),
+    STATIC_FIELD(":status", "400"),
+    STATIC_FIELD(":status", "404"),
+    STATIC_FIELD(":status", "500"),
+    STATIC_FIELD("accept-charset", ""),
+    STATIC_FIELD("accept-encoding", "gzip, deflate"),
+    STATIC_FIELD("accept-language", ""),
+    STATIC_FIELD("accept-ranges", ""),
+    STATIC_FIELD("accept", ""),
+    STATIC_FIELD("access-control-allow-origin", ""),
+    STATIC_FIELD("age", ""),
+    STATIC_FIELD("allow", ""),
+    STATIC_FIELD("authorization", ""),
+    STATIC_FIELD("cache-control", ""),
+    STATIC_FIELD("content-disposition", ""),
+    STATIC_FIELD("content-encoding", ""),
+    STATIC_FIELD("content-language", ""),
+    STATIC_FIELD("content-length", ""),
+    STATIC_FIELD("content-location", ""),
+    STATIC_FIELD("content-range", ""),
+    STATIC_FIELD("content-type", ""),
+    STATIC_FIELD("cookie", ""),
+    STATIC_FIELD("date", ""),
+    STATIC_FIELD("etag", ""),
+    STATIC_FIELD("expect", ""),
+    STATIC_FIELD("expires", ""),
+    STATIC_FIELD("from", ""),
+    STATIC_FIELD("host", ""),
+    STATIC_FIELD("if-match", ""),
+    STATIC_FIELD("if-modified-since", ""),
+    STATIC_FIELD("if-none-match", ""),
+    STATIC_FIELD("if-range", ""),
+    STATIC_FIELD("if-unmodified-since", ""),
+    STATIC_FIELD("last-modified", ""),
+    STATIC_FIELD("link", ""),
+    STATIC_FIELD("location", ""),
+    STATIC_FIELD("max-forwards", ""),
+    STATIC_FIELD("proxy-authenticate", ""),
+    STATIC_FIELD("proxy-authorization", ""),
+    STATIC_FIELD("range", ""),
+    STATIC_FIELD("referer", ""),
+    STATIC_FIELD("refresh", ""),
+    STATIC_FIELD("retry-after", ""),
+    STATIC_FIELD("server", ""),
+    STATIC_FIELD("set-cookie", ""),
+    STATIC_FIELD("strict-transport-security", ""),
+    STATIC_FIELD("transfer-encoding", ""),
+    STATIC_FIELD("user-agent", ""),
+    STATIC_FIELD("vary", ""),
+    STATIC_FIELD("via", ""),
+    STATIC_FIELD("www-authenticate", ""),
+};
+//the first static entry that is not a pseudo-header, and the first :status
+#define FIRST_STATIC_HEADER 15
+#define STATIC_STATUS 8
+
+//the Huffman code of RFC 7541 Appendix B is canonical: the codes of each length follow on from the
+//shorter ones, in symbol order, so the number of each length and the symbols in that order define it
+static const unsigned char huffmanCounts[HUFFMAN_MAX_BITS+1] = {
+    0, 0, 0, 0, 0, 10, 26, 32, 6, 0, 5, 3, 2, 6, 2, 3, 0, 0, 0, 3, 8, 13, 26, 29, 12, 4, 15, 19, 29, 0, 4
+};
+static const unsigned short huffmanSymbols[HUFFMAN_EOS+1] = {
+    48, 49, 50, 97, 99, 101, 105, 111, 115, 116, 32, 37, 45, 46, 47, 51,
+    52, 53, 54, 55, 56, 57, 61, 65, 95, 98, 100, 102, 103, 104, 108, 109,
+    110, 112, 114, 117, 58, 66, 67, 68, 69, 70, 71, 72, 73, 74, 75, 76,
+    77, 78, 79, 80, 81, 82, 83, 84, 85, 86, 87, 89, 106, 107, 113, 118,
+    119, 120, 121, 122, 38, 42, 44, 59, 88, 90, 33, 34, 40, 41, 63, 39,
+    43, 124, 35, 62, 0, 36, 64, 91, 93, 126, 94, 125, 60, 96, 123, 92,
+    195, 208, 128, 130, 131, 162, 184, 194, 224, 226, 153, 161, 167, 172, 176, 177,
+    179, 209, 216, 217, 227, 229, 230, 129, 132, 133, 134, 136, 146, 154, 156, 160,
+    163, 164, 169, 170, 173, 178, 181, 185, 186, 187, 189, 190, 196, 198, 228, 232,
+    233, 1, 135, 137, 138, 139, 140, 141, 143, 147, 149, 150, 151, 152, 155, 157,
+    158, 165, 166, 168, 174, 175, 180, 182, 183, 188, 191, 197, 231, 239, 9, 142,
+    144, 145, 148, 159, 171, 206, 215, 225, 236, 237, 199, 207, 234, 235, 192, 193,
+    200, 201, 202, 205, 210, 213, 218, 219, 238, 240, 242, 243, 255, 203, 204, 211,
+    212, 214, 221, 222, 223, 241, 244, 245, 246, 247, 248, 250, 251, 252, 253, 254,
+    2, 3, 4, 5, 6, 7, 8, 11, 12, 14, 15, 16, 17, 18, 19, 20,
+    21, 23, 24, 25, 26, 27, 28, 29, 30, 31, 127, 220, 249, 10, 13, 22,
+    256
+};
+
+static int DecodeInteger (unsigned char* block, int len, int* pos, int prefixBits, int* value);
+static int DecodeString (unsigned char* block, int len, int* pos, char* buffer, char** text, int* textLen);
+static int DecodeHuffman (unsigned char* data, int len, char* buffer);
+static int LookupField (HpackTable* table, int index, char** name, int* nameLen, char** value, int* valueLen);
+static int AddEntry (HpackTable* table, char* name, int nameLen, char* value, int valueLen);
+static void EvictEntries (HpackTable* table, int limit);
+static int EncodeInteger (unsigned char* out, int size, int prefixBits, int flags, int value);
+static int EncodeString (unsigned char* out, int size, char* text, int textLen);
+static int StaticNameIndex (char* name, int nameLen);
+
+void InitHpackTable (HpackTable* table) {
+    table->newest = HPACK_MAX_ENTRIES - 1;
+    table->count = 0;
+    table->size = 0;
+    table->maxSize = HPACK_TABLE_SIZE;
+}
+
+void ReleaseHpackTable (HpackTable* table) {
+    EvictEntries(table, 0);
+}
+
+//decode a whole header block, handing every field to field in order
+//returns ERROR if the block cannot be decoded, which leaves the table unusable (the connection has to go)
+int HpackDecode (HpackTable* table, unsigned char* block, int len, HpackField field, void* context) {
+    int pos = 0;
+    int numFields = 0;
+    while (pos < len) {
+        unsigned char first = block[pos];
+        int index;
+        char* name;
+        int nameLen;
+        char* value;
+        int valueLen;
+        if (first & 0x80) {
+            //a whole field from one of the tables
+            if (DecodeInteger(block, len, &pos, 7, &index) == ERROR) return ERROR;
+            if (LookupField(table, index, &name, &nameLen, &value, &valueLen) == ERROR) return ERROR;
+            if (field(context, name, nameLen, value, valueLen) == ERROR) return ERROR;
+        } else if ((first & 0xe0) == 0x20) {
+            //a new dynamic table size, only allowed ahead of the fields
+            if (numFields > 0 || DecodeInteger(block, len, &pos, 5, &index) == ERROR || index > HPACK_TABLE_SIZE) return ERROR;
+            table->maxSize = index;
+            EvictEntries(table, index);
+            continue;
+        } else {
+            //a literal value, added to the dynamic table (01) or not (0000, and 0001 never indexed)
+            int indexed = (first & 0xc0) == 0x40;
+            if (DecodeInteger(block, len, &pos, indexed ? 6 : 4, &index) == ERROR) return ERROR;
+            if (index == 0) {
+                if (DecodeString(block, len, &pos, table->nameBuffer, &name, &nameLen) == ERROR) return ERROR;
+            } else if (LookupField(table, index, &name, &nameLen, &value, &valueLen) == ERROR) {
+                return ERROR;
+            }
+            if (DecodeString(block, len, &pos, table->valueBuffer, &value, &valueLen) == ERROR) return ERROR;
+            //handed on first, adding the entry may drop the one its name came from
+            if (field(context, name, nameLen, value, valueLen) == ERROR) return ERROR;
+            if (indexed && AddEntry(table, name, nameLen, value, valueLen) == ERROR) return ERROR;
+        }
+        numFields++;
+    }
+    return NOERR;
+}
+
+//write :status, returns the bytes written or ERROR if there is not room
+int HpackEncodeStatus (unsigned char* out, int size, int status) {
+    //the static table has the common ones whole
+    int i;
+    for (i = STATIC_STATUS; i < FIRST_STATIC_HEADER; i++) {
+        if (atoi(staticTable[i-1].value) == status) return EncodeInteger(out, size, 7, 0x80, i);
+    }
+    char code[4];
+    snprintf(code,sizeof(code),"%03d",status);
+    int len = EncodeInteger(out, size, 4, 0x00, STATIC_STATUS);
+    int valueLen = len == ERROR ? ERROR : EncodeString(&out[len], size-len, code, 3);
+    return valueLen == ERROR ? ERROR : len + valueLen;
+}
+
+//write a field (with a lower case name) as a literal that is not indexed, the name from the static table
+//if it is there, returns the bytes written or ERROR if there is not room
+int HpackEncodeField (unsigned char* out, int size, char* name, int nameLen, char* value, int valueLen) {
+    int index = StaticNameIndex(name, nameLen);
+    int len = EncodeInteger(out, size, 4, 0x00, index == ERROR ? 0 : index);
+    if (len != ERROR && index == ERROR) {
+        int written = EncodeString(&out[len], size-len, name, nameLen);
+        len = written == ERROR ? ERROR : len + written;
+    }
+    if (len == ERROR) return ERROR;
+    int written = EncodeString(&out[len], size-len, value, valueLen);
+    return written == ERROR ? ERROR : len + written;
+}
+
+//an integer in the low prefixBits of the first byte, continued 7 bits a byte when it does not fit
+static int DecodeInteger (unsigned char* block, int len, int* pos, int prefixBits, int* value) {
+    if (*pos >= len) return ERROR;
+    int max = (1 << prefixBits) - 1;
+    *value = block[(*pos)++] & max;
+    if (*value < max) return NOERR;
+    int shift = 0;
+    while (*pos < len) {
+        unsigned char next = block[(*pos)++];
+        //nothing the server takes comes near 28 bits, and more could overflow
+        if (shift > 21) return ERROR;
+        *value += (next & 0x7f) << shift;
+        shift += 7;
+        if (!(next & 0x80)) return NOERR;
+    }
+    return ERROR;
+}
+
+//a length prefixed string, text is left pointing into the block unless it was Huffman coded
+static int DecodeString (unsigned char* block, int len, int* pos, char* buffer, char** text, int* textLen) {
+    if (*pos >= len) return ERROR;
+    int huffman = block[*pos] & 0x80;
+    int stringLen;
+    if (DecodeInteger(block, len, pos, 7, &stringLen) == ERROR || stringLen > len - *pos) return ERROR;
+    unsigned char* data = &block[*pos];
+    *pos += stringLen;
+    if (!huffman) {
+        *text = (char*)data;
+        *textLen = stringLen;
+        return NOERR;
+    }
+    *text = buffer;
+    *textLen = DecodeHuffman(data, stringLen, buffer);
+    return *textLen == ERROR ? ERROR : NOERR;
+}
+
+//decode len bytes of Huffman code into buffer, returns the length decoded or ERROR
+static int DecodeHuffman (unsigned char* data, int len, char* buffer) {
+    int decoded = 0;
+    //the code read so far, its length, the first code of that length and where its symbols start
+    int code = 0;
+    int bits = 0;
+    int first = 0;
+    int index = 0;
+    int i;
+    for (i = 0; i < len; i++) {
+        int bit;
+        for (bit = 7; bit >= 0; bit--) {
+            code = (code << 1) | ((data[i] >> bit) & 1);
+            bits++;
+            int count = huffmanCounts[bits];
+            if (code - first < count) {
+                int symbol = huffmanSymbols[index + code - first];
+                if (symbol == HUFFMAN_EOS || decoded == HPACK_STRING_SIZE) return ERROR;
+                buffer[decoded++] = symbol;
+                code = 0;
+                bits = 0;
+                first = 0;
+                index = 0;
+            } else if (bits == HUFFMAN_MAX_BITS) {
+                return ERROR;
+            } else {
+                index += count;
+                first = (first + count) << 1;
+            }
+        }
+    }
+    //the end is padded with the start of EOS (all ones), never a whole byte of it
+    if (bits > 7 || code != (1 << bits) - 1) return ERROR;
+    return decoded;
+}
+
+//the field at index, static entries first and then the dynamic ones newest first
+static int LookupField (HpackTable* table, int index, char** name, int* nameLen, char** value, int* valueLen) {
+    const HpackEntry* entry;
+    if (index >= 1 && index <= HPACK_STATIC_ENTRIES) {
+        entry = &staticTable[index-1];
+    } else if (index > HPACK_STATIC_ENTRIES && index - HPACK_STATIC_ENTRIES <= table->count) {
+        entry = &table->entries[(table->newest - (index - HPACK_STATIC_ENTRIES - 1) + HPACK_MAX_ENTRIES) % HPACK_MAX_ENTRIES];
+    } else {
+        return ERROR;
+    }
+    *name = entry->name;
+    *nameLen = entry->nameLen;
+    *value = entry->value;
+    *valueLen = entry->valueLen;
+    return NOERR;
+}
+
+//add a field to the dynamic table, dropping the oldest until it fits
+static int AddEntry (HpackTable* table, char* name, int nameLen, char* value, int valueLen) {
+    int entrySize = nameLen + valueLen + HPACK_ENTRY_OVERHEAD;
+    if (entrySize > table->maxSize) {
+        //too big for the table, which is emptied instead
+        EvictEntries(table, 0);
+        return NOERR;
+    }
+    //copied before anything is dropped, the name may be that of an entry about to go
+    char* copy = malloc(nameLen + valueLen);
+    if (copy == NULL) return ERROR;
+    memcpy(copy,name,nameLen);
+    memcpy(&copy[nameLen],value,valueLen);
+    EvictEntries(table, table->maxSize - entrySize);
+
+    table->newest = (table->newest + 1) % HPACK_MAX_ENTRIES;
+    HpackEntry* entry = &table->entries[table->newest];
+    entry->name = copy;
+    entry->nameLen = nameLen;
+    entry->value = &copy[nameLen];
+    entry->valueLen = valueLen;
+    table->count++;
+    table->size += entrySize;
+    return NOERR;
+}
+
+//drop the oldest entries until the table is no bigger than limit
+static void EvictEntries (HpackTable* table, int limit) {
+    while (table->size > limit && table->count > 0) {
+        HpackEntry* oldest = &table->entries[(table->newest - table->count + 1 + HPACK_MAX_ENTRIES) % HPACK_MAX_ENTRIES];
+        table->size -= oldest->nameLen + oldest->valueLen + HPACK_ENTRY_OVERHEAD;
+        table->count--;
+        free(oldest->name);
+        oldest->name = NULL;
+    }
+}
+
+static int EncodeInteger (unsigned char* out, int size, int prefixBits, int flags, int value) {
+    int max = (1 << prefixBits) - 1;
+    int len = 0;
+    if (size < 1) return ERROR;
+    if (value < max) {
+        out[len++] = flags | value;
+        return len;
+    }
+    out[len++] = flags | max;
+    value -= max;
+    while (value >= 0x80) {
+        if (len == size) return ERROR;
+        out[len++] = (value & 0x7f) | 0x80;
+        value >>= 7;
+    }
+    if (len == size) return ERROR;
+    out[len++] = value;
+    return len;
+}
+
+//a string as it is, without Huffman coding
+static int EncodeString (unsigned char* out, int size, char* text, int textLen) {
+    int len = EncodeInteger(out, size, 7, 0x00, textLen);
+    if (len == ERROR || textLen > size - len) return ERROR;
+    memcpy(&out[len],text,textLen);
+    return len + textLen;
+}
+
+static int StaticNameIndex (char* name, int nameLen) {
+    int i;
+    for (i = FIRST_STATIC_HEADER; i <= HPACK_STATIC_ENTRIES; i++) {
+        if (staticTable[i-1].nameLen == nameLen && memcmp(staticTable[i-1].name,name,nameLen) == STREQU) return i;
+    }
+    return ERROR;
+}
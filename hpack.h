@@ -0,0 +1,56 @@
+/*
+    Custom Web Server - HPACK header compression
+    By: Ricard Grace
+*/
+
+#ifndef HPACK_H
+#define HPACK_H
+
+#include "webServer.h"
+
+//entries every header block can refer to without adding them
+#define HPACK_STATIC_ENTRIES 61
+//size of the dynamic table clients may use (the HTTP/2 default, which is never changed)
+#define HPACK_TABLE_SIZE 4096
+//each entry counts 32 bytes on top of its name and value, so this many fit at most
+#define HPACK_ENTRY_OVERHEAD 32
+#define HPACK_MAX_ENTRIES (HPACK_TABLE_SIZE / HPACK_ENTRY_OVERHEAD)
+//longest name or value decoded
+#define HPACK_STRING_SIZE BUFF_SIZE
+
+//longest Huffman code, in bits
+#define HUFFMAN_MAX_BITS 30
+#define HUFFMAN_EOS 256
+
+//one field of the dynamic table, its name and value share an allocation
+typedef struct _hpackEntry {
+    char* name;
+    int nameLen;
+    char* value;
+    int valueLen;
+} HpackEntry;
+
+//the decoder's dynamic table, newest entry first
+typedef struct _hpackTable {
+    HpackEntry entries[HPACK_MAX_ENTRIES];
+    int newest;
+    int count;
+    int size;
+    //lowered (up to HPACK_TABLE_SIZE) by the encoder with size updates
+    int maxSize;
+    //decoded Huffman strings
+    char nameBuffer[HPACK_STRING_SIZE];
+    char valueBuffer[HPACK_STRING_SIZE];
+} HpackTable;
+
+//called with every field of a header block in order, the strings only last for the call
+//returns ERROR to stop decoding
+typedef int (*HpackField) (void* context, char* name, int nameLen, char* value, int valueLen);
+
+void InitHpackTable (HpackTable* table);
+void ReleaseHpackTable (HpackTable* table);
+int HpackDecode (HpackTable* table, unsigned char* block, int len, HpackField field, void* context);
+int HpackEncodeStatus (unsigned char* out, int size, int status);
+int HpackEncodeField (unsigned char* out, int size, char* name, int nameLen, char* value, int valueLen);
+
+#endif
@@ -0,0 +1,872 @@
+/*
+    Custom Web Server - HTTP/2 over cleartext (h2c)
+    By: Ricard Grace
+*/
+
+#include "http2.h"
+#include "logger.h"
+#include "metrics.h"
+#include "admission.h"
+#include "fileCache.h"
+#include "range.h"
+
+#include <ctype.h>
+
+/*
+    HTTP/1.1 answers the requests on a connection one after another, so the assets of a page either
+    queue up behind each other or need connections of their own. HTTP/2 (RFC 9113) carries them all
+    on one connection as streams whose frames are interleaved. A client starts it with the preface
+    (prior knowledge) or asks for Upgrade: h2c on an HTTP/1.1 request, which becomes stream 1, and
+    the connection's thread then serves every stream on it:
+        - frames are read whole into one buffer, header blocks are put together from HEADERS and
+          CONTINUATION frames and decoded with HPACK
+        - each request is written out as HTTP/1.1 and goes through the same parser and
+          ProcessRequest as any other, so the cache, ranges, conditionals and compression all
+          apply, and the HTTP/1.1 response header that comes back is HPACK encoded
+        - response bodies go out as DATA frames, one frame from each stream in turn so a large
+          file does not hold up the small ones, sent straight from the cache or the file
+        - DATA only goes out while the stream's and the connection's windows allow, and the
+          client's windows are opened again half a window at a time as its bodies are spooled
+        - request bodies go to the same sink as HTTP/1.1 ones, a body without a length is fed to
+          the reader as chunks so the limit still holds
+    A stream that breaks the rules is reset on its own, anything that puts the connection itself
+    in doubt (a bad frame, a header block that cannot be decoded) ends it with GOAWAY. Streams live
+    in a fixed table of slots that are used again once they close, so however many requests come
+    over the connection they share one set of buffers.
+    Handlers return H2_NO_ERROR to carry on, the error code to end the connection with, or ERROR
+    once the socket has failed.
+*/
+
+//largest frame other than DATA the server sends (a response HEADERS frame)
+#define H2_CONTROL_SIZE (HEADER_SIZE * 2)
+
+static void InitH2Connection (H2Connection* conn, int connID, char* client, Watch* watch);
+static int SendSettings (H2Connection* conn);
+static int UpgradeStream (H2Connection* conn, char* request, int requestLen, HttpParser* parser);
+static int ReceiveFrames (H2Connection* conn, int flags);
+static int HandleFrames (H2Connection* conn);
+static int HandleFrame (H2Connection* conn, int type, int flags, int streamId, unsigned char* payload, int len);
+static int HandleHeaders (H2Connection* conn, int flags, int streamId, unsigned char* payload, int len);
+static int AddToBlock (H2Connection* conn, int flags, unsigned char* fragment, int len);
+static int FinishHeaderBlock (H2Connection* conn);
+static int HandleData (H2Connection* conn, int flags, int streamId, unsigned char* payload, int len);
+static int HandleSettings (H2Connection* conn, int flags, int streamId, unsigned char* payload, int len);
+static int ApplySettings (H2Connection* conn, unsigned char* payload, int len);
+static int HandleWindowUpdate (H2Connection* conn, int streamId, unsigned char* payload, int len);
+static int RequestField (void* context, char* name, int nameLen, char* value, int valueLen);
+static int IgnoreField (void* context, char* name, int nameLen, char* value, int valueLen);
+static int BuildRequest (H2Connection* conn, H2Stream* stream);
+static int StartStream (H2Connection* conn, H2Stream* stream);
+static int FeedStreamBody (H2Stream* stream, char* data, int len);
+static int EndRequestBody (H2Connection* conn, H2Stream* stream);
+static int Respond (H2Connection* conn, H2Stream* stream);
+static int SendResponseHeader (H2Connection* conn, H2Stream* stream, char* header, int headerLen, int flags);
+static int SendReadyData (H2Connection* conn);
+static int SendData (H2Connection* conn, H2Stream* stream);
+static H2Stream* NewStream (H2Connection* conn, int streamId);
+static H2Stream* FindStream (H2Connection* conn, int streamId);
+static int CloseStream (H2Connection* conn, H2Stream* stream, int reset);
+static void SetTimeout (H2Connection* conn);
+static int SendFrame (H2Connection* conn, int type, int flags, int streamId, unsigned char* payload, int len);
+static int SendAll (H2Connection* conn, void* data, int len, int flags);
+static int SendRstStream (H2Connection* conn, int streamId, int error);
+static int SendWindowUpdate (H2Connection* conn, int streamId, int increment);
+static void WriteFrameHeader (unsigned char* out, int len, int type, int flags, int streamId);
+static void WriteUint32 (unsigned char* out, unsigned int value);
+static unsigned int ReadUint32 (unsigned char* data);
+static int IsConnectionHeader (char* name, int nameLen);
+static int HasToken (char* list, char* token);
+static int DecodeBase64Url (char* text, unsigned char* out, int size);
+
+//headers that only mean something to one HTTP/1 connection, HTTP/2 has none of them
+static char* connectionHeaders[] = {"connection", "keep-alive", "proxy-connection", "transfer-encoding", "upgrade", NULL};
+
+//the request is the preface, which reads as an HTTP/1 request for "*" without headers
+int IsHttp2Preface (char* request, int requestLen) {
+    return requestLen == H2_PREFACE_REQUEST_LEN && memcmp(request,H2_PREFACE,H2_PREFACE_REQUEST_LEN) == STREQU;
+}
+
+//the request asks to carry on in HTTP/2, which is only done for requests without a body
+int WantsHttp2Upgrade (HttpParser* parser, char* request) {
+    char upgrade[VALUE_SIZE];
+    char connection[VALUE_SIZE];
+    if (parser->malformed || parser->version != 11 || RequestHasBody(parser)) return FALSE;
+    if (CopyNamedHeader(parser, request, "Upgrade", upgrade, VALUE_SIZE) == ERROR || !HasToken(upgrade, "h2c")) return FALSE;
+    if (CopyNamedHeader(parser, request, "HTTP2-Settings", upgrade, VALUE_SIZE) == ERROR) return FALSE;
+    //both have to be connection options, so they were not passed on by a proxy
+    return CopyHeader(parser, request, HDR_CONNECTION, connection, VALUE_SIZE) != ERROR && HasToken(connection, "upgrade") && HasToken(connection, "http2-settings");
+}
+
+//serve the connection in HTTP/2 until either side ends it
+//received holds what has been read so far: the start of the preface, or the request asking to upgrade (which
+//upgrade is the parser of), and anything that followed it
+void ServeHttp2 (int connID, char* client, Watch* watch, char* received, int requestLen, int receivedLen, HttpParser* upgrade) {
+    H2Connection* conn = malloc(sizeof(H2Connection));
+    if (conn == NULL) {
+        LogError("** out of memory **");
+        return;
+    }
+    InitH2Connection(conn, connID, client, watch);
+    LogDebug("=== HTTP/2 CONNECTION ===");
+
+    //after an upgrade the client sends the whole preface, otherwise what followed its first line
+    conn->preface = upgrade != NULL ? H2_PREFACE : &H2_PREFACE[H2_PREFACE_REQUEST_LEN];
+    conn->prefaceLen = upgrade != NULL ? H2_PREFACE_LEN : H2_PREFACE_LEN - H2_PREFACE_REQUEST_LEN;
+    conn->recvLen = receivedLen - requestLen;
+    memcpy(conn->recvBuffer,&received[requestLen],conn->recvLen);
+
+    int result = NOERR;
+    if (upgrade != NULL) result = SendAll(conn, H2_UPGRADE_RESPONSE, strlen(H2_UPGRADE_RESPONSE), 0);
+    if (result == NOERR) result = SendSettings(conn);
+    if (result == NOERR && upgrade != NULL) result = UpgradeStream(conn, received, requestLen, upgrade);
+    if (result == NOERR) result = HandleFrames(conn);
+    while (result == NOERR && !(conn->goingAway && conn->openStreams == 0)) {
+        //a frame from every stream that has one ready, then whatever the client has sent meanwhile
+        //the socket is only waited on once nothing more can be sent
+        int sending = SendReadyData(conn);
+        if (sending == ERROR) break;
+        result = ReceiveFrames(conn, sending ? MSG_DONTWAIT : 0);
+    }
+    if (result > H2_NO_ERROR) {
+        LogDebug("HTTP/2 connection error %d",result);
+        unsigned char payload[8];
+        WriteUint32(payload, conn->lastStreamId);
+        WriteUint32(&payload[4], result);
+        //the frames that broke the rules may still be arriving, closing on them would lose the GOAWAY
+        if (SendFrame(conn, H2_GOAWAY, 0, 0, payload, sizeof(payload)) != ERROR) DiscardUnread(connID);
+    }
+
+    int i;
+    for (i = 0; i < H2_MAX_STREAMS; i++) {
+        if (conn->streams[i].state != STREAM_IDLE) CloseStream(conn, &conn->streams[i], ERROR);
+        ReleaseArena(&conn->streams[i].arena);
+    }
+    ReleaseHpackTable(&conn->decoder);
+    free(conn);
+}
+
+static void InitH2Connection (H2Connection* conn, int connID, char* client, Watch* watch) {
+    conn->connID = connID;
+    conn->client = client;
+    conn->watch = watch;
+    conn->timeout = ERROR;
+    conn->streamsDone = 0;
+    conn->settingsReceived = FALSE;
+    conn->recvLen = 0;
+    conn->blockLen = 0;
+    conn->blockStream = 0;
+    conn->blockFlags = 0;
+    conn->blockNew = FALSE;
+    InitHpackTable(&conn->decoder);
+    int i;
+    for (i = 0; i < H2_MAX_STREAMS; i++) {
+        conn->streams[i].state = STREAM_IDLE;
+        InitArena(&conn->streams[i].arena, NULL);
+    }
+    conn->openStreams = 0;
+    conn->lastStreamId = 0;
+    conn->nextStream = 0;
+    conn->sendWindow = H2_DEFAULT_WINDOW;
+    conn->recvUnacked = 0;
+    conn->initialWindow = H2_DEFAULT_WINDOW;
+    conn->goingAway = FALSE;
+}
+
+//the server's half of the preface
+static int SendSettings (H2Connection* conn) {
+    unsigned char payload[2 * H2_SETTING_SIZE];
+    payload[0] = 0;
+    payload[1] = H2_SETTINGS_MAX_CONCURRENT_STREAMS;
+    WriteUint32(&payload[2], H2_MAX_STREAMS);
+    payload[6] = 0;
+    payload[7] = H2_SETTINGS_INITIAL_WINDOW_SIZE;
+    WriteUint32(&payload[8], H2_WINDOW);
+    if (SendFrame(conn, H2_SETTINGS, 0, 0, payload, sizeof(payload)) == ERROR) return ERROR;
+    //the connection's own window can only be opened with an update
+    return SendWindowUpdate(conn, 0, H2_WINDOW - H2_DEFAULT_WINDOW);
+}
+
+//the request that asked for the upgrade is answered as stream 1, its client has nothing more to send on it
+static int UpgradeStream (H2Connection* conn, char* request, int requestLen, HttpParser* parser) {
+    char settings[VALUE_SIZE];
+    unsigned char payload[VALUE_SIZE];
+    if (CopyNamedHeader(parser, request, "HTTP2-Settings", settings, VALUE_SIZE) != ERROR) {
+        int len = DecodeBase64Url(settings, payload, VALUE_SIZE);
+        if (len == ERROR || len % H2_SETTING_SIZE != 0) return H2_PROTOCOL_ERROR;
+        int result = ApplySettings(conn, payload, len);
+        if (result != NOERR) return result;
+    }
+    H2Stream* stream = NewStream(conn, 1);
+    conn->lastStreamId = 1;
+    stream->remoteClosed = TRUE;
+    stream->request = ArenaAlloc(&stream->arena, requestLen + 1);
+    if (stream->request == NULL) return CloseStream(conn, stream, H2_INTERNAL_ERROR);
+    memcpy(stream->request,request,requestLen);
+    stream->request[requestLen] = '\0';
+    stream->parser = *parser;
+    return StartStream(conn, stream);
+}
+
+//receive what the client has sent and handle every frame that is complete
+static int ReceiveFrames (H2Connection* conn, int flags) {
+    if (!(flags & MSG_DONTWAIT)) SetTimeout(conn);
+    int recvOut = recv(conn->connID,&conn->recvBuffer[conn->recvLen],sizeof(conn->recvBuffer)-conn->recvLen,flags);
+    if (recvOut == ERROR) {
+        if (errno == EAGAIN || errno == EWOULDBLOCK) return (flags & MSG_DONTWAIT) ? NOERR : ERROR;
+        if (errno == EINTR) return NOERR;
+        LogError("** recv error ** %s",strerror(errno));
+        return ERROR;
+    } else if (recvOut == 0) {
+        //the client has terminated the connection
+        LogDebug("Connection Terminated");
+        return ERROR;
+    }
+    conn->recvLen += recvOut;
+    return HandleFrames(conn);
+}
+
+static int HandleFrames (H2Connection* conn) {
+    int pos = 0;
+    int result = NOERR;
+    if (conn->prefaceLen > 0) {
+        int count = conn->recvLen < conn->prefaceLen ? conn->recvLen : conn->prefaceLen;
+        if (memcmp(conn->recvBuffer,conn->preface,count) != STREQU) return H2_PROTOCOL_ERROR;
+        conn->preface += count;
+        conn->prefaceLen -= count;
+        pos = count;
+    }
+    while (result == NOERR && conn->prefaceLen == 0 && conn->recvLen - pos >= H2_FRAME_HEADER) {
+        unsigned char* header = &conn->recvBuffer[pos];
+        int len = (header[0] << 16) | (header[1] << 8) | header[2];
+        if (len > H2_MAX_FRAME) return H2_FRAME_SIZE_ERROR;
+        if (conn->recvLen - pos < H2_FRAME_HEADER + len) break;
+        result = HandleFrame(conn, header[3], header[4], ReadUint32(&header[5]) & 0x7fffffff, &header[H2_FRAME_HEADER], len);
+        pos += H2_FRAME_HEADER + len;
+    }
+    //keep the start of the next frame
+    memmove(conn->recvBuffer,&conn->recvBuffer[pos],conn->recvLen-pos);
+    conn->recvLen -= pos;
+    return result;
+}
+
+static int HandleFrame (H2Connection* conn, int type, int flags, int streamId, unsigned char* payload, int len) {
+    //a header block has to be finished before anything else, and the client's preface ends with its settings
+    if (conn->blockStream != 0 && (type != H2_CONTINUATION || streamId != conn->blockStream)) return H2_PROTOCOL_ERROR;
+    if (!conn->settingsReceived && type != H2_SETTINGS) return H2_PROTOCOL_ERROR;
+    H2Stream* stream;
+    switch (type) {
+        case H2_DATA:
+            return HandleData(conn, flags, streamId, payload, len);
+        case H2_HEADERS:
+            return HandleHeaders(conn, flags, streamId, payload, len);
+        case H2_CONTINUATION:
+            if (conn->blockStream == 0) return H2_PROTOCOL_ERROR;
+            return AddToBlock(conn, flags, payload, len);
+        case H2_PRIORITY:
+            //priorities are not used, every stream gets its turn
+            if (streamId == 0) return H2_PROTOCOL_ERROR;
+            return len == 5 ? NOERR : H2_FRAME_SIZE_ERROR;
+        case H2_RST_STREAM:
+            if (streamId == 0 || streamId > conn->lastStreamId) return H2_PROTOCOL_ERROR;
+            if (len != 4) return H2_FRAME_SIZE_ERROR;
+            stream = FindStream(conn, streamId);
+            return stream == NULL ? NOERR : CloseStream(conn, stream, ERROR);
+        case H2_SETTINGS:
+            return HandleSettings(conn, flags, streamId, payload, len);
+        case H2_PUSH_PROMISE:
+            //only servers push
+            return H2_PROTOCOL_ERROR;
+        case H2_PING:
+            if (streamId != 0) return H2_PROTOCOL_ERROR;
+            if (len != 8) return H2_FRAME_SIZE_ERROR;
+            if (flags & H2_FLAG_ACK) return NOERR;
+            return SendFrame(conn, H2_PING, H2_FLAG_ACK, 0, payload, len);
+        case H2_GOAWAY:
+            //streams already open are still answered
+            if (streamId != 0) return H2_PROTOCOL_ERROR;
+            conn->goingAway = TRUE;
+            return NOERR;
+        case H2_WINDOW_UPDATE:
+            return HandleWindowUpdate(conn, streamId, payload, len);
+        default:
+            //frames of unknown types are ignored
+            return NOERR;
+    }
+}
+
+//a new request, or the trailers ending a request body
+static int HandleHeaders (H2Connection* conn, int flags, int streamId, unsigned char* payload, int len) {
+    if (streamId == 0 || streamId % 2 == 0) return H2_PROTOCOL_ERROR;
+    int pos = 0;
+    int padding = 0;
+    if (flags & H2_FLAG_PADDED) {
+        if (len < 1) return H2_FRAME_SIZE_ERROR;
+        padding = payload[pos++];
+    }
+    if (flags & H2_FLAG_PRIORITY) pos += 5;
+    if (pos + padding > len) return H2_PROTOCOL_ERROR;
+
+    conn->blockNew = streamId > conn->lastStreamId;
+    if (conn->blockNew) {
+        conn->lastStreamId = streamId;
+    } else {
+        //trailers have to end the stream, and a stream only carries one request
+        H2Stream* stream = FindStream(conn, streamId);
+        if (stream != NULL && (stream->remoteClosed || !(flags & H2_FLAG_END_STREAM))) return H2_PROTOCOL_ERROR;
+    }
+    conn->blockStream = streamId;
+    conn->blockFlags = flags;
+    conn->blockLen = 0;
+    return AddToBlock(conn, flags, &payload[pos], len - pos - padding);
+}
+
+static int AddToBlock (H2Connection* conn, int flags, unsigned char* fragment, int len) {
+    if (len > H2_HEADER_BLOCK_SIZE - conn->blockLen) return H2_ENHANCE_YOUR_CALM;
+    memcpy(&conn->headerBlock[conn->blockLen],fragment,len);
+    conn->blockLen += len;
+    if (!(flags & H2_FLAG_END_HEADERS)) return NOERR;
+    return FinishHeaderBlock(conn);
+}
+
+static int FinishHeaderBlock (H2Connection* conn) {
+    int streamId = conn->blockStream;
+    conn->blockStream = 0;
+    H2Stream* stream = conn->blockNew ? NewStream(conn, streamId) : FindStream(conn, streamId);
+    if (!conn->blockNew || stream == NULL) {
+        //trailers, or a stream refused or already closed: the block is still decoded to keep the table in step
+        if (HpackDecode(&conn->decoder, conn->headerBlock, conn->blockLen, IgnoreField, NULL) == ERROR) return H2_COMPRESSION_ERROR;
+        if (conn->blockNew) return SendRstStream(conn, streamId, H2_REFUSED_STREAM);
+        if (stream == NULL) return NOERR;
+        stream->remoteClosed = TRUE;
+        return EndRequestBody(conn, stream);
+    }
+
+    H2RequestText* text = &conn->text;
+    text->pseudoLen = 0;
+    //the lengths are reset too, BuildRequest sizes the request from them whether or not the field was sent
+    text->method.start = ERROR;
+    text->method.len = 0;
+    text->path.start = ERROR;
+    text->path.len = 0;
+    text->authority.start = ERROR;
+    text->authority.len = 0;
+    text->scheme.start = ERROR;
+    text->scheme.len = 0;
+    text->headersLen = 0;
+    text->hasContentLength = FALSE;
+    text->sawHeader = FALSE;
+    text->malformed = FALSE;
+    if (HpackDecode(&conn->decoder, conn->headerBlock, conn->blockLen, RequestField, text) == ERROR) return H2_COMPRESSION_ERROR;
+    stream->remoteClosed = (conn->blockFlags & H2_FLAG_END_STREAM) != 0;
+    if (BuildRequest(conn, stream) == ERROR) {
+        LogDebug("Malformed HTTP/2 request");
+        return CloseStream(conn, stream, H2_PROTOCOL_ERROR);
+    }
+    return StartStream(conn, stream);
+}
+
+static int HandleData (H2Connection* conn, int flags, int streamId, unsigned char* payload, int len) {
+    if (streamId == 0 || streamId > conn->lastStreamId) return H2_PROTOCOL_ERROR;
+    //the whole frame counts against the windows, padding and all
+    conn->recvUnacked += len;
+    if (conn->recvUnacked > H2_WINDOW) return H2_FLOW_CONTROL_ERROR;
+    if (conn->recvUnacked >= H2_WINDOW / 2) {
+        if (SendWindowUpdate(conn, 0, conn->recvUnacked) == ERROR) return ERROR;
+        conn->recvUnacked = 0;
+    }
+    H2Stream* stream = FindStream(conn, streamId);
+    //frames still on their way to a stream that has been closed are dropped
+    if (stream == NULL) return NOERR;
+    if (stream->remoteClosed) return CloseStream(conn, stream, H2_STREAM_CLOSED);
+
+    int pos = 0;
+    int padding = 0;
+    if (flags & H2_FLAG_PADDED) {
+        if (len < 1) return H2_FRAME_SIZE_ERROR;
+        padding = payload[pos++];
+    }
+    if (pos + padding > len) return H2_PROTOCOL_ERROR;
+    stream->recvUnacked += len;
+    if (stream->recvUnacked > H2_WINDOW) return CloseStream(conn, stream, H2_FLOW_CONTROL_ERROR);
+    if (flags & H2_FLAG_END_STREAM) {
+        stream->remoteClosed = TRUE;
+    } else if (stream->recvUnacked >= H2_WINDOW / 2) {
+        if (SendWindowUpdate(conn, streamId, stream->recvUnacked) == ERROR) return ERROR;
+        stream->recvUnacked = 0;
+    }
+
+    //once the response is under way, whatever is left of the body is dropped
+    if (stream->state != STREAM_RECEIVING) return NOERR;
+    int dataLen = len - pos - padding;
+    if (dataLen > 0) {
+        if (!stream->hasBody || FeedStreamBody(stream, (char*)&payload[pos], dataLen) == ERROR) return CloseStream(conn, stream, H2_PROTOCOL_ERROR);
+        //a body that was turned away is answered without waiting for the rest of it
+        if (stream->body.status != NULL) return Respond(conn, stream);
+    }
+    if (stream->remoteClosed) return EndRequestBody(conn, stream);
+    return NOERR;
+}
+
+static int HandleSettings (H2Connection* conn, int flags, int streamId, unsigned char* payload, int len) {
+    if (streamId != 0) return H2_PROTOCOL_ERROR;
+    if (flags & H2_FLAG_ACK) return len == 0 ? NOERR : H2_FRAME_SIZE_ERROR;
+    if (len % H2_SETTING_SIZE != 0) return H2_FRAME_SIZE_ERROR;
+    int result = ApplySettings(conn, payload, len);
+    if (result != NOERR) return result;
+    conn->settingsReceived = TRUE;
+    return SendFrame(conn, H2_SETTINGS, H2_FLAG_ACK, 0, NULL, 0);
+}
+
+//the settings that matter to the server: how much it may send on a stream before being given more
+//the client's header table size only matters to an encoder using the dynamic table, which the server's does not
+static int ApplySettings (H2Connection* conn, unsigned char* payload, int len) {
+    int pos;
+    for (pos = 0; pos + H2_SETTING_SIZE <= len; pos += H2_SETTING_SIZE) {
+        int id = (payload[pos] << 8) | payload[pos+1];
+        unsigned int value = ReadUint32(&payload[pos+2]);
+        if (id == H2_SETTINGS_ENABLE_PUSH && value > 1) return H2_PROTOCOL_ERROR;
+        if (id == H2_SETTINGS_MAX_FRAME_SIZE && (value < H2_MAX_FRAME || value > 16777215)) return H2_PROTOCOL_ERROR;
+        if (id == H2_SETTINGS_INITIAL_WINDOW_SIZE) {
+            if (value > H2_MAX_WINDOW) return H2_FLOW_CONTROL_ERROR;
+            //the windows of open streams move by the difference
+            int i;
+            for (i = 0; i < H2_MAX_STREAMS; i++) {
+                H2Stream* stream = &conn->streams[i];
+                if (stream->state == STREAM_IDLE) continue;
+                stream->sendWindow += (long long)value - conn->initialWindow;
+                if (stream->sendWindow > H2_MAX_WINDOW) return H2_FLOW_CONTROL_ERROR;
+            }
+            conn->initialWindow = value;
+        }
+    }
+    return NOERR;
+}
+
+static int HandleWindowUpdate (H2Connection* conn, int streamId, unsigned char* payload, int len) {
+    if (len != 4) return H2_FRAME_SIZE_ERROR;
+    int increment = ReadUint32(payload) & 0x7fffffff;
+    if (streamId == 0) {
+        if (increment == 0) return H2_PROTOCOL_ERROR;
+        conn->sendWindow += increment;
+        return conn->sendWindow > H2_MAX_WINDOW ? H2_FLOW_CONTROL_ERROR : NOERR;
+    }
+    if (streamId > conn->lastStreamId) return H2_PROTOCOL_ERROR;
+    H2Stream* stream = FindStream(conn, streamId);
+    //a stream that has just been closed may still be given more
+    if (stream == NULL) return NOERR;
+    if (increment == 0) return CloseStream(conn, stream, H2_PROTOCOL_ERROR);
+    stream->sendWindow += increment;
+    if (stream->sendWindow > H2_MAX_WINDOW) return CloseStream(conn, stream, H2_FLOW_CONTROL_ERROR);
+    return NOERR;
+}
+
+//take one decoded field of a request, anything that is not allowed marks it malformed
+//decoding always carries on, the table has to see every field whatever happens to the request
+static int RequestField (void* context, char* name, int nameLen, char* value, int valueLen) {
+    H2RequestText* text = context;
+    //nothing may end a line of the request early
+    if (nameLen == 0 || memchr(value,'\r',valueLen) != NULL || memchr(value,'\n',valueLen) != NULL || memchr(value,'\0',valueLen) != NULL) {
+        text->malformed = TRUE;
+        return NOERR;
+    }
+
+    if (name[0] == ':') {
+        HttpSpan* span = NULL;
+        if (nameLen == 7 && memcmp(name,":method",7) == STREQU) span = &text->method;
+        if (nameLen == 5 && memcmp(name,":path",5) == STREQU) span = &text->path;
+        if (nameLen == 10 && memcmp(name,":authority",10) == STREQU) span = &text->authority;
+        if (nameLen == 7 && memcmp(name,":scheme",7) == STREQU) span = &text->scheme;
+        //pseudo-headers come first, once each
+        if (span == NULL || span->start != ERROR || text->sawHeader || valueLen > BUFF_SIZE - text->pseudoLen) {
+            text->malformed = TRUE;
+            return NOERR;
+        }
+        span->start = text->pseudoLen;
+        span->len = valueLen;
+        memcpy(&text->pseudo[text->pseudoLen],value,valueLen);
+        text->pseudoLen += valueLen;
+        return NOERR;
+    }
+
+    text->sawHeader = TRUE;
+    int i;
+    for (i = 0; i < nameLen; i++) {
+        //names are sent as lower case tokens
+        char c = name[i];
+        if (!islower((unsigned char)c) && !isdigit((unsigned char)c) && (c == '\0' || strchr("!#$%&'*+-.^_`|~",c) == NULL)) {
+            text->malformed = TRUE;
+            return NOERR;
+        }
+    }
+    if (IsConnectionHeader(name, nameLen) || (nameLen == 2 && memcmp(name,"te",2) == STREQU && (valueLen != 8 || memcmp(value,"trailers",8) != STREQU))) {
+        text->malformed = TRUE;
+        return NOERR;
+    }
+    //:authority stands in for Host
+    if (nameLen == 4 && memcmp(name,"host",4) == STREQU && text->authority.start != ERROR) return NOERR;
+    if (nameLen == 14 && memcmp(name,"content-length",14) == STREQU) text->hasContentLength = TRUE;
+
+    if (nameLen + valueLen + 4 > BUFF_SIZE - text->headersLen) {
+        text->malformed = TRUE;
+        return NOERR;
+    }
+    char* line = &text->headers[text->headersLen];
+    memcpy(line,name,nameLen);
+    memcpy(&line[nameLen],": ",2);
+    memcpy(&line[nameLen+2],value,valueLen);
+    memcpy(&line[nameLen+2+valueLen],"\r\n",2);
+    text->headersLen += nameLen + valueLen + 4;
+    return NOERR;
+}
+
+static int IgnoreField (void* context, char* name, int nameLen, char* value, int valueLen) {
+    return NOERR;
+}
+
+//write the decoded request out as HTTP/1.1 into the stream's arena and parse it
+static int BuildRequest (H2Connection* conn, H2Stream* stream) {
+    H2RequestText* text = &conn->text;
+    if (text->malformed || text->method.start == ERROR || text->path.start == ERROR || text->scheme.start == ERROR) return ERROR;
+    char* method = &text->pseudo[text->method.start];
+    char* path = &text->pseudo[text->path.start];
+    //the request line is split on spaces
+    if (text->method.len == 0 || text->path.len == 0 || memchr(method,' ',text->method.len) != NULL || memchr(path,' ',text->path.len) != NULL) return ERROR;
+
+    //a body of unknown length is fed to the reader as chunks, one per DATA frame
+    stream->chunked = !stream->remoteClosed && !text->hasContentLength;
+    int size = text->method.len + text->path.len + text->authority.len + text->headersLen + 64;
+    stream->request = ArenaAlloc(&stream->arena, size);
+    if (stream->request == NULL) return ERROR;
+    int len = snprintf(stream->request,size,"%.*s %.*s HTTP/2.0\r\n",text->method.len,method,text->path.len,path);
+    if (text->authority.start != ERROR) len += snprintf(&stream->request[len],size-len,"Host: %.*s\r\n",text->authority.len,&text->pseudo[text->authority.start]);
+    memcpy(&stream->request[len],text->headers,text->headersLen);
+    len += text->headersLen;
+    if (stream->chunked) len += snprintf(&stream->request[len],size-len,"Transfer-Encoding: chunked\r\n");
+    len += snprintf(&stream->request[len],size-len,"\r\n");
+
+    InitParser(&stream->parser);
+    if (ParseRequest(&stream->parser, stream->request, len) != TRUE || ParsedLength(&stream->parser) != len) return ERROR;
+    //the request line says HTTP/2.0 for the access log, it is answered like HTTP/1.1
+    stream->parser.version = 11;
+    return NOERR;
+}
+
+//the request header is in, answer it or wait for its body
+static int StartStream (H2Connection* conn, H2Stream* stream) {
+    stream->startTime = MicroTime();
+    stream->admitted = AdmitRequest();
+    if (!stream->admitted) {
+        //too many requests in progress, only this stream is turned away
+        unsigned char block[H2_CONTROL_SIZE];
+        char retryAfter[16];
+        int retryLen = snprintf(retryAfter,sizeof(retryAfter),"%d",RETRY_AFTER);
+        int len = HpackEncodeStatus(block, sizeof(block), atoi(RESPONSE_503));
+        len += HpackEncodeField(&block[len], sizeof(block)-len, "retry-after", 11, retryAfter, retryLen);
+        stream->state = STREAM_SENDING;
+        stream->responding = TRUE;
+        stream->reqInfo.responseCode = RESPONSE_503;
+        stream->reqInfo.fileFd = ERROR;
+        stream->reqInfo.cached = NULL;
+        stream->bytesSent = H2_FRAME_HEADER + len;
+        if (SendFrame(conn, H2_HEADERS, H2_FLAG_END_HEADERS | H2_FLAG_END_STREAM, stream->id, block, len) == ERROR) return ERROR;
+        return CloseStream(conn, stream, stream->remoteClosed ? ERROR : H2_NO_ERROR);
+    }
+    if (stream->remoteClosed) return Respond(conn, stream);
+
+    int bodyFollows = StartBody(&stream->body, &stream->parser, stream->request);
+    stream->hasBody = bodyFollows != FALSE;
+    //a body that is turned away is answered straight away
+    if (bodyFollows == ERROR) return Respond(conn, stream);
+    if (stream->hasBody && stream->body.expectsContinue) {
+        unsigned char block[8];
+        int len = HpackEncodeStatus(block, sizeof(block), 100);
+        return SendFrame(conn, H2_HEADERS, H2_FLAG_END_HEADERS, stream->id, block, len);
+    }
+    return NOERR;
+}
+
+//returns ERROR if the data does not fit the body the request said it had
+static int FeedStreamBody (H2Stream* stream, char* data, int len) {
+    int consumed;
+    int result;
+    if (stream->chunked) {
+        char chunkLine[16];
+        int lineLen = snprintf(chunkLine,sizeof(chunkLine),"%x\r\n",len);
+        result = FeedBody(&stream->body, chunkLine, lineLen, &consumed);
+        if (result == FALSE) result = FeedBody(&stream->body, data, len, &consumed);
+        if (result == FALSE) result = FeedBody(&stream->body, "\r\n", 2, &consumed);
+        return result == TRUE ? ERROR : NOERR;
+    }
+    result = FeedBody(&stream->body, data, len, &consumed);
+    //more than the Content-Length
+    return result == TRUE && consumed < len ? ERROR : NOERR;
+}
+
+//the client has ended the stream, the body (if any) is complete or never will be
+static int EndRequestBody (H2Connection* conn, H2Stream* stream) {
+    if (stream->state != STREAM_RECEIVING) return NOERR;
+    if (stream->hasBody && stream->body.status == NULL) {
+        int consumed;
+        int result = stream->chunked ? FeedBody(&stream->body, "0\r\n\r\n", 5, &consumed) : stream->body.complete;
+        //the stream ended short of the body's Content-Length
+        if (result == FALSE) {
+            EndBody(&stream->body);
+            stream->body.status = RESPONSE_400;
+        }
+    }
+    return Respond(conn, stream);
+}
+
+//process the request and send its response header, a body then goes out a DATA frame at a time
+static int Respond (H2Connection* conn, H2Stream* stream) {
+    stream->state = STREAM_SENDING;
+    stream->responding = TRUE;
+    stream->reqInfo = ProcessRequest(stream->request, &stream->parser, &stream->arena, stream->hasBody ? &stream->body : NULL);
+    ReqInfo* reqInfo = &stream->reqInfo;
+    char* header = ArenaAlloc(&stream->arena, HEADER_SIZE);
+    if (header == NULL) return CloseStream(conn, stream, H2_INTERNAL_ERROR);
+    int headerLen = BuildResponseHeader(reqInfo, header, HEADER_SIZE);
+    int hasBody = ResponseHasBody(reqInfo);
+    if (hasBody) {
+        InitResponseSender(reqInfo, &stream->sender);
+        stream->hasSender = TRUE;
+    }
+    int result = SendResponseHeader(conn, stream, header, headerLen, hasBody ? 0 : H2_FLAG_END_STREAM);
+    if (result != NOERR || hasBody) return result;
+    //the client may still be sending a body the response did not wait for
+    return CloseStream(conn, stream, stream->remoteClosed ? ERROR : H2_NO_ERROR);
+}
+
+//encode the HTTP/1.1 response header for the HEADERS frame: the status, then every field with its name
+//in lower case, leaving out those about the HTTP/1 connection
+static int SendResponseHeader (H2Connection* conn, H2Stream* stream, char* header, int headerLen, int flags) {
+    unsigned char block[H2_CONTROL_SIZE];
+    int len = HpackEncodeStatus(block, sizeof(block), atoi(stream->reqInfo.responseCode));
+    char* end = &header[headerLen];
+    char* line = strstr(header,"\r\n");
+    while (line != NULL && len != ERROR) {
+        line += 2;
+        char* lineEnd = strstr(line,"\r\n");
+        if (lineEnd == NULL || lineEnd == line || lineEnd > end) break;
+        char* colon = memchr(line,':',lineEnd-line);
+        char name[VALUE_SIZE];
+        int nameLen = colon == NULL ? 0 : colon - line;
+        if (nameLen > 0 && nameLen < VALUE_SIZE) {
+            int i;
+            for (i = 0; i < nameLen; i++) name[i] = tolower((unsigned char)line[i]);
+            char* value = colon + 1;
+            while (*value == ' ') value++;
+            if (!IsConnectionHeader(name, nameLen)) {
+                int written = HpackEncodeField(&block[len], sizeof(block)-len, name, nameLen, value, lineEnd - value);
+                len = written == ERROR ? ERROR : len + written;
+            }
+        }
+        line = lineEnd;
+    }
+    if (len == ERROR) return CloseStream(conn, stream, H2_INTERNAL_ERROR);
+    stream->bytesSent += H2_FRAME_HEADER + len;
+    return SendFrame(conn, H2_HEADERS, H2_FLAG_END_HEADERS | flags, stream->id, block, len);
+}
+
+//send a DATA frame from every stream that has one ready, starting one further along each time
+//returns TRUE if there is more that could go straight away, FALSE if every stream is waiting and ERROR if the socket failed
+static int SendReadyData (H2Connection* conn) {
+    int more = FALSE;
+    int i;
+    for (i = 0; i < H2_MAX_STREAMS; i++) {
+        H2Stream* stream = &conn->streams[(conn->nextStream + i) % H2_MAX_STREAMS];
+        if (stream->state != STREAM_SENDING || !stream->hasSender) continue;
+        int result = SendData(conn, stream);
+        if (result == ERROR) return ERROR;
+        if (result == TRUE) more = TRUE;
+    }
+    conn->nextStream = (conn->nextStream + 1) % H2_MAX_STREAMS;
+    return more;
+}
+
+//send as much of the stream's body as the windows allow in one frame
+//returns TRUE if it could send more straight away, FALSE if it has to wait (or is done) and ERROR if the socket failed
+static int SendData (H2Connection* conn, H2Stream* stream) {
+    long long window = conn->sendWindow < stream->sendWindow ? conn->sendWindow : stream->sendWindow;
+    if (window > H2_MAX_FRAME) window = H2_MAX_FRAME;
+    if (window <= 0) return FALSE;
+
+    ReqInfo* reqInfo = &stream->reqInfo;
+    //multipart bodies are a part after another, the last is the closing delimiter
+    int lastPart = reqInfo->ranges == NULL || reqInfo->ranges->numRanges <= 1 ? 0 : reqInfo->ranges->numRanges;
+    long long left = SenderLeft(&stream->sender);
+    int count = left < window ? left : window;
+    int end = count == left && stream->part == lastPart;
+    unsigned char header[H2_FRAME_HEADER];
+    WriteFrameHeader(header, count, H2_DATA, end ? H2_FLAG_END_STREAM : 0, stream->id);
+    if (SendAll(conn, header, H2_FRAME_HEADER, MSG_MORE) == ERROR) return ERROR;
+    //the socket blocks, so it can only "would block" once the watchdog has shut it down
+    if (count > 0 && SendFilePiece(&stream->sender, conn->connID, count) != TRUE) return ERROR;
+    conn->sendWindow -= count;
+    stream->sendWindow -= count;
+    stream->bytesSent += H2_FRAME_HEADER + count;
+
+    if (end) return CloseStream(conn, stream, stream->remoteClosed ? ERROR : H2_NO_ERROR) == ERROR ? ERROR : FALSE;
+    if (count == left) {
+        stream->part++;
+        NextBodyPart(reqInfo->ranges, stream->part, reqInfo->fileSize, &stream->sender);
+    }
+    return stream->sendWindow > 0 && conn->sendWindow > 0;
+}
+
+//a slot for a new stream, NULL if the client already has as many open as it may (or is going away)
+static H2Stream* NewStream (H2Connection* conn, int streamId) {
+    if (conn->goingAway || conn->openStreams == H2_MAX_STREAMS) return NULL;
+    H2Stream* stream = conn->streams;
+    while (stream->state != STREAM_IDLE) stream++;
+    stream->id = streamId;
+    stream->state = STREAM_RECEIVING;
+    stream->remoteClosed = FALSE;
+    stream->sendWindow = conn->initialWindow;
+    stream->recvUnacked = 0;
+    stream->request = NULL;
+    stream->hasBody = FALSE;
+    stream->chunked = FALSE;
+    stream->responding = FALSE;
+    stream->hasSender = FALSE;
+    stream->part = 0;
+    stream->admitted = FALSE;
+    stream->startTime = MicroTime();
+    stream->bytesSent = 0;
+    conn->openStreams++;
+    return stream;
+}
+
+static H2Stream* FindStream (H2Connection* conn, int streamId) {
+    int i;
+    for (i = 0; i < H2_MAX_STREAMS; i++) {
+        if (conn->streams[i].state != STREAM_IDLE && conn->streams[i].id == streamId) return &conn->streams[i];
+    }
+    return NULL;
+}
+
+//done with the stream, its slot is free again
+//reset is the error to reset the stream with, or ERROR if the client is not told
+static int CloseStream (H2Connection* conn, H2Stream* stream, int reset) {
+    if (stream->responding) RecordResponse(conn->client, stream->request, &stream->parser, stream->reqInfo.responseCode, stream->bytesSent, stream->startTime);
+    if (stream->hasSender) CloseFileSender(&stream->sender);
+    if (stream->responding && stream->reqInfo.fileFd != ERROR) close(stream->reqInfo.fileFd);
+    if (stream->responding && stream->reqInfo.cached != NULL) ReleaseCacheEntry(stream->reqInfo.cached);
+    if (stream->hasBody) EndBody(&stream->body);
+    if (stream->admitted) ReleaseRequest();
+    conn->watch->sent += stream->bytesSent;
+    ResetArena(&stream->arena);
+    stream->state = STREAM_IDLE;
+    conn->openStreams--;
+    conn->streamsDone++;
+    return reset == ERROR ? NOERR : SendRstStream(conn, stream->id, reset);
+}
+
+//the deadline for what the connection waits on next, set again whenever that changes or a stream was answered
+static void SetTimeout (H2Connection* conn) {
+    int timeout = conn->openStreams > 0 ? TIMEOUT_BODY : TIMEOUT_IDLE;
+    int i;
+    for (i = 0; i < H2_MAX_STREAMS; i++) {
+        if (conn->streams[i].state == STREAM_SENDING) timeout = TIMEOUT_SEND;
+    }
+    if (conn->openStreams == 0 && (conn->recvLen > 0 || conn->blockStream != 0)) timeout = TIMEOUT_HEADER;
+    if (timeout != conn->timeout || conn->streamsDone > 0) SetWatchDeadline(conn->watch, timeout);
+    conn->timeout = timeout;
+    conn->streamsDone = 0;
+}
+
+static int SendFrame (H2Connection* conn, int type, int flags, int streamId, unsigned char* payload, int len) {
+    unsigned char frame[H2_FRAME_HEADER + H2_CONTROL_SIZE];
+    WriteFrameHeader(frame, len, type, flags, streamId);
+    if (len > 0) memcpy(&frame[H2_FRAME_HEADER],payload,len);
+    return SendAll(conn, frame, H2_FRAME_HEADER + len, 0);
+}
+
+static int SendAll (H2Connection* conn, void* data, int len, int flags) {
+    char* bytes = data;
+    int sent = 0;
+    while (sent < len) {
+        ssize_t bytesSent = send(conn->connID,&bytes[sent],len-sent,MSG_NOSIGNAL | flags);
+        if (bytesSent == ERROR && errno == EINTR) continue;
+        if (bytesSent == ERROR) {
+            LogError("** send error ** %s",strerror(errno));
+            return ERROR;
+        }
+        sent += bytesSent;
+    }
+    return NOERR;
+}
+
+static int SendRstStream (H2Connection* conn, int streamId, int error) {
+    unsigned char payload[4];
+    WriteUint32(payload, error);
+    return SendFrame(conn, H2_RST_STREAM, 0, streamId, payload, sizeof(payload));
+}
+
+static int SendWindowUpdate (H2Connection* conn, int streamId, int increment) {
+    unsigned char payload[4];
+    WriteUint32(payload, increment);
+    return SendFrame(conn, H2_WINDOW_UPDATE, 0, streamId, payload, sizeof(payload));
+}
+
+static void WriteFrameHeader (unsigned char* out, int len, int type, int flags, int streamId) {
+    out[0] = (len >> 16) & 0xff;
+    out[1] = (len >> 8) & 0xff;
+    out[2] = len & 0xff;
+    out[3] = type;
+    out[4] = flags;
+    WriteUint32(&out[5], streamId);
+}
+
+static void WriteUint32 (unsigned char* out, unsigned int value) {
+    out[0] = (value >> 24) & 0xff;
+    out[1] = (value >> 16) & 0xff;
+    out[2] = (value >> 8) & 0xff;
+    out[3] = value & 0xff;
+}
+
+static unsigned int ReadUint32 (unsigned char* data) {
+    return ((unsigned int)data[0] << 24) | (data[1] << 16) | (data[2] << 8) | data[3];
+}
+
+static int IsConnectionHeader (char* name, int nameLen) {
+    int i;
+    for (i = 0; connectionHeaders[i] != NULL; i++) {
+        if ((int)strlen(connectionHeaders[i]) == nameLen && memcmp(connectionHeaders[i],name,nameLen) == STREQU) return TRUE;
+    }
+    return FALSE;
+}
+
+//is token one of the comma separated words in list
+static int HasToken (char* list, char* token) {
+    int tokenLen = strlen(token);
+    char* pos = list;
+    while (*pos != '\0') {
+        while (*pos == ' ' || *pos == '\t' || *pos == ',') pos++;
+        int len = 0;
+        while (pos[len] != '\0' && pos[len] != ',' && pos[len] != ' ' && pos[len] != '\t') len++;
+        if (len == tokenLen && strncasecmp(pos,token,len) == STREQU) return TRUE;
+        pos += len;
+    }
+    return FALSE;
+}
+
+//the HTTP2-Settings header is the settings frame's payload in base64url, returns its length or ERROR
+static int DecodeBase64Url (char* text, unsigned char* out, int size) {
+    char* digits = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789-_";
+    unsigned int bits = 0;
+    int numBits = 0;
+    int len = 0;
+    for (; *text != '\0' && *text != '='; text++) {
+        char* digit = strchr(digits,*text);
+        if (digit == NULL) return ERROR;
+        bits = (bits << 6) | (digit - digits);
+        numBits += 6;
+        if (numBits >= 8) {
+            numBits -= 8;
+            if (len == size) return ERROR;
+            out[len++] = (bits >> numBits) & 0xff;
+        }
+    }
+    return len;
+}
@@ -0,0 +1,162 @@
+/*
+    Custom Web Server - HTTP/2 over cleartext (h2c)
+    By: Ricard Grace
+*/
+
+#ifndef HTTP2_H
+#define HTTP2_H
+
+#include "webServer.h"
+#include "hpack.h"
+#include "httpParser.h"
+#include "memPool.h"
+#include "sendFile.h"
+#include "requestBody.h"
+#include "watchdog.h"
+
+//what every HTTP/2 connection starts with, its first 18 bytes read as an HTTP/1 request without headers
+#define H2_PREFACE "PRI * HTTP/2.0\r\n\r\nSM\r\n\r\n"
+#define H2_PREFACE_LEN 24
+#define H2_PREFACE_REQUEST_LEN 18
+#define H2_UPGRADE_RESPONSE "HTTP/1.1 101 Switching Protocols\r\nConnection: Upgrade\r\nUpgrade: h2c\r\n\r\n"
+
+#define H2_FRAME_HEADER 9
+//largest frame either side sends, the protocol default which the server never raises
+#define H2_MAX_FRAME 16384
+//streams a client may have open at once
+#define H2_MAX_STREAMS 32
+//flow control window the server gives every stream and the connection as a whole
+#define H2_WINDOW 262144
+#define H2_DEFAULT_WINDOW 65535
+#define H2_MAX_WINDOW 2147483647
+//largest header block (HEADERS and its CONTINUATIONs) accepted
+#define H2_HEADER_BLOCK_SIZE BUFF_SIZE
+
+//frame types
+#define H2_DATA          0x0
+#define H2_HEADERS       0x1
+#define H2_PRIORITY      0x2
+#define H2_RST_STREAM    0x3
+#define H2_SETTINGS      0x4
+#define H2_PUSH_PROMISE  0x5
+#define H2_PING          0x6
+#define H2_GOAWAY        0x7
+#define H2_WINDOW_UPDATE 0x8
+#define H2_CONTINUATION  0x9
+
+//frame flags
+#define H2_FLAG_END_STREAM  0x01
+#define H2_FLAG_ACK         0x01
+#define H2_FLAG_END_HEADERS 0x04
+#define H2_FLAG_PADDED      0x08
+#define H2_FLAG_PRIORITY    0x20
+
+//settings
+#define H2_SETTINGS_HEADER_TABLE_SIZE      0x1
+#define H2_SETTINGS_ENABLE_PUSH            0x2
+#define H2_SETTINGS_MAX_CONCURRENT_STREAMS 0x3
+#define H2_SETTINGS_INITIAL_WINDOW_SIZE    0x4
+#define H2_SETTINGS_MAX_FRAME_SIZE         0x5
+#define H2_SETTING_SIZE 6
+
+//error codes
+#define H2_NO_ERROR          0x0
+#define H2_PROTOCOL_ERROR    0x1
+#define H2_INTERNAL_ERROR    0x2
+#define H2_FLOW_CONTROL_ERROR 0x3
+#define H2_STREAM_CLOSED     0x5
+#define H2_FRAME_SIZE_ERROR  0x6
+#define H2_REFUSED_STREAM    0x7
+#define H2_COMPRESSION_ERROR 0x9
+#define H2_ENHANCE_YOUR_CALM 0xb
+
+//stream states, a slot is free while its stream is idle
+#define STREAM_IDLE      0
+#define STREAM_RECEIVING 1
+#define STREAM_SENDING   2
+
+//one request and its response
+typedef struct _h2Stream {
+    int id;
+    int state;
+    //the client has sent END_STREAM
+    int remoteClosed;
+    //bytes the server may still send, and bytes received that have not been given back to the client
+    long long sendWindow;
+    int recvUnacked;
+    //the request, written out as HTTP/1.1 so it goes through the same parser and ProcessRequest
+    char* request;
+    HttpParser parser;
+    //the body is fed a DATA frame at a time, chunked when the client did not give its length
+    BodyReader body;
+    int hasBody;
+    int chunked;
+    ReqInfo reqInfo;
+    int responding;
+    //the body of the response and the part of it being sent
+    FileSender sender;
+    int hasSender;
+    int part;
+    int admitted;
+    long long startTime;
+    long long bytesSent;
+    //the request text, its response header and ranges, reset once the stream closes
+    Arena arena;
+} H2Stream;
+
+//the fields of a header block as they are decoded, put together as an HTTP/1.1 request at the end
+typedef struct _h2RequestText {
+    char pseudo[BUFF_SIZE];
+    int pseudoLen;
+    HttpSpan method;
+    HttpSpan path;
+    HttpSpan authority;
+    HttpSpan scheme;
+    char headers[BUFF_SIZE];
+    int headersLen;
+    int hasContentLength;
+    int sawHeader;
+    int malformed;
+} H2RequestText;
+
+//one HTTP/2 connection, everything its streams share
+typedef struct _h2Connection {
+    int connID;
+    char* client;
+    Watch* watch;
+    int timeout;
+    //streams closed since the deadline was last set
+    int streamsDone;
+    int settingsReceived;
+    //bytes of the preface still to come
+    char* preface;
+    int prefaceLen;
+    //frames are read whole into the buffer
+    unsigned char recvBuffer[H2_FRAME_HEADER + H2_MAX_FRAME];
+    int recvLen;
+    //the header block being put together, on blockStream (which it opens if blockNew)
+    unsigned char headerBlock[H2_HEADER_BLOCK_SIZE];
+    int blockLen;
+    int blockStream;
+    int blockFlags;
+    int blockNew;
+    HpackTable decoder;
+    H2RequestText text;
+    H2Stream streams[H2_MAX_STREAMS];
+    int openStreams;
+    int lastStreamId;
+    //round robin position of the streams sending DATA
+    int nextStream;
+    long long sendWindow;
+    int recvUnacked;
+    //the stream window the client has asked for in its settings
+    int initialWindow;
+    //the client has sent GOAWAY, no new streams are taken
+    int goingAway;
+} H2Connection;
+
+int IsHttp2Preface (char* request, int requestLen);
+int WantsHttp2Upgrade (HttpParser* parser, char* request);
+void ServeHttp2 (int connID, char* client, Watch* watch, char* received, int requestLen, int receivedLen, HttpParser* upgrade);
+
+#endif
@@ -0,0 +1,263 @@
+/*
+    Custom Web Server - incremental HTTP request parser
+    By: Ricard Grace
+*/
+
+#include "httpParser.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#endif
+
+/*
+    Parses a request as its bytes arrive. Each call only looks at data received since the last
+    call: line ends are found with SSE2/AVX2 compares (16/32 bytes at a time) and every complete
+    line is parsed exactly once, filling in the method, target, version and a table of header
+    spans. The headers the server acts on are picked out while parsing so they never need to be
+    searched for later. Nothing is copied, every result is an offset into the request buffer.
+*/
+
+static void ParseRequestLine (HttpParser* parser, char* line, int start, int len);
+static void ParseHeaderLine (HttpParser* parser, char* line, int start, int len);
+static int MethodFromToken (char* token, int len);
+static int KnownHeader (char* name, int len);
+static int FindLineEndBytes (char* buffer, int start, int end);
+
+//names of the known headers, in HDR_ order
+static char* knownNames[NUM_KNOWN_HEADERS] = {
+    "Host", "Connection", "Range", "If-None-Match", "Accept-Encoding", "Content-Length",
+    "If-Modified-Since", "If-Range", "Transfer-Encoding", "Expect"
+};
+static int knownLengths[NUM_KNOWN_HEADERS] = {4, 10, 5, 13, 15, 14, 17, 8, 17, 6};
+
+static int (*findLineEnd) (char* buffer, int start, int end) = FindLineEndBytes;
+
+#ifdef __SSE2__
+static int FindLineEndSSE2 (char* buffer, int start, int end) {
+    __m128i newline = _mm_set1_epi8('\n');
+    int i;
+    for (i = start; i + 16 <= end; i += 16) {
+        __m128i chunk = _mm_loadu_si128((__m128i*)&buffer[i]);
+        int mask = _mm_movemask_epi8(_mm_cmpeq_epi8(chunk,newline));
+        if (mask != 0) return i + __builtin_ctz(mask);
+    }
+    return FindLineEndBytes(buffer, i, end);
+}
+
+__attribute__ ((target("avx2")))
+static int FindLineEndAVX2 (char* buffer, int start, int end) {
+    __m256i newline = _mm256_set1_epi8('\n');
+    int i;
+    for (i = start; i + 32 <= end; i += 32) {
+        __m256i chunk = _mm256_loadu_si256((__m256i*)&buffer[i]);
+        unsigned int mask = (unsigned int)_mm256_movemask_epi8(_mm256_cmpeq_epi8(chunk,newline));
+        if (mask != 0) return i + __builtin_ctz(mask);
+    }
+    return FindLineEndSSE2(buffer, i, end);
+}
+
+//pick the widest compare the CPU supports, once at startup
+__attribute__ ((constructor))
+static void SelectLineEndScanner () {
+    __builtin_cpu_init();
+    findLineEnd = __builtin_cpu_supports("avx2") ? FindLineEndAVX2 : FindLineEndSSE2;
+}
+#endif
+
+void InitParser (HttpParser* parser) {
+    parser->state = PARSE_REQUEST_LINE;
+    parser->lineStart = 0;
+    parser->scanPos = 0;
+    parser->method = REQUEST_INVALID;
+    parser->requestLine.start = 0;
+    parser->requestLine.len = 0;
+    parser->target.start = 0;
+    parser->target.len = 0;
+    parser->version = 10;
+    parser->malformed = FALSE;
+    parser->numHeaders = 0;
+    int i;
+    for (i = 0; i < NUM_KNOWN_HEADERS; i++) {
+        parser->known[i].start = ERROR;
+        parser->known[i].len = 0;
+    }
+}
+
+//parse whatever has arrived of the request (request[0..length))
+//returns TRUE once the blank line ending the header has been seen, FALSE if more data is needed
+int ParseRequest (HttpParser* parser, char* request, int length) {
+    while (parser->state != PARSE_DONE) {
+        int lineEnd = findLineEnd(request, parser->scanPos, length);
+        if (lineEnd == ERROR) {
+            //the rest of the line has not arrived, next time start searching where we stopped
+            parser->scanPos = length;
+            return FALSE;
+        }
+
+        //lines end in \r\n, but a bare \n is tolerated
+        int start = parser->lineStart;
+        int len = lineEnd - start;
+        if (len > 0 && request[lineEnd-1] == '\r') len--;
+        parser->lineStart = lineEnd + 1;
+        parser->scanPos = lineEnd + 1;
+
+        if (parser->state == PARSE_REQUEST_LINE) {
+            //empty lines before the request line are ignored
+            if (len > 0) {
+                ParseRequestLine(parser, request, start, len);
+                parser->state = PARSE_HEADERS;
+            }
+        } else if (len == 0) {
+            parser->state = PARSE_DONE;
+        } else {
+            ParseHeaderLine(parser, request, start, len);
+        }
+    }
+    return TRUE;
+}
+
+//length of the request header, including the blank line that ended it
+int ParsedLength (HttpParser* parser) {
+    return parser->lineStart;
+}
+
+//copy the value of a known header (HDR_) into value
+//returns the length of the value, or ERROR if the request did not have the header
+int CopyHeader (HttpParser* parser, char* request, int header, char* value, int size) {
+    HttpSpan span = parser->known[header];
+    if (span.start == ERROR) return ERROR;
+    int len = span.len < size-1 ? span.len : size-1;
+    memcpy(value,&request[span.start],len);
+    value[len] = '\0';
+    return len;
+}
+
+//copy the value of any header into value (case insensitive name)
+//returns the length of the value, or ERROR if the request did not have the header
+int CopyNamedHeader (HttpParser* parser, char* request, char* name, char* value, int size) {
+    int nameLen = strlen(name);
+    int i;
+    for (i = 0; i < parser->numHeaders; i++) {
+        HttpHeader* header = &parser->headers[i];
+        if (header->name.len == nameLen && strncasecmp(&request[header->name.start],name,nameLen) == STREQU) {
+            int len = header->value.len < size-1 ? header->value.len : size-1;
+            memcpy(value,&request[header->value.start],len);
+            value[len] = '\0';
+            return len;
+        }
+    }
+    return ERROR;
+}
+
+//index of the next \n in buffer[start..end), or ERROR if there is none
+int FindLineEnd (char* buffer, int start, int end) {
+    return findLineEnd(buffer, start, end);
+}
+
+//METHOD SP target SP HTTP/x.y
+static void ParseRequestLine (HttpParser* parser, char* line, int start, int len) {
+    int end = start + len;
+    int pos = start;
+    parser->requestLine.start = start;
+    parser->requestLine.len = len;
+    while (pos < end && line[pos] != ' ') pos++;
+    parser->method = MethodFromToken(&line[start], pos - start);
+
+    while (pos < end && line[pos] == ' ') pos++;
+    parser->target.start = pos;
+    while (pos < end && line[pos] != ' ') pos++;
+    parser->target.len = pos - parser->target.start;
+
+    while (pos < end && line[pos] == ' ') pos++;
+    int verLen = end - pos;
+    if (parser->target.len == 0) {
+        //no address was supplied
+        parser->malformed = TRUE;
+    } else if (verLen == 0) {
+        //HTTP/0.9 style request line, answer it as HTTP/1.0
+        parser->version = 10;
+    } else if (verLen == 8 && memcmp(&line[pos],HTTPVER_11,8) == STREQU) {
+        parser->version = 11;
+    } else if (verLen >= 5 && memcmp(&line[pos],"HTTP/",5) == STREQU) {
+        parser->version = 10;
+    } else {
+        parser->malformed = TRUE;
+    }
+}
+
+//Name: OWS value OWS
+static void ParseHeaderLine (HttpParser* parser, char* line, int start, int len) {
+    int end = start + len;
+    if (line[start] == ' ' || line[start] == '\t') {
+        //obsolete line folding is not accepted
+        parser->malformed = TRUE;
+        return;
+    }
+
+    char* colon = memchr(&line[start],':',len);
+    if (colon == NULL) {
+        parser->malformed = TRUE;
+        return;
+    }
+    int nameEnd = (int)(colon - line);
+    int valueStart = nameEnd + 1;
+    while (valueStart < end && (line[valueStart] == ' ' || line[valueStart] == '\t')) valueStart++;
+    int valueEnd = end;
+    while (valueEnd > valueStart && (line[valueEnd-1] == ' ' || line[valueEnd-1] == '\t')) valueEnd--;
+
+    int known = KnownHeader(&line[start], nameEnd - start);
+    if ((known == HDR_CONTENT_LENGTH || known == HDR_TRANSFER_ENCODING) && parser->known[known].start != ERROR) {
+        //where the body ends must not depend on which of two copies is believed
+        parser->malformed = TRUE;
+    }
+    if (known != ERROR && parser->known[known].start == ERROR) {
+        parser->known[known].start = valueStart;
+        parser->known[known].len = valueEnd - valueStart;
+    }
+    if (parser->numHeaders < MAX_HEADERS) {
+        HttpHeader* header = &parser->headers[parser->numHeaders++];
+        header->name.start = start;
+        header->name.len = nameEnd - start;
+        header->value.start = valueStart;
+        header->value.len = valueEnd - valueStart;
+    }
+}
+
+static int MethodFromToken (char* token, int len) {
+    switch (len) {
+        case 3:
+            if (memcmp(token,"GET",3) == STREQU) return REQUEST_GET;
+            if (memcmp(token,"PUT",3) == STREQU) return REQUEST_PUT;
+            break;
+        case 4:
+            if (memcmp(token,"HEAD",4) == STREQU) return REQUEST_HEAD;
+            if (memcmp(token,"POST",4) == STREQU) return REQUEST_POST;
+            break;
+        case 5:
+            if (memcmp(token,"TRACE",5) == STREQU) return REQUEST_TRACE;
+            break;
+        case 6:
+            if (memcmp(token,"DELETE",6) == STREQU) return REQUEST_DELETE;
+            break;
+        case 7:
+            if (memcmp(token,"CONNECT",7) == STREQU) return REQUEST_CONNECT;
+            if (memcmp(token,"OPTIONS",7) == STREQU) return REQUEST_OPTIONS;
+            break;
+    }
+    //the client supplied a malformed request
+    return REQUEST_INVALID;
+}
+
+static int KnownHeader (char* name, int len) {
+    int i;
+    for (i = 0; i < NUM_KNOWN_HEADERS; i++) {
+        if (knownLengths[i] == len && strncasecmp(name,knownNames[i],len) == STREQU) return i;
+    }
+    return ERROR;
+}
+
+static int FindLineEndBytes (char* buffer, int start, int end) {
+    if (start >= end) return ERROR;
+    char* found = memchr(&buffer[start],'\n',end-start);
+    return found == NULL ? ERROR : (int)(found - buffer);
+}
@@ -0,0 +1,68 @@
+/*
+    Custom Web Server - incremental HTTP request parser
+    By: Ricard Grace
+*/
+
+#ifndef HTTPPARSER_H
+#define HTTPPARSER_H
+
+#include "webServer.h"
+
+#define MAX_HEADERS 64
+
+//parser states
+#define PARSE_REQUEST_LINE 0
+#define PARSE_HEADERS      1
+#define PARSE_DONE         2
+
+//headers the server looks at, found while parsing so they never need searching for
+#define HDR_HOST              0
+#define HDR_CONNECTION        1
+#define HDR_RANGE             2
+#define HDR_IF_NONE_MATCH     3
+#define HDR_ACCEPT_ENCODING   4
+#define HDR_CONTENT_LENGTH    5
+#define HDR_IF_MODIFIED_SINCE 6
+#define HDR_IF_RANGE          7
+#define HDR_TRANSFER_ENCODING 8
+#define HDR_EXPECT            9
+#define NUM_KNOWN_HEADERS     10
+
+//a span of the request buffer
+typedef struct _httpSpan {
+    int start;
+    int len;
+} HttpSpan;
+
+typedef struct _httpHeader {
+    HttpSpan name;
+    HttpSpan value;
+} HttpHeader;
+
+//parse state for one request, offsets are relative to the start of the request in the buffer
+typedef struct _httpParser {
+    int state;
+    //start of the line being parsed and how far it has been searched for its end
+    int lineStart;
+    int scanPos;
+
+    //results
+    int method;
+    HttpSpan requestLine;
+    HttpSpan target;
+    int version;
+    int malformed;
+    //value of each known header, start is ERROR when the request did not have it
+    HttpSpan known[NUM_KNOWN_HEADERS];
+    HttpHeader headers[MAX_HEADERS];
+    int numHeaders;
+} HttpParser;
+
+void InitParser (HttpParser* parser);
+int ParseRequest (HttpParser* parser, char* request, int length);
+int ParsedLength (HttpParser* parser);
+int CopyHeader (HttpParser* parser, char* request, int header, char* value, int size);
+int CopyNamedHeader (HttpParser* parser, char* request, char* name, char* value, int size);
+int FindLineEnd (char* buffer, int start, int end);
+
+#endif
@@ -0,0 +1,135 @@
+/*
+    Custom Web Server - listening sockets
+    By: Ricard Grace
+*/
+
+#include "listener.h"
+#include "logger.h"
+
+/*
+    The server can listen on several sockets bound to the same port (-S). With SO_REUSEPORT the
+    kernel spreads incoming connections over them, so every accepting thread has its own socket
+    and accept queue instead of all of them queuing up on one. Sockets are IPv6 with IPV6_V6ONLY
+    turned off, so IPv4 clients arrive on them too (as ::ffff:a.b.c.d); hosts without IPv6 get
+    plain IPv4 sockets instead.
+    With -A each accepting thread is pinned to a CPU of its own and its socket asks for the
+    connections whose packets that CPU handled, keeping a connection on one CPU from start to end.
+*/
+
+static int OpenListener (char* port, int backlog, int family);
+
+static int pinShards = FALSE;
+
+//open count sockets listening on port, returns ERROR if any of them cannot be opened
+int OpenListeners (char* port, int backlog, int* sockets, int count) {
+    int family = AF_INET6;
+    int i;
+    for (i = 0; i < count; i++) {
+        sockets[i] = OpenListener(port, backlog, family);
+        if (sockets[i] == ERROR && i == 0 && (errno == EAFNOSUPPORT || errno == EADDRNOTAVAIL)) {
+            printf("IPv6 unavailable, listening on IPv4 only\n");
+            family = AF_INET;
+            sockets[i] = OpenListener(port, backlog, family);
+        }
+        if (sockets[i] == ERROR) {
+            while (--i >= 0) close(sockets[i]);
+            return ERROR;
+        }
+    }
+    printf("Listening on port %s with %d socket(s)%s\n",port,count,family == AF_INET6 ? " (IPv4 and IPv6)" : "");
+    return NOERR;
+}
+
+//spread numThreads accepting threads over the sockets, the caller frees the result
+Shard* AssignShards (int* sockets, int numSockets, int numThreads) {
+    Shard* shards = malloc(sizeof(Shard) * numThreads);
+    int i;
+    for (i = 0; i < numThreads; i++) {
+        shards[i].listenSoc = sockets[i % numSockets];
+        shards[i].index = i;
+    }
+    return shards;
+}
+
+void SetShardPinning (int enabled) {
+    pinShards = enabled;
+}
+
+//pin the calling thread to a CPU picked by its shard index (does nothing unless pinning is on)
+void PinShard (Shard* shard) {
+    if (!pinShards) return;
+    cpu_set_t allowed;
+    if (sched_getaffinity(0,sizeof(allowed),&allowed) == ERROR || CPU_COUNT(&allowed) == 0) return;
+
+    //the n'th CPU this process may run on
+    int wanted = shard->index % CPU_COUNT(&allowed);
+    int cpu;
+    for (cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+        if (CPU_ISSET(cpu,&allowed) && wanted-- == 0) break;
+    }
+
+    cpu_set_t pinned;
+    CPU_ZERO(&pinned);
+    CPU_SET(cpu,&pinned);
+    int err = pthread_setaffinity_np(pthread_self(),sizeof(pinned),&pinned);
+    if (err != NOERR) {
+        LogWarn("** pthread_setaffinity_np error ** %s",strerror(err));
+        return;
+    }
+    if (setsockopt(shard->listenSoc,SOL_SOCKET,SO_INCOMING_CPU,&cpu,sizeof(cpu)) == ERROR) {
+        LogWarn("** setsockopt error ** SO_INCOMING_CPU: %s",strerror(errno));
+    }
+}
+
+//returns the listening socket, or ERROR with errno set
+static int OpenListener (char* port, int backlog, int family) {
+    struct addrinfo serverSettings; //contains server settings
+    struct addrinfo *hostInfo;      //contains the host's network info
+    memset(&serverSettings,0,sizeof(serverSettings));
+    serverSettings.ai_family = family;
+    serverSettings.ai_socktype = SOCK_STREAM;  //connection type (TCP streaming)
+    serverSettings.ai_flags = AI_PASSIVE;      //IP address binding (auto)
+    int addrErr = getaddrinfo(NULL,port,&serverSettings,&hostInfo);
+    if (addrErr != NOERR) {
+        fprintf(stderr,"** getaddrinfo error ** %s\n",gai_strerror(addrErr));
+        errno = EINVAL;
+        return ERROR;
+    }
+
+    int listenSoc = socket(hostInfo->ai_family,hostInfo->ai_socktype | SOCK_CLOEXEC,hostInfo->ai_protocol);
+    if (listenSoc == ERROR) {
+        int err = errno;
+        if (err != EAFNOSUPPORT) fprintf(stderr,"** socket error ** %s\n",strerror(err));
+        freeaddrinfo(hostInfo);
+        errno = err;
+        return ERROR;
+    }
+
+    int on = 1;
+    int off = 0;
+    if ((family == AF_INET6 && setsockopt(listenSoc,IPPROTO_IPV6,IPV6_V6ONLY,&off,sizeof(off)) == ERROR)
+        || setsockopt(listenSoc,SOL_SOCKET,SO_REUSEADDR,&on,sizeof(on)) == ERROR
+        || setsockopt(listenSoc,SOL_SOCKET,SO_REUSEPORT,&on,sizeof(on)) == ERROR
+        //responses are put together before they are sent (and held back with MSG_MORE while more
+        //follows), so Nagle would only hold up their last packet, accepted sockets inherit this
+        || setsockopt(listenSoc,IPPROTO_TCP,TCP_NODELAY,&on,sizeof(on)) == ERROR) {
+        int err = errno;
+        fprintf(stderr,"** setsockopt error ** %s\n",strerror(err));
+        close(listenSoc);
+        freeaddrinfo(hostInfo);
+        errno = err;
+        return ERROR;
+    }
+
+    if (bind(listenSoc,hostInfo->ai_addr,hostInfo->ai_addrlen) == ERROR || listen(listenSoc,backlog) == ERROR) {
+        int err = errno;
+        if (err != EADDRNOTAVAIL || family != AF_INET6) fprintf(stderr,"** binding error ** %s\n",strerror(err));
+        close(listenSoc);
+        freeaddrinfo(hostInfo);
+        errno = err;
+        return ERROR;
+    }
+
+    freeaddrinfo(hostInfo);
+    return listenSoc;
+}
@@ -0,0 +1,29 @@
+/*
+    Custom Web Server - listening sockets
+    By: Ricard Grace
+*/
+
+#ifndef LISTENER_H
+#define LISTENER_H
+
+#include "webServer.h"
+
+#include <sched.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+
+#define DEFAULT_SHARDS 1
+
+//what each accepting thread (accept loop or event loop) is given
+typedef struct _shard {
+    int listenSoc;
+    //which thread this is, picks its CPU when shards are pinned
+    int index;
+} Shard;
+
+int OpenListeners (char* port, int backlog, int* sockets, int count);
+Shard* AssignShards (int* sockets, int numSockets, int numThreads);
+void SetShardPinning (int enabled);
+void PinShard (Shard* shard);
+
+#endif
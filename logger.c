@@ -0,0 +1,174 @@
+/*
+    Custom Web Server - logging
+    By: Ricard Grace
+*/
+
+#include "logger.h"
+
+#include <arpa/inet.h>
+#include <time.h>
+
+/*
+    Serving threads never write to stdout themselves. Each thread formats its lines straight into
+    a ring buffer of its own (one producer, one consumer, so no locks are needed) and a single
+    writer thread drains every ring and writes the lines out in batches. A full ring drops the
+    line and counts it rather than make a request wait for the disk.
+    Rings are never freed, an exited thread's ring is taken over by the next new thread (see
+    threadSlot.c).
+    The level check happens in the Log macros before any formatting, and levels above
+    LOG_MAX_LEVEL are removed at compile time, so debug output costs nothing when it is off.
+*/
+
+static void* WriteLogs (void* unused);
+static LogRing* ThreadRing ();
+static int DrainRing (LogRing* ring);
+
+int logLevel = LOG_DEFAULT_LEVEL;
+
+static SlotList rings;
+static __thread LogRing* threadRing = NULL;
+static atomic_long droppedLines = 0;
+static FILE* accessFile = NULL;
+static int loggerStarted = FALSE;
+
+//the access log is written to accessLog (stdout if NULL), diagnostics go to stdout and stderr
+int InitLogger (int level, char* accessLog) {
+    logLevel = level;
+    accessFile = stdout;
+    if (accessLog != NULL && (accessFile = fopen(accessLog,"a")) == NULL) {
+        fprintf(stderr,"** fopen error ** %s: %s\n",accessLog,strerror(errno));
+        return ERROR;
+    }
+    InitSlotList(&rings, sizeof(LogRing));
+
+    pthread_t thread;
+    if (pthread_create(&thread,NULL,WriteLogs,NULL) != NOERR) {
+        fprintf(stderr,"** pthread_create error **\n");
+        return ERROR;
+    }
+    pthread_detach(thread);
+    loggerStarted = TRUE;
+    return NOERR;
+}
+
+//returns the level called name, or ERROR if there is no such level
+int LogLevelFromName (char* name) {
+    if (strcmp(name,"error") == STREQU) return LOG_ERROR;
+    if (strcmp(name,"warn") == STREQU) return LOG_WARN;
+    if (strcmp(name,"info") == STREQU) return LOG_INFO;
+    if (strcmp(name,"debug") == STREQU) return LOG_DEBUG;
+    return ERROR;
+}
+
+//format a line into this thread's ring, the writer thread adds the newline
+void LogWrite (int level, const char* format, ...) {
+    LogRing* ring = ThreadRing();
+    if (ring == NULL) return;
+    unsigned long head = atomic_load_explicit(&ring->head,memory_order_relaxed);
+    if (head - atomic_load_explicit(&ring->tail,memory_order_acquire) >= LOG_RING_SIZE) {
+        atomic_fetch_add_explicit(&droppedLines,1,memory_order_relaxed);
+        return;
+    }
+
+    LogLine* line = &ring->lines[head % LOG_RING_SIZE];
+    va_list args;
+    va_start(args,format);
+    int len = vsnprintf(line->text,LOG_LINE_SIZE,format,args);
+    va_end(args);
+    if (len < 0) return;
+    if (len >= LOG_LINE_SIZE) len = LOG_LINE_SIZE-1;
+    //lines are written one per record, a trailing newline would double up
+    while (len > 0 && line->text[len-1] == '\n') len--;
+    line->len = len;
+    line->level = level;
+    atomic_store_explicit(&ring->head,head+1,memory_order_release);
+}
+
+//one combined log format line, with the time taken to answer in microseconds on the end
+void LogAccess (char* client, char* requestLine, int requestLineLen, int status, long long bytes, long long micros, char* referer, char* userAgent) {
+    //the date only changes once a second, so it is only formatted once a second
+    static __thread time_t lastSecond = 0;
+    static __thread char date[32];
+    time_t now = time(NULL);
+    if (now != lastSecond) {
+        struct tm local;
+        localtime_r(&now,&local);
+        strftime(date,sizeof(date),"%d/%b/%Y:%H:%M:%S %z",&local);
+        lastSecond = now;
+    }
+    LogWrite(LOG_ACCESS,"%s - - [%s] \"%.*s\" %d %lld \"%s\" \"%s\" %lld",client,date,requestLineLen,requestLine,status,bytes,referer[0] != '\0' ? referer : "-",userAgent[0] != '\0' ? userAgent : "-",micros);
+}
+
+//the address of the client on connID as text
+void ClientAddress (int connID, char* buffer, int size) {
+    struct sockaddr_storage addr;
+    socklen_t addrLen = sizeof(addr);
+    snprintf(buffer,size,"-");
+    if (getpeername(connID,(struct sockaddr*)&addr,&addrLen) == ERROR) return;
+    if (addr.ss_family == AF_INET) {
+        inet_ntop(AF_INET,&((struct sockaddr_in*)&addr)->sin_addr,buffer,size);
+    } else if (addr.ss_family == AF_INET6) {
+        struct in6_addr* ip6 = &((struct sockaddr_in6*)&addr)->sin6_addr;
+        if (IN6_IS_ADDR_V4MAPPED(ip6)) {
+            //IPv4 clients of a dual stack socket are logged as plain IPv4
+            inet_ntop(AF_INET,&ip6->s6_addr[12],buffer,size);
+        } else {
+            inet_ntop(AF_INET6,ip6,buffer,size);
+        }
+    }
+}
+
+long long MicroTime () {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC,&now);
+    return (long long)now.tv_sec * 1000000 + now.tv_nsec / 1000;
+}
+
+static void* WriteLogs (void* unused) {
+    long lastDropped = 0;
+    while (1) {
+        int written = 0;
+        ThreadSlot* slot;
+        for (slot = atomic_load(&rings.head); slot != NULL; slot = slot->next) {
+            written += DrainRing((LogRing*)slot);
+        }
+
+        long dropped = atomic_load_explicit(&droppedLines,memory_order_relaxed);
+        if (dropped != lastDropped) {
+            fprintf(stderr,"** log buffers full, %ld line(s) dropped **\n",dropped-lastDropped);
+            lastDropped = dropped;
+        }
+        if (written > 0) {
+            fflush(stdout);
+            fflush(accessFile);
+        } else {
+            usleep(LOG_FLUSH_MS * 1000);
+        }
+    }
+    return NULL;
+}
+
+//write out everything in the ring, returns the number of lines written
+static int DrainRing (LogRing* ring) {
+    unsigned long tail = atomic_load_explicit(&ring->tail,memory_order_relaxed);
+    unsigned long head = atomic_load_explicit(&ring->head,memory_order_acquire);
+    int written = 0;
+    while (tail != head) {
+        LogLine* line = &ring->lines[tail % LOG_RING_SIZE];
+        FILE* out = line->level == LOG_ACCESS ? accessFile : (line->level <= LOG_WARN ? stderr : stdout);
+        fwrite(line->text,1,line->len,out);
+        fputc('\n',out);
+        tail++;
+        written++;
+    }
+    //the lines can be reused by the thread once the tail has moved past them
+    atomic_store_explicit(&ring->tail,tail,memory_order_release);
+    return written;
+}
+
+//the ring of the calling thread, taking over an unused one or making a new one the first time
+static LogRing* ThreadRing () {
+    if (threadRing != NULL || loggerStarted == FALSE) return threadRing;
+    threadRing = (LogRing*)ClaimSlot(&rings);
+    return threadRing;
+}
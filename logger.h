@@ -0,0 +1,64 @@
+/*
+    Custom Web Server - logging
+    By: Ricard Grace
+*/
+
+#ifndef LOGGER_H
+#define LOGGER_H
+
+#include "webServer.h"
+#include "threadSlot.h"
+
+#include <stdarg.h>
+#include <stdatomic.h>
+
+//log levels, anything above the current level is skipped before it is formatted
+#define LOG_ERROR  0
+#define LOG_WARN   1
+#define LOG_INFO   2
+#define LOG_DEBUG  3
+//access log lines are not diagnostics and go to their own file
+#define LOG_ACCESS 4
+
+//levels above this are compiled out entirely (build with -DLOG_MAX_LEVEL=LOG_INFO)
+#ifndef LOG_MAX_LEVEL
+#define LOG_MAX_LEVEL LOG_DEBUG
+#endif
+
+#define LOG_DEFAULT_LEVEL LOG_INFO
+//lines per thread buffer and the longest line kept
+#define LOG_RING_SIZE 256
+#define LOG_LINE_SIZE 512
+//how long the writer sleeps when there is nothing to write
+#define LOG_FLUSH_MS 5
+
+#define LOG_ENABLED(level) ((level) <= LOG_MAX_LEVEL && (level) <= logLevel)
+#define LogError(...) do { if (LOG_ENABLED(LOG_ERROR)) LogWrite(LOG_ERROR,__VA_ARGS__); } while (0)
+#define LogWarn(...)  do { if (LOG_ENABLED(LOG_WARN)) LogWrite(LOG_WARN,__VA_ARGS__); } while (0)
+#define LogInfo(...)  do { if (LOG_ENABLED(LOG_INFO)) LogWrite(LOG_INFO,__VA_ARGS__); } while (0)
+#define LogDebug(...) do { if (LOG_ENABLED(LOG_DEBUG)) LogWrite(LOG_DEBUG,__VA_ARGS__); } while (0)
+
+typedef struct _logLine {
+    int level;
+    int len;
+    char text[LOG_LINE_SIZE];
+} LogLine;
+
+//lines written by one thread and not yet written out, only that thread adds to it
+typedef struct _logRing {
+    ThreadSlot slot;
+    LogLine lines[LOG_RING_SIZE];
+    atomic_ulong head;
+    atomic_ulong tail;
+} LogRing;
+
+extern int logLevel;
+
+int InitLogger (int level, char* accessLog);
+int LogLevelFromName (char* name);
+void LogWrite (int level, const char* format, ...) __attribute__ ((format (printf, 2, 3)));
+void LogAccess (char* client, char* requestLine, int requestLineLen, int status, long long bytes, long long micros, char* referer, char* userAgent);
+void ClientAddress (int connID, char* buffer, int size);
+long long MicroTime ();
+
+#endif
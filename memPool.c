@@ -0,0 +1,169 @@
+/*
+    Custom Web Server - connection memory
+    By: Ricard Grace
+*/
+
+#include "memPool.h"
+#include "logger.h"
+#include "metrics.h"
+
+/*
+    Keeps what an idle connection costs down to its connection object.
+        - connection objects come from a slab pool owned by the loop that accepted them, so
+          accepting and closing never touches malloc and objects of one loop sit together
+        - receive buffers start at RECV_INITIAL_SIZE (from a slab as well) and only grow for the
+          odd large request, they are handed back while a connection has nothing buffered
+        - everything one request needs (the parser, decoded file name, ranges, response header)
+          comes from a per-request arena that is reset, not freed, between pipelined requests
+          and gives its block back once the connection goes idle
+    The blocking modes use the same buffers and arenas with malloc in place of the slabs.
+*/
+
+void InitSlabPool (SlabPool* pool, size_t objectSize) {
+    pool->objectSize = (objectSize + SLAB_ALIGN - 1) / SLAB_ALIGN * SLAB_ALIGN;
+    pool->perSlab = SLAB_BYTES / pool->objectSize;
+    if (pool->perSlab < 1) pool->perSlab = 1;
+    pool->freeList = NULL;
+}
+
+//returns NULL when a new slab is needed and cannot be allocated
+void* SlabAlloc (SlabPool* pool) {
+    if (pool->freeList == NULL) {
+        //malloc's 16 byte alignment carries over to every object of the slab
+        char* slab = malloc(pool->objectSize * pool->perSlab);
+        if (slab == NULL) return NULL;
+        CountSlabBytes(pool->objectSize * pool->perSlab);
+        int i;
+        for (i = pool->perSlab - 1; i >= 0; i--) {
+            void** object = (void**)&slab[i * pool->objectSize];
+            *object = pool->freeList;
+            pool->freeList = object;
+        }
+    }
+    void** object = pool->freeList;
+    pool->freeList = *object;
+    return object;
+}
+
+void SlabFree (SlabPool* pool, void* object) {
+    *(void**)object = pool->freeList;
+    pool->freeList = object;
+}
+
+void InitGrowBuffer (GrowBuffer* buffer, SlabPool* slab) {
+    buffer->data = NULL;
+    buffer->size = 0;
+    buffer->slab = slab;
+}
+
+//make room for wanted more bytes after the used ones, growing the buffer (up to BUFF_SIZE) if needed
+//returns the space there is, which is less than wanted once the buffer is as big as it gets, or ERROR
+int ReserveSpace (GrowBuffer* buffer, int used, int wanted) {
+    if (buffer->data == NULL) {
+        buffer->size = buffer->slab != NULL ? (int)buffer->slab->objectSize : RECV_INITIAL_SIZE;
+        buffer->data = buffer->slab != NULL ? SlabAlloc(buffer->slab) : malloc(buffer->size);
+        if (buffer->data == NULL) {
+            LogError("** out of memory **");
+            buffer->size = 0;
+            return ERROR;
+        }
+    }
+
+    int newSize = buffer->size;
+    while (newSize - 1 - used < wanted && newSize < BUFF_SIZE+1) {
+        newSize = newSize * 2 > BUFF_SIZE+1 ? BUFF_SIZE+1 : newSize * 2;
+    }
+    if (newSize != buffer->size) {
+        char* data;
+        if (buffer->slab != NULL && buffer->size == buffer->slab->objectSize) {
+            //outgrown the slab block, larger buffers come from malloc
+            data = malloc(newSize);
+            if (data != NULL) {
+                memcpy(data,buffer->data,used);
+                SlabFree(buffer->slab, buffer->data);
+            }
+        } else {
+            data = realloc(buffer->data,newSize);
+        }
+        if (data == NULL) {
+            LogError("** out of memory **");
+            return ERROR;
+        }
+        buffer->data = data;
+        buffer->size = newSize;
+    }
+    return buffer->size - 1 - used;
+}
+
+//hand the buffer back, it is allocated again when next needed
+void ReleaseGrowBuffer (GrowBuffer* buffer) {
+    if (buffer->data == NULL) return;
+    if (buffer->slab != NULL && buffer->size == buffer->slab->objectSize) {
+        SlabFree(buffer->slab, buffer->data);
+    } else {
+        free(buffer->data);
+    }
+    buffer->data = NULL;
+    buffer->size = 0;
+}
+
+void InitArena (Arena* arena, SlabPool* slab) {
+    arena->block = NULL;
+    arena->used = 0;
+    arena->extra = NULL;
+    arena->slab = slab;
+}
+
+//size bytes (16 byte aligned) that last until the arena is reset, NULL if out of memory
+void* ArenaAlloc (Arena* arena, size_t size) {
+    size = (size + SLAB_ALIGN - 1) / SLAB_ALIGN * SLAB_ALIGN;
+    int blockSize = arena->slab != NULL ? (int)arena->slab->objectSize : ARENA_BLOCK_SIZE;
+    if (arena->block == NULL) {
+        arena->block = arena->slab != NULL ? SlabAlloc(arena->slab) : malloc(blockSize);
+        arena->used = 0;
+    }
+    if (arena->block != NULL && size <= blockSize - arena->used) {
+        void* memory = &arena->block[arena->used];
+        arena->used += size;
+        return memory;
+    }
+
+    //too big for what is left of the block
+    ArenaExtra* extra = malloc(sizeof(ArenaExtra) + size);
+    if (extra == NULL) {
+        LogError("** out of memory **");
+        return NULL;
+    }
+    extra->next = arena->extra;
+    arena->extra = extra;
+    return extra + 1;
+}
+
+char* ArenaStrdup (Arena* arena, char* text) {
+    size_t len = strlen(text);
+    char* copy = ArenaAlloc(arena, len + 1);
+    if (copy != NULL) memcpy(copy,text,len + 1);
+    return copy;
+}
+
+//forget everything allocated, the block is kept for the next request
+void ResetArena (Arena* arena) {
+    while (arena->extra != NULL) {
+        ArenaExtra* next = arena->extra->next;
+        free(arena->extra);
+        arena->extra = next;
+    }
+    arena->used = 0;
+}
+
+//reset and hand the block back as well
+void ReleaseArena (Arena* arena) {
+    ResetArena(arena);
+    if (arena->block == NULL) return;
+    if (arena->slab != NULL) {
+        SlabFree(arena->slab, arena->block);
+    } else {
+        free(arena->block);
+    }
+    arena->block = NULL;
+}
@@ -0,0 +1,68 @@
+/*
+    Custom Web Server - connection memory
+    By: Ricard Grace
+*/
+
+#ifndef MEMPOOL_H
+#define MEMPOOL_H
+
+#include "webServer.h"
+
+#include <stdint.h>
+
+//objects are handed out 16 byte aligned, slabs are carved into objects this many bytes at a time
+#define SLAB_ALIGN 16
+#define SLAB_BYTES 65536
+//receive buffers start this small and double (up to BUFF_SIZE) while a request needs more
+#define RECV_INITIAL_SIZE 2048
+//each request's arena block, anything that does not fit gets its own allocation
+#define ARENA_BLOCK_SIZE 4096
+
+//fixed size objects carved out of larger slabs, used by one thread only so nothing is locked
+//objects go back on the free list rather than to malloc, slabs are kept for the life of the pool
+typedef struct _slabPool {
+    size_t objectSize;
+    int perSlab;
+    void* freeList;
+} SlabPool;
+
+//receive buffer that grows as a request needs it, data is NULL while it is not needed
+typedef struct _growBuffer {
+    char* data;
+    //one byte is always kept for the terminating '\0'
+    int size;
+    //where the first (smallest) block comes from, NULL means malloc
+    SlabPool* slab;
+} GrowBuffer;
+
+//allocations that did not fit in an arena's block
+typedef struct _arenaExtra {
+    struct _arenaExtra* next;
+    //keeps what follows the header aligned
+    long long align;
+} ArenaExtra;
+
+//memory for one request, reset in one go once the response is sent
+typedef struct _arena {
+    char* block;
+    int used;
+    ArenaExtra* extra;
+    //where the block comes from, NULL means malloc
+    SlabPool* slab;
+} Arena;
+
+void InitSlabPool (SlabPool* pool, size_t objectSize);
+void* SlabAlloc (SlabPool* pool);
+void SlabFree (SlabPool* pool, void* object);
+
+void InitGrowBuffer (GrowBuffer* buffer, SlabPool* slab);
+int ReserveSpace (GrowBuffer* buffer, int used, int wanted);
+void ReleaseGrowBuffer (GrowBuffer* buffer);
+
+void InitArena (Arena* arena, SlabPool* slab);
+void* ArenaAlloc (Arena* arena, size_t size);
+char* ArenaStrdup (Arena* arena, char* text);
+void ResetArena (Arena* arena);
+void ReleaseArena (Arena* arena);
+
+#endif
@@ -0,0 +1,271 @@
+/*
+    Custom Web Server - metrics
+    By: Ricard Grace
+*/
+
+#include "metrics.h"
+#include "logger.h"
+
+#include <sys/mman.h>
+#include <time.h>
+
+/*
+    Every thread counts into a block of its own, so recording a request never takes a lock or
+    contends on a shared cache line: the owning thread is the only writer and uses plain relaxed
+    loads and stores. Latencies go into log-linear (HDR style) histograms that cost one array
+    increment to record. Blocks are only added together when /__metrics is requested, and are
+    never freed: an exited thread's block is taken over by the next new thread (see threadSlot.c),
+    so its counts carry on being included.
+*/
+
+static ThreadMetrics* ThreadBlock ();
+static void Bump (atomic_ulong* counter, unsigned long amount);
+static unsigned long Total (atomic_ulong* counter);
+
+static char* phaseNames[NUM_PHASES] = {"first_byte", "parse", "resolve", "header_send", "body_send"};
+static char* timeoutNames[NUM_TIMEOUTS] = {"idle", "header", "send", "body"};
+static char* shedNames[NUM_SHED_REASONS] = {"connections", "requests", "queue", "files"};
+//bucket boundaries reported to prometheus, in seconds
+static double promBuckets[] = {0.000001, 0.000005, 0.00001, 0.00005, 0.0001, 0.0005, 0.001, 0.005, 0.01, 0.05, 0.1, 0.5, 1, 5};
+static double quantiles[] = {0.5, 0.9, 0.99, 0.999};
+
+static SlotList blocks;
+static __thread ThreadMetrics* threadBlock = NULL;
+static ThreadPool* watchedPool = NULL;
+
+void InitMetrics () {
+    InitSlotList(&blocks, sizeof(ThreadMetrics));
+}
+
+//report the queue depth of pool as well
+void MetricsWatchPool (ThreadPool* pool) {
+    watchedPool = pool;
+}
+
+long long NanoTime () {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC,&now);
+    return (long long)now.tv_sec * 1000000000 + now.tv_nsec;
+}
+
+void RecordPhase (int phase, long long nanos) {
+    ThreadMetrics* block = ThreadBlock();
+    if (block == NULL) return;
+    if (nanos < 0) nanos = 0;
+    Bump(&block->phases[phase][HistBucket(nanos)],1);
+    Bump(&block->phaseSum[phase],nanos);
+}
+
+void CountResponse (int status, long long bytes) {
+    ThreadMetrics* block = ThreadBlock();
+    if (block == NULL) return;
+    if (status >= MIN_STATUS && status <= MAX_STATUS) Bump(&block->responses[status-MIN_STATUS],1);
+    Bump(&block->bytesSent,bytes);
+}
+
+void CountCache (int hit) {
+    ThreadMetrics* block = ThreadBlock();
+    if (block == NULL) return;
+    Bump(hit ? &block->cacheHits : &block->cacheMisses,1);
+}
+
+void CountConnection (int change) {
+    ThreadMetrics* block = ThreadBlock();
+    if (block == NULL) return;
+    long value = atomic_load_explicit(&block->connections,memory_order_relaxed);
+    atomic_store_explicit(&block->connections,value+change,memory_order_relaxed);
+}
+
+//slabs are never freed, so this only grows
+void CountSlabBytes (long bytes) {
+    ThreadMetrics* block = ThreadBlock();
+    if (block == NULL) return;
+    Bump(&block->slabBytes,bytes);
+}
+
+void CountTimeout (int timeout) {
+    ThreadMetrics* block = ThreadBlock();
+    if (block == NULL) return;
+    Bump(&block->timeouts[timeout],1);
+}
+
+void CountShed (int reason) {
+    ThreadMetrics* block = ThreadBlock();
+    if (block == NULL) return;
+    Bump(&block->shed[reason],1);
+}
+
+//write the current metrics into an anonymous file, returns its descriptor and size
+int MetricsFile (long long* size) {
+    char* text = NULL;
+    size_t textLen = 0;
+    FILE* out = open_memstream(&text,&textLen);
+    if (out == NULL) return ERROR;
+
+    //add up every thread's block
+    static unsigned long phases[NUM_PHASES][HIST_BUCKETS];
+    unsigned long phaseSum[NUM_PHASES];
+    unsigned long responses[MAX_STATUS - MIN_STATUS + 1];
+    unsigned long bytesSent = 0;
+    unsigned long cacheHits = 0;
+    unsigned long cacheMisses = 0;
+    long connections = 0;
+    unsigned long slabBytes = 0;
+    unsigned long timeouts[NUM_TIMEOUTS];
+    unsigned long shed[NUM_SHED_REASONS];
+    memset(phaseSum,0,sizeof(phaseSum));
+    memset(timeouts,0,sizeof(timeouts));
+    memset(shed,0,sizeof(shed));
+    memset(responses,0,sizeof(responses));
+    //only one thread adds up at a time, the rest of the time phases is unused
+    static pthread_mutex_t sumLock = PTHREAD_MUTEX_INITIALIZER;
+    pthread_mutex_lock(&sumLock);
+    memset(phases,0,sizeof(phases));
+
+    ThreadSlot* slot;
+    int p, i;
+    for (slot = atomic_load(&blocks.head); slot != NULL; slot = slot->next) {
+        ThreadMetrics* block = (ThreadMetrics*)slot;
+        for (p = 0; p < NUM_PHASES; p++) {
+            for (i = 0; i < HIST_BUCKETS; i++) phases[p][i] += Total(&block->phases[p][i]);
+            phaseSum[p] += Total(&block->phaseSum[p]);
+        }
+        for (i = 0; i <= MAX_STATUS - MIN_STATUS; i++) responses[i] += Total(&block->responses[i]);
+        bytesSent += Total(&block->bytesSent);
+        cacheHits += Total(&block->cacheHits);
+        cacheMisses += Total(&block->cacheMisses);
+        connections += atomic_load_explicit(&block->connections,memory_order_relaxed);
+        slabBytes += Total(&block->slabBytes);
+        for (i = 0; i < NUM_TIMEOUTS; i++) timeouts[i] += Total(&block->timeouts[i]);
+        for (i = 0; i < NUM_SHED_REASONS; i++) shed[i] += Total(&block->shed[i]);
+    }
+
+    fprintf(out,"# HELP webserver_responses_total Responses sent, by status code.\n");
+    fprintf(out,"# TYPE webserver_responses_total counter\n");
+    for (i = 0; i <= MAX_STATUS - MIN_STATUS; i++) {
+        if (responses[i] > 0) fprintf(out,"webserver_responses_total{code=\"%d\"} %lu\n",i+MIN_STATUS,responses[i]);
+    }
+    fprintf(out,"# HELP webserver_sent_bytes_total Bytes of responses sent.\n");
+    fprintf(out,"# TYPE webserver_sent_bytes_total counter\n");
+    fprintf(out,"webserver_sent_bytes_total %lu\n",bytesSent);
+    fprintf(out,"# HELP webserver_active_connections Connections currently open.\n");
+    fprintf(out,"# TYPE webserver_active_connections gauge\n");
+    fprintf(out,"webserver_active_connections %ld\n",connections);
+    fprintf(out,"# HELP webserver_slab_bytes Memory the event loops hold for connections and their buffers.\n");
+    fprintf(out,"# TYPE webserver_slab_bytes gauge\n");
+    fprintf(out,"webserver_slab_bytes %lu\n",slabBytes);
+    fprintf(out,"# HELP webserver_timeouts_total Connections closed by a timeout, by what it was waiting for.\n");
+    fprintf(out,"# TYPE webserver_timeouts_total counter\n");
+    for (i = 0; i < NUM_TIMEOUTS; i++) fprintf(out,"webserver_timeouts_total{kind=\"%s\"} %lu\n",timeoutNames[i],timeouts[i]);
+    fprintf(out,"# HELP webserver_shed_total Clients turned away with a 503, by the limit they ran into.\n");
+    fprintf(out,"# TYPE webserver_shed_total counter\n");
+    for (i = 0; i < NUM_SHED_REASONS; i++) fprintf(out,"webserver_shed_total{reason=\"%s\"} %lu\n",shedNames[i],shed[i]);
+    fprintf(out,"# HELP webserver_cache_requests_total File cache lookups, by result.\n");
+    fprintf(out,"# TYPE webserver_cache_requests_total counter\n");
+    fprintf(out,"webserver_cache_requests_total{result=\"hit\"} %lu\n",cacheHits);
+    fprintf(out,"webserver_cache_requests_total{result=\"miss\"} %lu\n",cacheMisses);
+    if (watchedPool != NULL) {
+        fprintf(out,"# HELP webserver_pool_queue_depth Accepted connections waiting for a worker.\n");
+        fprintf(out,"# TYPE webserver_pool_queue_depth gauge\n");
+        fprintf(out,"webserver_pool_queue_depth %d\n",PoolQueueDepth(watchedPool));
+    }
+
+    fprintf(out,"# HELP webserver_phase_seconds Time spent in each phase of a request.\n");
+    fprintf(out,"# TYPE webserver_phase_seconds histogram\n");
+    int numBuckets = sizeof(promBuckets) / sizeof(promBuckets[0]);
+    for (p = 0; p < NUM_PHASES; p++) {
+        //a histogram bucket is counted under the first boundary that its largest value fits below
+        unsigned long count = 0;
+        int b = 0;
+        for (i = 0; i < HIST_BUCKETS; i++) {
+            while (b < numBuckets && HistBucketUpper(i) > promBuckets[b] * 1e9) {
+                fprintf(out,"webserver_phase_seconds_bucket{phase=\"%s\",le=\"%g\"} %lu\n",phaseNames[p],promBuckets[b],count);
+                b++;
+            }
+            count += phases[p][i];
+        }
+        for (; b < numBuckets; b++) {
+            fprintf(out,"webserver_phase_seconds_bucket{phase=\"%s\",le=\"%g\"} %lu\n",phaseNames[p],promBuckets[b],count);
+        }
+        fprintf(out,"webserver_phase_seconds_bucket{phase=\"%s\",le=\"+Inf\"} %lu\n",phaseNames[p],count);
+        fprintf(out,"webserver_phase_seconds_sum{phase=\"%s\"} %.9f\n",phaseNames[p],phaseSum[p] / 1e9);
+        fprintf(out,"webserver_phase_seconds_count{phase=\"%s\"} %lu\n",phaseNames[p],count);
+    }
+
+    //the full resolution histograms give much better tail estimates than the buckets above
+    fprintf(out,"# HELP webserver_phase_quantile_seconds Quantiles of the time spent in each phase.\n");
+    fprintf(out,"# TYPE webserver_phase_quantile_seconds gauge\n");
+    int numQuantiles = sizeof(quantiles) / sizeof(quantiles[0]);
+    for (p = 0; p < NUM_PHASES; p++) {
+        unsigned long count = 0;
+        for (i = 0; i < HIST_BUCKETS; i++) count += phases[p][i];
+        if (count == 0) continue;
+        int q;
+        for (q = 0; q < numQuantiles; q++) {
+            fprintf(out,"webserver_phase_quantile_seconds{phase=\"%s\",quantile=\"%g\"} %.9f\n",phaseNames[p],quantiles[q],HistQuantile(phases[p],count,quantiles[q]) / 1e9);
+        }
+    }
+    pthread_mutex_unlock(&sumLock);
+    fclose(out);
+
+    int fileFd = memfd_create("metrics",MFD_CLOEXEC);
+    if (fileFd == ERROR) {
+        LogError("** memfd_create error ** %s",strerror(errno));
+    } else if (write(fileFd,text,textLen) != (ssize_t)textLen) {
+        LogError("** write error ** %s",strerror(errno));
+        close(fileFd);
+        fileFd = ERROR;
+    }
+    free(text);
+    *size = (long long)textLen;
+    return fileFd;
+}
+
+//the bucket value is counted in, a histogram is an array of HIST_BUCKETS (tools/loadGen.c keeps its latencies the same way)
+int HistBucket (unsigned long value) {
+    if (value < HIST_SUB_BUCKETS) return (int)value;
+    int top = 63 - __builtin_clzl(value);
+    int sub = (int)(value >> (top - HIST_SUB_BITS)) & (HIST_SUB_BUCKETS - 1);
+    return (top - HIST_SUB_BITS + 1) * HIST_SUB_BUCKETS + sub;
+}
+
+//largest value that falls in the bucket
+unsigned long HistBucketUpper (int index) {
+    if (index < HIST_SUB_BUCKETS) return index;
+    int top = index / HIST_SUB_BUCKETS + HIST_SUB_BITS - 1;
+    int sub = index % HIST_SUB_BUCKETS;
+    unsigned long width = 1UL << (top - HIST_SUB_BITS);
+    return (HIST_SUB_BUCKETS + sub) * width + width - 1;
+}
+
+//an upper bound on the given quantile of the count values in buckets (0 if there are none)
+double HistQuantile (unsigned long* buckets, unsigned long count, double quantile) {
+    if (count == 0) return 0;
+    unsigned long rank = (unsigned long)(quantile * count);
+    if (rank >= count) rank = count - 1;
+    unsigned long seen = 0;
+    int i;
+    for (i = 0; i < HIST_BUCKETS; i++) {
+        seen += buckets[i];
+        if (seen > rank) return HistBucketUpper(i);
+    }
+    return HistBucketUpper(HIST_BUCKETS - 1);
+}
+
+//the block of the calling thread, taking over an unused one or making a new one the first time
+static ThreadMetrics* ThreadBlock () {
+    if (threadBlock != NULL) return threadBlock;
+    //a new block is zeroed, which is a valid set of counters
+    threadBlock = (ThreadMetrics*)ClaimSlot(&blocks);
+    return threadBlock;
+}
+
+//only the owning thread writes, so a relaxed load and store is enough and needs no locked instruction
+static void Bump (atomic_ulong* counter, unsigned long amount) {
+    atomic_store_explicit(counter,atomic_load_explicit(counter,memory_order_relaxed)+amount,memory_order_relaxed);
+}
+
+static unsigned long Total (atomic_ulong* counter) {
+    return atomic_load_explicit(counter,memory_order_relaxed);
+}
+
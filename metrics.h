@@ -0,0 +1,71 @@
+/*
+    Custom Web Server - metrics
+    By: Ricard Grace
+*/
+
+#ifndef METRICS_H
+#define METRICS_H
+
+#include "webServer.h"
+#include "threadPool.h"
+#include "timerWheel.h"
+#include "admission.h"
+#include "threadSlot.h"
+
+#include <stdatomic.h>
+
+//reserved address the metrics are served on (Prometheus text format)
+#define METRICS_PATH "/__metrics"
+
+//phases of a request that are timed
+#define PHASE_FIRST_BYTE 0
+#define PHASE_PARSE      1
+#define PHASE_RESOLVE    2
+#define PHASE_HEADER     3
+#define PHASE_BODY       4
+#define NUM_PHASES       5
+
+//histogram buckets: values below 2^HIST_SUB_BITS get a bucket each, above that every power of
+//two is split into 2^HIST_SUB_BITS buckets (about 6% precision from 1ns up to any 64 bit value)
+#define HIST_SUB_BITS 4
+#define HIST_SUB_BUCKETS (1 << HIST_SUB_BITS)
+#define HIST_BUCKETS ((64 - HIST_SUB_BITS + 1) * HIST_SUB_BUCKETS)
+
+//status codes counted individually
+#define MIN_STATUS 100
+#define MAX_STATUS 599
+
+//the metrics of one thread, only that thread ever changes them
+typedef struct _threadMetrics {
+    ThreadSlot slot;
+    atomic_ulong phases[NUM_PHASES][HIST_BUCKETS];
+    atomic_ulong phaseSum[NUM_PHASES];
+    atomic_ulong responses[MAX_STATUS - MIN_STATUS + 1];
+    atomic_ulong bytesSent;
+    atomic_ulong cacheHits;
+    atomic_ulong cacheMisses;
+    //opened minus closed, a connection may be closed by a different thread than opened it
+    atomic_long connections;
+    atomic_ulong slabBytes;
+    //connections closed by their deadline, by what it was waiting for
+    atomic_ulong timeouts[NUM_TIMEOUTS];
+    //clients turned away with a 503, by the limit they ran into
+    atomic_ulong shed[NUM_SHED_REASONS];
+} ThreadMetrics;
+
+void InitMetrics ();
+void MetricsWatchPool (ThreadPool* pool);
+long long NanoTime ();
+void RecordPhase (int phase, long long nanos);
+void CountResponse (int status, long long bytes);
+void CountCache (int hit);
+void CountConnection (int change);
+void CountSlabBytes (long bytes);
+void CountTimeout (int timeout);
+void CountShed (int reason);
+int MetricsFile (long long* size);
+int HistBucket (unsigned long value);
+unsigned long HistBucketUpper (int index);
+double HistQuantile (unsigned long* buckets, unsigned long count, double quantile);
+
+#endif
@@ -0,0 +1,81 @@
+/*
+    Custom Web Server - content types
+    By: Ricard Grace
+*/
+
+#include "mimeTypes.h"
+
+#include <ctype.h>
+
+/*
+    Every response with a body says what it is, so browsers do not have to guess from the bytes.
+    The type comes from the file's extension, looked up in a table laid out at compile time: each
+    extension is put in the slot MIME_SLOT gives it, and the multipliers in MIME_SLOT were picked
+    so that no two extensions in the table share a slot. A lookup is then one hash and one string
+    compare, with nothing to build at startup and nothing to lock.
+    Text types say they are UTF-8, anything not in the table is sent as application/octet-stream.
+*/
+
+//two extensions landing in the same slot would silently replace one another, make it a build error
+#pragma GCC diagnostic error "-Woverride-init"
+
+#define MIME_ENTRY(first,second,last,ext,type) [MIME_SLOT(first,second,last,sizeof(ext)-1)] = {ext, type}
+
+static const MimeType mimeTable[MIME_SLOTS] = {
+    //text
+    MIME_ENTRY('h','t','l',"html","text/html; charset=utf-8"),
+    MIME_ENTRY('h','t','m',"htm","text/html; charset=utf-8"),
+    MIME_ENTRY('c','s','s',"css","text/css; charset=utf-8"),
+    MIME_ENTRY('j','s','s',"js","text/javascript; charset=utf-8"),
+    MIME_ENTRY('m','j','s',"mjs","text/javascript; charset=utf-8"),
+    MIME_ENTRY('t','x','t',"txt","text/plain; charset=utf-8"),
+    MIME_ENTRY('c','s','v',"csv","text/csv; charset=utf-8"),
+    MIME_ENTRY('m','d','d',"md","text/markdown; charset=utf-8"),
+    MIME_ENTRY('j','s','n',"json","application/json"),
+    MIME_ENTRY('x','m','l',"xml","application/xml"),
+    //images
+    MIME_ENTRY('s','v','g',"svg","image/svg+xml"),
+    MIME_ENTRY('p','n','g',"png","image/png"),
+    MIME_ENTRY('j','p','g',"jpg","image/jpeg"),
+    MIME_ENTRY('j','p','g',"jpeg","image/jpeg"),
+    MIME_ENTRY('g','i','f',"gif","image/gif"),
+    MIME_ENTRY('w','e','p',"webp","image/webp"),
+    MIME_ENTRY('i','c','o',"ico","image/x-icon"),
+    MIME_ENTRY('a','v','f',"avif","image/avif"),
+    MIME_ENTRY('b','m','p',"bmp","image/bmp"),
+    //fonts
+    MIME_ENTRY('w','o','f',"woff","font/woff"),
+    MIME_ENTRY('w','o','2',"woff2","font/woff2"),
+    MIME_ENTRY('t','t','f',"ttf","font/ttf"),
+    MIME_ENTRY('o','t','f',"otf","font/otf"),
+    //audio and video
+    MIME_ENTRY('m','p','3',"mp3","audio/mpeg"),
+    MIME_ENTRY('m','p','4',"mp4","video/mp4"),
+    MIME_ENTRY('w','e','m',"webm","video/webm"),
+    MIME_ENTRY('o','g','g',"ogg","audio/ogg"),
+    MIME_ENTRY('w','a','v',"wav","audio/wav"),
+    //everything else
+    MIME_ENTRY('p','d','f',"pdf","application/pdf"),
+    MIME_ENTRY('z','i','p',"zip","application/zip"),
+    MIME_ENTRY('g','z','z',"gz","application/gzip"),
+    MIME_ENTRY('t','a','r',"tar","application/x-tar"),
+    MIME_ENTRY('w','a','m',"wasm","application/wasm"),
+};
+
+//the Content-Type for the file at path, from its extension
+char* ContentType (char* path) {
+    char* dot = strrchr(path,'.');
+    if (dot == NULL || strchr(dot,'/') != NULL) return DEFAULT_MIME_TYPE;
+    char ext[MIME_MAX_EXT+1];
+    int len;
+    for (len = 0; dot[len+1] != '\0'; len++) {
+        if (len == MIME_MAX_EXT) return DEFAULT_MIME_TYPE;
+        ext[len] = tolower((unsigned char)dot[len+1]);
+    }
+    ext[len] = '\0';
+    if (len < 2) return DEFAULT_MIME_TYPE;
+
+    const MimeType* entry = &mimeTable[MIME_SLOT(ext[0],ext[1],ext[len-1],len)];
+    if (entry->extension == NULL || strcmp(entry->extension,ext) != STREQU) return DEFAULT_MIME_TYPE;
+    return entry->type;
+}
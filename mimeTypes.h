@@ -0,0 +1,29 @@
+/*
+    Custom Web Server - content types
+    By: Ricard Grace
+*/
+
+#ifndef MIMETYPES_H
+#define MIMETYPES_H
+
+#include "webServer.h"
+
+//size of the extension table (a power of two) and the longest extension in it
+#define MIME_SLOTS 64
+#define MIME_MAX_EXT 5
+//files with an extension that is not in the table
+#define DEFAULT_MIME_TYPE "application/octet-stream"
+#define METRICS_MIME_TYPE "text/plain; version=0.0.4; charset=utf-8"
+
+//where an extension (lower case, at least two characters) goes in the table, from its first two
+//and last characters and its length
+#define MIME_SLOT(first,second,last,len) (((first) + (second)*17 + (last)*45 + (len)*6) % MIME_SLOTS)
+
+typedef struct _mimeType {
+    char* extension;
+    char* type;
+} MimeType;
+
+char* ContentType (char* path);
+
+#endif
@@ -0,0 +1,197 @@
+/*
+    Custom Web Server - byte ranges
+    By: Ricard Grace
+*/
+
+#include "range.h"
+#include "conditional.h"
+#include "memPool.h"
+
+#include <stdatomic.h>
+#include <sys/random.h>
+
+/*
+    Range requests let clients resume downloads and fetch a file in pieces. A GET for a file can
+    ask for any number of byte ranges (first-last, first- or -suffix). One satisfiable range is
+    answered with a 206 and a Content-Range, several with a multipart/byteranges 206, and a
+    request none of whose ranges are inside the file with a 416. A Range header that cannot be
+    parsed, uses another unit or asks for more than MAX_RANGES ranges is ignored and the whole
+    file is sent. If-Range makes the Range conditional on the client still having the current
+    version (its ETag, or its exact Last-Modified date).
+    Every response body is sent as a sequence of parts (NextBodyPart), a whole file being a
+    single part, so both serving modes and every send method handle ranges the same way.
+    Multipart boundaries start with 64 random bits picked when the server starts, so a client
+    cannot predict them and put one in a file to break up a later response.
+*/
+
+static int ParseRangeSpec (char* spec, long long fileSize, ByteRange* range);
+static int IfRangeMatches (HttpParser* parser, char* request, ReqInfo* reqInfo);
+static int PartHeader (RangeSet* ranges, int part, long long fileSize, char* buffer, int size);
+
+//numbers the multipart boundaries so no two responses share one
+static atomic_ullong nextBoundary = 1;
+static unsigned long long boundaryPrefix = 0;
+
+//pick the random part of every multipart boundary
+int InitRanges () {
+    if (getrandom(&boundaryPrefix,sizeof(boundaryPrefix),0) != sizeof(boundaryPrefix)) {
+        fprintf(stderr,"** getrandom error ** %s\n",strerror(errno));
+        return ERROR;
+    }
+    return NOERR;
+}
+
+//fill in reqInfo->ranges from the Range header of a GET for a whole file
+//returns TRUE for a 206, FALSE to send the whole file and ERROR for a 416
+int ParseRanges (HttpParser* parser, char* request, ReqInfo* reqInfo) {
+    reqInfo->ranges = NULL;
+    char value[VALUE_SIZE];
+    if (CopyHeader(parser, request, HDR_RANGE, value, VALUE_SIZE) == ERROR) return FALSE;
+    if (strncasecmp(value,RANGE_UNIT,strlen(RANGE_UNIT)) != STREQU) return FALSE;
+    if (!IfRangeMatches(parser, request, reqInfo)) return FALSE;
+
+    //only requests with ranges pay for a RangeSet
+    RangeSet* ranges = ArenaAlloc(reqInfo->arena, sizeof(RangeSet));
+    if (ranges == NULL) return FALSE;
+    ranges->numRanges = 0;
+    ranges->contentType = reqInfo->contentType;
+    reqInfo->ranges = ranges;
+
+    int numSpecs = 0;
+    char* save;
+    char* spec;
+    for (spec = strtok_r(&value[strlen(RANGE_UNIT)],",",&save); spec != NULL; spec = strtok_r(NULL,",",&save)) {
+        if (++numSpecs > MAX_RANGES) {
+            ranges->numRanges = 0;
+            return FALSE;
+        }
+        int result = ParseRangeSpec(spec, reqInfo->fileSize, &ranges->ranges[ranges->numRanges]);
+        if (result == ERROR) {
+            ranges->numRanges = 0;
+            return FALSE;
+        }
+        if (result == TRUE) ranges->numRanges++;
+    }
+    if (ranges->numRanges == 0) return ERROR;
+
+    if (ranges->numRanges == 1) {
+        ranges->bodyLength = ranges->ranges[0].end - ranges->ranges[0].start + 1;
+        return TRUE;
+    }
+    ranges->boundary = atomic_fetch_add_explicit(&nextBoundary,1,memory_order_relaxed);
+    ranges->bodyLength = 0;
+    int part;
+    for (part = 0; part <= ranges->numRanges; part++) {
+        ranges->bodyLength += PartHeader(ranges, part, reqInfo->fileSize, ranges->partHeader, RANGE_HEADER_SIZE);
+        if (part < ranges->numRanges) ranges->bodyLength += ranges->ranges[part].end - ranges->ranges[part].start + 1;
+    }
+    return TRUE;
+}
+
+//write the headers that describe the ranges of a 206 or 416 into buffer, returns their length
+int RangeHeaders (ReqInfo* reqInfo, char* buffer, int size) {
+    RangeSet* ranges = reqInfo->ranges;
+    if (strcmp(reqInfo->responseCode,RESPONSE_416) == STREQU) {
+        return snprintf(buffer,size,"Content-Range: bytes */%lld\r\n",reqInfo->fileSize);
+    }
+    if (ranges == NULL) {
+        buffer[0] = '\0';
+        return 0;
+    }
+    if (ranges->numRanges == 1) {
+        return snprintf(buffer,size,"Content-Range: bytes %lld-%lld/%lld\r\n",ranges->ranges[0].start,ranges->ranges[0].end,reqInfo->fileSize);
+    }
+    if (ranges->numRanges > 1) {
+        return snprintf(buffer,size,"Content-Type: multipart/byteranges; boundary=" BOUNDARY_FORMAT "\r\n",boundaryPrefix,ranges->boundary);
+    }
+    buffer[0] = '\0';
+    return 0;
+}
+
+//length of the body the response sends
+long long BodyLength (ReqInfo* reqInfo) {
+    if (strcmp(reqInfo->responseCode,RESPONSE_416) == STREQU) return 0;
+    if (reqInfo->ranges != NULL && reqInfo->ranges->numRanges > 0) return reqInfo->ranges->bodyLength;
+    return reqInfo->fileSize;
+}
+
+//point sender (set up for the whole file) at part number part of the body, returns FALSE once there are no more
+//multipart bodies are a delimiter and range per part then a closing delimiter
+//ranges is NULL when the whole file is sent
+int NextBodyPart (RangeSet* ranges, int part, long long fileSize, FileSender* sender) {
+    if (ranges == NULL || ranges->numRanges == 0) {
+        if (part > 0) return FALSE;
+        SetSenderRange(sender, NULL, 0, 0, fileSize);
+        return TRUE;
+    }
+    if (ranges->numRanges == 1) {
+        if (part > 0) return FALSE;
+        SetSenderRange(sender, NULL, 0, ranges->ranges[0].start, ranges->ranges[0].end - ranges->ranges[0].start + 1);
+        return TRUE;
+    }
+    if (part > ranges->numRanges) return FALSE;
+    int headerLen = PartHeader(ranges, part, fileSize, ranges->partHeader, RANGE_HEADER_SIZE);
+    if (part == ranges->numRanges) {
+        SetSenderRange(sender, ranges->partHeader, headerLen, 0, 0);
+    } else {
+        SetSenderRange(sender, ranges->partHeader, headerLen, ranges->ranges[part].start, ranges->ranges[part].end - ranges->ranges[part].start + 1);
+    }
+    return TRUE;
+}
+
+//one of first-last, first- or -suffix, returns TRUE for a range inside the file
+//FALSE for one that starts past the end and ERROR if it cannot be parsed
+static int ParseRangeSpec (char* spec, long long fileSize, ByteRange* range) {
+    while (*spec == ' ' || *spec == '\t') spec++;
+    char* end;
+    if (*spec == '-') {
+        //the last n bytes
+        if (spec[1] < '0' || spec[1] > '9') return ERROR;
+        long long suffix = strtoll(&spec[1],&end,10);
+        if (end[strspn(end," \t")] != '\0') return ERROR;
+        if (suffix == 0 || fileSize == 0) return FALSE;
+        range->start = suffix >= fileSize ? 0 : fileSize - suffix;
+        range->end = fileSize - 1;
+        return TRUE;
+    }
+    if (*spec < '0' || *spec > '9') return ERROR;
+    range->start = strtoll(spec,&end,10);
+    if (*end != '-') return ERROR;
+    spec = end + 1;
+    if (*spec >= '0' && *spec <= '9') {
+        range->end = strtoll(spec,&end,10);
+        if (range->end < range->start) return ERROR;
+    } else {
+        range->end = fileSize - 1;
+        end = spec;
+    }
+    if (end[strspn(end," \t")] != '\0') return ERROR;
+    if (range->start >= fileSize) return FALSE;
+    if (range->end >= fileSize) range->end = fileSize - 1;
+    return TRUE;
+}
+
+//the Range applies only if If-Range (when there is one) still describes the file
+static int IfRangeMatches (HttpParser* parser, char* request, ReqInfo* reqInfo) {
+    char value[VALUE_SIZE];
+    if (CopyHeader(parser, request, HDR_IF_RANGE, value, VALUE_SIZE) == ERROR) return TRUE;
+    if (value[0] == '"') {
+        //strong comparison, a weak tag never matches
+        return strcmp(value,reqInfo->etag) == STREQU;
+    }
+    if (strncmp(value,"W/",2) == STREQU || reqInfo->etag[0] == '\0') return FALSE;
+    char date[HTTP_DATE_SIZE];
+    FormatHttpDate(date, reqInfo->mtime);
+    return strcmp(value,date) == STREQU;
+}
+
+//the delimiter and headers (type and range) ahead of range part, or the closing delimiter when part is numRanges
+static int PartHeader (RangeSet* ranges, int part, long long fileSize, char* buffer, int size) {
+    int len;
+    if (part == ranges->numRanges) {
+        len = snprintf(buffer,size,"\r\n--" BOUNDARY_FORMAT "--\r\n",boundaryPrefix,ranges->boundary);
+    } else {
+        len = snprintf(buffer,size,"\r\n--" BOUNDARY_FORMAT "\r\nContent-Type: %s\r\nContent-Range: bytes %lld-%lld/%lld\r\n\r\n",boundaryPrefix,ranges->boundary,ranges->contentType,ranges->ranges[part].start,ranges->ranges[part].end,fileSize);
+    }
+    return len < size ? len : size-1;
+}
@@ -0,0 +1,24 @@
+/*
+    Custom Web Server - byte ranges
+    By: Ricard Grace
+*/
+
+#ifndef RANGE_H
+#define RANGE_H
+
+#include "webServer.h"
+#include "httpParser.h"
+#include "sendFile.h"
+
+#define RANGE_UNIT "bytes="
+//a multipart boundary is the process's random prefix followed by the response's number
+#define BOUNDARY_FORMAT "%016llx%016llx"
+
+int InitRanges ();
+
+int ParseRanges (HttpParser* parser, char* request, ReqInfo* reqInfo);
+int RangeHeaders (ReqInfo* reqInfo, char* buffer, int size);
+long long BodyLength (ReqInfo* reqInfo);
+int NextBodyPart (RangeSet* ranges, int part, long long fileSize, FileSender* sender);
+
+#endif
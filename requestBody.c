@@ -0,0 +1,283 @@
+/*
+    Custom Web Server - request bodies
+    By: Ricard Grace
+*/
+
+#include "requestBody.h"
+#include "logger.h"
+
+/*
+    Requests with a body (POST uploads and form posts) have it read as it arrives and handed on
+    a receive at a time to a sink, so no body is ever held in memory whole, however large it is.
+        - the body is framed by Content-Length or chunked Transfer-Encoding, chunks are decoded
+          a byte at a time so a chunk size line split over two receives needs nothing kept
+          but the size read so far
+        - a body over the limit (-B) is turned away with a 413: straight away when its
+          Content-Length says so, as soon as it goes over when chunked
+        - a request that sends both framings, or a coding other than chunked, is turned away
+          rather than guessed at, as either guess could let a second request hide in the body
+        - a client that sends Expect: 100-continue is only told to go ahead once the headers
+          have been accepted, so a body that would be turned away is never sent
+    The default sink spools the body to an unnamed file in the spool directory (-T), which goes
+    away by itself once closed. Something that wants the bodies can set its own sink opener.
+    Bodies of requests other than POST are read and thrown away, keeping the connection in step.
+*/
+
+static int Deliver (BodyReader* reader, char* data, int len);
+static int DecodeChunked (BodyReader* reader, char c);
+static int CloseSink (BodyReader* reader, int complete);
+static int WriteSpool (BodySink* sink, char* data, int len);
+static int FinishSpool (BodySink* sink, int complete);
+
+static long long maxBody = DEFAULT_MAX_BODY;
+static char* spoolDir = DEFAULT_SPOOL_DIR;
+static int spoolDirFd = ERROR;
+static BodySinkOpener sinkOpener = OpenSpoolSink;
+
+//the limit on bodies and the directory they are spooled to, returns ERROR if it cannot be used
+int InitRequestBodies (long long limit, char* dir) {
+    maxBody = limit;
+    spoolDir = dir;
+    spoolDirFd = open(dir,O_PATH | O_DIRECTORY | O_CLOEXEC);
+    if (spoolDirFd == ERROR) {
+        fprintf(stderr,"** spool directory error ** %s: %s\n",dir,strerror(errno));
+        return ERROR;
+    }
+    return NOERR;
+}
+
+//send POST bodies somewhere other than the spool file
+void SetBodySinkOpener (BodySinkOpener opener) {
+    sinkOpener = opener;
+}
+
+//does the request header say a body follows
+int RequestHasBody (HttpParser* parser) {
+    return parser->known[HDR_CONTENT_LENGTH].start != ERROR || parser->known[HDR_TRANSFER_ENCODING].start != ERROR;
+}
+
+//work out how the body of the request is framed and open its sink
+//returns TRUE if a body follows, FALSE if there is none and ERROR if it is turned away (reader->status says why)
+int StartBody (BodyReader* reader, HttpParser* parser, char* request) {
+    reader->framing = BODY_LENGTH;
+    reader->remaining = 0;
+    reader->received = 0;
+    reader->chunkState = CHUNK_SIZE;
+    reader->lineLen = 0;
+    reader->complete = FALSE;
+    reader->expectsContinue = FALSE;
+    reader->status = NULL;
+    reader->hasSink = FALSE;
+
+    char value[VALUE_SIZE];
+    if (CopyHeader(parser, request, HDR_TRANSFER_ENCODING, value, VALUE_SIZE) != ERROR) {
+        if (strcasecmp(value,"chunked") != STREQU) {
+            reader->status = RESPONSE_501;
+            return ERROR;
+        }
+        if (parser->known[HDR_CONTENT_LENGTH].start != ERROR) {
+            reader->status = RESPONSE_400;
+            return ERROR;
+        }
+        reader->framing = BODY_CHUNKED;
+    } else if (CopyHeader(parser, request, HDR_CONTENT_LENGTH, value, VALUE_SIZE) != ERROR) {
+        char* end;
+        errno = 0;
+        long long length = strtoll(value,&end,10);
+        if (value[0] < '0' || value[0] > '9' || *end != '\0' || errno == ERANGE) {
+            reader->status = RESPONSE_400;
+            return ERROR;
+        }
+        if (length > maxBody) {
+            reader->status = RESPONSE_413;
+            return ERROR;
+        }
+        if (length == 0) return FALSE;
+        reader->remaining = length;
+    } else {
+        return FALSE;
+    }
+
+    reader->expectsContinue = parser->version == 11 && CopyHeader(parser, request, HDR_EXPECT, value, VALUE_SIZE) != ERROR && strcasecmp(value,"100-continue") == STREQU;
+    if (parser->method == REQUEST_POST) {
+        if (sinkOpener(&reader->sink, request, parser) == ERROR) {
+            reader->status = RESPONSE_500;
+            return ERROR;
+        }
+        reader->hasSink = TRUE;
+    }
+    return TRUE;
+}
+
+//decode len bytes of the body, consumed is set to how many of them belonged to it
+//returns TRUE once the whole body is in, FALSE if more is needed and ERROR if it was turned away
+int FeedBody (BodyReader* reader, char* data, int len, int* consumed) {
+    int pos = 0;
+    while (pos < len && !reader->complete && reader->status == NULL) {
+        if (reader->framing == BODY_LENGTH || reader->chunkState == CHUNK_DATA) {
+            //the body (or chunk) itself goes to the sink in one piece
+            int count = len - pos < reader->remaining ? len - pos : (int)reader->remaining;
+            if (Deliver(reader, &data[pos], count) == ERROR) break;
+            pos += count;
+            reader->remaining -= count;
+            if (reader->remaining == 0 && reader->framing == BODY_LENGTH) reader->complete = TRUE;
+            if (reader->remaining == 0 && reader->framing == BODY_CHUNKED) reader->chunkState = CHUNK_DATA_CR;
+        } else if (DecodeChunked(reader, data[pos++]) == ERROR) {
+            break;
+        }
+    }
+    *consumed = pos;
+
+    if (reader->complete && reader->hasSink && CloseSink(reader, TRUE) == ERROR) reader->status = RESPONSE_500;
+    if (reader->status != NULL) {
+        CloseSink(reader, FALSE);
+        return ERROR;
+    }
+    return reader->complete ? TRUE : FALSE;
+}
+
+//feed the body bytes after the request header in buffer to the reader and drop them from the buffer, so it
+//never holds more than one receive of the body, anything past the end of the body is kept for the next request
+int ConsumeBuffered (BodyReader* reader, char* buffer, int* bytesRecv, int requestLen) {
+    int consumed = 0;
+    int result = FeedBody(reader, &buffer[requestLen], *bytesRecv - requestLen, &consumed);
+    memmove(&buffer[requestLen],&buffer[requestLen+consumed],*bytesRecv-requestLen-consumed);
+    *bytesRecv -= consumed;
+    buffer[*bytesRecv] = '\0';
+    return result;
+}
+
+//done with the request, a body that is not complete by now is abandoned
+void EndBody (BodyReader* reader) {
+    CloseSink(reader, FALSE);
+}
+
+//tell the client to go ahead with its body, returns ERROR if the socket would not take it whole
+int SendContinue (int connID) {
+    int len = strlen(CONTINUE_RESPONSE);
+    return send(connID,CONTINUE_RESPONSE,len,MSG_DONTWAIT | MSG_NOSIGNAL) == len ? NOERR : ERROR;
+}
+
+//the connection is about to be closed with request bytes unread, those would turn the close into a
+//reset that can wipe out the response on its way, so stop sending and drain what has arrived first
+void DiscardUnread (int connID) {
+    shutdown(connID,SHUT_WR);
+    char discard[PACK_SIZE];
+    while (recv(connID,discard,PACK_SIZE,MSG_DONTWAIT) > 0);
+}
+
+//spool the body to a file without a name, so it goes away by itself once closed
+int OpenSpoolSink (BodySink* sink, char* request, HttpParser* parser) {
+    sink->write = WriteSpool;
+    sink->finish = FinishSpool;
+    sink->written = 0;
+    sink->context = NULL;
+    sink->fd = openat(spoolDirFd,".",O_TMPFILE | O_WRONLY | O_CLOEXEC,0600);
+    if (sink->fd == ERROR && (errno == EOPNOTSUPP || errno == EISDIR)) {
+        //the filesystem cannot make unnamed files, make a named one and unlink it straight away
+        char path[PATH_SIZE];
+        snprintf(path,PATH_SIZE,"%s/webServerBodyXXXXXX",spoolDir);
+        sink->fd = mkostemp(path,O_CLOEXEC);
+        if (sink->fd != ERROR) unlink(path);
+    }
+    if (sink->fd == ERROR) {
+        LogError("** spool error ** %s",strerror(errno));
+        return ERROR;
+    }
+    return NOERR;
+}
+
+static int Deliver (BodyReader* reader, char* data, int len) {
+    reader->received += len;
+    if (reader->received > maxBody) {
+        reader->status = RESPONSE_413;
+        return ERROR;
+    }
+    if (reader->hasSink && reader->sink.write(&reader->sink, data, len) == ERROR) {
+        reader->status = RESPONSE_500;
+        return ERROR;
+    }
+    return NOERR;
+}
+
+//take one byte of the chunk framing (sizes, the line ends after the data and the trailer)
+static int DecodeChunked (BodyReader* reader, char c) {
+    int digit = ERROR;
+    if (c >= '0' && c <= '9') digit = c - '0';
+    if (c >= 'a' && c <= 'f') digit = c - 'a' + 10;
+    if (c >= 'A' && c <= 'F') digit = c - 'A' + 10;
+
+    switch (reader->chunkState) {
+        case CHUNK_SIZE:
+            if (digit != ERROR) {
+                //a chunk bigger than the limit is turned away before its size can overflow
+                if (reader->remaining > (maxBody - digit) / 16) reader->status = RESPONSE_413;
+                reader->remaining = reader->remaining * 16 + digit;
+                reader->lineLen++;
+                break;
+            }
+            if (reader->lineLen == 0 || (c != ';' && c != ' ' && c != '\t' && c != '\r' && c != '\n')) {
+                reader->status = RESPONSE_400;
+                break;
+            }
+            reader->chunkState = CHUNK_EXT;
+            //fall through, the size may end the line
+        case CHUNK_EXT:
+            //extensions are skipped
+            if (c != '\n') {
+                if (++reader->lineLen > CHUNK_LINE_SIZE) reader->status = RESPONSE_400;
+                break;
+            }
+            reader->lineLen = 0;
+            //a zero size chunk is the last, the trailer follows
+            reader->chunkState = reader->remaining == 0 ? CHUNK_TRAILER : CHUNK_DATA;
+            break;
+        case CHUNK_DATA_CR:
+            if (c != '\r') reader->status = RESPONSE_400;
+            reader->chunkState = CHUNK_DATA_LF;
+            break;
+        case CHUNK_DATA_LF:
+            if (c != '\n') reader->status = RESPONSE_400;
+            reader->chunkState = CHUNK_SIZE;
+            break;
+        case CHUNK_TRAILER:
+            //trailer fields are skipped, an empty line ends the body
+            if (c == '\n') {
+                if (reader->lineLen == 0) reader->complete = TRUE;
+                reader->lineLen = 0;
+            } else if (c != '\r' && ++reader->lineLen > CHUNK_LINE_SIZE) {
+                reader->status = RESPONSE_400;
+            }
+            break;
+    }
+    return reader->status == NULL ? NOERR : ERROR;
+}
+
+//close the sink if it is still open, returns ERROR if it could not keep the body
+static int CloseSink (BodyReader* reader, int complete) {
+    if (!reader->hasSink) return NOERR;
+    reader->hasSink = FALSE;
+    return reader->sink.finish(&reader->sink, complete);
+}
+
+static int WriteSpool (BodySink* sink, char* data, int len) {
+    int written = 0;
+    while (written < len) {
+        ssize_t elemWritten = write(sink->fd,&data[written],len-written);
+        if (elemWritten == ERROR && errno == EINTR) continue;
+        if (elemWritten == ERROR) {
+            LogError("** spool error ** %s",strerror(errno));
+            return ERROR;
+        }
+        written += elemWritten;
+    }
+    sink->written += len;
+    return NOERR;
+}
+
+static int FinishSpool (BodySink* sink, int complete) {
+    if (complete) LogDebug("Spooled a %lld byte request body",sink->written);
+    close(sink->fd);
+    sink->fd = ERROR;
+    return NOERR;
+}
@@ -0,0 +1,78 @@
+/*
+    Custom Web Server - request bodies
+    By: Ricard Grace
+*/
+
+#ifndef REQUESTBODY_H
+#define REQUESTBODY_H
+
+#include "webServer.h"
+#include "httpParser.h"
+
+//largest body accepted and where bodies are spooled, changed with -B and -T or in the config file
+#define DEFAULT_MAX_BODY 10485760
+#define DEFAULT_SPOOL_DIR "/tmp"
+//most bytes of a body received (and handed to its sink) at a time
+#define BODY_CHUNK_SIZE 16384
+//longest chunk size line (extensions included) or trailer line accepted
+#define CHUNK_LINE_SIZE 1024
+#define CONTINUE_RESPONSE "HTTP/1.1 100 Continue\r\n\r\n"
+
+//how the end of the body is found
+#define BODY_LENGTH  0
+#define BODY_CHUNKED 1
+
+//where the chunked decoder is
+#define CHUNK_SIZE    0
+#define CHUNK_EXT     1
+#define CHUNK_DATA    2
+#define CHUNK_DATA_CR 3
+#define CHUNK_DATA_LF 4
+#define CHUNK_TRAILER 5
+
+//where a body goes as it arrives, the spool file unless another opener is set with SetBodySinkOpener
+typedef struct _bodySink {
+    //called with every piece of the body in order, returns ERROR if it could not be kept
+    int (*write) (struct _bodySink* sink, char* data, int len);
+    //called once, complete is FALSE if the body was abandoned, returns ERROR if it could not be kept
+    int (*finish) (struct _bodySink* sink, int complete);
+    int fd;
+    long long written;
+    void* context;
+} BodySink;
+
+//sets up sink for the body of the request, returns ERROR if it cannot take one
+typedef int (*BodySinkOpener) (BodySink* sink, char* request, HttpParser* parser);
+
+//state of one request body being received
+typedef struct _bodyReader {
+    int framing;
+    //bytes left of the body (Content-Length) or of the current chunk
+    long long remaining;
+    //body bytes received so far, after chunked decoding
+    long long received;
+    int chunkState;
+    //characters of the chunk size or trailer line read so far
+    int lineLen;
+    int complete;
+    //the client waits for a 100 Continue before sending the body
+    int expectsContinue;
+    //the response code the body was turned away with, NULL while it is fine
+    char* status;
+    //sink is open until the body is complete or abandoned, requests other than POST have none
+    int hasSink;
+    BodySink sink;
+} BodyReader;
+
+int InitRequestBodies (long long maxBody, char* spoolDir);
+void SetBodySinkOpener (BodySinkOpener opener);
+int RequestHasBody (HttpParser* parser);
+int StartBody (BodyReader* reader, HttpParser* parser, char* request);
+int FeedBody (BodyReader* reader, char* data, int len, int* consumed);
+int ConsumeBuffered (BodyReader* reader, char* buffer, int* bytesRecv, int requestLen);
+void EndBody (BodyReader* reader);
+int SendContinue (int connID);
+void DiscardUnread (int connID);
+int OpenSpoolSink (BodySink* sink, char* request, HttpParser* parser);
+
+#endif
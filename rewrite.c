@@ -0,0 +1,369 @@
+/*
+    Custom Web Server - redirect and rewrite table
+    By: Ricard Grace
+*/
+
+#include "rewrite.h"
+#include "docRoot.h"
+#include "logger.h"
+#include "epoch.h"
+
+/*
+    Pages that have moved are answered from a table of rules read from the file given with -W (or
+    rewrites in the config file), one rule per line in the form "match pattern action target":
+        exact  /old.html  301      /new.html
+        prefix /blog/     302      https://blog.example.com/
+        suffix .htm       rewrite  .html
+    The part of the path the pattern matched is swapped for the target and the rest of the path is
+    kept, so the prefix rule above sends /blog/2020/post.html to
+    https://blog.example.com/2020/post.html. 301 and 302 answer with a Location and no body, rewrite
+    serves the new path in place of the one asked for. Patterns are matched against the decoded
+    path, which has lost any trailing '/' by then (and / is /index.html). An exact rule wins, then
+    the longest prefix and then the longest suffix, and only one rule is applied to a request.
+    The table is looked at as soon as the path is decoded, before the asset pack, the cache or the
+    data directory, so a redirect is answered without touching the filesystem. The patterns are
+    compiled into a trie (suffixes back to front in a second one), so finding the rule for a path
+    is one walk along the path however many rules there are.
+    SIGHUP reloads the file without a restart. The new table replaces the old one with a single
+    atomic store, and the old one is freed once every request that might still be reading it has
+    finished, the same way the file cache releases its entries (see epoch.c). A file that fails to
+    load leaves the rules already loaded in place.
+*/
+
+static RewriteTable* LoadTable (char* fileName, char* error, int errorSize);
+static char* ParseRule (RewriteTable* table, char* line);
+static int NewNode (RewriteTable* table, unsigned char byte);
+static int AddChild (RewriteTable* table, int node, unsigned char byte);
+static int FindChild (RewriteTable* table, int node, unsigned char byte);
+static RewriteRule* FindRule (RewriteTable* table, char* path, int len);
+static char* ApplyRule (RewriteRule* rule, char* path, int len, Arena* arena, char** location);
+static int EncodedLength (char* text, int len);
+static int EncodeUrl (char* buffer, char* text, int len);
+static int NeedsEncoding (unsigned char c);
+static void FreeTable (RewriteTable* table);
+static void* WaitForReload (void* unused);
+
+//the rules in use, swapped whole on a reload
+static RewriteTable* _Atomic currentTable = NULL;
+static char* rewriteFile = NULL;
+
+//readers of the table
+static Epoch tableEpoch;
+
+//load the rules in fileName and reload them on every SIGHUP, a NULL fileName leaves every path as it is
+int InitRewrites (char* fileName) {
+    if (fileName == NULL) return NOERR;
+
+    char error[VALUE_SIZE];
+    RewriteTable* table = LoadTable(fileName, error, VALUE_SIZE);
+    if (table == NULL) {
+        fprintf(stderr,"** rewrite error ** %s\n",error);
+        return ERROR;
+    }
+    atomic_store(&currentTable,table);
+    rewriteFile = fileName;
+
+    //every thread started from here on inherits the mask, so SIGHUP is only ever taken by the reloading thread
+    sigset_t signals;
+    sigemptyset(&signals);
+    sigaddset(&signals,SIGHUP);
+    pthread_sigmask(SIG_BLOCK,&signals,NULL);
+    pthread_t thread;
+    if (pthread_create(&thread,NULL,WaitForReload,NULL) != NOERR) {
+        fprintf(stderr,"** pthread_create error **\n");
+        return ERROR;
+    }
+    pthread_detach(thread);
+    printf("Loaded %d rewrite rule(s) from %s\n",table->numRules,fileName);
+    return NOERR;
+}
+
+//look the decoded path up before anything else is: a rewrite changes path in place and returns NULL,
+//a redirect returns its response code with the Location (in the arena), and a path with no rule returns NULL
+char* RewriteRequest (char* path, Arena* arena, char** location) {
+    *location = NULL;
+    if (rewriteFile == NULL) return NULL;
+
+    int slot = EnterEpoch(&tableEpoch);
+    RewriteTable* table = atomic_load_explicit(&currentTable,memory_order_acquire);
+    int len = strlen(path);
+    RewriteRule* rule = FindRule(table, path, len);
+    char* response = rule == NULL ? NULL : ApplyRule(rule, path, len, arena, location);
+    ExitEpoch(&tableEpoch, slot);
+
+    return response;
+}
+
+//read and compile every rule in the file, returns NULL (with the reason in error) if any of them is bad
+static RewriteTable* LoadTable (char* fileName, char* error, int errorSize) {
+    FILE* file = fopen(fileName,"r");
+    if (file == NULL) {
+        snprintf(error,errorSize,"%s: %s",fileName,strerror(errno));
+        return NULL;
+    }
+
+    RewriteTable* table = calloc(1,sizeof(RewriteTable));
+    table->maxNodes = REWRITE_INITIAL_NODES;
+    table->nodes = malloc(table->maxNodes * sizeof(RewriteNode));
+    NewNode(table, '\0');
+    NewNode(table, '\0');
+
+    char line[REWRITE_LINE_SIZE];
+    int lineNum = 0;
+    while (fgets(line,REWRITE_LINE_SIZE,file) != NULL) {
+        lineNum++;
+        char* reason = ParseRule(table, line);
+        if (reason != NULL) {
+            snprintf(error,errorSize,"%s:%d: %s",fileName,lineNum,reason);
+            fclose(file);
+            FreeTable(table);
+            return NULL;
+        }
+    }
+
+    fclose(file);
+    return table;
+}
+
+//add the rule on one line of the file to the table, returns why it is bad or NULL if it is fine (or blank)
+static char* ParseRule (RewriteTable* table, char* line) {
+    char* comment = strchr(line,'#');
+    if (comment != NULL) *comment = '\0';
+    char* save;
+    char* match = strtok_r(line," \t\r\n",&save);
+    if (match == NULL) return NULL;
+    char* pattern = strtok_r(NULL," \t\r\n",&save);
+    char* action = strtok_r(NULL," \t\r\n",&save);
+    char* target = strtok_r(NULL," \t\r\n",&save);
+    if (target == NULL || strtok_r(NULL," \t\r\n",&save) != NULL) return "a rule is: match pattern action target";
+
+    RewriteRule rule;
+    if (strcmp(match,"exact") == STREQU) {
+        rule.match = MATCH_EXACT;
+    } else if (strcmp(match,"prefix") == STREQU) {
+        rule.match = MATCH_PREFIX;
+    } else if (strcmp(match,"suffix") == STREQU) {
+        rule.match = MATCH_SUFFIX;
+    } else {
+        return "the match must be exact, prefix or suffix";
+    }
+    if (strcmp(action,"301") == STREQU) {
+        rule.action = REWRITE_301;
+    } else if (strcmp(action,"302") == STREQU) {
+        rule.action = REWRITE_302;
+    } else if (strcmp(action,"rewrite") == STREQU) {
+        rule.action = REWRITE_INTERNAL;
+    } else {
+        return "the action must be 301, 302 or rewrite";
+    }
+
+    rule.patternLen = strlen(pattern);
+    rule.targetLen = strlen(target);
+    //decoded paths always start with '/'
+    if (rule.patternLen >= PATH_SIZE || (rule.match != MATCH_SUFFIX && pattern[0] != '/')) {
+        return "the pattern must be a path";
+    }
+    //the target of a redirect goes in the Location header as it is
+    int i;
+    for (i = 0; i < rule.targetLen; i++) {
+        if ((unsigned char)target[i] <= ' ' || (unsigned char)target[i] >= 0x7f) return "the target must be printable ASCII";
+    }
+    //what replaces the start of a path is a path as well, or for a redirect it can be another site
+    if (rule.targetLen >= PATH_SIZE || (rule.match != MATCH_SUFFIX && target[0] != '/' && (rule.action == REWRITE_INTERNAL || strstr(target,"://") == NULL))) {
+        return "the target must be a path (or a URL for a redirect)";
+    }
+
+    //suffixes are stored from their last byte, so they are found walking back from the end of the path
+    int root = rule.match == MATCH_SUFFIX ? SUFFIX_ROOT : PREFIX_ROOT;
+    int node = root;
+    for (i = 0; i < rule.patternLen && node != ERROR; i++) {
+        node = AddChild(table, node, pattern[rule.match == MATCH_SUFFIX ? rule.patternLen-1-i : i]);
+    }
+    RewriteRule* rules = node == ERROR ? NULL : realloc(table->rules,(table->numRules+1) * sizeof(RewriteRule));
+    if (rules == NULL) return "out of memory";
+    table->rules = rules;
+    int* slot = rule.match == MATCH_EXACT ? &table->nodes[node].exactRule : &table->nodes[node].partRule;
+    if (*slot != ERROR) return "the pattern already has a rule";
+    rule.target = strdup(target);
+    *slot = table->numRules;
+    table->rules[table->numRules++] = rule;
+    return NULL;
+}
+
+//returns the index of a new node with no children or rules, ERROR if out of memory
+static int NewNode (RewriteTable* table, unsigned char byte) {
+    if (table->numNodes == table->maxNodes) {
+        RewriteNode* nodes = realloc(table->nodes,table->maxNodes * 2 * sizeof(RewriteNode));
+        if (nodes == NULL) return ERROR;
+        table->nodes = nodes;
+        table->maxNodes *= 2;
+    }
+    RewriteNode* node = &table->nodes[table->numNodes];
+    node->byte = byte;
+    node->firstChild = ERROR;
+    node->nextSibling = ERROR;
+    node->exactRule = ERROR;
+    node->partRule = ERROR;
+    return table->numNodes++;
+}
+
+//returns the child of node for byte, added in its place in the list if it is not there yet (ERROR if out of memory)
+static int AddChild (RewriteTable* table, int node, unsigned char byte) {
+    int prev = ERROR;
+    int child = table->nodes[node].firstChild;
+    while (child != ERROR && table->nodes[child].byte < byte) {
+        prev = child;
+        child = table->nodes[child].nextSibling;
+    }
+    if (child != ERROR && table->nodes[child].byte == byte) return child;
+
+    //the nodes may move, so they are only looked at by index from here on
+    int added = NewNode(table, byte);
+    if (added == ERROR) return ERROR;
+    table->nodes[added].nextSibling = child;
+    if (prev == ERROR) {
+        table->nodes[node].firstChild = added;
+    } else {
+        table->nodes[prev].nextSibling = added;
+    }
+    return added;
+}
+
+//returns the child of node for byte, or ERROR if no pattern carries on that way
+static int FindChild (RewriteTable* table, int node, unsigned char byte) {
+    int child = table->nodes[node].firstChild;
+    while (child != ERROR && table->nodes[child].byte < byte) {
+        child = table->nodes[child].nextSibling;
+    }
+    return child != ERROR && table->nodes[child].byte == byte ? child : ERROR;
+}
+
+//the rule for the path: an exact rule wins, then the longest prefix and then the longest suffix
+static RewriteRule* FindRule (RewriteTable* table, char* path, int len) {
+    int best = ERROR;
+    int node = PREFIX_ROOT;
+    int i;
+    for (i = 0; node != ERROR; i++) {
+        if (i == len && table->nodes[node].exactRule != ERROR) return &table->rules[table->nodes[node].exactRule];
+        if (table->nodes[node].partRule != ERROR) best = table->nodes[node].partRule;
+        node = i < len ? FindChild(table, node, path[i]) : ERROR;
+    }
+    if (best != ERROR) return &table->rules[best];
+
+    node = SUFFIX_ROOT;
+    for (i = len; node != ERROR; i--) {
+        if (table->nodes[node].partRule != ERROR) best = table->nodes[node].partRule;
+        node = i > 0 ? FindChild(table, node, path[i-1]) : ERROR;
+    }
+    return best == ERROR ? NULL : &table->rules[best];
+}
+
+//swap the part of the path the rule matched for its target
+//a path (or Location) that would be too long to use is left alone and served as it is
+static char* ApplyRule (RewriteRule* rule, char* path, int len, Arena* arena, char** location) {
+    //what the rule keeps of the path: after the pattern, or before it for a suffix
+    char* rest = rule->match == MATCH_SUFFIX ? path : &path[rule->patternLen];
+    int restLen = len - rule->patternLen;
+
+    if (rule->action == REWRITE_INTERNAL) {
+        char rewritten[PATH_SIZE+2];
+        int newLen;
+        if (rule->match == MATCH_SUFFIX) {
+            newLen = snprintf(rewritten,PATH_SIZE+2,"%.*s%s",restLen,rest,rule->target);
+        } else {
+            newLen = snprintf(rewritten,PATH_SIZE+2,"%s%.*s",rule->target,restLen,rest);
+        }
+        if (newLen > PATH_SIZE) return NULL;
+        //the new path is looked up like any other, so it is normalised the same way
+        NormalizePath(rewritten);
+        if (rewritten[0] == '/' && rewritten[1] == '\0') {
+            snprintf(rewritten,PATH_SIZE+2,"%s",DEFAULT_PAGE);
+        }
+        LogDebug("Rewrote (%s) to (%s)",path,rewritten);
+        //it is no longer than PATH_SIZE, so it fits where the old path was
+        memcpy(path,rewritten,strlen(rewritten)+1);
+        return NULL;
+    }
+
+    //the part kept came from the client decoded, so it is encoded again before it goes in a header
+    int urlLen = rule->targetLen + EncodedLength(rest, restLen);
+    char* url = urlLen > REWRITE_MAX_LOCATION ? NULL : ArenaAlloc(arena, urlLen + 1);
+    if (url == NULL) return NULL;
+    int pos = 0;
+    if (rule->match != MATCH_SUFFIX) {
+        memcpy(url,rule->target,rule->targetLen);
+        pos = rule->targetLen;
+    }
+    pos += EncodeUrl(&url[pos], rest, restLen);
+    if (rule->match == MATCH_SUFFIX) {
+        memcpy(&url[pos],rule->target,rule->targetLen);
+        pos += rule->targetLen;
+    }
+    url[pos] = '\0';
+    *location = url;
+    return rule->action == REWRITE_301 ? RESPONSE_301 : RESPONSE_302;
+}
+
+//length of text once percent-encoded
+static int EncodedLength (char* text, int len) {
+    int encodedLen = len;
+    int i;
+    for (i = 0; i < len; i++) {
+        if (NeedsEncoding(text[i])) encodedLen += ENCODE_SIZE-1;
+    }
+    return encodedLen;
+}
+
+//write text percent-encoded into buffer (which has room for EncodedLength of it), returns the length written
+static int EncodeUrl (char* buffer, char* text, int len) {
+    int pos = 0;
+    int i;
+    for (i = 0; i < len; i++) {
+        if (NeedsEncoding(text[i])) {
+            snprintf(&buffer[pos],ENCODE_SIZE+1,"%%%02X",(unsigned char)text[i]);
+            pos += ENCODE_SIZE;
+        } else {
+            buffer[pos++] = text[i];
+        }
+    }
+    return pos;
+}
+
+//spaces, control characters, anything outside ASCII and the characters a URL cannot hold as they are
+static int NeedsEncoding (unsigned char c) {
+    return c <= ' ' || c >= 0x7f || strchr("\"#%<>\\^`{|}",c) != NULL;
+}
+
+static void FreeTable (RewriteTable* table) {
+    int i;
+    for (i = 0; i < table->numRules; i++) {
+        free(table->rules[i].target);
+    }
+    free(table->rules);
+    free(table->nodes);
+    free(table);
+}
+
+//reload the file on every SIGHUP, keeping the rules in use when it cannot be loaded
+static void* WaitForReload (void* unused) {
+    sigset_t signals;
+    sigemptyset(&signals);
+    sigaddset(&signals,SIGHUP);
+    while (1) {
+        int signal;
+        if (sigwait(&signals,&signal) != NOERR) continue;
+
+        char error[VALUE_SIZE];
+        RewriteTable* table = LoadTable(rewriteFile, error, VALUE_SIZE);
+        if (table == NULL) {
+            LogError("** rewrite reload error ** %s, the old rules stay in use",error);
+            continue;
+        }
+        RewriteTable* old = atomic_exchange(&currentTable,table);
+        //requests that found the old table may still be reading it
+        SynchronizeEpoch(&tableEpoch);
+        FreeTable(old);
+        LogInfo("Reloaded %d rewrite rule(s) from %s",table->numRules,rewriteFile);
+    }
+    return NULL;
+}
@@ -0,0 +1,65 @@
+/*
+    Custom Web Server - redirect and rewrite table
+    By: Ricard Grace
+*/
+
+#ifndef REWRITE_H
+#define REWRITE_H
+
+#include "webServer.h"
+#include "memPool.h"
+
+#include <stdatomic.h>
+
+#define REWRITE_LINE_SIZE 1024
+//nodes the trie starts with, it doubles as rules are added
+#define REWRITE_INITIAL_NODES 64
+//longest Location a redirect sends, so it always fits in the response header
+#define REWRITE_MAX_LOCATION 512
+
+//how a rule's pattern is matched against the decoded path
+#define MATCH_EXACT  0
+#define MATCH_PREFIX 1
+#define MATCH_SUFFIX 2
+
+//what a matching rule does with the request
+#define REWRITE_INTERNAL 0
+#define REWRITE_301      1
+#define REWRITE_302      2
+
+//the part of the path the pattern matched is replaced by target, the rest of the path is kept
+typedef struct _rewriteRule {
+    int match;
+    int action;
+    int patternLen;
+    char* target;
+    int targetLen;
+} RewriteRule;
+
+//one byte of one or more patterns, the children of a node are a list in byte order
+typedef struct _rewriteNode {
+    unsigned char byte;
+    int firstChild;
+    int nextSibling;
+    //the rule for a path that ends here, and the rule for any path that carries on past here (ERROR for none)
+    int exactRule;
+    int partRule;
+} RewriteNode;
+
+//the rules of one file, compiled: exact and prefix patterns hang off one root,
+//suffix patterns are stored back to front under the other
+typedef struct _rewriteTable {
+    RewriteRule* rules;
+    int numRules;
+    RewriteNode* nodes;
+    int numNodes;
+    int maxNodes;
+} RewriteTable;
+
+#define PREFIX_ROOT 0
+#define SUFFIX_ROOT 1
+
+int InitRewrites (char* fileName);
+char* RewriteRequest (char* path, Arena* arena, char** location);
+
+#endif
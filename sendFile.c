@@ -0,0 +1,335 @@
+/*
+    Custom Web Server - file transmission
+    By: Ricard Grace
+*/
+
+#include "sendFile.h"
+#include "logger.h"
+
+/*
+    Three ways of moving a file onto a socket:
+        stdio    - read the file into a buffer and send it (copies every byte through userspace)
+        sendfile - the kernel sends straight from the page cache, nothing is copied to us
+        splice   - file -> pipe -> socket, for when sendfile is not supported
+    sendfile falls back to splice, and splice to stdio, when the kernel refuses the files involved.
+    A FileSender remembers exactly how far it got, so partial writes and EAGAIN on non-blocking
+    sockets simply resume from there. Once a range is sent the same sender (and its file, pipe
+    and fallbacks) can be pointed at another range, which is how several byte ranges go out.
+    The response header goes out in the same call as the start of the body (SendWithHeader):
+    gathered with the delimiter and a body in memory into one sendmsg, or held back with MSG_MORE
+    until the file that follows fills the packet, so a small response is a single packet.
+    Framed protocols (HTTP/2 DATA frames) send the range a piece at a time with SendFilePiece,
+    which goes through the same methods, so a file is still sent without copying it.
+*/
+
+static int SendFileSendfile (FileSender* sender, int connID);
+static int SendFileSplice (FileSender* sender, int connID);
+static int SendFileCopy (FileSender* sender, int connID);
+static int SendMemory (FileSender* sender, int connID);
+static int SendPrefix (FileSender* sender, int connID);
+
+static int sendMethod = SEND_SENDFILE;
+
+void SetSendMethod (int method) {
+    sendMethod = method;
+}
+
+int GetSendMethod () {
+    return sendMethod;
+}
+
+void InitFileSender (FileSender* sender, int fileFd, off_t offset, long long length) {
+    sender->method = sendMethod;
+    sender->fileFd = fileFd;
+    sender->ownsFd = TRUE;
+    sender->base = offset;
+    sender->offset = offset;
+    sender->length = length;
+    sender->remaining = length;
+    sender->prefix = NULL;
+    sender->prefixLen = 0;
+    sender->prefixSent = 0;
+    sender->done = 0;
+    sender->pipeFds[0] = ERROR;
+    sender->pipeFds[1] = ERROR;
+    sender->piped = 0;
+    sender->data = NULL;
+    sender->buffer = NULL;
+    sender->bufLen = 0;
+    sender->bufSent = 0;
+}
+
+//send length bytes from data instead of a file (the caller keeps data alive until sent)
+void InitMemorySender (FileSender* sender, char* data, long long length) {
+    InitFileSender(sender, ERROR, 0, length);
+    sender->method = SEND_MEMORY;
+    sender->data = data;
+}
+
+//send length bytes from offset of a descriptor that stays open for others (every send gives its own offset)
+void InitSharedSender (FileSender* sender, int fileFd, off_t offset, long long length) {
+    InitFileSender(sender, fileFd, offset, length);
+    sender->ownsFd = FALSE;
+}
+
+//once the current range is sent, send prefix followed by length bytes from offset of the same body (or memory)
+void SetSenderRange (FileSender* sender, char* prefix, int prefixLen, off_t offset, long long length) {
+    sender->done = FileSenderSent(sender);
+    sender->prefix = prefix;
+    sender->prefixLen = prefixLen;
+    sender->prefixSent = 0;
+    sender->offset = sender->base + offset;
+    sender->length = length;
+    sender->remaining = length;
+    sender->bufLen = 0;
+    sender->bufSent = 0;
+}
+
+//send as much of the file as the socket will take
+//returns TRUE once everything is sent, FALSE if the socket would block and ERROR on failure
+int SendFileStep (FileSender* sender, int connID) {
+    int result = SendPrefix(sender, connID);
+    if (result != TRUE) return result;
+    if (sender->method == SEND_MEMORY) return SendMemory(sender, connID);
+    if (sender->method == SEND_SENDFILE) {
+        result = SendFileSendfile(sender, connID);
+        if (result != ERROR || (errno != EINVAL && errno != ENOSYS)) return result;
+        //this file or socket cannot be used with sendfile, nothing was sent so try splice
+        sender->method = SEND_SPLICE;
+    }
+    if (sender->method == SEND_SPLICE) {
+        result = SendFileSplice(sender, connID);
+        if (result != ERROR || (errno != EINVAL && errno != ENOSYS) || sender->piped > 0) return result;
+        sender->method = SEND_STDIO;
+    }
+    return SendFileCopy(sender, connID);
+}
+
+//send what is left of the response header along with as much of the body as can go in the same call:
+//the range's prefix and, for a body in memory, the range itself, a file body is held back for with MSG_MORE
+//sender is NULL for a response without a body, the rest of the body is sent with SendFileStep
+//returns TRUE once the header is sent, FALSE if the socket would block and ERROR on failure
+int SendWithHeader (FileSender* sender, int connID, char* header, int headerLen, int* headerSent) {
+    while (*headerSent < headerLen) {
+        struct iovec parts[3];
+        int numParts = 0;
+        parts[numParts].iov_base = &header[*headerSent];
+        parts[numParts++].iov_len = headerLen - *headerSent;
+        int more = FALSE;
+        if (sender != NULL) {
+            if (sender->prefixSent < sender->prefixLen) {
+                parts[numParts].iov_base = &sender->prefix[sender->prefixSent];
+                parts[numParts++].iov_len = sender->prefixLen - sender->prefixSent;
+            }
+            if (sender->method == SEND_MEMORY && sender->remaining > 0) {
+                parts[numParts].iov_base = &sender->data[sender->offset];
+                parts[numParts++].iov_len = sender->remaining;
+            }
+            more = sender->method != SEND_MEMORY && sender->remaining > 0;
+        }
+        struct msghdr msg;
+        memset(&msg,0,sizeof(msg));
+        msg.msg_iov = parts;
+        msg.msg_iovlen = numParts;
+        ssize_t bytesSent = sendmsg(connID,&msg,MSG_NOSIGNAL | (more ? MSG_MORE : 0));
+        if (bytesSent == ERROR) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK) return FALSE;
+            if (errno == EINTR) continue;
+            LogError("** send error ** %s",strerror(errno));
+            return ERROR;
+        }
+
+        //share what went out between the pieces, in the order they were gathered
+        int fromHeader = bytesSent < headerLen - *headerSent ? bytesSent : headerLen - *headerSent;
+        *headerSent += fromHeader;
+        bytesSent -= fromHeader;
+        if (sender != NULL) {
+            int fromPrefix = bytesSent < sender->prefixLen - sender->prefixSent ? bytesSent : sender->prefixLen - sender->prefixSent;
+            sender->prefixSent += fromPrefix;
+            bytesSent -= fromPrefix;
+            //anything left over can only have come from a body in memory
+            sender->offset += bytesSent;
+            sender->remaining -= bytesSent;
+        }
+    }
+    return TRUE;
+}
+
+//send the next limit bytes of the prefix and range (no more than are left), the rest waits for another call
+//returns TRUE once they are sent, FALSE if the socket would block and ERROR on failure
+int SendFilePiece (FileSender* sender, int connID, long long limit) {
+    //hide everything past the piece from SendFileStep, then put it back
+    int prefixLeft = sender->prefixLen - sender->prefixSent;
+    int prefixHeld = prefixLeft > limit ? prefixLeft - limit : 0;
+    long long rangeLimit = limit - (prefixLeft - prefixHeld);
+    long long rangeHeld = sender->remaining > rangeLimit ? sender->remaining - rangeLimit : 0;
+    sender->prefixLen -= prefixHeld;
+    sender->remaining -= rangeHeld;
+    sender->length -= rangeHeld;
+    int result = SendFileStep(sender, connID);
+    sender->prefixLen += prefixHeld;
+    sender->remaining += rangeHeld;
+    sender->length += rangeHeld;
+    return result;
+}
+
+//bytes of the prefix and range still to be sent
+long long SenderLeft (FileSender* sender) {
+    return sender->prefixLen - sender->prefixSent + sender->remaining;
+}
+
+//bytes that have actually reached the socket
+long long FileSenderSent (FileSender* sender) {
+    return sender->done + sender->prefixSent + sender->length - sender->remaining - sender->piped - (sender->bufLen - sender->bufSent);
+}
+
+//the stdio copy buffer, only senders that end up copying pay for one, NULL if out of memory
+char* SenderBuffer (FileSender* sender) {
+    if (sender->buffer == NULL) sender->buffer = malloc(PACK_SIZE);
+    if (sender->buffer == NULL) LogError("** out of memory **");
+    return sender->buffer;
+}
+
+//close the file (unless it is shared) and anything used to send it
+void CloseFileSender (FileSender* sender) {
+    free(sender->buffer);
+    sender->buffer = NULL;
+    if (sender->pipeFds[0] != ERROR) close(sender->pipeFds[0]);
+    if (sender->pipeFds[1] != ERROR) close(sender->pipeFds[1]);
+    if (sender->fileFd != ERROR && sender->ownsFd) close(sender->fileFd);
+    sender->pipeFds[0] = ERROR;
+    sender->pipeFds[1] = ERROR;
+    sender->fileFd = ERROR;
+}
+
+static int SendFileSendfile (FileSender* sender, int connID) {
+    while (sender->remaining > 0) {
+        size_t count = sender->remaining < SENDFILE_CHUNK ? sender->remaining : SENDFILE_CHUNK;
+        //sendfile moves the offset along by however much was actually sent
+        ssize_t bytesSent = sendfile(connID,sender->fileFd,&sender->offset,count);
+        if (bytesSent == ERROR) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK) return FALSE;
+            if (errno == EINTR) continue;
+            if (errno != EINVAL && errno != ENOSYS) LogError("** sendfile error ** %s",strerror(errno));
+            return ERROR;
+        }
+        if (bytesSent == 0) {
+            //the file is shorter than we said it would be
+            LogError("** file truncated while sending **");
+            errno = EIO;
+            return ERROR;
+        }
+        sender->remaining -= bytesSent;
+    }
+    return TRUE;
+}
+
+static int SendFileSplice (FileSender* sender, int connID) {
+    if (sender->pipeFds[0] == ERROR && pipe2(sender->pipeFds,O_NONBLOCK | O_CLOEXEC) == ERROR) {
+        LogError("** pipe error ** %s",strerror(errno));
+        return ERROR;
+    }
+
+    while (sender->remaining > 0 || sender->piped > 0) {
+        if (sender->piped == 0) {
+            //refill the pipe from the file
+            size_t count = sender->remaining < SPLICE_CHUNK ? sender->remaining : SPLICE_CHUNK;
+            ssize_t bytesMoved = splice(sender->fileFd,&sender->offset,sender->pipeFds[1],NULL,count,SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+            if (bytesMoved == ERROR) {
+                if (errno == EINTR) continue;
+                if (errno != EINVAL && errno != ENOSYS) LogError("** splice error ** %s",strerror(errno));
+                return ERROR;
+            }
+            if (bytesMoved == 0) {
+                LogError("** file truncated while sending **");
+                errno = EIO;
+                return ERROR;
+            }
+            sender->piped = bytesMoved;
+            sender->remaining -= bytesMoved;
+        }
+
+        //drain the pipe into the socket, whatever does not fit stays in the pipe for next time
+        int flags = SPLICE_F_MOVE | SPLICE_F_NONBLOCK | (sender->remaining > 0 ? SPLICE_F_MORE : 0);
+        ssize_t bytesSent = splice(sender->pipeFds[0],NULL,connID,NULL,sender->piped,flags);
+        if (bytesSent == ERROR) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK) return FALSE;
+            if (errno == EINTR) continue;
+            LogError("** splice error ** %s",strerror(errno));
+            return ERROR;
+        }
+        sender->piped -= bytesSent;
+    }
+    return TRUE;
+}
+
+static int SendFileCopy (FileSender* sender, int connID) {
+    if (SenderBuffer(sender) == NULL) {
+        errno = ENOMEM;
+        return ERROR;
+    }
+    while (sender->remaining > 0 || sender->bufSent < sender->bufLen) {
+        if (sender->bufSent == sender->bufLen) {
+            //the last chunk has gone out, read the next one
+            size_t count = sender->remaining < PACK_SIZE ? sender->remaining : PACK_SIZE;
+            ssize_t elemRead = pread(sender->fileFd,sender->buffer,count,sender->offset);
+            if (elemRead == ERROR) {
+                if (errno == EINTR) continue;
+                LogError("** read error ** %s",strerror(errno));
+                return ERROR;
+            }
+            if (elemRead == 0) {
+                LogError("** file truncated while sending **");
+                errno = EIO;
+                return ERROR;
+            }
+            sender->offset += elemRead;
+            sender->remaining -= elemRead;
+            sender->bufLen = elemRead;
+            sender->bufSent = 0;
+        }
+
+        //resume from wherever the last partial send stopped, more of the file follows unless this is the end
+        int flags = MSG_NOSIGNAL | (sender->remaining > 0 ? MSG_MORE : 0);
+        ssize_t bytesSent = send(connID,&sender->buffer[sender->bufSent],sender->bufLen-sender->bufSent,flags);
+        if (bytesSent == ERROR) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK) return FALSE;
+            if (errno == EINTR) continue;
+            LogError("** send error ** %s",strerror(errno));
+            return ERROR;
+        }
+        sender->bufSent += bytesSent;
+    }
+    return TRUE;
+}
+
+static int SendMemory (FileSender* sender, int connID) {
+    while (sender->remaining > 0) {
+        ssize_t bytesSent = send(connID,&sender->data[sender->offset],sender->remaining,MSG_NOSIGNAL);
+        if (bytesSent == ERROR) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK) return FALSE;
+            if (errno == EINTR) continue;
+            LogError("** send error ** %s",strerror(errno));
+            return ERROR;
+        }
+        sender->offset += bytesSent;
+        sender->remaining -= bytesSent;
+    }
+    return TRUE;
+}
+
+static int SendPrefix (FileSender* sender, int connID) {
+    while (sender->prefixSent < sender->prefixLen) {
+        //the range follows straight after, so let the kernel wait for it
+        int flags = MSG_NOSIGNAL | (sender->remaining > 0 ? MSG_MORE : 0);
+        ssize_t bytesSent = send(connID,&sender->prefix[sender->prefixSent],sender->prefixLen-sender->prefixSent,flags);
+        if (bytesSent == ERROR) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK) return FALSE;
+            if (errno == EINTR) continue;
+            LogError("** send error ** %s",strerror(errno));
+            return ERROR;
+        }
+        sender->prefixSent += bytesSent;
+    }
+    return TRUE;
+}
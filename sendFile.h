@@ -0,0 +1,72 @@
+/*
+    Custom Web Server - file transmission
+    By: Ricard Grace
+*/
+
+#ifndef SENDFILE_H
+#define SENDFILE_H
+
+#include "webServer.h"
+
+#include <fcntl.h>
+#include <sys/sendfile.h>
+#include <sys/uio.h>
+
+//ways of getting a file onto the socket (selected at startup with -s)
+#define SEND_STDIO    0
+#define SEND_SENDFILE 1
+#define SEND_SPLICE   2
+//used internally for bodies that are already in memory
+#define SEND_MEMORY   3
+
+//most bytes moved by a single sendfile/splice call
+#define SENDFILE_CHUNK 524288
+#define SPLICE_CHUNK 65536
+
+//state of one file being sent, kept between calls when the socket would block
+typedef struct _fileSender {
+    int method;
+    int fileFd;
+    //FALSE when the descriptor is shared (the asset pack's) and left open once the body is sent
+    int ownsFd;
+    //where the body starts in the file (an archive holds many), ranges are from there
+    off_t base;
+    off_t offset;
+    long long length;
+    long long remaining;
+
+    //sent ahead of the range being sent (e.g. a multipart delimiter)
+    char* prefix;
+    int prefixLen;
+    int prefixSent;
+    //bytes sent for ranges before this one
+    long long done;
+
+    //splice: bytes moved into the pipe but not yet onto the socket
+    int pipeFds[2];
+    int piped;
+
+    //memory: the body itself
+    char* data;
+
+    //stdio: bytes read into the buffer (allocated on first use) but not yet sent
+    char* buffer;
+    int bufLen;
+    int bufSent;
+} FileSender;
+
+void SetSendMethod (int method);
+int GetSendMethod ();
+void InitFileSender (FileSender* sender, int fileFd, off_t offset, long long length);
+void InitMemorySender (FileSender* sender, char* data, long long length);
+void InitSharedSender (FileSender* sender, int fileFd, off_t offset, long long length);
+void SetSenderRange (FileSender* sender, char* prefix, int prefixLen, off_t offset, long long length);
+int SendFileStep (FileSender* sender, int connID);
+int SendWithHeader (FileSender* sender, int connID, char* header, int headerLen, int* headerSent);
+int SendFilePiece (FileSender* sender, int connID, long long limit);
+long long SenderLeft (FileSender* sender);
+long long FileSenderSent (FileSender* sender);
+char* SenderBuffer (FileSender* sender);
+void CloseFileSender (FileSender* sender);
+
+#endif
@@ -0,0 +1,171 @@
+/*
+    Custom Web Server - worker thread pool
+    By: Ricard Grace
+*/
+
+#include "threadPool.h"
+#include "logger.h"
+#include "metrics.h"
+#include "admission.h"
+
+/*
+    A fixed number of workers, sized to the core count, serve every connection.
+    The accept loop deals sockets round robin onto per-worker queues. A worker takes the oldest
+    socket from its own queue and when that is empty steals the oldest from the other queues, so
+    a worker stuck on a slow client never strands work. Every queue is served first in, first
+    out: the sockets were accepted on another thread so the newest is no warmer than the rest,
+    and serving it first would leave the oldest waiting until the admission limit sheds them.
+    The producer is the accept loop rather than the owning worker, so each queue has its own
+    small lock instead of a lock-free owner/thief deque. Idle workers do share one lock and
+    condition, which guard the count of queued sockets: it is taken once when a socket is
+    queued and once by the worker that claims it, and is only held to change the count.
+    Sockets remember when they were queued, one that waited longer than the admission limit is
+    turned away with a 503 instead of being served to a client that has likely given up.
+*/
+
+typedef struct _workerArgs {
+    ThreadPool* pool;
+    int id;
+} WorkerArgs;
+
+static void* Worker (void* args);
+static QueuedConnection TakeConnection (ThreadPool* pool, int id);
+static int PopOldest (WorkQueue* queue, QueuedConnection* conn);
+
+int DefaultWorkerCount () {
+    long cores = sysconf(_SC_NPROCESSORS_ONLN);
+    return cores > 0 ? (int)cores : 1;
+}
+
+ThreadPool* CreateThreadPool (int numWorkers) {
+    if (numWorkers < 1) numWorkers = DefaultWorkerCount();
+
+    ThreadPool* pool = malloc(sizeof(ThreadPool));
+    pool->numWorkers = numWorkers;
+    pool->queues = malloc(sizeof(WorkQueue) * numWorkers);
+    pool->threads = malloc(sizeof(pthread_t) * numWorkers);
+    pool->nextQueue = 0;
+    pool->pending = 0;
+    pool->maxDepth = 0;
+    pthread_mutex_init(&pool->idleLock,NULL);
+    pthread_cond_init(&pool->idleCond,NULL);
+
+    int i;
+    for (i = 0; i < numWorkers; i++) {
+        pthread_mutex_init(&pool->queues[i].lock,NULL);
+        pool->queues[i].head = 0;
+        pool->queues[i].count = 0;
+    }
+
+    for (i = 0; i < numWorkers; i++) {
+        WorkerArgs* args = malloc(sizeof(WorkerArgs));
+        args->pool = pool;
+        args->id = i;
+        if (pthread_create(&pool->threads[i],NULL,Worker,args) != NOERR) {
+            fprintf(stderr,"** pthread_create error **\n");
+            exit(1);
+        }
+    }
+    printf("Started %d worker thread(s)\n",numWorkers);
+
+    return pool;
+}
+
+//queue an accepted socket, returns ERROR if every queue is full
+int SubmitConnection (ThreadPool* pool, int connID) {
+    //every accept loop submits, they share the round robin without a lock
+    unsigned start = __atomic_fetch_add(&pool->nextQueue,1,__ATOMIC_RELAXED);
+    int i;
+    for (i = 0; i < pool->numWorkers; i++) {
+        WorkQueue* queue = &pool->queues[(start + i) % pool->numWorkers];
+
+        pthread_mutex_lock(&queue->lock);
+        if (queue->count < QUEUE_SIZE) {
+            QueuedConnection* queued = &queue->conns[(queue->head + queue->count) % QUEUE_SIZE];
+            queued->connID = connID;
+            queued->queuedAt = NanoTime();
+            queue->count++;
+            pthread_mutex_unlock(&queue->lock);
+
+            pthread_mutex_lock(&pool->idleLock);
+            pool->pending++;
+            int depth = pool->pending;
+            if (depth > pool->maxDepth) pool->maxDepth = depth;
+            pthread_cond_signal(&pool->idleCond);
+            pthread_mutex_unlock(&pool->idleLock);
+
+            //report saturation each time the queue reaches a new high water mark
+            if (depth >= POOL_WARN_DEPTH && depth == pool->maxDepth && depth % POOL_WARN_DEPTH == 0) {
+                LogWarn("** worker pool saturated: %d connections queued **",depth);
+            }
+            return NOERR;
+        }
+        pthread_mutex_unlock(&queue->lock);
+    }
+
+    return ERROR;
+}
+
+//number of accepted connections waiting for a worker
+int PoolQueueDepth (ThreadPool* pool) {
+    pthread_mutex_lock(&pool->idleLock);
+    int depth = pool->pending;
+    pthread_mutex_unlock(&pool->idleLock);
+    return depth;
+}
+
+static void* Worker (void* args) {
+    ThreadPool* pool = ((WorkerArgs*)args)->pool;
+    int id = ((WorkerArgs*)args)->id;
+    free(args);
+
+    while (1) {
+        //wait until there is something queued somewhere
+        pthread_mutex_lock(&pool->idleLock);
+        while (pool->pending == 0) {
+            pthread_cond_wait(&pool->idleCond,&pool->idleLock);
+        }
+        pool->pending--;
+        pthread_mutex_unlock(&pool->idleLock);
+
+        //we have claimed one connection, find it
+        QueuedConnection conn = TakeConnection(pool, id);
+        if (!AdmitQueued(conn.queuedAt)) {
+            ShedConnection(conn.connID);
+            ReleaseConnection();
+            continue;
+        }
+        ServeConnection(conn.connID, conn.queuedAt);
+    }
+
+    return NULL;
+}
+
+//own queue first, then steal from the others
+static QueuedConnection TakeConnection (ThreadPool* pool, int id) {
+    QueuedConnection conn;
+    int found = PopOldest(&pool->queues[id], &conn);
+    while (!found) {
+        int i;
+        for (i = 1; i < pool->numWorkers && !found; i++) {
+            found = PopOldest(&pool->queues[(id + i) % pool->numWorkers], &conn);
+        }
+        //every claim is backed by a queued socket, keep looking until we hold it
+        if (!found) found = PopOldest(&pool->queues[id], &conn);
+    }
+    return conn;
+}
+
+//returns FALSE if the queue is empty
+static int PopOldest (WorkQueue* queue, QueuedConnection* conn) {
+    int found = FALSE;
+    pthread_mutex_lock(&queue->lock);
+    if (queue->count > 0) {
+        *conn = queue->conns[queue->head];
+        queue->head = (queue->head + 1) % QUEUE_SIZE;
+        queue->count--;
+        found = TRUE;
+    }
+    pthread_mutex_unlock(&queue->lock);
+    return found;
+}
@@ -0,0 +1,46 @@
+/*
+    Custom Web Server - worker thread pool
+    By: Ricard Grace
+*/
+
+#ifndef THREADPOOL_H
+#define THREADPOOL_H
+
+#include "webServer.h"
+
+#define QUEUE_SIZE 1024
+#define POOL_WARN_DEPTH 64
+
+//an accepted socket and when it was queued
+typedef struct _queuedConnection {
+    int connID;
+    long long queuedAt;
+} QueuedConnection;
+
+//one queue of accepted sockets per worker
+typedef struct _workQueue {
+    pthread_mutex_t lock;
+    QueuedConnection conns[QUEUE_SIZE];
+    int head;
+    int count;
+} WorkQueue;
+
+typedef struct _threadPool {
+    int numWorkers;
+    WorkQueue* queues;
+    pthread_t* threads;
+    unsigned nextQueue;
+
+    //idle workers sleep here until something is queued
+    pthread_mutex_t idleLock;
+    pthread_cond_t idleCond;
+    int pending;
+    int maxDepth;
+} ThreadPool;
+
+ThreadPool* CreateThreadPool (int numWorkers);
+int SubmitConnection (ThreadPool* pool, int connID);
+int PoolQueueDepth (ThreadPool* pool);
+int DefaultWorkerCount ();
+
+#endif
@@ -0,0 +1,46 @@
+/*
+    Custom Web Server - per-thread slots
+    By: Ricard Grace
+*/
+
+#include "threadSlot.h"
+
+/*
+    The logger and the metrics give every thread a structure of its own that only that thread
+    writes, and that some other thread walks over to read. They are never freed, so the reader
+    can walk the list without a lock: when a thread exits its slot is marked unused and the next
+    new thread takes it over, so thread-per-connection mode does not keep allocating them.
+*/
+
+static void ReleaseSlot (void* slot);
+
+//slots in list will be size bytes, starting with a ThreadSlot
+void InitSlotList (SlotList* list, size_t size) {
+    atomic_init(&list->head,NULL);
+    list->size = size;
+    pthread_key_create(&list->key,ReleaseSlot);
+}
+
+//an unused slot taken over, or a new zeroed one the first time (NULL if out of memory or list was never set up)
+ThreadSlot* ClaimSlot (SlotList* list) {
+    if (list->size == 0) return NULL;
+    ThreadSlot* slot;
+    for (slot = atomic_load(&list->head); slot != NULL; slot = slot->next) {
+        int unused = FALSE;
+        if (atomic_compare_exchange_strong(&slot->inUse,&unused,TRUE)) break;
+    }
+    if (slot == NULL) {
+        slot = calloc(1,list->size);
+        if (slot == NULL) return NULL;
+        atomic_init(&slot->inUse,TRUE);
+        slot->next = atomic_load(&list->head);
+        while (!atomic_compare_exchange_weak(&list->head,&slot->next,slot)) {}
+    }
+    pthread_setspecific(list->key,slot);
+    return slot;
+}
+
+//called as a thread exits, whatever the thread left in the slot is still there for the reader
+static void ReleaseSlot (void* slot) {
+    atomic_store(&((ThreadSlot*)slot)->inUse,FALSE);
+}
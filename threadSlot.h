@@ -0,0 +1,30 @@
+/*
+    Custom Web Server - per-thread slots
+    By: Ricard Grace
+*/
+
+#ifndef THREAD_SLOT_H
+#define THREAD_SLOT_H
+
+#include "webServer.h"
+
+#include <stdatomic.h>
+
+//the first member of anything kept per thread this way (a log ring, a block of metrics)
+typedef struct _threadSlot {
+    //cleared when the owning thread exits so another thread can take the slot over
+    atomic_int inUse;
+    struct _threadSlot* next;
+} ThreadSlot;
+
+//every slot of one kind, only ever added to at the front so it can be walked at any time
+typedef struct _slotList {
+    ThreadSlot* _Atomic head;
+    pthread_key_t key;
+    size_t size;
+} SlotList;
+
+void InitSlotList (SlotList* list, size_t size);
+ThreadSlot* ClaimSlot (SlotList* list);
+
+#endif
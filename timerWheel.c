@@ -0,0 +1,92 @@
+/*
+    Custom Web Server - timer wheel
+    By: Ricard Grace
+*/
+
+#include "timerWheel.h"
+
+/*
+    A hashed timing wheel: every timer sits in the slot for the tick it expires on, so setting,
+    moving and cancelling one is a couple of pointer updates and no system call, however many
+    there are. Expiring walks only the slots of the ticks that have passed since the last time
+    and hands back everything that went off as one list, so callers deal with a batch at a time.
+    Timers further away than a full turn of the wheel stay in their slot until their turn comes.
+*/
+
+static unsigned long long CurrentTick ();
+
+void InitTimerWheel (TimerWheel* wheel) {
+    int i;
+    for (i = 0; i < WHEEL_SLOTS; i++) {
+        //each slot is a circular list with the slot itself as its head
+        wheel->slots[i].prev = &wheel->slots[i];
+        wheel->slots[i].next = &wheel->slots[i];
+    }
+    wheel->now = CurrentTick();
+}
+
+void InitTimer (Timer* timer, void* owner) {
+    timer->prev = NULL;
+    timer->next = NULL;
+    timer->armed = FALSE;
+    timer->owner = owner;
+}
+
+//(re)start the timer so it goes off in ms milliseconds (rounded up to whole ticks, never early)
+void SetTimer (TimerWheel* wheel, Timer* timer, int ms) {
+    CancelTimer(timer);
+    timer->expires = wheel->now + 1 + (ms + TIMER_TICK_MS - 1) / TIMER_TICK_MS;
+    Timer* head = &wheel->slots[timer->expires & (WHEEL_SLOTS-1)];
+    timer->prev = head->prev;
+    timer->next = head;
+    head->prev->next = timer;
+    head->prev = timer;
+    timer->armed = TRUE;
+}
+
+void CancelTimer (Timer* timer) {
+    if (!timer->armed) return;
+    timer->prev->next = timer->next;
+    timer->next->prev = timer->prev;
+    timer->armed = FALSE;
+}
+
+//take every timer that has gone off out of the wheel
+//returns them linked through next (NULL terminated), they can be set again straight away
+Timer* ExpireTimers (TimerWheel* wheel) {
+    unsigned long long target = CurrentTick();
+    Timer* expired = NULL;
+    //after a whole turn every slot has been looked at
+    unsigned long long steps = target - wheel->now;
+    if (steps > WHEEL_SLOTS) steps = WHEEL_SLOTS;
+    unsigned long long i;
+    for (i = 1; i <= steps; i++) {
+        Timer* head = &wheel->slots[(wheel->now + i) & (WHEEL_SLOTS-1)];
+        Timer* timer = head->next;
+        while (timer != head) {
+            Timer* next = timer->next;
+            if (timer->expires <= target) {
+                CancelTimer(timer);
+                timer->next = expired;
+                expired = timer;
+            }
+            timer = next;
+        }
+    }
+    if (target > wheel->now) wheel->now = target;
+    return expired;
+}
+
+//what a connection that ran out of time was too slow with, for the log
+char* TimeoutName (int timeout) {
+    if (timeout == TIMEOUT_HEADER) return "request header";
+    if (timeout == TIMEOUT_BODY) return "request body";
+    if (timeout == TIMEOUT_SEND) return "response";
+    return "next request";
+}
+
+static unsigned long long CurrentTick () {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC,&now);
+    return ((unsigned long long)now.tv_sec * 1000 + now.tv_nsec / 1000000) / TIMER_TICK_MS;
+}
@@ -0,0 +1,48 @@
+/*
+    Custom Web Server - timer wheel
+    By: Ricard Grace
+*/
+
+#ifndef TIMERWHEEL_H
+#define TIMERWHEEL_H
+
+#include "webServer.h"
+
+#include <time.h>
+
+//timers are kept to the nearest tick, a wheel covers WHEEL_SLOTS ticks (64 seconds) in one turn
+#define TIMER_TICK_MS 250
+#define WHEEL_SLOTS 256
+
+//what a connection's timer is waiting for
+#define TIMEOUT_IDLE   0
+#define TIMEOUT_HEADER 1
+#define TIMEOUT_SEND   2
+#define TIMEOUT_BODY   3
+#define NUM_TIMEOUTS   4
+
+//kept inside whatever it times, so arming and cancelling never allocate
+typedef struct _timer {
+    struct _timer* prev;
+    struct _timer* next;
+    //tick the timer goes off on
+    unsigned long long expires;
+    int armed;
+    void* owner;
+} Timer;
+
+//timers hashed by expiry tick into a ring of lists, only used by one thread at a time
+typedef struct _timerWheel {
+    Timer slots[WHEEL_SLOTS];
+    //every tick up to this one has been expired
+    unsigned long long now;
+} TimerWheel;
+
+void InitTimerWheel (TimerWheel* wheel);
+void InitTimer (Timer* timer, void* owner);
+void SetTimer (TimerWheel* wheel, Timer* timer, int ms);
+void CancelTimer (Timer* timer);
+Timer* ExpireTimers (TimerWheel* wheel);
+char* TimeoutName (int timeout);
+
+#endif
@@ -0,0 +1,377 @@
+/*
+    Custom Web Server - load generator
+    By: Ricard Grace
+*/
+
+#include "../webServer.h"
+#include "../metrics.h"
+
+#include <dirent.h>
+#include <netinet/tcp.h>
+#include <time.h>
+
+/*
+    A closed loop load generator: every client thread keeps one request in flight at a time,
+    sending the next one as soon as the last response has been read in full. Requests are picked
+    at random (from a fixed seed, so runs are repeatable) from a weighted mix of
+    files    - every file in the bench document root
+    large    - generated files of 1MB and 16MB, created in the bench document root if missing
+    404      - files that do not exist
+    400      - malformed requests
+    Connections are reused unless keep-alive is turned off or the server closes them. Latencies
+    are kept per thread in the server's own log-linear histograms (metrics.c) and merged at the
+    end. The results are printed as a single JSON object so runs can be compared by script.
+    The bench document root is a copy of the data directory made by `make bench`, which points the
+    server at it, so the generated files never end up in the data directory itself.
+*/
+
+#define MAX_FILES 1024
+#define MAX_CLIENTS 4096
+#define RESPONSE_BUFF 65536
+//document root the server under test serves, the Makefile's BENCH_DIR
+#define BENCH_DIR "benchData"
+
+//kinds of request in the mix
+#define MIX_FILES 0
+#define MIX_LARGE 1
+#define MIX_404   2
+#define MIX_400   3
+#define NUM_MIX   4
+
+typedef struct _clientStats {
+    unsigned long requests;
+    unsigned long errors;
+    unsigned long long bytes;
+    unsigned long status[600];
+    //histogram of latencies in nanoseconds
+    unsigned long latency[HIST_BUCKETS];
+    unsigned long long maxLatency;
+} ClientStats;
+
+typedef struct _client {
+    int id;
+    pthread_t thread;
+    ClientStats stats;
+} Client;
+
+static void* RunClient (void* args);
+static int Connect ();
+static int DoRequest (int* connID, char* request, int requestLen, ClientStats* stats);
+static int PickMix (unsigned int* seed);
+static void LoadFiles (char* dir, char* relPath);
+static void MakeLargeFiles ();
+static void Encode (char* path, char* result, int size);
+
+static char* mixNames[NUM_MIX] = {"files", "large", "404", "400"};
+static int mixWeights[NUM_MIX] = {80, 5, 10, 5};
+static int totalWeight = 100;
+
+static char* runName = "bench";
+static char* host = "127.0.0.1";
+static char* port = DEFAULT_PORT;
+static char* dataDir = BENCH_DIR;
+static int keepAlive = TRUE;
+static int duration = 10;
+static struct addrinfo* serverAddr = NULL;
+static volatile int running = TRUE;
+
+static char* files[MAX_FILES];
+static int numFiles = 0;
+static char* largeFiles[] = {"/bench-1M.bin", "/bench-16M.bin"};
+static long long largeSizes[] = {1048576, 16777216};
+static int numLarge = 2;
+
+int main (int argc, char* argv[]) {
+    int numClients = 16;
+    int opt;
+    while ((opt = getopt(argc, argv, "n:h:p:c:d:kD:m:")) != ERROR) {
+        if (opt == 'n') {
+            runName = optarg;
+        } else if (opt == 'h') {
+            host = optarg;
+        } else if (opt == 'p') {
+            port = optarg;
+        } else if (opt == 'c' && atoi(optarg) > 0 && atoi(optarg) <= MAX_CLIENTS) {
+            numClients = atoi(optarg);
+        } else if (opt == 'd' && atoi(optarg) > 0) {
+            duration = atoi(optarg);
+        } else if (opt == 'k') {
+            keepAlive = FALSE;
+        } else if (opt == 'D') {
+            dataDir = optarg;
+        } else if (opt == 'm') {
+            //files:80,large:5,404:10,400:5 (kinds left out get no requests)
+            memset(mixWeights,0,sizeof(mixWeights));
+            char* item;
+            for (item = strtok(optarg,","); item != NULL; item = strtok(NULL,",")) {
+                char* colon = strchr(item,':');
+                int kind;
+                for (kind = 0; kind < NUM_MIX; kind++) {
+                    if (colon != NULL && strncmp(item,mixNames[kind],colon-item) == STREQU && strlen(mixNames[kind]) == (size_t)(colon-item)) break;
+                }
+                if (kind == NUM_MIX) {
+                    fprintf(stderr,"** unknown request kind: %s **\n",item);
+                    exit(1);
+                }
+                mixWeights[kind] = atoi(colon+1);
+            }
+        } else {
+            fprintf(stderr,"Usage: %s [-n run name] [-h host] [-p port] [-c connections] [-d seconds] [-k (no keep-alive)] [-D document root] [-m files:80,large:5,404:10,400:5]\n",argv[0]);
+            exit(1);
+        }
+    }
+    totalWeight = 0;
+    int kind;
+    for (kind = 0; kind < NUM_MIX; kind++) totalWeight += mixWeights[kind];
+    if (totalWeight <= 0) {
+        fprintf(stderr,"** the request mix is empty **\n");
+        exit(1);
+    }
+
+    LoadFiles(dataDir, "");
+    if (mixWeights[MIX_LARGE] > 0) MakeLargeFiles();
+    if (mixWeights[MIX_FILES] > 0 && numFiles == 0) {
+        fprintf(stderr,"** no files found in %s **\n",dataDir);
+        exit(1);
+    }
+
+    struct addrinfo hints;
+    memset(&hints,0,sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    int addrErr = getaddrinfo(host,port,&hints,&serverAddr);
+    if (addrErr != NOERR) {
+        fprintf(stderr,"** getaddrinfo error: %s **\n",gai_strerror(addrErr));
+        exit(1);
+    }
+    signal(SIGPIPE,SIG_IGN);
+
+    Client* clients = calloc(numClients,sizeof(Client));
+    long long start = NanoTime();
+    int i;
+    for (i = 0; i < numClients; i++) {
+        clients[i].id = i;
+        if (pthread_create(&clients[i].thread,NULL,RunClient,&clients[i]) != NOERR) {
+            fprintf(stderr,"** pthread_create error **\n");
+            exit(1);
+        }
+    }
+    sleep(duration);
+    running = FALSE;
+
+    //merge every client's results
+    ClientStats* total = calloc(1,sizeof(ClientStats));
+    for (i = 0; i < numClients; i++) {
+        pthread_join(clients[i].thread,NULL);
+        ClientStats* stats = &clients[i].stats;
+        total->requests += stats->requests;
+        total->errors += stats->errors;
+        total->bytes += stats->bytes;
+        int j;
+        for (j = 0; j < 600; j++) total->status[j] += stats->status[j];
+        for (j = 0; j < HIST_BUCKETS; j++) total->latency[j] += stats->latency[j];
+        if (stats->maxLatency > total->maxLatency) total->maxLatency = stats->maxLatency;
+    }
+    double seconds = (NanoTime() - start) / 1e9;
+
+    printf("{\"name\": \"%s\", \"config\": {\"host\": \"%s\", \"port\": \"%s\", \"connections\": %d, \"duration_s\": %d, \"keep_alive\": %s, \"mix\": {",runName,host,port,numClients,duration,keepAlive ? "true" : "false");
+    for (kind = 0; kind < NUM_MIX; kind++) printf("%s\"%s\": %d",kind > 0 ? ", " : "",mixNames[kind],mixWeights[kind]);
+    printf("}}, ");
+    printf("\"requests\": %lu, \"errors\": %lu, \"elapsed_s\": %.3f, ",total->requests,total->errors,seconds);
+    printf("\"requests_per_s\": %.1f, \"mb_per_s\": %.2f, ",total->requests / seconds,total->bytes / seconds / 1048576);
+    printf("\"latency_us\": {\"p50\": %.1f, \"p99\": %.1f, \"p999\": %.1f, \"max\": %.1f}, ",HistQuantile(total->latency,total->requests,0.5) / 1e3,HistQuantile(total->latency,total->requests,0.99) / 1e3,HistQuantile(total->latency,total->requests,0.999) / 1e3,total->maxLatency / 1e3);
+    printf("\"status\": {");
+    int first = TRUE;
+    for (i = 0; i < 600; i++) {
+        if (total->status[i] == 0) continue;
+        printf("%s\"%d\": %lu",first ? "" : ", ",i,total->status[i]);
+        first = FALSE;
+    }
+    printf("}}\n");
+
+    freeaddrinfo(serverAddr);
+    return total->requests > 0 ? 0 : 1;
+}
+
+static void* RunClient (void* args) {
+    Client* client = (Client*)args;
+    ClientStats* stats = &client->stats;
+    unsigned int seed = 12345 + client->id;
+    int connID = ERROR;
+    char request[PATH_SIZE*3+HEADER_SIZE];
+    char encoded[PATH_SIZE*3+1];
+
+    while (running) {
+        int requestLen;
+        int kind = PickMix(&seed);
+        char* connection = keepAlive ? "keep-alive" : "close";
+        if (kind == MIX_400) {
+            requestLen = snprintf(request,sizeof(request),"BLAH\r\nHost: %s\r\n\r\n",host);
+        } else if (kind == MIX_404) {
+            requestLen = snprintf(request,sizeof(request),"GET /missing/%u.html HTTP/1.1\r\nHost: %s\r\nConnection: %s\r\n\r\n",rand_r(&seed) % 1000,host,connection);
+        } else {
+            char* path = kind == MIX_LARGE ? largeFiles[rand_r(&seed) % numLarge] : files[rand_r(&seed) % numFiles];
+            Encode(path, encoded, sizeof(encoded));
+            requestLen = snprintf(request,sizeof(request),"GET %s HTTP/1.1\r\nHost: %s\r\nConnection: %s\r\n\r\n",encoded,host,connection);
+        }
+
+        long long start = NanoTime();
+        if (connID == ERROR && (connID = Connect()) == ERROR) {
+            stats->errors++;
+            usleep(1000);
+            continue;
+        }
+        if (DoRequest(&connID, request, requestLen, stats) == ERROR) {
+            //a reused connection may have been closed by the server just before we sent
+            stats->errors++;
+            if (connID != ERROR) close(connID);
+            connID = ERROR;
+            continue;
+        }
+        unsigned long long latency = NanoTime() - start;
+        stats->requests++;
+        stats->latency[HistBucket(latency)]++;
+        if (latency > stats->maxLatency) stats->maxLatency = latency;
+        if (!keepAlive && connID != ERROR) {
+            close(connID);
+            connID = ERROR;
+        }
+    }
+    if (connID != ERROR) close(connID);
+    return NULL;
+}
+
+static int Connect () {
+    int connID = socket(serverAddr->ai_family,serverAddr->ai_socktype | SOCK_CLOEXEC,serverAddr->ai_protocol);
+    if (connID == ERROR) return ERROR;
+    if (connect(connID,serverAddr->ai_addr,serverAddr->ai_addrlen) == ERROR) {
+        close(connID);
+        return ERROR;
+    }
+    int on = 1;
+    setsockopt(connID,IPPROTO_TCP,TCP_NODELAY,&on,sizeof(on));
+    return connID;
+}
+
+//send the request and read the whole response, closing the connection if the server asked to
+static int DoRequest (int* connID, char* request, int requestLen, ClientStats* stats) {
+    int sent = 0;
+    while (sent < requestLen) {
+        int bytesSent = send(*connID,&request[sent],requestLen-sent,MSG_NOSIGNAL);
+        if (bytesSent == ERROR) return ERROR;
+        sent += bytesSent;
+    }
+
+    //read up to the end of the header (the server may end lines with \n or \r\n)
+    static __thread char buffer[RESPONSE_BUFF+1];
+    int bufferLen = 0;
+    char* headerEnd = NULL;
+    int headerLen = 0;
+    while (headerEnd == NULL) {
+        if (bufferLen >= RESPONSE_BUFF) return ERROR;
+        int recvOut = recv(*connID,&buffer[bufferLen],RESPONSE_BUFF-bufferLen,0);
+        if (recvOut <= 0) return ERROR;
+        bufferLen += recvOut;
+        buffer[bufferLen] = '\0';
+        if ((headerEnd = strstr(buffer,"\r\n\r\n")) != NULL) {
+            headerLen = headerEnd - buffer + 4;
+        } else if ((headerEnd = strstr(buffer,"\n\n")) != NULL) {
+            headerLen = headerEnd - buffer + 2;
+        }
+    }
+
+    int status = 0;
+    if (sscanf(buffer,"HTTP/%*d.%*d %d",&status) != 1 || status < 100 || status >= 600) return ERROR;
+    long long contentLength = 0;
+    char* field = strcasestr(buffer,"\nContent-Length:");
+    if (field != NULL && field < headerEnd) contentLength = atoll(field + 16);
+    field = strcasestr(buffer,"\nConnection:");
+    int closing = field != NULL && field < headerEnd && strncasecmp(&field[12 + strspn(&field[12]," ")],"close",5) == STREQU;
+
+    //the rest of the body is read and thrown away
+    long long bodyRead = bufferLen - headerLen;
+    while (bodyRead < contentLength) {
+        long long want = contentLength - bodyRead < RESPONSE_BUFF ? contentLength - bodyRead : RESPONSE_BUFF;
+        int recvOut = recv(*connID,buffer,want,0);
+        if (recvOut <= 0) return ERROR;
+        bodyRead += recvOut;
+    }
+
+    stats->status[status]++;
+    stats->bytes += headerLen + contentLength;
+    if (closing) {
+        close(*connID);
+        *connID = ERROR;
+    }
+    return NOERR;
+}
+
+static int PickMix (unsigned int* seed) {
+    int pick = rand_r(seed) % totalWeight;
+    int kind;
+    for (kind = 0; kind < NUM_MIX; kind++) {
+        if (pick < mixWeights[kind]) return kind;
+        pick -= mixWeights[kind];
+    }
+    return MIX_FILES;
+}
+
+//collect every regular file below dir (the generated large files are requested separately)
+static void LoadFiles (char* dir, char* relPath) {
+    char fullPath[PATH_SIZE+1];
+    snprintf(fullPath,PATH_SIZE+1,"%s%s",dir,relPath);
+    DIR* folder = opendir(fullPath);
+    if (folder == NULL) return;
+    struct dirent* item;
+    while ((item = readdir(folder)) != NULL && numFiles < MAX_FILES) {
+        if (item->d_name[0] == '.' || strncmp(item->d_name,"bench-",6) == STREQU) continue;
+        char path[PATH_SIZE+1];
+        snprintf(path,PATH_SIZE+1,"%s/%s",relPath,item->d_name);
+        if (item->d_type == DT_DIR) {
+            LoadFiles(dir, path);
+        } else if (item->d_type == DT_REG) {
+            files[numFiles++] = strdup(path);
+        }
+    }
+    closedir(folder);
+}
+
+static void MakeLargeFiles () {
+    int i;
+    for (i = 0; i < numLarge; i++) {
+        char fullPath[PATH_SIZE+1];
+        snprintf(fullPath,PATH_SIZE+1,"%s%s",dataDir,largeFiles[i]);
+        struct stat st;
+        if (stat(fullPath,&st) == NOERR && st.st_size == largeSizes[i]) continue;
+
+        FILE* file = fopen(fullPath,"w");
+        if (file == NULL) {
+            fprintf(stderr,"** fopen error ** %s: %s\n",fullPath,strerror(errno));
+            exit(1);
+        }
+        char block[4096];
+        unsigned int seed = i;
+        long long written;
+        for (written = 0; written < largeSizes[i]; written += sizeof(block)) {
+            int j;
+            for (j = 0; j < (int)sizeof(block); j++) block[j] = rand_r(&seed);
+            fwrite(block,1,sizeof(block),file);
+        }
+        fclose(file);
+        fprintf(stderr,"created %s\n",fullPath);
+    }
+}
+
+//percent encode anything in path that is not safe in a request line
+static void Encode (char* path, char* result, int size) {
+    int len = 0;
+    for (; *path != '\0' && len < size-4; path++) {
+        unsigned char c = *path;
+        if ((c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || (c >= '0' && c <= '9') || strchr("/._-~",c) != NULL) {
+            result[len++] = c;
+        } else {
+            len += snprintf(&result[len],size-len,"%%%02X",c);
+        }
+    }
+    result[len] = '\0';
+}
@@ -0,0 +1,284 @@
+/*
+    Custom Web Server - asset packer
+    By: Ricard Grace
+*/
+
+#include "../webServer.h"
+#include "../assetPack.h"
+#include "../conditional.h"
+#include "../mimeTypes.h"
+#include "../docRoot.h"
+#include "../hash.h"
+
+#include <dirent.h>
+
+/*
+    Bundles the data directory into one archive for the server to map with -P (see assetPack.c).
+        usage: packAssets <data directory> <archive>
+    Every regular file beneath the directory (except the load generator's bench-* files) is opened
+    the way the server opens it, and its entity headers and ETag are worked out as the file cache
+    would. The perfect hash is built before anything is written: buckets are placed largest first,
+    each trying displacements until all of its paths land in free slots, and the whole thing starts
+    again with a new seed if a bucket cannot be placed. The archive is written next to its final
+    name and renamed over it, so a server still mapping the old one is not disturbed.
+*/
+
+#define COPY_SIZE 65536
+
+typedef struct _packFile {
+    char* path;
+    uint64_t hash;
+    struct stat st;
+} PackFile;
+
+static int CollectFiles (char* dataDir, char* relPath);
+static int BuildIndex (uint32_t seed, uint32_t numBuckets, uint32_t* displacements, int* slots);
+static int WritePack (char* fileName, uint32_t seed, uint32_t numBuckets, uint32_t* displacements, int* slots);
+static int CopyBody (int outFd, int fileFd, uint64_t offset, long long size);
+static uint64_t Align (uint64_t offset, uint64_t align);
+
+static PackFile* files = NULL;
+static int numFiles = 0;
+static int filesSize = 0;
+//the archive being replaced, so it is not packed into itself
+static struct stat oldPack;
+static int hasOldPack = FALSE;
+
+int main (int argc, char* argv[]) {
+    if (argc != 3) {
+        fprintf(stderr,"Usage: %s <data directory> <archive>\n",argv[0]);
+        return 1;
+    }
+    char dataDir[PATH_SIZE+1];
+    if (realpath(argv[1],dataDir) == NULL) {
+        fprintf(stderr,"** pack error ** %s: %s\n",argv[1],strerror(errno));
+        return 1;
+    }
+    if (OpenDocRoot(dataDir) == ERROR) return 1;
+    hasOldPack = stat(argv[2],&oldPack) != ERROR;
+    if (CollectFiles(dataDir, "") == ERROR) return 1;
+
+    uint32_t numBuckets = numFiles / PACK_BUCKET_LOAD + 1;
+    uint32_t* displacements = calloc(numBuckets,sizeof(uint32_t));
+    int* slots = malloc((numFiles > 0 ? numFiles : 1) * sizeof(int));
+    uint32_t seed;
+    for (seed = 0; seed < PACK_MAX_SEEDS && BuildIndex(seed, numBuckets, displacements, slots) == ERROR; seed++);
+    if (seed == PACK_MAX_SEEDS) {
+        fprintf(stderr,"** pack error ** could not build the path index\n");
+        return 1;
+    }
+    return WritePack(argv[2], seed, numBuckets, displacements, slots) == ERROR ? 1 : 0;
+}
+
+//add every regular file beneath relPath (a path from the data directory, "" for the directory itself)
+static int CollectFiles (char* dataDir, char* relPath) {
+    char dirPath[PATH_SIZE*2+2];
+    snprintf(dirPath,sizeof(dirPath),"%s%s",dataDir,relPath);
+    DIR* dir = opendir(dirPath);
+    if (dir == NULL) {
+        fprintf(stderr,"** pack error ** %s: %s\n",dirPath,strerror(errno));
+        return ERROR;
+    }
+    struct dirent* item;
+    while ((item = readdir(dir)) != NULL) {
+        if (strcmp(item->d_name,".") == STREQU || strcmp(item->d_name,"..") == STREQU) continue;
+        //the load generator's generated files are not part of the site
+        if (strncmp(item->d_name,"bench-",6) == STREQU) continue;
+        char path[PATH_SIZE+1];
+        if (snprintf(path,sizeof(path),"%s/%s",relPath,item->d_name) >= sizeof(path)) continue;
+
+        struct stat st;
+        char fullPath[PATH_SIZE*2+2];
+        snprintf(fullPath,sizeof(fullPath),"%s%s",dataDir,path);
+        if (stat(fullPath,&st) == ERROR) continue;
+        if (S_ISDIR(st.st_mode)) {
+            if (CollectFiles(dataDir, path) == ERROR) {
+                closedir(dir);
+                return ERROR;
+            }
+            continue;
+        }
+        if (hasOldPack && st.st_dev == oldPack.st_dev && st.st_ino == oldPack.st_ino) continue;
+
+        //only what the server itself would serve
+        int fileFd = OpenBeneath(path, &st);
+        if (fileFd == ERROR) continue;
+        close(fileFd);
+        if (numFiles == filesSize) {
+            filesSize = filesSize == 0 ? 64 : filesSize * 2;
+            files = realloc(files,filesSize * sizeof(PackFile));
+        }
+        files[numFiles].path = strdup(path);
+        files[numFiles].st = st;
+        numFiles++;
+    }
+    closedir(dir);
+    return NOERR;
+}
+
+//find a displacement for every bucket so that each path gets a slot of its own, slots[i] is the file in slot i
+//returns ERROR if a bucket cannot be placed with this seed
+static int BuildIndex (uint32_t seed, uint32_t numBuckets, uint32_t* displacements, int* slots) {
+    //the files of each bucket, grouped together with a counting sort
+    int* bucketStart = calloc(numBuckets + 1,sizeof(int));
+    int* members = malloc((numFiles > 0 ? numFiles : 1) * sizeof(int));
+    int* fill = calloc(numBuckets,sizeof(int));
+    int i;
+    for (i = 0; i < numFiles; i++) {
+        files[i].hash = HashPath64(files[i].path, seed);
+        bucketStart[PackBucket(files[i].hash, numBuckets) + 1]++;
+    }
+    for (i = 0; i < numBuckets; i++) bucketStart[i+1] += bucketStart[i];
+    for (i = 0; i < numFiles; i++) {
+        uint32_t bucket = PackBucket(files[i].hash, numBuckets);
+        members[bucketStart[bucket] + fill[bucket]++] = i;
+    }
+    for (i = 0; i < numFiles; i++) slots[i] = ERROR;
+    memset(displacements,0,numBuckets * sizeof(uint32_t));
+
+    //the largest buckets go first, while there are still plenty of free slots
+    int largest = 0;
+    uint32_t bucket;
+    for (bucket = 0; bucket < numBuckets; bucket++) {
+        if (bucketStart[bucket+1] - bucketStart[bucket] > largest) largest = bucketStart[bucket+1] - bucketStart[bucket];
+    }
+    int result = NOERR;
+    int size;
+    for (size = largest; size > 0 && result == NOERR; size--) {
+        for (bucket = 0; bucket < numBuckets && result == NOERR; bucket++) {
+            int count = bucketStart[bucket+1] - bucketStart[bucket];
+            if (count != size) continue;
+            int* bucketFiles = &members[bucketStart[bucket]];
+            uint32_t displacement;
+            for (displacement = 0; displacement < PACK_MAX_DISPLACEMENT; displacement++) {
+                //every path of the bucket has to land in a free slot, and not on another of the bucket
+                int placed;
+                for (placed = 0; placed < count; placed++) {
+                    uint32_t slot = PackSlot(files[bucketFiles[placed]].hash, displacement, numFiles);
+                    if (slots[slot] != ERROR) break;
+                    slots[slot] = bucketFiles[placed];
+                }
+                if (placed == count) break;
+                while (--placed >= 0) slots[PackSlot(files[bucketFiles[placed]].hash, displacement, numFiles)] = ERROR;
+            }
+            if (displacement == PACK_MAX_DISPLACEMENT) result = ERROR;
+            displacements[bucket] = displacement;
+        }
+    }
+    free(bucketStart);
+    free(members);
+    free(fill);
+    return result;
+}
+
+//lay the archive out (header, displacements, records, strings, then the bodies a page apart) and write it
+static int WritePack (char* fileName, uint32_t seed, uint32_t numBuckets, uint32_t* displacements, int* slots) {
+    PackHeader header;
+    memset(&header,0,sizeof(header));
+    memcpy(header.magic,PACK_MAGIC,PACK_MAGIC_SIZE);
+    header.version = PACK_VERSION;
+    header.numEntries = numFiles;
+    header.numBuckets = numBuckets;
+    header.seed = seed;
+    header.displacementOffset = sizeof(PackHeader);
+    header.recordOffset = Align(header.displacementOffset + numBuckets * sizeof(uint32_t), sizeof(uint64_t));
+
+    //the index (everything before the first body) is put together in memory
+    uint64_t stringOffset = header.recordOffset + numFiles * sizeof(PackRecord);
+    uint64_t indexSize = stringOffset;
+    char (*headers)[HEADER_SIZE] = malloc((numFiles > 0 ? numFiles : 1) * HEADER_SIZE);
+    int i;
+    for (i = 0; i < numFiles; i++) {
+        PackFile* file = &files[slots[i]];
+        char etag[ETAG_SIZE];
+        FormatETag(etag, &file->st);
+        EntityHeaders(headers[i], HEADER_SIZE, ContentType(file->path), (long long)file->st.st_size, etag, file->st.st_mtime, file->path, NULL);
+        indexSize += strlen(file->path) + 1 + strlen(headers[i]) + 1;
+    }
+    char* index = calloc(indexSize,1);
+    memcpy(index,&header,sizeof(header));
+    memcpy(&index[header.displacementOffset],displacements,numBuckets * sizeof(uint32_t));
+    PackRecord* records = (PackRecord*)&index[header.recordOffset];
+    uint64_t bodyOffset = Align(indexSize, PACK_ALIGN);
+    for (i = 0; i < numFiles; i++) {
+        PackFile* file = &files[slots[i]];
+        PackRecord* record = &records[i];
+        record->pathOffset = stringOffset;
+        record->pathLen = strlen(file->path);
+        memcpy(&index[stringOffset],file->path,record->pathLen);
+        stringOffset += record->pathLen + 1;
+        record->headerOffset = stringOffset;
+        record->headerLen = strlen(headers[i]);
+        memcpy(&index[stringOffset],headers[i],record->headerLen);
+        stringOffset += record->headerLen + 1;
+        record->bodyOffset = bodyOffset;
+        record->bodySize = file->st.st_size;
+        record->mtime = file->st.st_mtime;
+        FormatETag(record->etag, &file->st);
+        bodyOffset = Align(bodyOffset + record->bodySize, PACK_ALIGN);
+    }
+    uint64_t size = numFiles > 0 ? records[numFiles-1].bodyOffset + records[numFiles-1].bodySize : indexSize;
+    ((PackHeader*)index)->size = size;
+
+    char tmpName[PATH_SIZE+1];
+    snprintf(tmpName,sizeof(tmpName),"%s.tmp",fileName);
+    int outFd = open(tmpName,O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC,0644);
+    if (outFd == ERROR) {
+        fprintf(stderr,"** pack error ** %s: %s\n",tmpName,strerror(errno));
+        return ERROR;
+    }
+    int result = pwrite(outFd,index,indexSize,0) == indexSize ? NOERR : ERROR;
+    long long bodyBytes = 0;
+    for (i = 0; i < numFiles && result == NOERR; i++) {
+        PackFile* file = &files[slots[i]];
+        struct stat st;
+        int fileFd = OpenBeneath(file->path, &st);
+        //the file has to be the one the headers were worked out for
+        if (fileFd == ERROR || st.st_size != file->st.st_size || st.st_mtim.tv_sec != file->st.st_mtim.tv_sec || st.st_mtim.tv_nsec != file->st.st_mtim.tv_nsec) {
+            fprintf(stderr,"** pack error ** %s changed while packing\n",file->path);
+            if (fileFd != ERROR) close(fileFd);
+            close(outFd);
+            unlink(tmpName);
+            return ERROR;
+        }
+        result = CopyBody(outFd, fileFd, records[i].bodyOffset, records[i].bodySize);
+        bodyBytes += records[i].bodySize;
+        close(fileFd);
+    }
+    //the gaps between bodies are left as holes
+    if (result == NOERR && (ftruncate(outFd,size) == ERROR || fsync(outFd) == ERROR)) result = ERROR;
+    if (close(outFd) == ERROR) result = ERROR;
+    if (result == NOERR && rename(tmpName,fileName) == ERROR) result = ERROR;
+    if (result == ERROR) {
+        fprintf(stderr,"** pack error ** %s: %s\n",fileName,strerror(errno));
+        unlink(tmpName);
+    } else {
+        printf("Packed %d files (%lld bytes) into %s\n",numFiles,bodyBytes,fileName);
+    }
+    free(index);
+    free(headers);
+    return result;
+}
+
+static int CopyBody (int outFd, int fileFd, uint64_t offset, long long size) {
+    char buffer[COPY_SIZE];
+    long long copied = 0;
+    while (copied < size) {
+        ssize_t elemRead = pread(fileFd,buffer,size-copied < COPY_SIZE ? size-copied : COPY_SIZE,copied);
+        if (elemRead == ERROR && errno == EINTR) continue;
+        if (elemRead <= 0) return ERROR;
+        ssize_t written = 0;
+        while (written < elemRead) {
+            ssize_t elemWritten = pwrite(outFd,&buffer[written],elemRead-written,offset+copied+written);
+            if (elemWritten == ERROR && errno == EINTR) continue;
+            if (elemWritten == ERROR) return ERROR;
+            written += elemWritten;
+        }
+        copied += elemRead;
+    }
+    return NOERR;
+}
+
+static uint64_t Align (uint64_t offset, uint64_t align) {
+    return (offset + align - 1) / align * align;
+}
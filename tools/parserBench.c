@@ -0,0 +1,118 @@
+/*
+    Custom Web Server - request parser microbenchmark
+    By: Ricard Grace
+*/
+
+#include "../webServer.h"
+#include "../httpParser.h"
+
+#include <time.h>
+
+/*
+    Times the incremental parser against the original way of reading a request: searching the
+    whole buffer for \r\n\r\n every time more data arrives, then rescanning it for the method,
+    path, version and each header. Each request is fed in chunks to mimic it arriving over
+    several recv calls; a chunk size of 1 is the worst case for the original code.
+*/
+
+#define BENCH_ITERATIONS 20000
+
+static char* sampleRequest =
+    "GET /images/some%20folder/../photo.jpg HTTP/1.1\r\n"
+    "Host: localhost:8080\r\n"
+    "User-Agent: Mozilla/5.0 (X11; Linux x86_64; rv:109.0) Gecko/20100101 Firefox/115.0\r\n"
+    "Accept: text/html,application/xhtml+xml,application/xml;q=0.9,image/avif,image/webp,*/*;q=0.8\r\n"
+    "Accept-Language: en-GB,en;q=0.5\r\n"
+    "Accept-Encoding: gzip, deflate, br\r\n"
+    "Referer: http://localhost:8080/index.html\r\n"
+    "Cookie: session=0123456789abcdef0123456789abcdef; theme=dark; lang=en\r\n"
+    "If-None-Match: \"5f1c-1a2b3c-64\"\r\n"
+    "Range: bytes=0-1023\r\n"
+    "Connection: keep-alive\r\n"
+    "Upgrade-Insecure-Requests: 1\r\n"
+    "\r\n";
+
+static volatile int sink;
+
+static double Seconds () {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec + now.tv_nsec / 1e9;
+}
+
+//the original request handling: strstr over the whole buffer after every recv, then one scan per field
+static void LegacyParse (char* request, int length, int chunk) {
+    char buffer[BUFF_SIZE+1];
+    char fileName[PATH_SIZE+1];
+    char value[VALUE_SIZE];
+    int bytesRecv = 0;
+    memset(buffer,0,BUFF_SIZE+1);
+    while (bytesRecv < length) {
+        int count = length - bytesRecv < chunk ? length - bytesRecv : chunk;
+        memcpy(&buffer[bytesRecv],&request[bytesRecv],count);
+        bytesRecv += count;
+        if (strstr(buffer,"\r\n\r\n") != NULL) break;
+    }
+    sink += RequestType(buffer, bytesRecv);
+    sink += RequestPath(buffer, bytesRecv, fileName);
+    sink += RequestVersion(buffer, bytesRecv);
+    sink += FindHeader(buffer, bytesRecv, "Connection", value, VALUE_SIZE);
+    sink += FindHeader(buffer, bytesRecv, "Range", value, VALUE_SIZE);
+    sink += FindHeader(buffer, bytesRecv, "If-None-Match", value, VALUE_SIZE);
+    sink += FindHeader(buffer, bytesRecv, "Accept-Encoding", value, VALUE_SIZE);
+}
+
+static void ParserParse (char* request, int length, int chunk) {
+    char buffer[BUFF_SIZE+1];
+    char fileName[PATH_SIZE+1];
+    char value[VALUE_SIZE];
+    HttpParser parser;
+    int bytesRecv = 0;
+    InitParser(&parser);
+    while (bytesRecv < length) {
+        int count = length - bytesRecv < chunk ? length - bytesRecv : chunk;
+        memcpy(&buffer[bytesRecv],&request[bytesRecv],count);
+        bytesRecv += count;
+        if (ParseRequest(&parser, buffer, bytesRecv) == TRUE) break;
+    }
+    sink += parser.method;
+    DecodePath(&buffer[parser.target.start], parser.target.len, fileName);
+    sink += fileName[0];
+    sink += parser.version;
+    sink += CopyHeader(&parser, buffer, HDR_CONNECTION, value, VALUE_SIZE);
+    sink += CopyHeader(&parser, buffer, HDR_RANGE, value, VALUE_SIZE);
+    sink += CopyHeader(&parser, buffer, HDR_IF_NONE_MATCH, value, VALUE_SIZE);
+    sink += CopyHeader(&parser, buffer, HDR_ACCEPT_ENCODING, value, VALUE_SIZE);
+}
+
+static double Run (void (*parse) (char*, int, int), char* request, int length, int chunk) {
+    double start = Seconds();
+    int i;
+    for (i = 0; i < BENCH_ITERATIONS; i++) parse(request, length, chunk);
+    return (Seconds() - start) / BENCH_ITERATIONS * 1e9;
+}
+
+int main (int argc, char* argv[]) {
+    int chunks[] = {1, 16, 64, 1460, BUFF_SIZE};
+    int numChunks = sizeof(chunks) / sizeof(chunks[0]);
+    int length = strlen(sampleRequest);
+
+    //the legacy functions print what they find, keep that out of the results
+    int out = dup(STDOUT_FILENO);
+    if (freopen("/dev/null","w",stdout) == NULL) {
+        fprintf(stderr,"** freopen error ** %s\n",strerror(errno));
+        return 1;
+    }
+    FILE* results = fdopen(out,"w");
+
+    fprintf(results,"request: %d bytes, %d iterations\n", length, BENCH_ITERATIONS);
+    fprintf(results,"%10s %14s %14s %9s\n","chunk","legacy ns/req","parser ns/req","speedup");
+    int i;
+    for (i = 0; i < numChunks; i++) {
+        double legacy = Run(LegacyParse, sampleRequest, length, chunks[i]);
+        double parser = Run(ParserParse, sampleRequest, length, chunks[i]);
+        fprintf(results,"%10d %14.0f %14.0f %8.1fx\n", chunks[i], legacy, parser, legacy / parser);
+    }
+    fclose(results);
+    return 0;
+}
@@ -0,0 +1,178 @@
+/*
+    Custom Web Server - request parser fuzz target
+    By: Ricard Grace
+*/
+
+#include "../webServer.h"
+#include "../httpParser.h"
+
+#include <stdint.h>
+#include <time.h>
+
+/*
+    Differential fuzzing of the incremental parser against the original request functions.
+    For any input the parser must stay inside the buffer, give the same result however the bytes
+    are split between calls, and (for requests the original functions understood) agree with
+    them on the method, path, version and Connection header.
+    Built with libFuzzer (-DLIBFUZZER -fsanitize=fuzzer) the entry point is LLVMFuzzerTestOneInput,
+    otherwise a small driver mutates well formed requests at random. Both are meant to be run
+    under -fsanitize=address,undefined.
+*/
+
+#define FUZZ_ITERATIONS 200000
+#define FUZZ_MAX_INPUT 4096
+
+static void Fail (char* what, const uint8_t* data, size_t size) {
+    fprintf(stderr,"** parser mismatch ** %s\n",what);
+    fwrite(data,1,size,stderr);
+    fprintf(stderr,"\n");
+    abort();
+}
+
+static void CheckSpan (HttpSpan span, int length, const uint8_t* data, size_t size) {
+    if (span.start == ERROR) return;
+    if (span.start < 0 || span.len < 0 || span.start + span.len > length) Fail("span outside request",data,size);
+}
+
+int LLVMFuzzerTestOneInput (const uint8_t* data, size_t size) {
+    if (size > BUFF_SIZE) return 0;
+    char request[BUFF_SIZE+1];
+    memcpy(request,data,size);
+    request[size] = '\0';
+    int length = (int)size;
+
+    //parse in one go
+    HttpParser whole;
+    InitParser(&whole);
+    int done = ParseRequest(&whole, request, length);
+    if (done == TRUE && ParsedLength(&whole) > length) Fail("parsed past the end",data,size);
+    CheckSpan(whole.target, length, data, size);
+    int i;
+    for (i = 0; i < NUM_KNOWN_HEADERS; i++) CheckSpan(whole.known[i], length, data, size);
+    for (i = 0; i < whole.numHeaders; i++) {
+        CheckSpan(whole.headers[i].name, length, data, size);
+        CheckSpan(whole.headers[i].value, length, data, size);
+    }
+
+    //parse again a few bytes at a time, the result must not depend on how the data arrived
+    HttpParser pieces;
+    InitParser(&pieces);
+    int step = size > 0 ? data[0] % 7 + 1 : 1;
+    int bytesRecv = 0;
+    int piecesDone = FALSE;
+    while (bytesRecv < length && piecesDone == FALSE) {
+        bytesRecv = bytesRecv + step < length ? bytesRecv + step : length;
+        piecesDone = ParseRequest(&pieces, request, bytesRecv);
+    }
+    if (length == 0) piecesDone = ParseRequest(&pieces, request, 0);
+    if (piecesDone != done) Fail("incremental parse finished differently",data,size);
+    if (done == TRUE) {
+        if (ParsedLength(&pieces) != ParsedLength(&whole)) Fail("incremental parse length differs",data,size);
+        if (pieces.method != whole.method || pieces.version != whole.version || pieces.malformed != whole.malformed) Fail("incremental parse result differs",data,size);
+        if (pieces.target.start != whole.target.start || pieces.target.len != whole.target.len) Fail("incremental parse target differs",data,size);
+        if (pieces.numHeaders != whole.numHeaders) Fail("incremental parse headers differ",data,size);
+    }
+    if (done == FALSE || whole.malformed) return 0;
+
+    //compare against the original functions on requests they were written for:
+    //a single space separated request line ending in \r\n and no stray control characters
+    int headerLen = ParsedLength(&whole);
+    for (i = 0; i < headerLen; i++) {
+        if (request[i] == '\0' || (request[i] == '\r' && request[i+1] != '\n')) return 0;
+        if (request[i] == '\n' && (i == 0 || request[i-1] != '\r')) return 0;
+        if (request[i] == '\t') return 0;
+    }
+    char* lineEnd = memchr(request,'\r',headerLen);
+    int spaces = 0;
+    for (i = 0; &request[i] < lineEnd; i++) {
+        if (request[i] == ' ' && (i == 0 || request[i-1] == ' ')) return 0;
+        if (request[i] == ' ') spaces++;
+    }
+    if (spaces != 2 || request[0] == '\r' || lineEnd[-1] == ' ') return 0;
+
+    if (whole.target.start <= TYPE_SIZE && RequestType(request, headerLen) != whole.method) Fail("method differs",data,size);
+    if (whole.target.start <= TYPE_SIZE) {
+        char legacyPath[PATH_SIZE+1];
+        char parserPath[PATH_SIZE+1];
+        if (RequestPath(request, headerLen, legacyPath) == TRUE) {
+            DecodePath(&request[whole.target.start], whole.target.len, parserPath);
+            if (strcmp(legacyPath,parserPath) != STREQU) Fail("path differs",data,size);
+        }
+    }
+    if (RequestVersion(request, headerLen) != whole.version) Fail("version differs",data,size);
+
+    char legacyValue[VALUE_SIZE];
+    char parserValue[VALUE_SIZE];
+    int legacyLen = FindHeader(request, headerLen, "Connection", legacyValue, VALUE_SIZE);
+    int parserLen = CopyHeader(&whole, request, HDR_CONNECTION, parserValue, VALUE_SIZE);
+    if (legacyLen != parserLen || (legacyLen != ERROR && strcmp(legacyValue,parserValue) != STREQU)) Fail("Connection header differs",data,size);
+    return 0;
+}
+
+#ifndef LIBFUZZER
+static char* seeds[] = {
+    "GET / HTTP/1.1\r\nHost: localhost\r\n\r\n",
+    "HEAD /index.html HTTP/1.0\r\nConnection: keep-alive\r\n\r\n",
+    "GET /a%20b/../c.txt HTTP/1.1\r\nHost: x\r\nRange: bytes=0-10\r\nConnection:  close \r\n\r\n",
+    "POST /form HTTP/1.1\r\nContent-Length: 5\r\nAccept-Encoding: gzip\r\n\r\nhello",
+    "GET /%2e%2e/etc/passwd HTTP/1.1\r\nIf-None-Match: \"abc\"\r\n\r\n",
+    "DELETE /x HTTP/1.1\r\n\r\nGET /y HTTP/1.1\r\n\r\n",
+};
+
+//bytes that tend to matter to the parser
+static char interesting[] = {'\r', '\n', ' ', ':', '%', '/', '.', '\t', '\0', 'A'};
+
+int main (int argc, char* argv[]) {
+    long iterations = argc > 1 ? atol(argv[1]) : FUZZ_ITERATIONS;
+    unsigned int seed = argc > 2 ? (unsigned int)atoi(argv[2]) : (unsigned int)time(NULL);
+    int numSeeds = sizeof(seeds) / sizeof(seeds[0]);
+    printf("fuzzing %ld inputs (seed %u)\n", iterations, seed);
+    srand(seed);
+
+    //the legacy functions print what they find
+    if (freopen("/dev/null","w",stdout) == NULL) {
+        fprintf(stderr,"** freopen error ** %s\n",strerror(errno));
+        return 1;
+    }
+
+    uint8_t input[FUZZ_MAX_INPUT];
+    long n;
+    for (n = 0; n < iterations; n++) {
+        char* base = seeds[rand() % numSeeds];
+        size_t size = strlen(base);
+        memcpy(input,base,size);
+
+        int mutations = rand() % 4;
+        int m;
+        for (m = 0; m < mutations && size > 0; m++) {
+            size_t pos = rand() % size;
+            switch (rand() % 4) {
+                case 0:
+                    //overwrite a byte
+                    input[pos] = rand() % 2 ? interesting[rand() % sizeof(interesting)] : rand() % 256;
+                    break;
+                case 1:
+                    //insert a byte
+                    if (size < FUZZ_MAX_INPUT) {
+                        memmove(&input[pos+1],&input[pos],size-pos);
+                        input[pos] = interesting[rand() % sizeof(interesting)];
+                        size++;
+                    }
+                    break;
+                case 2:
+                    //delete a byte
+                    memmove(&input[pos],&input[pos+1],size-pos-1);
+                    size--;
+                    break;
+                case 3:
+                    //cut the input short
+                    size = pos;
+                    break;
+            }
+        }
+        LLVMFuzzerTestOneInput(input, size);
+    }
+    fprintf(stderr,"no mismatches\n");
+    return 0;
+}
+#endif
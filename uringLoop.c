@@ -0,0 +1,628 @@
+/*
+    Custom Web Server - io_uring event loop
+    By: Ricard Grace
+*/
+
+#include "uringLoop.h"
+#include "logger.h"
+#include "metrics.h"
+#include "range.h"
+#include "admission.h"
+
+/*
+    A completion based alternative to the epoll loops (-m uring), talking to the kernel through
+    the raw io_uring syscalls. Each loop owns a ring and the connections it accepted:
+        - one multishot accept keeps delivering new connections without being re-armed
+        - receives pick a buffer from a provided buffer ring, so no memory is tied up by idle
+          connections waiting for a request, and the buffer goes straight back once copied
+        - a response is queued as one linked chain: header, multipart delimiter and the next
+          piece of the body (a file -> pipe -> socket splice pair, a read -> send pair, or a
+          send from memory), so the kernel runs the whole chain in order without coming back
+    Everything queued while handling a batch of completions is submitted together with the wait
+    for the next batch, so many connections' work costs a single io_uring_enter.
+    A connection only moves on once every operation it queued has completed, the state machine
+    itself (parsing, building responses, keep-alive) is the one the epoll loops use.
+    If the kernel cannot run io_uring the caller falls back to the epoll loops.
+*/
+
+static void* RunLoop (void* shardPtr);
+static int SetupRing (UringLoop* loop);
+static void FreeRing (UringLoop* loop);
+static int SupportsOps (int ringFd);
+static struct io_uring_sqe* GetSqe (UringLoop* loop);
+static void EnsureSpace (UringLoop* loop, unsigned count);
+static int Submit (UringLoop* loop, int wait);
+static void HandleCompletion (UringLoop* loop, struct io_uring_cqe* cqe);
+static void QueueAccept (UringLoop* loop);
+static void QueueTimeout (UringLoop* loop);
+static void QueueRecv (UringLoop* loop, UringConnection* uconn);
+static struct io_uring_sqe* QueueOp (UringLoop* loop, UringConnection* uconn, int op, int opcode, int fd, struct io_uring_sqe* chain);
+static struct io_uring_sqe* QueueSend (UringLoop* loop, UringConnection* uconn, int op, char* data, long long len, int more, struct io_uring_sqe* chain);
+static struct io_uring_sqe* QueueSplice (UringLoop* loop, UringConnection* uconn, int op, int fdIn, long long offIn, int fdOut, long long len, int more, struct io_uring_sqe* chain);
+static int QueueResponse (UringLoop* loop, UringConnection* uconn);
+static int PartSent (FileSender* sender);
+static void Accepted (UringLoop* loop, int connID);
+static void Received (UringLoop* loop, UringConnection* uconn, struct io_uring_cqe* cqe);
+static void Sent (UringConnection* uconn, int op, int result);
+static void Advance (UringLoop* loop, UringConnection* uconn);
+static void RecycleBuffer (UringLoop* loop, int bid);
+static void CloseUringConnection (UringLoop* loop, UringConnection* uconn);
+static void ShutdownExpired (UringLoop* loop);
+
+static int IoUringSetup (unsigned entries, struct io_uring_params* params) {
+    return syscall(__NR_io_uring_setup,entries,params);
+}
+
+static int IoUringEnter (int ringFd, unsigned toSubmit, unsigned minComplete, unsigned flags) {
+    return syscall(__NR_io_uring_enter,ringFd,toSubmit,minComplete,flags,NULL,0);
+}
+
+static int IoUringRegister (int ringFd, unsigned opcode, void* arg, unsigned numArgs) {
+    return syscall(__NR_io_uring_register,ringFd,opcode,arg,numArgs);
+}
+
+//returns ERROR (with errno set) straight away if this kernel cannot run the loops, otherwise only when they stop
+int RunUringLoops (int* listenSocs, int numListeners, int numLoops) {
+    //try everything the loops need once, so the caller can still fall back before anything is started
+    UringLoop probe;
+    if (SetupRing(&probe) == ERROR) return ERROR;
+    FreeRing(&probe);
+    //every socket needs a loop accepting from it
+    if (numLoops < numListeners) numLoops = numListeners;
+    Shard* shards = AssignShards(listenSocs, numListeners, numLoops);
+
+    //the calling thread runs the first loop itself
+    pthread_t* threads = malloc(sizeof(pthread_t) * numLoops);
+    int i;
+    for (i = 1; i < numLoops; i++) {
+        if (pthread_create(&threads[i],NULL,RunLoop,&shards[i]) != NOERR) {
+            fprintf(stderr,"** pthread_create error **\n");
+            numLoops = i;
+            break;
+        }
+    }
+    //sockets left without a loop are closed so the kernel stops giving them connections
+    for (i = numLoops; i < numListeners; i++) {
+        close(listenSocs[i]);
+    }
+    printf("Running %d io_uring loop(s)\n",numLoops);
+    RunLoop(&shards[0]);
+
+    for (i = 1; i < numLoops; i++) {
+        pthread_join(threads[i],NULL);
+    }
+    free(threads);
+    free(shards);
+    return NOERR;
+}
+
+static void* RunLoop (void* shardPtr) {
+    Shard* shard = shardPtr;
+    PinShard(shard);
+    UringLoop loop;
+    if (SetupRing(&loop) == ERROR) {
+        LogError("** io_uring setup error ** %s",strerror(errno));
+        return NULL;
+    }
+    loop.listenSoc = shard->listenSoc;
+    InitLoopPools(&loop.pools, sizeof(UringConnection));
+    loop.multishotAccept = TRUE;
+    loop.acceptPaused = FALSE;
+    loop.descriptorsOut = FALSE;
+    InitTimerWheel(&loop.wheel);
+    loop.sweep.tv_sec = TIMER_TICK_MS / 1000;
+    loop.sweep.tv_nsec = (TIMER_TICK_MS % 1000) * 1000000;
+    QueueAccept(&loop);
+    QueueTimeout(&loop);
+
+    while (1) {
+        //hand over everything queued since the last wait and sleep until something completes
+        if (Submit(&loop, TRUE) == ERROR && errno != EBUSY && errno != EAGAIN) {
+            LogError("** io_uring_enter error ** %s",strerror(errno));
+            break;
+        }
+
+        unsigned head = *loop.cqHead;
+        while (head != __atomic_load_n(loop.cqTail,__ATOMIC_ACQUIRE)) {
+            //release the slot before handling it, handling may need to submit more
+            struct io_uring_cqe cqe = loop.cqes[head & loop.cqMask];
+            head++;
+            __atomic_store_n(loop.cqHead,head,__ATOMIC_RELEASE);
+            HandleCompletion(&loop, &cqe);
+        }
+    }
+
+    FreeRing(&loop);
+    return NULL;
+}
+
+//create the ring, map its queues and register the receive buffers
+static int SetupRing (UringLoop* loop) {
+    memset(loop,0,sizeof(UringLoop));
+    struct io_uring_params params;
+    memset(&params,0,sizeof(params));
+    //only this thread submits, and completions can wait until it next enters the kernel
+    params.flags = IORING_SETUP_COOP_TASKRUN | IORING_SETUP_SINGLE_ISSUER;
+    loop->ringFd = IoUringSetup(URING_ENTRIES, &params);
+    if (loop->ringFd == ERROR && errno == EINVAL) {
+        //older kernels do not know those flags
+        memset(&params,0,sizeof(params));
+        loop->ringFd = IoUringSetup(URING_ENTRIES, &params);
+    }
+    if (loop->ringFd == ERROR) return ERROR;
+    if (SupportsOps(loop->ringFd) == ERROR) {
+        FreeRing(loop);
+        return ERROR;
+    }
+
+    loop->sqRingSize = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    loop->cqRingSize = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    if (params.features & IORING_FEAT_SINGLE_MMAP) {
+        //both queues live in one mapping
+        if (loop->cqRingSize > loop->sqRingSize) loop->sqRingSize = loop->cqRingSize;
+        loop->cqRingSize = 0;
+    }
+    loop->sqRing = mmap(NULL,loop->sqRingSize,PROT_READ | PROT_WRITE,MAP_SHARED | MAP_POPULATE,loop->ringFd,IORING_OFF_SQ_RING);
+    if (loop->sqRing == MAP_FAILED) loop->sqRing = NULL;
+    loop->cqRing = loop->sqRing;
+    if (loop->cqRingSize > 0) {
+        loop->cqRing = mmap(NULL,loop->cqRingSize,PROT_READ | PROT_WRITE,MAP_SHARED | MAP_POPULATE,loop->ringFd,IORING_OFF_CQ_RING);
+        if (loop->cqRing == MAP_FAILED) loop->cqRing = NULL;
+    }
+    loop->sqesSize = params.sq_entries * sizeof(struct io_uring_sqe);
+    loop->sqes = mmap(NULL,loop->sqesSize,PROT_READ | PROT_WRITE,MAP_SHARED | MAP_POPULATE,loop->ringFd,IORING_OFF_SQES);
+    if (loop->sqes == MAP_FAILED) loop->sqes = NULL;
+    if (loop->sqRing == NULL || loop->cqRing == NULL || loop->sqes == NULL) {
+        FreeRing(loop);
+        return ERROR;
+    }
+
+    char* sq = loop->sqRing;
+    loop->sqHead = (unsigned*)(sq + params.sq_off.head);
+    loop->sqTail = (unsigned*)(sq + params.sq_off.tail);
+    loop->sqMask = *(unsigned*)(sq + params.sq_off.ring_mask);
+    loop->sqEntries = *(unsigned*)(sq + params.sq_off.ring_entries);
+    loop->sqArray = (unsigned*)(sq + params.sq_off.array);
+    loop->sqLocalTail = *loop->sqTail;
+    char* cq = loop->cqRing;
+    loop->cqHead = (unsigned*)(cq + params.cq_off.head);
+    loop->cqTail = (unsigned*)(cq + params.cq_off.tail);
+    loop->cqMask = *(unsigned*)(cq + params.cq_off.ring_mask);
+    loop->cqes = (struct io_uring_cqe*)(cq + params.cq_off.cqes);
+
+    //receive buffers, the kernel picks one for each receive as data arrives
+    loop->bufRingSize = URING_BUFFERS * sizeof(struct io_uring_buf);
+    loop->bufRing = mmap(NULL,loop->bufRingSize,PROT_READ | PROT_WRITE,MAP_PRIVATE | MAP_ANONYMOUS,ERROR,0);
+    if (loop->bufRing == MAP_FAILED) loop->bufRing = NULL;
+    loop->buffers = malloc(URING_BUFFERS * URING_BUF_SIZE);
+    if (loop->bufRing == NULL || loop->buffers == NULL) {
+        FreeRing(loop);
+        errno = ENOMEM;
+        return ERROR;
+    }
+    struct io_uring_buf_reg reg;
+    memset(&reg,0,sizeof(reg));
+    reg.ring_addr = (unsigned long)loop->bufRing;
+    reg.ring_entries = URING_BUFFERS;
+    reg.bgid = URING_BUF_GROUP;
+    if (IoUringRegister(loop->ringFd, IORING_REGISTER_PBUF_RING, &reg, 1) == ERROR) {
+        FreeRing(loop);
+        return ERROR;
+    }
+    int i;
+    for (i = 0; i < URING_BUFFERS; i++) {
+        RecycleBuffer(loop, i);
+    }
+    return NOERR;
+}
+
+static void FreeRing (UringLoop* loop) {
+    if (loop->bufRing != NULL) munmap(loop->bufRing,loop->bufRingSize);
+    free(loop->buffers);
+    if (loop->sqes != NULL) munmap(loop->sqes,loop->sqesSize);
+    if (loop->cqRing != NULL && loop->cqRing != loop->sqRing) munmap(loop->cqRing,loop->cqRingSize);
+    if (loop->sqRing != NULL) munmap(loop->sqRing,loop->sqRingSize);
+    if (loop->ringFd != ERROR) close(loop->ringFd);
+    memset(loop,0,sizeof(UringLoop));
+    loop->ringFd = ERROR;
+}
+
+//returns ERROR (errno ENOSYS) unless the kernel has every operation the loops use
+static int SupportsOps (int ringFd) {
+    int needed[] = {IORING_OP_ACCEPT, IORING_OP_RECV, IORING_OP_SEND, IORING_OP_READ, IORING_OP_SPLICE, IORING_OP_TIMEOUT};
+    size_t probeSize = sizeof(struct io_uring_probe) + IORING_OP_LAST * sizeof(struct io_uring_probe_op);
+    struct io_uring_probe* probe = calloc(1,probeSize);
+    if (IoUringRegister(ringFd, IORING_REGISTER_PROBE, probe, IORING_OP_LAST) == ERROR) {
+        free(probe);
+        return ERROR;
+    }
+    int i;
+    for (i = 0; i < sizeof(needed) / sizeof(needed[0]); i++) {
+        if (needed[i] > probe->last_op || !(probe->ops[needed[i]].flags & IO_URING_OP_SUPPORTED)) {
+            free(probe);
+            errno = ENOSYS;
+            return ERROR;
+        }
+    }
+    free(probe);
+    return NOERR;
+}
+
+//the next free submission entry, cleared
+static struct io_uring_sqe* GetSqe (UringLoop* loop) {
+    EnsureSpace(loop, 1);
+    unsigned index = loop->sqLocalTail & loop->sqMask;
+    struct io_uring_sqe* sqe = &loop->sqes[index];
+    memset(sqe,0,sizeof(struct io_uring_sqe));
+    loop->sqArray[index] = index;
+    loop->sqLocalTail++;
+    loop->toSubmit++;
+    return sqe;
+}
+
+//make sure count entries can be queued without submitting in between (a chain must go in together)
+static void EnsureSpace (UringLoop* loop, unsigned count) {
+    while (loop->sqLocalTail - __atomic_load_n(loop->sqHead,__ATOMIC_ACQUIRE) + count > loop->sqEntries) {
+        if (Submit(loop, FALSE) == ERROR && errno != EBUSY && errno != EAGAIN) {
+            LogError("** io_uring_enter error ** %s",strerror(errno));
+            return;
+        }
+    }
+}
+
+//hand queued entries to the kernel, waiting for at least one completion if wait is TRUE
+static int Submit (UringLoop* loop, int wait) {
+    __atomic_store_n(loop->sqTail,loop->sqLocalTail,__ATOMIC_RELEASE);
+    while (1) {
+        int submitted = IoUringEnter(loop->ringFd, loop->toSubmit, wait ? 1 : 0, wait ? IORING_ENTER_GETEVENTS : 0);
+        if (submitted == ERROR) {
+            if (errno == EINTR) continue;
+            return ERROR;
+        }
+        loop->toSubmit -= submitted;
+        return NOERR;
+    }
+}
+
+static void HandleCompletion (UringLoop* loop, struct io_uring_cqe* cqe) {
+    int op = cqe->user_data & OP_MASK;
+    UringConnection* uconn = (UringConnection*)(unsigned long)(cqe->user_data & ~(unsigned long long)OP_MASK);
+    if (op == OP_ACCEPT) {
+        if (cqe->res >= 0) {
+            if (loop->descriptorsOut) {
+                LogInfo("Descriptors available again, accepting");
+                loop->descriptorsOut = FALSE;
+            }
+            Accepted(loop, cqe->res);
+        } else if (cqe->res == -EINVAL && loop->multishotAccept) {
+            //the kernel cannot keep an accept armed, accept one at a time
+            loop->multishotAccept = FALSE;
+        } else if (cqe->res == -EMFILE || cqe->res == -ENFILE) {
+            //accepting again straight away would fail the same way, it is queued again on the next tick
+            if (!(cqe->flags & IORING_CQE_F_MORE)) {
+                if (!loop->descriptorsOut) LogError("** accept error ** %s, pausing",strerror(-cqe->res));
+                loop->descriptorsOut = TRUE;
+                loop->acceptPaused = TRUE;
+            }
+            return;
+        } else if (cqe->res != -EINTR && cqe->res != -ECONNABORTED && cqe->res != -EAGAIN) {
+            LogError("** accept error ** %s",strerror(-cqe->res));
+        }
+        //a multishot accept stays armed until the kernel says otherwise
+        if (!(cqe->flags & IORING_CQE_F_MORE)) QueueAccept(loop);
+        return;
+    }
+    if (op == OP_TIMEOUT) {
+        ShutdownExpired(loop);
+        QueueTimeout(loop);
+        if (loop->acceptPaused) {
+            loop->acceptPaused = FALSE;
+            QueueAccept(loop);
+        }
+        return;
+    }
+
+    uconn->inFlight--;
+    if (op == OP_RECV) {
+        Received(loop, uconn, cqe);
+    } else {
+        Sent(uconn, op, cqe->res);
+    }
+    if (uconn->inFlight == 0) Advance(loop, uconn);
+}
+
+static void QueueAccept (UringLoop* loop) {
+    struct io_uring_sqe* sqe = GetSqe(loop);
+    sqe->opcode = IORING_OP_ACCEPT;
+    sqe->fd = loop->listenSoc;
+    sqe->accept_flags = SOCK_CLOEXEC;
+    if (loop->multishotAccept) sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+    sqe->user_data = OP_ACCEPT;
+}
+
+//wake up every tick even when nothing happens so expired connections get closed
+static void QueueTimeout (UringLoop* loop) {
+    struct io_uring_sqe* sqe = GetSqe(loop);
+    sqe->opcode = IORING_OP_TIMEOUT;
+    sqe->fd = ERROR;
+    sqe->addr = (unsigned long)&loop->sweep;
+    sqe->len = 1;
+    sqe->user_data = OP_TIMEOUT;
+}
+
+static void QueueRecv (UringLoop* loop, UringConnection* uconn) {
+    Connection* conn = &uconn->conn;
+    int space = BUFF_SIZE - conn->bytesRecv;
+    struct io_uring_sqe* sqe = QueueOp(loop, uconn, OP_RECV, IORING_OP_RECV, conn->connID, NULL);
+    //never take more than fits in the request buffer
+    sqe->len = space < URING_BUF_SIZE ? space : URING_BUF_SIZE;
+    sqe->flags |= IOSQE_BUFFER_SELECT;
+    sqe->buf_group = URING_BUF_GROUP;
+}
+
+//queue an operation for the connection, linked after chain (the previous operation) if there is one
+static struct io_uring_sqe* QueueOp (UringLoop* loop, UringConnection* uconn, int op, int opcode, int fd, struct io_uring_sqe* chain) {
+    if (chain != NULL) chain->flags |= IOSQE_IO_LINK;
+    struct io_uring_sqe* sqe = GetSqe(loop);
+    sqe->opcode = opcode;
+    sqe->fd = fd;
+    sqe->user_data = (unsigned long)uconn | op;
+    uconn->inFlight++;
+    return sqe;
+}
+
+static struct io_uring_sqe* QueueSend (UringLoop* loop, UringConnection* uconn, int op, char* data, long long len, int more, struct io_uring_sqe* chain) {
+    struct io_uring_sqe* sqe = QueueOp(loop, uconn, op, IORING_OP_SEND, uconn->conn.connID, chain);
+    sqe->addr = (unsigned long)data;
+    sqe->len = len < SENDFILE_CHUNK ? len : SENDFILE_CHUNK;
+    //MSG_WAITALL makes a short send break the chain, so nothing linked after it can jump ahead
+    sqe->msg_flags = MSG_NOSIGNAL | MSG_WAITALL | (more || len > SENDFILE_CHUNK ? MSG_MORE : 0);
+    return sqe;
+}
+
+//offIn is ERROR when reading from a pipe
+static struct io_uring_sqe* QueueSplice (UringLoop* loop, UringConnection* uconn, int op, int fdIn, long long offIn, int fdOut, long long len, int more, struct io_uring_sqe* chain) {
+    struct io_uring_sqe* sqe = QueueOp(loop, uconn, op, IORING_OP_SPLICE, fdOut, chain);
+    sqe->splice_fd_in = fdIn;
+    sqe->splice_off_in = offIn;
+    sqe->off = (unsigned long long)ERROR;
+    sqe->len = len;
+    sqe->splice_flags = SPLICE_F_MOVE | (more ? SPLICE_F_MORE : 0);
+    return sqe;
+}
+
+//queue the next chain of the response, returns FALSE once all of it has been sent and ERROR if it cannot be
+static int QueueResponse (UringLoop* loop, UringConnection* uconn) {
+    Connection* conn = &uconn->conn;
+    FileSender* sender = &conn->sender;
+    if (conn->state == CONN_SEND_BODY && PartSent(sender)) {
+        if (!NextBodyPart(conn->ranges, conn->part+1, conn->fileSize, sender)) return FALSE;
+        conn->part++;
+    }
+    if (conn->state != CONN_SEND_HEADER && conn->state != CONN_SEND_BODY) return FALSE;
+
+    //a chain is at most header, delimiter and two body operations
+    EnsureSpace(loop, 4);
+    struct io_uring_sqe* chain = NULL;
+    if (conn->headerSent < conn->headerLen) {
+        chain = QueueSend(loop, uconn, OP_HEADER, &conn->header[conn->headerSent], conn->headerLen - conn->headerSent, conn->hasBody, NULL);
+    }
+    if (!conn->hasBody) return TRUE;
+    if (sender->prefixSent < sender->prefixLen) {
+        chain = QueueSend(loop, uconn, OP_PREFIX, &sender->prefix[sender->prefixSent], sender->prefixLen - sender->prefixSent, sender->remaining > 0, chain);
+    }
+
+    if (sender->method == SEND_MEMORY) {
+        if (sender->remaining > 0) QueueSend(loop, uconn, OP_MEMORY, &sender->data[sender->offset], sender->remaining, FALSE, chain);
+        return TRUE;
+    }
+    if (sender->method != SEND_STDIO && sender->pipeFds[0] == ERROR && pipe2(sender->pipeFds,O_CLOEXEC) == ERROR) {
+        LogError("** pipe error ** %s",strerror(errno));
+        sender->method = SEND_STDIO;
+    }
+    if (sender->method == SEND_STDIO) {
+        if (sender->bufSent < sender->bufLen) {
+            QueueSend(loop, uconn, OP_SEND_BUF, &sender->buffer[sender->bufSent], sender->bufLen - sender->bufSent, sender->remaining > 0, chain);
+        } else if (sender->remaining > 0) {
+            if (SenderBuffer(sender) == NULL) return ERROR;
+            //read the next chunk and send it, a short read cancels the send
+            long long count = sender->remaining < PACK_SIZE ? sender->remaining : PACK_SIZE;
+            sender->bufLen = 0;
+            sender->bufSent = 0;
+            chain = QueueOp(loop, uconn, OP_READ, IORING_OP_READ, sender->fileFd, chain);
+            chain->addr = (unsigned long)sender->buffer;
+            chain->len = count;
+            chain->off = sender->offset;
+            QueueSend(loop, uconn, OP_SEND_BUF, sender->buffer, count, sender->remaining > count, chain);
+        }
+        return TRUE;
+    }
+
+    //there is no io_uring sendfile, so sendfile and splice both go file -> pipe -> socket
+    if (sender->piped > 0) {
+        QueueSplice(loop, uconn, OP_DRAIN, sender->pipeFds[0], ERROR, conn->connID, sender->piped, sender->remaining > 0, chain);
+    } else if (sender->remaining > 0) {
+        long long count = sender->remaining < SPLICE_CHUNK ? sender->remaining : SPLICE_CHUNK;
+        chain = QueueSplice(loop, uconn, OP_FILL, sender->fileFd, sender->offset, sender->pipeFds[1], count, FALSE, chain);
+        QueueSplice(loop, uconn, OP_DRAIN, sender->pipeFds[0], ERROR, conn->connID, count, sender->remaining > count, chain);
+    }
+    return TRUE;
+}
+
+//has everything of the current part (prefix and range) reached the socket
+static int PartSent (FileSender* sender) {
+    return sender->prefixSent == sender->prefixLen && sender->remaining == 0 && sender->piped == 0 && sender->bufSent == sender->bufLen;
+}
+
+static void Accepted (UringLoop* loop, int connID) {
+    //too many open already, the client is told to come back later
+    if (!AdmitConnection()) {
+        ShedConnection(connID);
+        return;
+    }
+    //slab objects are 16 byte aligned, which leaves the low bits of the pointer free for the operation
+    UringConnection* uconn = SlabAlloc(&loop->pools.connections);
+    if (uconn == NULL) {
+        LogError("** out of memory **");
+        ShedConnection(connID);
+        ReleaseConnection();
+        return;
+    }
+    InitConnection(&uconn->conn, connID, &loop->pools, &loop->wheel);
+    uconn->inFlight = 0;
+    uconn->closing = FALSE;
+    Advance(loop, uconn);
+}
+
+static void Received (UringLoop* loop, UringConnection* uconn, struct io_uring_cqe* cqe) {
+    Connection* conn = &uconn->conn;
+    if (cqe->flags & IORING_CQE_F_BUFFER) {
+        int bid = cqe->flags >> IORING_CQE_BUFFER_SHIFT;
+        if (cqe->res > 0) {
+            if (conn->numRequests == 0 && conn->bytesRecv == 0) RecordPhase(PHASE_FIRST_BYTE, NanoTime() - conn->acceptTime);
+            if (ReserveSpace(&conn->recvBuffer, conn->bytesRecv, cqe->res) < cqe->res) {
+                uconn->closing = TRUE;
+            } else {
+                memcpy(&conn->recvBuffer.data[conn->bytesRecv],&loop->buffers[bid * URING_BUF_SIZE],cqe->res);
+                conn->bytesRecv += cqe->res;
+                conn->recvBuffer.data[conn->bytesRecv] = '\0';
+            }
+        }
+        RecycleBuffer(loop, bid);
+    }
+    //out of buffers for now, the receive is simply queued again
+    if (cqe->res == -ENOBUFS) return;
+    if (cqe->res < 0 && cqe->res != -ECONNRESET) LogError("** recv error ** %s",strerror(-cqe->res));
+    //the client has terminated the connection
+    if (cqe->res <= 0) uconn->closing = TRUE;
+}
+
+//account for a completed part of the response
+static void Sent (UringConnection* uconn, int op, int result) {
+    Connection* conn = &uconn->conn;
+    FileSender* sender = &conn->sender;
+    //an earlier operation in its chain came up short, it is queued again from where that stopped
+    if (result == -ECANCELED) return;
+    if (result < 0) {
+        if (result != -EPIPE && result != -ECONNRESET) LogError("** send error ** %s",strerror(-result));
+        uconn->closing = TRUE;
+        return;
+    }
+    if (result == 0 && (op == OP_FILL || op == OP_READ)) {
+        //the file is shorter than we said it would be
+        LogError("** file truncated while sending **");
+        uconn->closing = TRUE;
+        return;
+    }
+
+    switch (op) {
+        case OP_HEADER:
+            conn->headerSent += result;
+            if (conn->headerSent == conn->headerLen) {
+                long long now = NanoTime();
+                RecordPhase(PHASE_HEADER, now - conn->phaseStart);
+                conn->phaseStart = now;
+                conn->state = conn->hasBody ? CONN_SEND_BODY : CONN_DONE;
+            }
+            break;
+        case OP_PREFIX:
+            sender->prefixSent += result;
+            break;
+        case OP_MEMORY:
+            sender->offset += result;
+            sender->remaining -= result;
+            break;
+        case OP_FILL:
+        case OP_READ:
+            //a read and its send can complete in either order, so both only ever add
+            sender->offset += result;
+            sender->remaining -= result;
+            if (op == OP_FILL) sender->piped += result;
+            if (op == OP_READ) sender->bufLen += result;
+            break;
+        case OP_DRAIN:
+            sender->piped -= result;
+            break;
+        case OP_SEND_BUF:
+            sender->bufSent += result;
+            break;
+    }
+}
+
+//everything the connection queued has completed, take it as far as it can go and queue what it waits on next
+static void Advance (UringLoop* loop, UringConnection* uconn) {
+    Connection* conn = &uconn->conn;
+    while (!uconn->closing) {
+        if (conn->state == CONN_READING) {
+            //a pipelined request may already be complete
+            int parsed = ParseBuffered(conn);
+            if (parsed == ERROR) break;
+            if (parsed == FALSE) {
+                QueueRecv(loop, uconn);
+                return;
+            }
+            if (StartRequest(conn) == ERROR) break;
+        }
+        if (conn->state == CONN_READING_BODY) {
+            int result = BufferedBody(conn);
+            if (result == ERROR) break;
+            if (result == FALSE) {
+                QueueRecv(loop, uconn);
+                return;
+            }
+        }
+        int queued = QueueResponse(loop, uconn);
+        if (queued == ERROR) break;
+        if (queued) return;
+
+        //the response is out
+        if (conn->hasBody) RecordPhase(PHASE_BODY, NanoTime() - conn->phaseStart);
+        conn->state = CONN_DONE;
+        FinishResponse(conn);
+        if (conn->state != CONN_READING) break;
+    }
+    CloseUringConnection(loop, uconn);
+}
+
+//give a receive buffer back to the kernel
+static void RecycleBuffer (UringLoop* loop, int bid) {
+    struct io_uring_buf* buf = &loop->bufRing->bufs[loop->bufTail & (URING_BUFFERS-1)];
+    buf->addr = (unsigned long)&loop->buffers[bid * URING_BUF_SIZE];
+    buf->len = URING_BUF_SIZE;
+    buf->bid = bid;
+    loop->bufTail++;
+    __atomic_store_n(&loop->bufRing->tail,loop->bufTail,__ATOMIC_RELEASE);
+}
+
+//only called once nothing is in flight for the connection
+static void CloseUringConnection (UringLoop* loop, UringConnection* uconn) {
+    Connection* conn = &uconn->conn;
+    CancelTimer(&conn->timer);
+    //a response that was cut short is still logged
+    if (conn->state == CONN_SEND_HEADER || conn->state == CONN_SEND_BODY) LogResponse(conn);
+    CloseFileSender(&conn->sender);
+    if (conn->cached != NULL) ReleaseCacheEntry(conn->cached);
+    if (conn->admitted) ReleaseRequest();
+    if (conn->body != NULL) EndBody(conn->body);
+    FreeConnectionMemory(conn);
+    close(conn->connID);
+    CountConnection(-1);
+    ReleaseConnection();
+    SlabFree(&loop->pools.connections, uconn);
+}
+
+//shut down every connection whose deadline has passed
+//their queued operations then complete, and they are closed once the last one has
+static void ShutdownExpired (UringLoop* loop) {
+    Timer* timer = ExpireTimers(&loop->wheel);
+    while (timer != NULL) {
+        //the timer may be set again, so move on before looking at it
+        Timer* next = timer->next;
+        UringConnection* uconn = timer->owner;
+        if (!uconn->closing && DeadlinePassed(&uconn->conn)) {
+            uconn->closing = TRUE;
+            shutdown(uconn->conn.connID,SHUT_RDWR);
+        }
+        timer = next;
+    }
+}
@@ -0,0 +1,90 @@
+/*
+    Custom Web Server - io_uring event loop
+    By: Ricard Grace
+*/
+
+#ifndef URINGLOOP_H
+#define URINGLOOP_H
+
+#include "webServer.h"
+#include "eventLoop.h"
+
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+
+//submission queue size, the completion queue is twice as big
+#define URING_ENTRIES 256
+//provided buffers that receives land in, returned to the kernel as soon as they are copied
+#define URING_BUFFERS 256
+#define URING_BUF_SIZE 4096
+#define URING_BUF_GROUP 0
+
+//what a completion was for, kept in the low bits of its user_data (connections are 16 byte aligned)
+#define OP_MASK      15
+#define OP_ACCEPT    1
+#define OP_TIMEOUT   2
+#define OP_RECV      3
+#define OP_HEADER    4
+#define OP_PREFIX    5
+#define OP_MEMORY    6
+#define OP_FILL      7
+#define OP_DRAIN     8
+#define OP_READ      9
+#define OP_SEND_BUF  10
+
+//a connection plus the operations it has queued on the ring
+typedef struct _uringConnection {
+    Connection conn;
+    //completions still to come, the connection is only changed or freed when there are none
+    int inFlight;
+    //set once anything fails or the connection is being shut down
+    int closing;
+} UringConnection;
+
+//state kept by each io_uring loop thread
+typedef struct _uringLoop {
+    int ringFd;
+    int listenSoc;
+    int multishotAccept;
+    //accepting stops until the next tick when there are no descriptors left
+    int acceptPaused;
+    //set from the first accept that finds no descriptors until one succeeds, so each is logged once
+    int descriptorsOut;
+    TimerWheel wheel;
+
+    //submission queue, shared with the kernel
+    void* sqRing;
+    size_t sqRingSize;
+    unsigned* sqHead;
+    unsigned* sqTail;
+    unsigned* sqArray;
+    unsigned sqMask;
+    unsigned sqEntries;
+    struct io_uring_sqe* sqes;
+    size_t sqesSize;
+    //entries filled in but not yet handed to the kernel
+    unsigned sqLocalTail;
+    unsigned toSubmit;
+
+    //completion queue, shared with the kernel
+    void* cqRing;
+    size_t cqRingSize;
+    unsigned* cqHead;
+    unsigned* cqTail;
+    unsigned cqMask;
+    struct io_uring_cqe* cqes;
+
+    //provided receive buffers
+    struct io_uring_buf_ring* bufRing;
+    size_t bufRingSize;
+    char* buffers;
+    unsigned short bufTail;
+
+    struct __kernel_timespec sweep;
+    LoopPools pools;
+} UringLoop;
+
+int RunUringLoops (int* listenSocs, int numListeners, int numLoops);
+
+#endif
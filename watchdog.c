@@ -0,0 +1,114 @@
+/*
+    Custom Web Server - connection watchdog
+    By: Ricard Grace
+*/
+
+#include "watchdog.h"
+#include "logger.h"
+#include "metrics.h"
+
+#include <linux/tcp.h>
+
+/*
+    The thread and pool modes block in recv and send, so their deadlines cannot be checked by
+    the serving thread itself. Instead each thread puts its connection's deadline in one shared
+    timer wheel (the same idle, header and send deadlines as the event loops) and a watchdog
+    thread expires the wheel every tick. A connection that has run out is shut down, which wakes
+    its thread from whatever call it is blocked in with an error, and the thread then closes it.
+    How far a response has got is only looked up (from the socket's TCP_INFO) once its send
+    window runs out, so a deadline costs no system calls while it is being set and moved. A
+    request body is timed the same way from the bytes the socket has received, which is looked
+    up once more as the body starts.
+    A thread takes its connection out of the wheel before closing it, so the watchdog never
+    shuts down a socket number that has since been reused.
+*/
+
+static void* RunWatchdog (void* unused);
+static long long Progress (int connID, int timeout);
+
+static TimerWheel wheel;
+static pthread_mutex_t wheelLock = PTHREAD_MUTEX_INITIALIZER;
+static int running = FALSE;
+
+//start the watchdog thread, deadlines are ignored until it has been started
+int StartWatchdog () {
+    InitTimerWheel(&wheel);
+    pthread_t thread;
+    if (pthread_create(&thread,NULL,RunWatchdog,NULL) != NOERR) {
+        fprintf(stderr,"** pthread_create error ** watchdog\n");
+        return ERROR;
+    }
+    pthread_detach(thread);
+    running = TRUE;
+    return NOERR;
+}
+
+void InitWatch (Watch* watch, int connID) {
+    InitTimer(&watch->timer, watch);
+    watch->connID = connID;
+    watch->sent = 0;
+    SetWatchDeadline(watch, TIMEOUT_IDLE);
+}
+
+//wait on a new deadline in place of the current one
+void SetWatchDeadline (Watch* watch, int timeout) {
+    if (!running) return;
+    int seconds = KEEPALIVE_TIMEOUT;
+    if (timeout == TIMEOUT_HEADER) {
+        seconds = HEADER_TIMEOUT;
+    } else if (timeout == TIMEOUT_SEND || timeout == TIMEOUT_BODY) {
+        seconds = SEND_WINDOW;
+    }
+    long long received = timeout == TIMEOUT_BODY ? Progress(watch->connID, TIMEOUT_BODY) : 0;
+    pthread_mutex_lock(&wheelLock);
+    watch->timeout = timeout;
+    //earlier responses have been acknowledged by now, or near enough
+    watch->windowBytes = timeout == TIMEOUT_BODY ? received : watch->sent;
+    SetTimer(&wheel, &watch->timer, seconds * 1000);
+    pthread_mutex_unlock(&wheelLock);
+}
+
+//the connection is about to be closed, it must not be shut down after this
+void EndWatch (Watch* watch) {
+    if (!running) return;
+    pthread_mutex_lock(&wheelLock);
+    CancelTimer(&watch->timer);
+    pthread_mutex_unlock(&wheelLock);
+}
+
+static void* RunWatchdog (void* unused) {
+    while (1) {
+        usleep(TIMER_TICK_MS * 1000);
+        pthread_mutex_lock(&wheelLock);
+        Timer* timer = ExpireTimers(&wheel);
+        while (timer != NULL) {
+            //the timer may be set again, so move on before looking at it
+            Timer* next = timer->next;
+            Watch* watch = timer->owner;
+            int windowed = watch->timeout == TIMEOUT_SEND || watch->timeout == TIMEOUT_BODY;
+            long long progress = windowed ? Progress(watch->connID, watch->timeout) : 0;
+            if (windowed && progress - watch->windowBytes >= (long long)MIN_SEND_RATE * SEND_WINDOW) {
+                //still going at the minimum rate, another window starts from here
+                watch->windowBytes = progress;
+                SetTimer(&wheel, &watch->timer, SEND_WINDOW * 1000);
+            } else {
+                CountTimeout(watch->timeout);
+                if (watch->timeout != TIMEOUT_IDLE) LogWarn("** timeout ** connection %d: %s too slow, closing",watch->connID,TimeoutName(watch->timeout));
+                shutdown(watch->connID,SHUT_RDWR);
+            }
+            timer = next;
+        }
+        pthread_mutex_unlock(&wheelLock);
+    }
+    return NULL;
+}
+
+//bytes of the connection's responses the client has acknowledged, or for a body bytes the connection
+//has received, ERROR if unknown
+static long long Progress (int connID, int timeout) {
+    struct tcp_info info;
+    socklen_t infoLen = sizeof(info);
+    memset(&info,0,sizeof(info));
+    if (getsockopt(connID,IPPROTO_TCP,TCP_INFO,&info,&infoLen) == ERROR) return ERROR;
+    return timeout == TIMEOUT_BODY ? info.tcpi_bytes_received : info.tcpi_bytes_acked;
+}
@@ -0,0 +1,29 @@
+/*
+    Custom Web Server - connection watchdog
+    By: Ricard Grace
+*/
+
+#ifndef WATCHDOG_H
+#define WATCHDOG_H
+
+#include "webServer.h"
+#include "timerWheel.h"
+
+//the deadline of one connection served by a blocking thread
+typedef struct _watch {
+    Timer timer;
+    int connID;
+    int timeout;
+    //bytes of responses the thread has sent on the connection so far
+    long long sent;
+    //bytes of responses the client had acknowledged (or of request bodies the connection had
+    //received) when the current send (or body) window started
+    long long windowBytes;
+} Watch;
+
+int StartWatchdog ();
+void InitWatch (Watch* watch, int connID);
+void SetWatchDeadline (Watch* watch, int timeout);
+void EndWatch (Watch* watch);
+
+#endif
@@ -4,6 +4,28 @@
 */
 
 #include "webServer.h"
+#include "config.h"
+#include "listener.h"
+#include "eventLoop.h"
+#include "uringLoop.h"
+#include "threadPool.h"
+#include "sendFile.h"
+#include "fileCache.h"
+#include "httpParser.h"
+#include "docRoot.h"
+#include "logger.h"
+#include "metrics.h"
+#include "conditional.h"
+#include "encoding.h"
+#include "range.h"
+#include "memPool.h"
+#include "watchdog.h"
+#include "admission.h"
+#include "mimeTypes.h"
+#include "requestBody.h"
+#include "http2.h"
+#include "assetPack.h"
+#include "rewrite.h"
 
 /***** Things to do *****
     * server to handle and accept incoming connections
@@ -22,93 +44,174 @@
     * create status request generator
     * create function that properly gets the HTTP request (read until \n\n) before processing
     * prevent the user from accessing files outside of the webServerData directory
-    - prevent the server from opening and returning directory 'files'
-    - create a redirection lookup table
+    * prevent the server from opening and returning directory 'files'
+    * create a redirection lookup table
 */
 
-int main () {
+static int ReadWhole (int fileFd, char* data, long long size);
+
+//the tools link against the request handling code without the server's main
+#ifndef NO_SERVER_MAIN
+static void* AcceptLoop (void* shardPtr);
+
+//connection threads are never joined, so they clean themselves up when done
+static pthread_attr_t threadAttr;
+static ThreadPool* pool = NULL;
+
+int main (int argc, char* argv[]) {
     printf("==============================\n");
     printf("Booting Web Server\n");
     printf("Version: 1.4\n");
     printf("==============================\n");
-    
-    //setup multithreading
-    pthread_t thread;
 
-    //setup server
-    int addrErr;
-    struct addrinfo serverSettings; //contains server settings
-    struct addrinfo *hostInfo;      //contains the host's network info
-    memset(&serverSettings,0,sizeof(serverSettings));
-    serverSettings.ai_family = AF_INET;     //network type (ipv4)
-    serverSettings.ai_socktype = SOCK_STREAM;  //connection type (TCP streaming)
-    serverSettings.ai_flags = AI_PASSIVE;      //IP address binding (auto)
-    
-    printf("Starting server setup...\n");
-    addrErr = getaddrinfo(NULL,PORT,&serverSettings,&hostInfo);
-    if (addrErr != NOERR) {
-        //error handling
-        fprintf(stderr,"** getaddrinfo error: %s **\n",gai_strerror(addrErr));
+    //read the options from the config file and the command line
+    ServerConfig config;
+    if (ReadConfig(&config, argc, argv) == ERROR) {
         exit(1);
     }
-    
-    //socket setup
-    int listenSoc;
-    printf("Socket setup...\n");
-    listenSoc = socket(hostInfo->ai_family,hostInfo->ai_socktype,hostInfo->ai_protocol);
-    if (listenSoc == ERROR) {
-        //error handling
-        fprintf(stderr,"** socket error **\n");
+
+    //loaded before any thread starts, so SIGHUP (which reloads the table) is left to the thread waiting for it
+    if (InitRewrites(config.rewriteFile) == ERROR) {
         exit(1);
     }
 
-    //bind to port and socket
-    int bindErr;
-    printf("Binding to port...\n");
-    bindErr = bind(listenSoc,hostInfo->ai_addr,hostInfo->ai_addrlen);
-    if (bindErr == ERROR) {
-        //error handling
-        fprintf(stderr,"** binding error **\n");
+    //everything logged from here on is written out by the logging thread
+    if (InitLogger(config.logLevel, config.accessLog) == ERROR) {
         exit(1);
     }
+    InitMetrics();
+    if (InitRanges() == ERROR) {
+        exit(1);
+    }
+    InitAdmission(config.maxConnections, config.maxRequests, config.maxQueueMs);
+    if (InitRequestBodies(config.maxBody, config.spoolDir) == ERROR) {
+        exit(1);
+    }
+    
+    //setup multithreading
+    pthread_attr_init(&threadAttr);
+    pthread_attr_setdetachstate(&threadAttr,PTHREAD_CREATE_DETACHED);
 
-    //listen on port
-    int listenErr;
-    printf("Listening to port...\n");
-    listenErr = listen(listenSoc,BACKLOG);
-    if (listenErr == ERROR) {
-        fprintf(stderr,"** listen error **\n");
+    //setup server, one listening socket per shard
+    printf("Starting server setup...\n");
+    int listenSocs[MAX_SHARDS];
+    if (OpenListeners(config.port, config.backlog, listenSocs, config.numShards) == ERROR) {
         exit(1);
     }
+    SetShardPinning(config.pinShards);
 
     printf("Setting up error handles...\n");
     signal(SIGPIPE,SigPipeHandle);
 
+    printf("Opening data directory...\n");
+    char dataDir[PATH_SIZE*2+2];
+    if (config.docRoot == NULL) {
+        CreateFullFileAddress(dataDir, "");
+    } else if (realpath(config.docRoot,dataDir) == NULL) {
+        fprintf(stderr,"** document root error ** %s: %s\n",config.docRoot,strerror(errno));
+        exit(1);
+    }
+    if (OpenDocRoot(dataDir) == ERROR) {
+        exit(1);
+    }
+
+    printf("Setting up file cache...\n");
+    InitFileCache(dataDir, config.cacheMB * 1048576);
+    if (config.packFile != NULL && LoadAssetPack(config.packFile) == ERROR) {
+        exit(1);
+    }
+
     printf("Server Setup Complete!\n");
     printf("Waiting for Clients\n");
     printf("==============================\n");
-    
+
+    if (config.serverMode == MODE_URING) {
+        //the io_uring loops only return on failure, or straight away if the kernel cannot run them
+        if (RunUringLoops(listenSocs, config.numShards, config.numLoops) == NOERR) {
+            return 1;
+        }
+        fprintf(stderr,"** io_uring unavailable ** %s, using epoll instead\n",strerror(errno));
+        config.serverMode = MODE_EPOLL;
+    }
+    if (config.serverMode == MODE_EPOLL) {
+        //the event loops take over the listening sockets and only return on failure
+        RunEventLoops(listenSocs, config.numShards, config.numLoops);
+        return 1;
+    }
+    //blocking threads cannot time themselves out, the watchdog does it for them
+    if (StartWatchdog() == ERROR) {
+        exit(1);
+    }
+    if (config.serverMode == MODE_POOL) {
+        pool = CreateThreadPool(config.numWorkers);
+        MetricsWatchPool(pool);
+    }
+
+    //one accept loop per listening socket, the calling thread runs the first itself
+    Shard* shards = AssignShards(listenSocs, config.numShards, config.numShards);
+    int i;
+    for (i = 1; i < config.numShards; i++) {
+        pthread_t thread;
+        if (pthread_create(&thread,&threadAttr,AcceptLoop,&shards[i]) != NOERR) {
+            fprintf(stderr,"** pthread_create error **\n");
+            exit(1);
+        }
+    }
+    AcceptLoop(&shards[0]);
+    return 0;
+}
+
+//hand every connection accepted on one listening socket to a new thread or the worker pool
+static void* AcceptLoop (void* shardPtr) {
+    Shard* shard = shardPtr;
+    PinShard(shard);
+
+    pthread_t thread;
     struct sockaddr_storage connInfo;
-    socklen_t connInfoSize = sizeof(connInfo);
     while (1) {
         //reset for new connection
+        socklen_t connInfoSize = sizeof(connInfo);
         memset(&connInfo,0,connInfoSize);
 
         //wait for incoming connections
-        int* newConn = malloc(sizeof(int));
-        *newConn = accept(listenSoc,(struct sockaddr*)&connInfo,&connInfoSize);
-        if (*newConn == ERROR) {
-            //error checking
-            fprintf(stderr,"** accept error **\n");
-            exit(1);
+        int connID = accept(shard->listenSoc,(struct sockaddr*)&connInfo,&connInfoSize);
+        if (connID == ERROR) {
+            if (errno == EINTR || errno == ECONNABORTED) continue;
+            //out of descriptors, turn the waiting client away rather than leave the queue stuck
+            //then give closing connections a moment to free something up
+            int err = errno;
+            int shed = err == EMFILE || err == ENFILE ? ShedWithReserve(shard->listenSoc) : ERROR;
+            if (shed == TRUE) continue;
+            if (shed == ERROR) LogError("** accept error ** %s",strerror(err));
+            usleep(ACCEPT_BACKOFF_MS * 1000);
+            continue;
+        }
+        //too many open already, the client is told to come back later
+        if (!AdmitConnection()) {
+            ShedConnection(connID);
+            continue;
         }
         //we have a valid connection, start processing request
-        pthread_create(&thread,NULL,ServePage,(void*)newConn);
+        if (pool != NULL) {
+            //hand it to a warm worker
+            if (SubmitConnection(pool,connID) == ERROR) {
+                LogWarn("** worker queues full, turning connection away **");
+                CountShed(SHED_QUEUE);
+                ShedConnection(connID);
+                ReleaseConnection();
+            }
+        } else {
+            //the socket is passed in the pointer itself, so nothing is allocated per connection
+            if (pthread_create(&thread,&threadAttr,ServePage,(void*)(intptr_t)connID) != NOERR) {
+                LogError("** pthread_create error **");
+                ShedConnection(connID);
+                ReleaseConnection();
+            }
+        }
     }
-    
-    freeaddrinfo(hostInfo);
-    return 0;
+    return NULL;
 }
+#endif
 
 char* Concat (char* str1, char* str2) {
     int str1Len = strlen(str1);
@@ -126,148 +229,334 @@ char* Concat (char* str1, char* str2) {
     return newStr;
 }
 
-int ReadHTTPRequest(char* buffer, int connID) {
-    //keep reading the request into the buffer until a double new line is encountered (it will be in the form /r/n/r/n or /n/n)
-    //assume only one request will be made per tcp connection
-    int endRequest = FALSE;
-    int bytesRead = 0;
+//read until the parser has the whole request header, returns the length of the request
+//bytes after the end of the request belong to the next (pipelined) request and are left in the buffer
+//firstByte is set to when the first byte of the request was available
+//the connection's deadline moves from idle to the header timeout once the request starts arriving
+int ReadHTTPRequest (GrowBuffer* buffer, int* bufferLen, HttpParser* parser, int connID, long long* firstByte, Watch* watch) {
     int recvOut = 0;
-    printf("- Getting Client Request...");
-    while (!endRequest) {
-        //read into buffer
+    long long parseTime = 0;
+    LogDebug("- Getting Client Request...");
+    InitParser(parser);
+    *firstByte = NanoTime();
+    SetWatchDeadline(watch, *bufferLen == 0 ? TIMEOUT_IDLE : TIMEOUT_HEADER);
+    if (buffer->data == NULL && ReserveSpace(buffer, 0, 1) == ERROR) return ERROR;
+    while (1) {
+        //only the data that has not been parsed yet is looked at
+        long long parseStart = NanoTime();
+        int parsed = ParseRequest(parser, buffer->data, *bufferLen);
+        parseTime += NanoTime() - parseStart;
+        if (parsed == TRUE) {
+            LogDebug("Found end");
+            RecordPhase(PHASE_PARSE, parseTime);
+            return ParsedLength(parser);
+        }
+
+        if (*bufferLen >= BUFF_SIZE) {
+            //the request does not fit in the buffer
+            LogError("** request too large **");
+            return ERROR;
+        }
+
+        //read into buffer, growing it once it is full
         //keep track of how much we have read into the buffer, the position to start reading into and how much more we can read into the buffer
-        recvOut = recv(connID, &buffer[bytesRead], BUFF_SIZE-bytesRead,0);
+        int space = ReserveSpace(buffer, *bufferLen, 1);
+        if (space == ERROR) return ERROR;
+        recvOut = recv(connID, &buffer->data[*bufferLen], space,0);
         if (recvOut == ERROR) {
-            //some error
-            fprintf(stderr,"** recv error ** %s\n",strerror(errno));
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                //not expected from a blocking socket without a receive timeout
+                LogDebug("Connection Idle");
+            } else {
+                //some error
+                LogError("** recv error ** %s",strerror(errno));
+            }
             return ERROR;
         } else if (recvOut == 0) {
             //the client has terminated the connection
-            printf("Connection Terminated\n");
+            LogDebug("Connection Terminated");
             return ERROR;
         }
+        if (*bufferLen == 0) {
+            *firstByte = NanoTime();
+            SetWatchDeadline(watch, TIMEOUT_HEADER);
+        }
+        *bufferLen += recvOut;
+        buffer->data[*bufferLen] = '\0';
+    }
+}
 
-        //if we get here then we recieved the data correctly
-        //check if the data received contained a double return
-        int i;
-        for (i = bytesRead; i< bytesRead+recvOut; i++) {
-            //this should loop through all the characters that were just placed into the buffer
-            if (strstr(buffer, "\r\n\r\n")){// || strstr(buffer, "\n\n")) {
-                printf("Found end\n");
-                return bytesRead+recvOut;
-            }
+//read the body of the request into its reader (and sink), first what followed the header into the buffer
+//then from the socket, one receive at a time so the buffer never holds more than that of it
+//returns ERROR if the connection failed, a body that was turned away has body->status set instead
+int ReadRequestBody (GrowBuffer* buffer, int* bufferLen, int requestLen, BodyReader* body, int connID) {
+    //the client only sends the body once it is told to go ahead
+    if (body->expectsContinue && *bufferLen == requestLen && SendContinue(connID) == ERROR) return ERROR;
+    int result = ConsumeBuffered(body, buffer->data, bufferLen, requestLen);
+    while (result == FALSE) {
+        int space = ReserveSpace(buffer, *bufferLen, 1);
+        if (space == ERROR) return ERROR;
+        int recvOut = recv(connID,&buffer->data[*bufferLen],space < BODY_CHUNK_SIZE ? space : BODY_CHUNK_SIZE,0);
+        if (recvOut == ERROR && errno == EINTR) continue;
+        if (recvOut == ERROR) {
+            LogError("** recv error ** %s",strerror(errno));
+            return ERROR;
+        }
+        if (recvOut == 0) {
+            //the client has terminated the connection
+            LogDebug("Connection Terminated");
+            return ERROR;
         }
-        bytesRead += recvOut;
+        *bufferLen += recvOut;
+        result = ConsumeBuffered(body, buffer->data, bufferLen, requestLen);
     }
-    
-    return ERROR;
+    return NOERR;
 }
 
 void* ServePage (void* newConn) {
-    //save the connection id on the stack and free the temp memory
-    int connID = *(int*)newConn;
-    free(newConn);
-    printf("=== NEW CONNECTION ===\n");
-    //the request needs to be read first
-    char recvBuffer[BUFF_SIZE+1];
-    memset(recvBuffer,0,BUFF_SIZE+1);
-    //int bytesRecv = recv(connID,buffer,BUFF_SIZE,0);
-    int bytesRecv;
-    if ((bytesRecv = ReadHTTPRequest(recvBuffer,connID)) == ERROR) {
-        //error reading the request
-        printf("Error reading request\n");
-        printf("TERMINATING\n");
-        return NULL;
+    //the connection id is the pointer itself
+    int connID = (int)(intptr_t)newConn;
+    ServeConnection(connID, NanoTime());
+    return NULL;
+}
+
+//serve requests on the connection until either side wants to close it
+//acceptTime (NanoTime) is when it was accepted, so time spent queued counts towards the first byte
+void ServeConnection (int connID, long long acceptTime) {
+    LogDebug("=== NEW CONNECTION ===");
+    CountConnection(1);
+    char client[INET6_ADDRSTRLEN];
+    ClientAddress(connID, client, INET6_ADDRSTRLEN);
+    //the watchdog shuts the connection down when it is idle, or a request or response is too slow
+    Watch watch;
+    InitWatch(&watch, connID);
+
+    //the request needs to be read first, into a buffer that starts small and grows for large requests
+    //everything else a request needs comes from its arena, which is reset once it is answered
+    GrowBuffer recvBuffer;
+    InitGrowBuffer(&recvBuffer, NULL);
+    Arena arena;
+    InitArena(&arena, NULL);
+    int bufferLen = 0;
+    int numRequests = 0;
+    int keepAlive = TRUE;
+    HttpParser parser;
+    while (keepAlive) {
+        int requestLen;
+        long long firstByte;
+        if ((requestLen = ReadHTTPRequest(&recvBuffer,&bufferLen,&parser,connID,&firstByte,&watch)) == ERROR) {
+            //error reading the request
+            LogDebug("Error reading request, TERMINATING");
+            break;
+        }
+
+        LogDebug("- Serving webpage...");
+        if (numRequests == 0) RecordPhase(PHASE_FIRST_BYTE, firstByte - acceptTime);
+        //a client that speaks HTTP/2 has the rest of the connection served that way
+        if ((numRequests == 0 && IsHttp2Preface(recvBuffer.data, requestLen)) || WantsHttp2Upgrade(&parser, recvBuffer.data)) {
+            ServeHttp2(connID, client, &watch, recvBuffer.data, requestLen, bufferLen, IsHttp2Preface(recvBuffer.data, requestLen) ? NULL : &parser);
+            break;
+        }
+        long long startTime = MicroTime();
+        if (!AdmitRequest()) {
+            //too many requests in progress, answer with the prebuilt 503 and close
+            int overloadLen;
+            char* overload = OverloadResponse(&overloadLen);
+            SetWatchDeadline(&watch, TIMEOUT_SEND);
+            int sent = send(connID,overload,overloadLen,MSG_NOSIGNAL);
+            RecordResponse(client, recvBuffer.data, &parser, RESPONSE_503, sent == ERROR ? 0 : sent, startTime);
+            break;
+        }
+        //the body is read before anything else, it has to be off the connection before the response goes out
+        BodyReader body;
+        int bodyFollows = StartBody(&body, &parser, recvBuffer.data);
+        if (bodyFollows == TRUE) SetWatchDeadline(&watch, TIMEOUT_BODY);
+        if (bodyFollows == TRUE && ReadRequestBody(&recvBuffer, &bufferLen, requestLen, &body, connID) == ERROR) {
+            LogDebug("Error reading request body, TERMINATING");
+            EndBody(&body);
+            ReleaseRequest();
+            break;
+        }
+        ReqInfo reqInfo = ProcessRequest(recvBuffer.data, &parser, &arena, bodyFollows == FALSE ? NULL : &body);
+        numRequests++;
+        if (numRequests >= MAX_KEEPALIVE_REQUESTS) reqInfo.keepAlive = FALSE;
+        keepAlive = reqInfo.keepAlive;
+
+        //send the HTTP response header, with as much of the body as can go along with it
+        SetWatchDeadline(&watch, TIMEOUT_SEND);
+        char* sendBuffer = ArenaAlloc(&arena, HEADER_SIZE);
+        int headerLen = sendBuffer == NULL ? 0 : BuildResponseHeader(&reqInfo, sendBuffer, HEADER_SIZE);
+        int hasBody = sendBuffer != NULL && ResponseHasBody(&reqInfo);
+        FileSender sender;
+        if (hasBody) InitResponseSender(&reqInfo, &sender);
+        long long phaseStart = NanoTime();
+        int headerSent = 0;
+        int sendErr = sendBuffer == NULL || SendWithHeader(hasBody ? &sender : NULL, connID, sendBuffer, headerLen, &headerSent) != TRUE ? ERROR : NOERR;
+        RecordPhase(PHASE_HEADER, NanoTime() - phaseStart);
+
+        //now send the rest of the attatched file
+        if (sendErr != ERROR && hasBody) {
+            phaseStart = NanoTime();
+            sendErr = SendResponseBody(&reqInfo, &sender, connID);
+            RecordPhase(PHASE_BODY, NanoTime() - phaseStart);
+        }
+        long long bytesSent = headerSent;
+        if (hasBody) {
+            bytesSent += FileSenderSent(&sender);
+            CloseFileSender(&sender);
+        }
+        RecordResponse(client, recvBuffer.data, &parser, reqInfo.responseCode, bytesSent, startTime);
+        if (reqInfo.fileFd != ERROR) close(reqInfo.fileFd);
+        if (reqInfo.cached != NULL) ReleaseCacheEntry(reqInfo.cached);
+        ResetArena(&arena);
+        ReleaseRequest();
+        watch.sent += bytesSent;
+        if (sendErr == ERROR) break;
+        //the rest of a body that was turned away may still be on its way, the connection closes after the response
+        if (bodyFollows != FALSE && body.status != NULL) DiscardUnread(connID);
+
+        //keep any pipelined requests that arrived after this one
+        bufferLen -= requestLen;
+        memmove(recvBuffer.data,&recvBuffer.data[requestLen],bufferLen);
+        recvBuffer.data[bufferLen] = '\0';
     }
 
-    /*
-    //Determine the kind of request (GET,POST,...)
-    int reqType = RequestType(buffer, bytesRecv);
-    */
-    
-    printf("- Serving webpage...\n");
-    ReqInfo reqInfo = ProcessRequest(recvBuffer, bytesRecv);
-    
-    //send the HTTP response header
-    char sendBuffer[BUFF_SIZE+1];
-    memset(sendBuffer,0,BUFF_SIZE+1);
-    snprintf(sendBuffer,BUFF_SIZE+1,"%s %s\nContent-Length: %lld\n\n",reqInfo.httpVer,reqInfo.responseCode,reqInfo.fileSize);
-    send(connID,sendBuffer,strlen(sendBuffer),0);
+    //finished sending info, kill connection
+    ReleaseGrowBuffer(&recvBuffer);
+    ReleaseArena(&arena);
+    EndWatch(&watch);
+    close(connID);
+    ReleaseConnection();
+    CountConnection(-1);
+    LogDebug("Done!");
+}
+
+//status lines of every response the server sends, for HTTP/1.0 and HTTP/1.1, put together at compile time
+#define STATUS_LINES(code) {code, HTTPVER_10 " " code "\r\n", HTTPVER_11 " " code "\r\n"}
+static char* statusLines[][3] = {
+    STATUS_LINES(RESPONSE_200),
+    STATUS_LINES(RESPONSE_206),
+    STATUS_LINES(RESPONSE_301),
+    STATUS_LINES(RESPONSE_302),
+    STATUS_LINES(RESPONSE_304),
+    STATUS_LINES(RESPONSE_400),
+    STATUS_LINES(RESPONSE_404),
+    STATUS_LINES(RESPONSE_413),
+    STATUS_LINES(RESPONSE_416),
+    STATUS_LINES(RESPONSE_500),
+    STATUS_LINES(RESPONSE_501),
+    STATUS_LINES(RESPONSE_503),
+};
+#define CONNECTION_KEEPALIVE "Connection: keep-alive\r\n\r\n"
+#define CONNECTION_CLOSE "Connection: close\r\n\r\n"
+
+//copy textLen bytes of text to the end of the len bytes in buffer (as much as fits), returns the new length
+static int AppendText (char* buffer, int size, int len, char* text, int textLen) {
+    if (textLen > size-1-len) textLen = size-1-len;
+    memcpy(&buffer[len],text,textLen);
+    buffer[len+textLen] = '\0';
+    return len+textLen;
+}
 
-    //now send the attatched file
-    if (reqInfo.fileSize > 0 && reqInfo.reqType != REQUEST_HEAD) {
-        SendFile(reqInfo.fullAddress,connID);
+//write the HTTP response header for reqInfo into buffer, returns the header length
+//only the entity headers of files that are not cached are formatted, everything else is copied in
+int BuildResponseHeader (ReqInfo* reqInfo, char* buffer, int size) {
+    int len = 0;
+    int i;
+    for (i = 0; i < sizeof(statusLines)/sizeof(statusLines[0]) && len == 0; i++) {
+        if (strcmp(statusLines[i][0],reqInfo->responseCode) == STREQU) {
+            char* line = statusLines[i][strcmp(reqInfo->httpVer,HTTPVER_11) == STREQU ? 2 : 1];
+            len = AppendText(buffer, size, 0, line, strlen(line));
+        }
+    }
+    if (len == 0) {
+        len = snprintf(buffer,size,"%s %s\r\n",reqInfo->httpVer,reqInfo->responseCode);
+        if (len >= size) len = size-1;
     }
 
-    /*
-    //if GET request
-    if (reqInfo.reqType == REQUEST_GET) {
-        //printf("*%s*\n",buffer);
-        //process the http request and find the requested file
-        //insert function here (returns a file address string)
-        char buffer[BUFF_SIZE+1];
-        memset(buffer,0,BUFF_SIZE+1);
-        snprintf(buffer,BUFF_SIZE+1,"%s %s\nContent-Length: %lld\n\n",reqInfo.httpVer,reqInfo.responseCode,reqInfo.fileSize);
-        //char* head1 = "HTTP/1.0 200 OK\n";
-        //char* head2 = "Content-Length: "
-        send(connID,buffer,strlen(buffer),0);
-        //send contents of file at requested location
-        //insert function here
-        //SendFile("index.html",connID);
-        SendFile(reqInfo.fullAddress,connID);
-    } else if (reqInfo.reqType == REQUEST_INVALID) {
-        char* msg = "HTTP/1.0 400 Bad Request\n\n";
-        send(connID,msg,strlen(msg),0);
-        SendFile(reqInfo.fullAddress,connID);
+    int ranged = (reqInfo->ranges != NULL && reqInfo->ranges->numRanges > 0) || strcmp(reqInfo->responseCode,RESPONSE_416) == STREQU;
+    //a packed .gz sent in place of the file it compresses has headers of its own
+    int packedSibling = reqInfo->cached != NULL && reqInfo->cached->packFd != ERROR && reqInfo->encoding != NULL;
+    if (reqInfo->cached != NULL && !ranged && !packedSibling) {
+        //the entity headers were built when the file was cached
+        len = AppendText(buffer, size, len, reqInfo->cached->header, reqInfo->cached->headerLen);
     } else {
-        char* msg = "HTTP/1.0 501 Not Implemented\n\n";
-        send(connID,msg,strlen(msg),0);
+        //every part of a multipart body has its own type, the response as a whole is multipart
+        int multipart = reqInfo->ranges != NULL && reqInfo->ranges->numRanges > 1;
+        len += EntityHeaders(&buffer[len], size-len, multipart ? NULL : reqInfo->contentType, BodyLength(reqInfo), reqInfo->etag, reqInfo->mtime, reqInfo->fileName, reqInfo->encoding);
+        if (ranged) len += RangeHeaders(reqInfo, &buffer[len], size-len);
+        if (len >= size) len = size-1;
     }
-    */
-
-    //finished sending info, kill connection
-    close(connID);
-    printf("Done!\n");
-    
-    return NULL;
+    if (reqInfo->location != NULL) {
+        len += snprintf(&buffer[len],size-len,"Location: %s\r\n",reqInfo->location);
+        if (len >= size) len = size-1;
+    }
+    if (reqInfo->keepAlive) return AppendText(buffer, size, len, CONNECTION_KEEPALIVE, strlen(CONNECTION_KEEPALIVE));
+    return AppendText(buffer, size, len, CONNECTION_CLOSE, strlen(CONNECTION_CLOSE));
 }
 
+//HEAD requests, 304s and 416s are answered with the header alone
+int ResponseHasBody (ReqInfo* reqInfo) {
+    return BodyLength(reqInfo) > 0 && reqInfo->reqType != REQUEST_HEAD && strcmp(reqInfo->responseCode,RESPONSE_304) != STREQU;
+}
 
+//the failed write reports the error, and nothing can be safely printed from a signal handler
 void SigPipeHandle (int i) {
-    printf("SIGPIPE - throwing error\n");
     return;
 }
 
-void SendFile (char* address, int connID) {
-    printf("Sending file: (%s)\n",address);
+//count a finished response and write its access log line, startTime is when the request was ready to process
+void RecordResponse (char* client, char* request, HttpParser* parser, char* responseCode, long long bytes, long long startTime) {
+    CountResponse(atoi(responseCode), bytes);
+    char referer[VALUE_SIZE];
+    char userAgent[VALUE_SIZE];
+    if (CopyNamedHeader(parser, request, "Referer", referer, VALUE_SIZE) == ERROR) referer[0] = '\0';
+    if (CopyNamedHeader(parser, request, "User-Agent", userAgent, VALUE_SIZE) == ERROR) userAgent[0] = '\0';
+    LogAccess(client, &request[parser->requestLine.start], parser->requestLine.len, atoi(responseCode), bytes, MicroTime() - startTime, referer, userAgent);
+}
 
-    FILE* file = fopen(address,"r");
-    if (file == NULL) {
-        fprintf(stderr,"** FILE DOES NOT EXIST **\n");
-        return;
+//set sender up to send the body of the response, starting with its first part
+//a cached file is sent from memory and so is a small one, read in whole so it can go out along with
+//the header, anything else is sent from the file (the sender takes it over and closes it)
+//a larger file from the asset pack is sent straight from the archive's shared descriptor
+void InitResponseSender (ReqInfo* reqInfo, FileSender* sender) {
+    char* data = NULL;
+    if (reqInfo->cached != NULL && reqInfo->cached->packFd != ERROR && reqInfo->cached->size > INLINE_FILE_SIZE) {
+        InitSharedSender(sender, reqInfo->cached->packFd, reqInfo->cached->packOffset, reqInfo->cached->size);
+    } else if (reqInfo->cached != NULL) {
+        InitMemorySender(sender, reqInfo->cached->data, reqInfo->cached->size);
+    } else if (reqInfo->fileSize <= INLINE_FILE_SIZE && (data = ArenaAlloc(reqInfo->arena, reqInfo->fileSize)) != NULL && ReadWhole(reqInfo->fileFd, data, reqInfo->fileSize) == NOERR) {
+        InitMemorySender(sender, data, reqInfo->fileSize);
+        close(reqInfo->fileFd);
+        reqInfo->fileFd = ERROR;
+    } else {
+        InitFileSender(sender, reqInfo->fileFd, 0, reqInfo->fileSize);
+        reqInfo->fileFd = ERROR;
     }
-    char buffer[PACK_SIZE+1];
-    memset(buffer,0,PACK_SIZE+1);
+    NextBodyPart(reqInfo->ranges, 0, reqInfo->fileSize, sender);
+}
 
+//read size bytes from the start of the file, returns ERROR if there are fewer
+static int ReadWhole (int fileFd, char* data, long long size) {
     long long totalRead = 0;
-    int elemRead = 0;
-    int bytesSent = 0;
-    int totalSent = 0;
-    //put read and send into a loop to send all data in a file until done
-    while ((elemRead = (int)fread(buffer,1,PACK_SIZE,file)) > 0) {
-        totalRead+=elemRead;
-        totalSent = 0;
-        while (totalSent < elemRead) {
-            bytesSent = send(connID,buffer,elemRead-totalSent,0);
-            if (bytesSent == ERROR) {//change later
-                //error handling
-                fprintf(stderr,"** send error ** %s\n",strerror(errno));
-
-                return;
-            }
-            totalSent += bytesSent;
-        }
+    while (totalRead < size) {
+        ssize_t elemRead = pread(fileFd,&data[totalRead],size-totalRead,totalRead);
+        if (elemRead == ERROR && errno == EINTR) continue;
+        if (elemRead <= 0) return ERROR;
+        totalRead += elemRead;
+    }
+    return NOERR;
+}
+
+//send the rest of the body (every part of it, the first already set up by InitResponseSender) on a blocking socket
+int SendResponseBody (ReqInfo* reqInfo, FileSender* sender, int connID) {
+    int result = SendFileStep(sender, connID);
+    int part;
+    for (part = 1; result == TRUE && NextBodyPart(reqInfo->ranges, part, reqInfo->fileSize, sender); part++) {
+        result = SendFileStep(sender, connID);
     }
+    //the socket blocks, so it can only "would block" once the watchdog has shut it down
+    return result == TRUE ? NOERR : ERROR;
 }
 
 int RequestType (char* request, int bytesRecv) {
@@ -281,7 +570,7 @@ int RequestType (char* request, int bytesRecv) {
         buffer[i] = request[i];
     }
     //the first word is now in the buffer
-    printf("REQUEST: '%s'\n",buffer);
+    LogDebug("REQUEST: '%s'",buffer);
     //convert the text into a number representing the request type
     if (strcmp(buffer,"GET") == STREQU) return REQUEST_GET;
     if (strcmp(buffer,"HEAD") == STREQU) return REQUEST_HEAD;
@@ -318,20 +607,12 @@ void CreateFullFileAddress (char* fullAddress, char* fileName) {
     return;
 }
 
-//returns a pointer to the response code generated
-char* FileAddress (char* request, int bytesRecv, char* result, char* fileName) {
+//decode the address in the request into fileName (which holds at least PATH_SIZE+1 characters)
+//returns FALSE if the request has no address
+int RequestPath (char* request, int bytesRecv, char* fileName) {
     //expect text and then a space before the address
-    //the address does not contain any spaces in its raw form
-    //'%' is a command character which can be followed by numbers to represent a character
-    //stop reading at the new space or when we reach the end of the request
     int isAddress = FALSE;
-    char* file = NULL;
-    char* response = NULL;
-    char fullAddress[PATH_SIZE*2+2];
-    char buffer[PATH_SIZE+1];
-    memset(buffer,0,PATH_SIZE+1);
-    memset(fullAddress,0,PATH_SIZE*2+2);
-    //printf("Full: (%p|%p)\n",fullAddress,buffer);
+    memset(fileName,0,PATH_SIZE+1);
 
     int i;
     for(i = 0; i < bytesRecv && i < TYPE_SIZE; i++) {
@@ -342,93 +623,85 @@ char* FileAddress (char* request, int bytesRecv, char* result, char* fileName) {
             break;
         }
     }
+    if (isAddress == FALSE) return FALSE;
+
+    DecodePath(&request[i], bytesRecv-i, fileName);
+    return TRUE;
+}
+
+//decode the raw address (at most len characters) into fileName (which holds at least PATH_SIZE+1 characters)
+void DecodePath (char* address, int len, char* fileName) {
+    //the address does not contain any spaces in its raw form
+    //'%' is a command character which can be followed by numbers to represent a character
+    //stop reading at the new space or when we reach the end of the address
+    char* buffer = fileName;
+    memset(buffer,0,PATH_SIZE+1);
 
-    if (isAddress == TRUE) {
-        //read the address (up until the next space)
-        char buffer[PATH_SIZE+1];
-        memset(buffer,0,PATH_SIZE+1);
-        int j;
-        for (j = 0; j < PATH_SIZE && j+i < bytesRecv; j++) {
-            if (request[i+j] != ' ' && request[i+j] != '\n' && request[i+j] != '\r') {
-                if (request[i+j] == '%') {
-                    //control character
-                    char control[ENCODE_SIZE+1];
-                    memset(control,0,ENCODE_SIZE+1);
-                    
-                    //add data to array
-                    int p;
-                    for (p = 0; p < ENCODE_SIZE && i+j+p < bytesRecv; p++) {
-                        control[p] = request[i+j+p];
-                    }
-                    int r = ConvertControlChar(control);
-                    if (r == ERROR) {
-                        //this is not a control character, do nothing
-                        buffer[j] = request[i+j];
-                    } else if (r > 0) {
-                        //this is an invalid control sequence, skip ahead r many positions
-                        i+=r;
-                        j--;
-                    } else if (r == 0) {
-                        //the conversion was a success
-                        buffer[j] = control[0];
-                        i+=ENCODE_SIZE-1;
-                    }
-                    //check for directory up (/../)
-                } else if (i+j+3 < bytesRecv && (request[i+j] == '/' && request[i+j+1] == '.' && request[i+j+2] == '.' && request[i+j+3] == '/')) {
-                    //this is a directory up command, ignore it (remove '../')
-                    //printf("Up Dir Command Detected, Ignoring it\n");
-                    //buffer[j] = request[i+j];
-                    i+=3;
+    int i = 0;
+    int j;
+    for (j = 0; j < PATH_SIZE && j+i < len; j++) {
+        if (address[i+j] != ' ' && address[i+j] != '\n' && address[i+j] != '\r') {
+            if (address[i+j] == '%') {
+                //control character
+                char control[ENCODE_SIZE+1];
+                memset(control,0,ENCODE_SIZE+1);
+                
+                //add data to array
+                int p;
+                for (p = 0; p < ENCODE_SIZE && i+j+p < len; p++) {
+                    control[p] = address[i+j+p];
+                }
+                int r = ConvertControlChar(control);
+                if (r == ERROR) {
+                    //this is not a control character, do nothing
+                    buffer[j] = address[i+j];
+                } else if (r > 0) {
+                    //this is an invalid control sequence, skip ahead r many positions
+                    i+=r;
                     j--;
-                } else {
-                    buffer[j] = request[i+j];
+                } else if (r == 0) {
+                    //the conversion was a success
+                    buffer[j] = control[0];
+                    i+=ENCODE_SIZE-1;
                 }
             } else {
-                break;
-            }        
-        }
-        file = buffer;
-        printf("Requested Address: (%s) | ",file);
-        if (file[0] == '/' && strlen(file) == 1) {
-            file = DEFAULT_PAGE;
-            response = RESPONSE_200;
-        }
-    } else {
-        //no address was supplied
-        printf("No address\n");
-        file = ERROR400_PAGE;
-        response = RESPONSE_400;
-    }
-    //append the current working directory to the start of the requested file
-    CreateFullFileAddress (fullAddress, file);
-
-    //check that the address in result actually exists
-    FILE* checkF = fopen(fullAddress,"r");
-    if (checkF != NULL) {
-        //the file opened, so close the file
-        fclose(checkF);
-        response = RESPONSE_200;
-    } else {
-        //the file does not exist, return the 404error file
-        file = ERROR404_PAGE;
-        CreateFullFileAddress(fullAddress, file);
-        response = RESPONSE_404;
+                buffer[j] = address[i+j];
+            }
+        } else {
+            break;
+        }        
     }
 
-    //copy the full file address into the result string and return the response code
-    //copy address into result string (len PATH_SIZE*2+2)
-    int k;
-    for (k = 0 ;k < PATH_SIZE*2+1 && fullAddress[k] != '\0'; k++) {
-        result[k] = fullAddress[k];
+    //resolve "." and ".." once the address is decoded, so encoded dots cannot sneak past
+    NormalizePath(buffer);
+    if (buffer[0] == '/' && buffer[1] == '\0') {
+        snprintf(buffer,PATH_SIZE+1,"%s",DEFAULT_PAGE);
     }
+}
 
-    //copy the file retrieved into file name
-    for (k = 0; k < PATH_SIZE && file[k] != '\0'; k++) {
-        fileName[k] = file[k];
+//open the file for the decoded path, the file served goes in reqInfo (a 404 leaves it to be opened later)
+//returns a pointer to the response code
+char* ResolveFileAddress (char* path, ReqInfo* reqInfo) {
+    struct stat st;
+    reqInfo->fileFd = OpenBeneath(path, &st);
+    if (reqInfo->fileFd == ERROR) {
+        //the file does not exist, return the 404error file
+        reqInfo->fileName = ERROR404_PAGE;
+        LogDebug("Requested Address: (%s) | File To Serve: (%s)",path,ERROR404_PAGE);
+        return RESPONSE_404;
     }
-    printf("File To Serve: (%s)\n", file);
+    reqInfo->fileSize = (long long)st.st_size;
+    FormatETag(reqInfo->etag, &st);
+    reqInfo->mtime = st.st_mtime;
+    reqInfo->fileName = CopyFileName(reqInfo->arena, path);
+    LogDebug("Requested Address: (%s) | File To Serve: (%s)",path,path);
+    return RESPONSE_200;
+}
 
-    return response;
+//the decoded path lives on the stack, the request keeps its own copy in the arena
+char* CopyFileName (Arena* arena, char* path) {
+    char* copy = ArenaStrdup(arena, path);
+    return copy == NULL ? "" : copy;
 }
 
 int NextNonSpace (char* text, int length, int startPos) {
@@ -466,44 +739,177 @@ int ConvertControlChar (char* text) {
 
 }
 
-ReqInfo ProcessRequest (char* request, int bytesRecv) {
+//returns 11 for an HTTP/1.1 request line, 10 for anything else
+int RequestVersion (char* request, int bytesRecv) {
+    char* lineEnd = memchr(request,'\r',bytesRecv);
+    int lineLen = lineEnd == NULL ? bytesRecv : (int)(lineEnd - request);
+    if (lineLen >= 8 && strncmp(&request[lineLen-8],HTTPVER_11,8) == STREQU) return 11;
+    return 10;
+}
+
+//copy the value of the named header (case insensitive) into value
+//returns the length of the value, or ERROR if the header is not in the request
+int FindHeader (char* request, int bytesRecv, char* name, char* value, int size) {
+    int nameLen = strlen(name);
+    //skip the request line, each header starts after a \r\n
+    char* line = memchr(request,'\n',bytesRecv);
+    char* end = request + bytesRecv;
+    while (line != NULL && ++line < end) {
+        char* lineEnd = memchr(line,'\r',end-line);
+        if (lineEnd == NULL) lineEnd = end;
+        if (lineEnd - line > nameLen && line[nameLen] == ':' && strncasecmp(line,name,nameLen) == STREQU) {
+            char* start = &line[nameLen+1];
+            while (start < lineEnd && (*start == ' ' || *start == '\t')) start++;
+            int len = 0;
+            while (start+len < lineEnd && len < size-1) {
+                value[len] = start[len];
+                len++;
+            }
+            //trailing whitespace is not part of the value
+            while (len > 0 && (value[len-1] == ' ' || value[len-1] == '\t')) len--;
+            value[len] = '\0';
+            return len;
+        }
+        line = memchr(line,'\n',end-line);
+    }
+    return ERROR;
+}
+
+//build the response for a request the parser has finished with
+//body is the request's body, read by now, or NULL when the request has none
+ReqInfo ProcessRequest (char* request, HttpParser* parser, Arena* arena, BodyReader* body) {
     //create and setup data structure
     ReqInfo reqInfo;
-    memset(reqInfo.fullAddress,0, PATH_SIZE*2+2);
-    memset(reqInfo.fileName,0,PATH_SIZE+1);
+    reqInfo.arena = arena;
+    reqInfo.fileName = "";
+    //anything not handled below is not implemented
+    reqInfo.responseCode = RESPONSE_501;
+    reqInfo.fileFd = ERROR;
+    reqInfo.fileSize = 0;
+    reqInfo.etag[0] = '\0';
+    reqInfo.mtime = 0;
+    reqInfo.contentType = NULL;
+    reqInfo.encoding = NULL;
+    reqInfo.ranges = NULL;
+    reqInfo.location = NULL;
 
     //Determine the nature of the request (GET,...)
-    reqInfo.reqType = RequestType(request, bytesRecv);
+    reqInfo.reqType = parser->malformed ? REQUEST_INVALID : parser->method;
 
     //Determine the address in the request
-    if (reqInfo.reqType == REQUEST_GET || reqInfo.reqType == REQUEST_HEAD) {
-        reqInfo.responseCode = FileAddress(request, bytesRecv, reqInfo.fullAddress, reqInfo.fileName);
+    //a cached file is answered straight from memory without touching the filesystem
+    reqInfo.cached = NULL;
+    long long resolveStart = NanoTime();
+    //taken before any file is opened, so a file replaced after it was opened is not cached
+    long generation = CacheGeneration();
+    if (body != NULL && body->status != NULL) {
+        //the body was turned away, so that is the answer whatever was asked for
+        reqInfo.responseCode = body->status;
+        if (strcmp(body->status,RESPONSE_400) == STREQU) reqInfo.fileName = ERROR400_PAGE;
+        if (strcmp(body->status,RESPONSE_413) == STREQU) reqInfo.fileName = ERROR413_PAGE;
+        if (strcmp(body->status,RESPONSE_501) == STREQU) reqInfo.fileName = ERROR501_PAGE;
+    } else if (reqInfo.reqType == REQUEST_GET || reqInfo.reqType == REQUEST_HEAD) {
+        char path[PATH_SIZE+1];
+        DecodePath(&request[parser->target.start], parser->target.len, path);
+        //moved pages are redirected (or rewritten to their new path) before anything is looked up
+        char* redirect = RewriteRequest(path, arena, &reqInfo.location);
+        if (redirect != NULL) {
+            reqInfo.responseCode = redirect;
+        } else if (strcmp(path,METRICS_PATH) == STREQU) {
+            //generated fresh for every request, so it is never cached
+            reqInfo.fileFd = MetricsFile(&reqInfo.fileSize);
+            reqInfo.contentType = METRICS_MIME_TYPE;
+            reqInfo.responseCode = RESPONSE_200;
+            if (reqInfo.fileFd == ERROR) {
+                //the metrics exist but could not be written out, nothing is sent with the 500
+                reqInfo.responseCode = RESPONSE_500;
+                reqInfo.fileSize = 0;
+            }
+        } else if ((reqInfo.cached = PackLookup(path)) != NULL || (reqInfo.cached = CacheLookup(path)) != NULL) {
+            reqInfo.responseCode = RESPONSE_200;
+            reqInfo.fileName = CopyFileName(arena, path);
+            CountCache(TRUE);
+        } else {
+            reqInfo.responseCode = ResolveFileAddress(path, &reqInfo);
+            CountCache(FALSE);
+        }
     } else if (reqInfo.reqType == REQUEST_INVALID) {
         reqInfo.responseCode = RESPONSE_400;
-        CreateFullFileAddress(reqInfo.fullAddress,ERROR400_PAGE);
-        snprintf(reqInfo.fileName,PATH_SIZE,ERROR400_PAGE);
+        reqInfo.fileName = ERROR400_PAGE;
     } else if (reqInfo.reqType == REQUEST_POST) {
-        printf("%s\n\n",request);
+        //the body has been handed to its sink, the client is told it arrived
+        reqInfo.responseCode = RESPONSE_200;
+        reqInfo.fileName = POST_DONE_PAGE;
     } else {
         //this is a request which is not implemented
         reqInfo.responseCode = RESPONSE_501;
-        CreateFullFileAddress(reqInfo.fullAddress,ERROR501_PAGE);
-        snprintf(reqInfo.fileName,PATH_SIZE,ERROR501_PAGE);
+        reqInfo.fileName = ERROR501_PAGE;
     }
 
-    //set http version code
-    reqInfo.httpVer = HTTPVER_10;
+    //answer in the version the client used and work out if the connection stays open
+    //HTTP/1.1 connections persist unless the client says otherwise, HTTP/1.0 ones only if asked to
+    char connection[VALUE_SIZE];
+    int hasConnection = CopyHeader(parser, request, HDR_CONNECTION, connection, VALUE_SIZE) != ERROR;
+    if (parser->version == 11) {
+        reqInfo.httpVer = HTTPVER_11;
+        reqInfo.keepAlive = !(hasConnection && strcasestr(connection,"close") != NULL);
+    } else {
+        reqInfo.httpVer = HTTPVER_10;
+        reqInfo.keepAlive = hasConnection && strcasestr(connection,"keep-alive") != NULL;
+    }
+    //whatever follows a body that was turned away (or a request that is not implemented) cannot be trusted
+    //to be a new request
+    if ((body != NULL && body->status != NULL) || (reqInfo.reqType != REQUEST_GET && reqInfo.reqType != REQUEST_HEAD && reqInfo.reqType != REQUEST_POST)) {
+        reqInfo.keepAlive = FALSE;
+    }
 
-    //set file size of file that is being transmitted
-    struct stat st;
-    if (stat(reqInfo.fullAddress,&st) == ERROR) {
-        printf("Could not get file stats\n");
+    //error pages are usually packed or cached as well, anything else gets cached on its way out
+    if (reqInfo.cached == NULL && reqInfo.fileName[0] != '\0') {
+        reqInfo.cached = PackLookup(reqInfo.fileName);
+        if (reqInfo.cached == NULL) reqInfo.cached = CacheLookup(reqInfo.fileName);
+        struct stat st;
+        if (reqInfo.cached == NULL && reqInfo.fileFd == ERROR && (reqInfo.fileFd = OpenBeneath(reqInfo.fileName, &st)) != ERROR) {
+            reqInfo.fileSize = (long long)st.st_size;
+            FormatETag(reqInfo.etag, &st);
+            reqInfo.mtime = st.st_mtime;
+        }
+        if (reqInfo.cached == NULL && reqInfo.fileFd != ERROR) reqInfo.cached = CacheInsert(reqInfo.fileName, reqInfo.fileFd, generation);
+    }
+
+    //a cached file is sent from memory, so the file is no longer needed
+    if (reqInfo.cached != NULL) {
+        if (reqInfo.fileFd != ERROR) close(reqInfo.fileFd);
+        reqInfo.fileFd = ERROR;
+        reqInfo.fileSize = reqInfo.cached->size;
+        memcpy(reqInfo.etag,reqInfo.cached->etag,ETAG_SIZE);
+        reqInfo.mtime = reqInfo.cached->mtime;
+    } else if (reqInfo.fileFd == ERROR) {
+        LogDebug("Could not open file");
         reqInfo.fileSize = 0;
-    } else {
-        //we need to get and use the file size
-        //printf("File Size: %lldB\n",(long long)st.st_size);
-        reqInfo.fileSize = (long long)st.st_size;
     }
 
+    //the type comes from the name the client asked for, even when a compressed version is sent
+    if (reqInfo.contentType == NULL && reqInfo.fileName[0] != '\0') {
+        reqInfo.contentType = ContentType(reqInfo.fileName);
+    }
+
+    //send a compressed version of the file to clients that can take one
+    if (strcmp(reqInfo.responseCode,RESPONSE_200) == STREQU && reqInfo.etag[0] != '\0' && AcceptsGzip(parser, request)) {
+        NegotiateEncoding(&reqInfo);
+    }
+
+    //the client's copy is still current, it only needs the validators back
+    if (strcmp(reqInfo.responseCode,RESPONSE_200) == STREQU && reqInfo.reqType != REQUEST_POST && NotModified(parser, request, reqInfo.etag, reqInfo.mtime)) {
+        reqInfo.responseCode = RESPONSE_304;
+    }
+
+    //a GET can ask for only part of the file
+    if (strcmp(reqInfo.responseCode,RESPONSE_200) == STREQU && reqInfo.reqType == REQUEST_GET && reqInfo.etag[0] != '\0') {
+        int ranged = ParseRanges(parser, request, &reqInfo);
+        if (ranged == TRUE) reqInfo.responseCode = RESPONSE_206;
+        if (ranged == ERROR) reqInfo.responseCode = RESPONSE_416;
+    }
+    RecordPhase(PHASE_RESOLVE, NanoTime() - resolveStart);
+
     return reqInfo;
 }
@@ -3,6 +3,11 @@
     By: Ricard Grace
 */
 
+#ifndef WEBSERVER_H
+#define WEBSERVER_H
+
+#define _GNU_SOURCE
+
 //networking headers
 #include <sys/types.h>
 #include <sys/socket.h>
@@ -21,6 +26,9 @@
 #include <signal.h>
 #include <limits.h>
 #include <sys/stat.h>
+#include <sys/time.h>
+#include <fcntl.h>
+#include <strings.h>
 
 //Error handling
 #include <errno.h>
@@ -28,19 +36,41 @@
 #define STREQU 0
 #define NOERR 0
 #define ERROR -1
-#define PORT "80"
-#define BACKLOG 10
+//listening defaults, changed with -p and -b or in the config file
+#define DEFAULT_PORT "80"
+#define DEFAULT_BACKLOG 511
 #define PACK_SIZE 2048
 #define BUFF_SIZE 16384
 #define TYPE_SIZE 10
 #define PATH_SIZE PATH_MAX
 #define HTMLVER_SIZE 3
+#define HEADER_SIZE 1024
+#define VALUE_SIZE 256
+#define ETAG_SIZE 64
+//files up to this size that are not cached are read in whole and sent in one go with the header
+#define INLINE_FILE_SIZE 2048
+#define KEEPALIVE_TIMEOUT 5
+#define MAX_KEEPALIVE_REQUESTS 100
+//seconds a request header has to arrive in once its first byte has
+#define HEADER_TIMEOUT 10
+//a response (or request body) has to go out (come in) at MIN_SEND_RATE bytes a second or better, checked every SEND_WINDOW seconds
+#define SEND_WINDOW 10
+#define MIN_SEND_RATE 1024
+
+//serving modes (selected at startup with -m)
+#define MODE_THREAD 0
+#define MODE_EPOLL  1
+#define MODE_POOL   2
+#define MODE_URING  3
 
 //default locations
 #define DEFAULT_PAGE "/index.html"
 #define ERROR404_PAGE "/404error.html"
 #define ERROR400_PAGE "/400error.html"
 #define ERROR501_PAGE "/501error.html"
+#define ERROR413_PAGE "/413error.html"
+//what a form post is answered with once its body has been taken
+#define POST_DONE_PAGE "/postReceived.html"
 #define DEFAULT_DIR "/webServerData"
 
 #define ENCODE_SIZE 3
@@ -53,9 +83,17 @@
 
 //Response Codes
 #define RESPONSE_200 "200 OK"
+#define RESPONSE_206 "206 Partial Content"
+#define RESPONSE_301 "301 Moved Permanently"
+#define RESPONSE_302 "302 Found"
+#define RESPONSE_304 "304 Not Modified"
 #define RESPONSE_400 "400 Bad Request"
 #define RESPONSE_404 "404 Not Found"
+#define RESPONSE_413 "413 Content Too Large"
+#define RESPONSE_416 "416 Range Not Satisfiable"
+#define RESPONSE_500 "500 Internal Server Error"
 #define RESPONSE_501 "501 Not Implemented"
+#define RESPONSE_503 "503 Service Unavailable"
 
 //request types
 #define REQUEST_GET     1000
@@ -68,22 +106,82 @@
 #define REQUEST_TRACE   1007
 #define REQUEST_INVALID 1999
 
+//most ranges answered in one response, requests for more get the whole file
+#define MAX_RANGES 16
+#define RANGE_HEADER_SIZE 256
+
+//first and last byte (inclusive) of one range of the file
+typedef struct _byteRange {
+    long long start;
+    long long end;
+} ByteRange;
+
+//the parts of the file a 206 sends, no ranges means the whole file
+typedef struct _rangeSet {
+    int numRanges;
+    ByteRange ranges[MAX_RANGES];
+    //multipart/byteranges responses: the boundary, the length of the whole body, the type
+    //every part is sent with and the delimiter of the part being sent
+    unsigned long long boundary;
+    long long bodyLength;
+    char* contentType;
+    char partHeader[RANGE_HEADER_SIZE];
+} RangeSet;
+
 typedef struct _requestInfo {
     int reqType;
-    char fullAddress[PATH_SIZE*2+2];
-    char fileName[PATH_SIZE+1];
+    //the file served, in the request's arena (or a constant for error pages)
+    char* fileName;
+    //the file to send, opened beneath the data directory (ERROR when there is none)
+    int fileFd;
     char* httpVer;
     char* responseCode;
     long long fileSize;
+    //Content-Type of the body, NULL when there is none
+    char* contentType;
+    //validators of the file, etag is empty for generated bodies
+    char etag[ETAG_SIZE];
+    time_t mtime;
+    //Content-Encoding of the body, NULL when it is sent as is
+    char* encoding;
+    //parts of the body requested with Range, NULL for the whole body
+    RangeSet* ranges;
+    //where a redirect sends the client, NULL for any other response
+    char* location;
+    int keepAlive;
+    //set when the file is served from the cache (holds a reference)
+    struct _cacheEntry* cached;
+    //memory that lasts until the response has been sent
+    struct _arena* arena;
 } ReqInfo;
 
 void* ServePage (void* newConn);
-void SendFile (char* address, int connID);
+void ServeConnection (int connID, long long acceptTime);
+struct _httpParser;
+struct _growBuffer;
+struct _arena;
+struct _watch;
+struct _bodyReader;
+int ReadHTTPRequest (struct _growBuffer* buffer, int* bufferLen, struct _httpParser* parser, int connID, long long* firstByte, struct _watch* watch);
+int ReadRequestBody (struct _growBuffer* buffer, int* bufferLen, int requestLen, struct _bodyReader* body, int connID);
+int BuildResponseHeader (ReqInfo* reqInfo, char* buffer, int size);
+int ResponseHasBody (ReqInfo* reqInfo);
+struct _fileSender;
+void InitResponseSender (ReqInfo* reqInfo, struct _fileSender* sender);
+int SendResponseBody (ReqInfo* reqInfo, struct _fileSender* sender, int connID);
 int RequestType (char* request, int bytesRecv);
-char* FileAddress (char* request, int bytesRecv, char* result, char* fileName);
-ReqInfo ProcessRequest (char* request, int bytesRecv);
+int RequestPath (char* request, int bytesRecv, char* fileName);
+void DecodePath (char* address, int len, char* fileName);
+char* ResolveFileAddress (char* path, ReqInfo* reqInfo);
+char* CopyFileName (struct _arena* arena, char* path);
+ReqInfo ProcessRequest (char* request, struct _httpParser* parser, struct _arena* arena, struct _bodyReader* body);
+int RequestVersion (char* request, int bytesRecv);
+int FindHeader (char* request, int bytesRecv, char* name, char* value, int size);
 int NextNonSpace (char* text, int length, int startPos);
 int ConvertControlChar (char* text);
 void SigPipeHandle (int i);
+void RecordResponse (char* client, char* request, struct _httpParser* parser, char* responseCode, long long bytes, long long startTime);
 void CreateFullFileAddress (char* fullAddress, char* address);
 char* Concat (char* str1, char* str2);
+
+#endif